@@ -0,0 +1,291 @@
+/*
+ * agg.h
+ *
+ *  Mergeable partial aggregate of the per-flow stats. Partial aggregates of
+ *  disjoint record sets (chunks, threads, time ranges) merge into the same
+ *  result a single pass over all the records would give.
+ */
+
+#ifndef AGG_H_
+#define AGG_H_
+
+/* log-linear histograms, 16 buckets per power of two, so a percentile is
+ * within 1/32 of the value
+ */
+enum {
+    PCT_SUB_BITS    = 4,
+    PCT_SUBS        = 1 << PCT_SUB_BITS,
+    PCT_BUCKETS     = PCT_SUBS + (32 - PCT_SUB_BITS) * PCT_SUBS,
+};
+
+struct flow_agg {
+    uint64_t    rec_cnt;
+    uint64_t    dir_in;
+    uint64_t    dir_out;
+
+    uint64_t    data_pkt_cnt;
+    uint64_t    total_data_sz;
+    uint64_t    fragment_cnt;
+    uint32_t    min_payload_sz;
+    uint32_t    max_payload_sz;
+
+    uint64_t    srtt_sum;
+    uint32_t    srtt_min;
+    uint32_t    srtt_max;
+
+    uint64_t    cwnd_sum;
+    uint32_t    cwnd_min;
+    uint32_t    cwnd_max;
+
+    uint32_t    time_min;           /* rel_time of the first record */
+    uint32_t    time_max;           /* rel_time of the last record */
+
+    uint32_t    srtt_hist[PCT_BUCKETS];
+};
+
+static inline void
+flow_agg_init(struct flow_agg *agg)
+{
+    memset(agg, 0, sizeof(*agg));
+    agg->min_payload_sz = UINT32_MAX;
+    agg->srtt_min = UINT32_MAX;
+    agg->cwnd_min = UINT32_MAX;
+    agg->time_min = UINT32_MAX;
+}
+
+static inline uint32_t
+pct_bucket(uint32_t v)
+{
+    if (v < PCT_SUBS) {
+        return v;
+    }
+    uint32_t e = 31 - (uint32_t)__builtin_clz(v);
+    return PCT_SUBS + (e - PCT_SUB_BITS) * PCT_SUBS +
+           ((v >> (e - PCT_SUB_BITS)) & (PCT_SUBS - 1));
+}
+
+/* the middle of bucket `b` */
+static inline uint32_t
+pct_bucket_value(uint32_t b)
+{
+    if (b < PCT_SUBS) {
+        return b;
+    }
+    uint32_t shift = (b - PCT_SUBS) / PCT_SUBS;
+    uint64_t lo = (uint64_t)(PCT_SUBS + (b - PCT_SUBS) % PCT_SUBS) << shift;
+    return (uint32_t)(lo + ((1ull << shift) >> 1));
+}
+
+static inline void
+flow_agg_update(struct flow_agg *agg, const record_t *rec, uint32_t mss)
+{
+    agg->rec_cnt++;
+    if (rec->direction == 'o') {
+        agg->dir_out++;
+    } else {
+        agg->dir_in++;
+    }
+
+    if (rec->data_sz > 0) {
+        agg->total_data_sz += rec->data_sz;
+        agg->data_pkt_cnt++;
+        if (agg->min_payload_sz > rec->data_sz) {
+            agg->min_payload_sz = rec->data_sz;
+        }
+        if (agg->max_payload_sz < rec->data_sz) {
+            agg->max_payload_sz = rec->data_sz;
+        }
+    }
+    /* mss is 0 in a rebuilt foot note (recover.h), as in mss_reciprocal() */
+    if (mss > 1 && (rec->data_sz % mss) > 0) {
+        agg->fragment_cnt++;
+    }
+
+    agg->srtt_sum += rec->srtt;
+    if (agg->srtt_min > rec->srtt) {
+        agg->srtt_min = rec->srtt;
+    }
+    if (agg->srtt_max < rec->srtt) {
+        agg->srtt_max = rec->srtt;
+    }
+    agg->srtt_hist[pct_bucket(rec->srtt)]++;
+
+    agg->cwnd_sum += rec->cwnd;
+    if (agg->cwnd_min > rec->cwnd) {
+        agg->cwnd_min = rec->cwnd;
+    }
+    if (agg->cwnd_max < rec->cwnd) {
+        agg->cwnd_max = rec->cwnd;
+    }
+
+    if (agg->time_min > rec->rel_time) {
+        agg->time_min = rec->rel_time;
+    }
+    if (agg->time_max < rec->rel_time) {
+        agg->time_max = rec->rel_time;
+    }
+}
+
+#define AGG_MIN(a, b)   (((a) < (b)) ? (a) : (b))
+#define AGG_MAX(a, b)   (((a) > (b)) ? (a) : (b))
+
+static inline void
+flow_agg_merge(struct flow_agg *dst, const struct flow_agg *src)
+{
+    dst->rec_cnt += src->rec_cnt;
+    dst->dir_in += src->dir_in;
+    dst->dir_out += src->dir_out;
+
+    dst->data_pkt_cnt += src->data_pkt_cnt;
+    dst->total_data_sz += src->total_data_sz;
+    dst->fragment_cnt += src->fragment_cnt;
+    dst->min_payload_sz = AGG_MIN(dst->min_payload_sz, src->min_payload_sz);
+    dst->max_payload_sz = AGG_MAX(dst->max_payload_sz, src->max_payload_sz);
+
+    dst->srtt_sum += src->srtt_sum;
+    dst->srtt_min = AGG_MIN(dst->srtt_min, src->srtt_min);
+    dst->srtt_max = AGG_MAX(dst->srtt_max, src->srtt_max);
+
+    dst->cwnd_sum += src->cwnd_sum;
+    dst->cwnd_min = AGG_MIN(dst->cwnd_min, src->cwnd_min);
+    dst->cwnd_max = AGG_MAX(dst->cwnd_max, src->cwnd_max);
+
+    dst->time_min = AGG_MIN(dst->time_min, src->time_min);
+    dst->time_max = AGG_MAX(dst->time_max, src->time_max);
+
+    for (int b = 0; b < PCT_BUCKETS; b++) {
+        dst->srtt_hist[b] += src->srtt_hist[b];
+    }
+}
+
+/* Fold an aggregate into the stats part of flow_info for printing. */
+static inline void
+flow_agg_to_flow_info(const struct flow_agg *agg, struct flow_info *f_info)
+{
+    f_info->dir_in = agg->dir_in;
+    f_info->dir_out = agg->dir_out;
+
+    f_info->data_pkt_cnt = agg->data_pkt_cnt;
+    f_info->total_data_sz = agg->total_data_sz;
+    f_info->min_payload_sz = (agg->min_payload_sz > UINT16_MAX) ?
+                             UINT16_MAX : (uint16_t)agg->min_payload_sz;
+    f_info->max_payload_sz = (agg->max_payload_sz > UINT16_MAX) ?
+                             UINT16_MAX : (uint16_t)agg->max_payload_sz;
+    f_info->fragment_cnt = agg->fragment_cnt;
+
+    f_info->srtt_sum = agg->srtt_sum;
+    f_info->srtt_min = agg->srtt_min;
+    f_info->srtt_max = agg->srtt_max;
+
+    f_info->cwnd_sum = agg->cwnd_sum;
+    f_info->cwnd_min = agg->cwnd_min;
+    f_info->cwnd_max = agg->cwnd_max;
+}
+
+/* srtt percentile from the histogram, the middle of the bucket that holds
+ * it within the srtt seen, as the percentiles analyzer gives it
+ */
+static inline uint32_t
+flow_agg_srtt_percentile(const struct flow_agg *agg, double pct)
+{
+    uint64_t rank = (uint64_t)ceil(agg->rec_cnt * pct / 100.0), seen = 0;
+
+    if (agg->rec_cnt == 0) {
+        return 0;
+    }
+    for (uint32_t b = 0; b < PCT_BUCKETS; b++) {
+        seen += agg->srtt_hist[b];
+        if (seen >= rank && seen > 0) {
+            uint32_t v = pct_bucket_value(b);
+            return AGG_MIN(AGG_MAX(v, agg->srtt_min), agg->srtt_max);
+        }
+    }
+    return agg->srtt_max;
+}
+
+/* c = ceil(2^64 / mss) turns the fragment test into a multiply: for any
+ * 32-bit n, n % mss == 0 iff n * c <= c - 1 (Lemire, Kaser and Kurz). mss of
+ * 0 or 1 gives c = 0, and nothing counts as a fragment.
+ */
+static inline uint64_t
+mss_reciprocal(uint32_t mss)
+{
+    return (mss > 1) ? UINT64_MAX / mss + 1 : 0;
+}
+
+/* Fold a batch into `agg`. Each loop runs over one or two columns without
+ * branches or divisions, so it vectorizes; only the histogram stays scalar.
+ */
+static void
+flow_agg_update_batch(struct flow_agg *agg, const struct rec_batch *b,
+                      uint32_t mss)
+{
+    const uint32_t n = b->cnt;
+    const uint64_t mss_c = mss_reciprocal(mss);
+    uint64_t out_cnt = 0, data_pkt_cnt = 0, data_sz_sum = 0, fragment_cnt = 0;
+    uint64_t srtt_sum = 0, cwnd_sum = 0;
+    uint32_t payload_min, payload_max = 0;
+    uint32_t srtt_min = UINT32_MAX, srtt_max = 0;
+    uint32_t cwnd_min = UINT32_MAX, cwnd_max = 0;
+    uint32_t time_min = UINT32_MAX, time_max = 0;
+
+    if (n == 0) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        out_cnt += b->is_out[i];
+    }
+    /* d - 1 wraps an empty payload to UINT32_MAX, out of the min's way */
+    uint32_t payload_min_1 = UINT32_MAX;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t d = b->data_sz[i];
+        data_pkt_cnt += (d > 0);
+        data_sz_sum += d;
+        payload_min_1 = AGG_MIN(payload_min_1, d - 1);
+        payload_max = AGG_MAX(payload_max, d);
+    }
+    payload_min = (payload_min_1 == UINT32_MAX) ? UINT32_MAX : payload_min_1 + 1;
+    for (uint32_t i = 0; i < n; i++) {
+        fragment_cnt += ((uint64_t)b->data_sz[i] * mss_c > mss_c - 1);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t v = b->srtt[i];
+        srtt_sum += v;
+        srtt_min = AGG_MIN(srtt_min, v);
+        srtt_max = AGG_MAX(srtt_max, v);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t v = b->cwnd[i];
+        cwnd_sum += v;
+        cwnd_min = AGG_MIN(cwnd_min, v);
+        cwnd_max = AGG_MAX(cwnd_max, v);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t v = b->rel_time[i];
+        time_min = AGG_MIN(time_min, v);
+        time_max = AGG_MAX(time_max, v);
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        agg->srtt_hist[pct_bucket(b->srtt[i])]++;
+    }
+
+    agg->rec_cnt += n;
+    agg->dir_out += out_cnt;
+    agg->dir_in += n - out_cnt;
+    agg->data_pkt_cnt += data_pkt_cnt;
+    agg->total_data_sz += data_sz_sum;
+    agg->fragment_cnt += fragment_cnt;
+    agg->min_payload_sz = AGG_MIN(agg->min_payload_sz, payload_min);
+    agg->max_payload_sz = AGG_MAX(agg->max_payload_sz, payload_max);
+    agg->srtt_sum += srtt_sum;
+    agg->srtt_min = AGG_MIN(agg->srtt_min, srtt_min);
+    agg->srtt_max = AGG_MAX(agg->srtt_max, srtt_max);
+    agg->cwnd_sum += cwnd_sum;
+    agg->cwnd_min = AGG_MIN(agg->cwnd_min, cwnd_min);
+    agg->cwnd_max = AGG_MAX(agg->cwnd_max, cwnd_max);
+    agg->time_min = AGG_MIN(agg->time_min, time_min);
+    agg->time_max = AGG_MAX(agg->time_max, time_max);
+}
+
+#endif /* AGG_H_ */
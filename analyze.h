@@ -0,0 +1,715 @@
+/*
+ * analyze.h
+ *
+ *  Analyzers of the records of a reviewed flow, all fed from the one scan of
+ *  the body. Each analyzer keeps its own state per flow and has four hooks:
+ *
+ *  - init:     reset the state for a flow.
+ *  - batch:    fold a batch of decoded records (struct rec_batch) in.
+ *  - merge:    fold in the state of the records right after those of `dst`,
+ *              so parallel workers can each fill a state and the states are
+ *              merged in file order. An analyzer whose result depends on
+ *              the records before a batch has none; its batch hook then runs
+ *              on the merging thread, over the batches in file order.
+ *  - finalize: print the result.
+ *
+ *  The summary block is the built-in "summary" analyzer and always runs;
+ *  --analyze adds the others of analyzers[] by name.
+ */
+
+#ifndef ANALYZE_H_
+#define ANALYZE_H_
+
+#include <math.h>
+#include <stddef.h>
+
+enum {
+    ANALYZER_MAX        = 8,
+    ANALYZE_MAX_BINS    = 4096,
+    ANALYZE_BIN_MS      = 1000,     /* shortest time bin */
+    ANALYZE_MAX_EVENTS  = 64,       /* recovery events listed */
+    LIMIT_DWELL_RECS    = 8,        /* records a new limit holds to count */
+};
+
+struct analyzer {
+    const char  *name;
+    size_t      state_size;
+    void        (*init)(void *state, const struct file_basic_stats *f_basics,
+                        const struct flow_info *f_info);
+    void        (*batch)(void *state, const struct rec_batch *b);
+    void        (*merge)(void *dst, const void *src);
+    void        (*finalize)(void *state, const struct file_basic_stats *f_basics,
+                            struct flow_info *f_info);
+};
+
+/* the enabled analyzers, each with the state of one flow */
+struct analysis {
+    uint32_t    cnt;
+    const struct analyzer *an[ANALYZER_MAX];
+    void        *state[ANALYZER_MAX];
+};
+
+/* summary: the flow stats of print_flow_summary() */
+struct summary_state {
+    struct flow_agg agg;
+    uint32_t    mss;
+};
+
+static void
+summary_init(void *state, const struct file_basic_stats *f_basics,
+             const struct flow_info *f_info)
+{
+    struct summary_state *st = state;
+    (void)f_basics;
+
+    flow_agg_init(&st->agg);
+    st->mss = f_info->mss;
+}
+
+static void
+summary_batch(void *state, const struct rec_batch *b)
+{
+    struct summary_state *st = state;
+
+    flow_agg_update_batch(&st->agg, b, st->mss);
+}
+
+static void
+summary_merge(void *dst, const void *src)
+{
+    flow_agg_merge(&((struct summary_state *)dst)->agg,
+                   &((const struct summary_state *)src)->agg);
+}
+
+static void
+summary_finalize(void *state, const struct file_basic_stats *f_basics,
+                 struct flow_info *f_info)
+{
+    struct summary_state *st = state;
+
+    flow_agg_to_flow_info(&st->agg, f_info);
+    print_flow_summary(f_basics, f_info);
+}
+
+/* percentiles: the log-linear histograms of agg.h */
+enum {
+    PCT_SRTT,
+    PCT_CWND,
+    PCT_INFLIGHT,
+    TOTAL_PCT_SERIES,
+};
+
+struct pct_state {
+    uint64_t    cnt;
+    uint32_t    max[TOTAL_PCT_SERIES];
+    uint64_t    hist[TOTAL_PCT_SERIES][PCT_BUCKETS];
+};
+
+static void
+pct_init(void *state, const struct file_basic_stats *f_basics,
+         const struct flow_info *f_info)
+{
+    (void)f_basics;
+    (void)f_info;
+    memset(state, 0, sizeof(struct pct_state));
+}
+
+static void
+pct_batch(void *state, const struct rec_batch *b)
+{
+    struct pct_state *st = state;
+    const uint32_t *cols[TOTAL_PCT_SERIES] = {
+        [PCT_SRTT] = b->srtt, [PCT_CWND] = b->cwnd, [PCT_INFLIGHT] = b->pipe,
+    };
+
+    for (int s = 0; s < TOTAL_PCT_SERIES; s++) {
+        for (uint32_t i = 0; i < b->cnt; i++) {
+            uint32_t v = cols[s][i];
+            st->hist[s][pct_bucket(v)]++;
+            st->max[s] = AGG_MAX(st->max[s], v);
+        }
+    }
+    st->cnt += b->cnt;
+}
+
+static void
+pct_merge(void *dst, const void *src)
+{
+    struct pct_state *d = dst;
+    const struct pct_state *s = src;
+
+    for (int k = 0; k < TOTAL_PCT_SERIES; k++) {
+        for (int b = 0; b < PCT_BUCKETS; b++) {
+            d->hist[k][b] += s->hist[k][b];
+        }
+        d->max[k] = AGG_MAX(d->max[k], s->max[k]);
+    }
+    d->cnt += s->cnt;
+}
+
+static uint32_t
+pct_of(const struct pct_state *st, int series, double pct)
+{
+    uint64_t rank = (uint64_t)ceil(st->cnt * pct / 100.0), seen = 0;
+
+    for (uint32_t b = 0; b < PCT_BUCKETS; b++) {
+        seen += st->hist[series][b];
+        if (seen >= rank && seen > 0) {
+            return AGG_MIN(pct_bucket_value(b), st->max[series]);
+        }
+    }
+    return st->max[series];
+}
+
+static void
+pct_finalize(void *state, const struct file_basic_stats *f_basics,
+             struct flow_info *f_info)
+{
+    static const char *const names[TOTAL_PCT_SERIES] = {
+        [PCT_SRTT] = "srtt", [PCT_CWND] = "cwnd", [PCT_INFLIGHT] = "inflight",
+    };
+    static const char *const units[TOTAL_PCT_SERIES] = {
+        [PCT_SRTT] = "µs", [PCT_CWND] = "bytes", [PCT_INFLIGHT] = "bytes",
+    };
+    const struct pct_state *st = state;
+    (void)f_basics;
+    (void)f_info;
+
+    printf("++++++++++++++++++++++++++++ percentiles ++++++++++++++++++++++++++\n");
+    for (int s = 0; s < TOTAL_PCT_SERIES; s++) {
+        printf("%-8s p50: %u, p90: %u, p99: %u, p99.9: %u, max: %u %s\n",
+               names[s], pct_of(st, s, 50), pct_of(st, s, 90), pct_of(st, s, 99),
+               pct_of(st, s, 99.9), st->max[s], units[s]);
+    }
+}
+
+/* bins: records, goodput, cwnd and srtt per time bin; the bins are one
+ * second wide, or wider to cover the log in ANALYZE_MAX_BINS
+ */
+struct time_bin {
+    uint64_t    rec_cnt;
+    uint64_t    out_bytes;
+    uint64_t    cwnd_sum;
+    uint64_t    srtt_sum;
+};
+
+struct bins_state {
+    uint32_t    bin_ms;
+    uint32_t    bin_cnt;
+    struct time_bin bins[ANALYZE_MAX_BINS];
+};
+
+static void
+bins_init(void *state, const struct file_basic_stats *f_basics,
+          const struct flow_info *f_info)
+{
+    struct bins_state *st = state;
+    struct timeval duration;
+    (void)f_info;
+
+    timeval_subtract(&duration, &f_basics->last_line_stats->disable_time,
+                     &f_basics->first_line_stats->enable_time);
+    uint64_t span = (duration.tv_sec < 0) ? 1 :
+                    (uint64_t)duration.tv_sec * 1000 + duration.tv_usec / 1000 + 1;
+    uint64_t bin_ms = (span + ANALYZE_MAX_BINS - 1) / ANALYZE_MAX_BINS;
+
+    bin_ms = (bin_ms + ANALYZE_BIN_MS - 1) / ANALYZE_BIN_MS * ANALYZE_BIN_MS;
+    st->bin_ms = (bin_ms > 0) ? (uint32_t)bin_ms : ANALYZE_BIN_MS;
+    st->bin_cnt = (uint32_t)AGG_MIN((span + st->bin_ms - 1) / st->bin_ms,
+                                    (uint64_t)ANALYZE_MAX_BINS);
+    memset(st->bins, 0, st->bin_cnt * sizeof(st->bins[0]));
+}
+
+static void
+bins_batch(void *state, const struct rec_batch *b)
+{
+    struct bins_state *st = state;
+
+    for (uint32_t i = 0; i < b->cnt; i++) {
+        uint32_t k = AGG_MIN(b->rel_time[i] / st->bin_ms, st->bin_cnt - 1);
+        struct time_bin *bin = &st->bins[k];
+        bin->rec_cnt++;
+        bin->out_bytes += b->is_out[i] ? b->data_sz[i] : 0;
+        bin->cwnd_sum += b->cwnd[i];
+        bin->srtt_sum += b->srtt[i];
+    }
+}
+
+static void
+bins_merge(void *dst, const void *src)
+{
+    struct bins_state *d = dst;
+    const struct bins_state *s = src;
+
+    for (uint32_t k = 0; k < d->bin_cnt; k++) {
+        d->bins[k].rec_cnt += s->bins[k].rec_cnt;
+        d->bins[k].out_bytes += s->bins[k].out_bytes;
+        d->bins[k].cwnd_sum += s->bins[k].cwnd_sum;
+        d->bins[k].srtt_sum += s->bins[k].srtt_sum;
+    }
+}
+
+static void
+bins_finalize(void *state, const struct file_basic_stats *f_basics,
+              struct flow_info *f_info)
+{
+    const struct bins_state *st = state;
+    (void)f_basics;
+    (void)f_info;
+
+    printf("+++++++++++++++++++++++++++++ time bins +++++++++++++++++++++++++++\n");
+    printf("%10s %10s %14s %10s %10s\n", "time(s)", "records", "goodput(Mbps)",
+           "avg_cwnd", "avg_srtt");
+    for (uint32_t k = 0; k < st->bin_cnt; k++) {
+        const struct time_bin *bin = &st->bins[k];
+        if (bin->rec_cnt == 0) {
+            continue;
+        }
+        printf("%10.3f %10" PRIu64 " %14.3f %10" PRIu64 " %10" PRIu64 "\n",
+               (double)k * st->bin_ms / 1000.0, bin->rec_cnt,
+               bin->out_bytes * 8.0 / (st->bin_ms * 1000.0),
+               bin->cwnd_sum / bin->rec_cnt, bin->srtt_sum / bin->rec_cnt);
+    }
+}
+
+/* recovery: every cut of ssthresh is a congestion event; one that leaves
+ * cwnd at 2 mss or less is counted as a retransmission timeout
+ */
+struct recovery_event {
+    uint32_t    time;
+    uint32_t    cwnd_before;
+    uint32_t    ssthresh;
+    uint32_t    cwnd_after;
+};
+
+struct recovery_state {
+    uint32_t    mss;
+    bool        has_recs;
+    uint32_t    first_time;     /* the first record, for merge */
+    uint32_t    first_cwnd;
+    uint32_t    first_ssthresh;
+    uint32_t    last_cwnd;
+    uint32_t    last_ssthresh;
+    uint64_t    event_cnt;
+    uint64_t    timeout_cnt;
+    uint32_t    listed;
+    struct recovery_event events[ANALYZE_MAX_EVENTS];
+};
+
+static void
+recovery_init(void *state, const struct file_basic_stats *f_basics,
+              const struct flow_info *f_info)
+{
+    struct recovery_state *st = state;
+    (void)f_basics;
+
+    memset(st, 0, offsetof(struct recovery_state, events));
+    st->mss = f_info->mss;
+}
+
+static void
+recovery_add(struct recovery_state *st, uint32_t time, uint32_t cwnd_before,
+             uint32_t ssthresh, uint32_t cwnd_after)
+{
+    st->event_cnt++;
+    st->timeout_cnt += (cwnd_after <= 2 * (uint64_t)st->mss);
+    if (st->listed < ANALYZE_MAX_EVENTS) {
+        st->events[st->listed++] = (struct recovery_event){
+            time, cwnd_before, ssthresh, cwnd_after,
+        };
+    }
+}
+
+static void
+recovery_batch(void *state, const struct rec_batch *b)
+{
+    struct recovery_state *st = state;
+    uint32_t i = 0;
+
+    if (b->cnt == 0) {
+        return;
+    }
+    if (!st->has_recs) {
+        st->has_recs = true;
+        st->first_time = b->rel_time[0];
+        st->first_cwnd = b->cwnd[0];
+        st->first_ssthresh = b->ssthresh[0];
+        st->last_cwnd = b->cwnd[0];
+        st->last_ssthresh = b->ssthresh[0];
+        i = 1;
+    }
+    for (; i < b->cnt; i++) {
+        if (b->ssthresh[i] < st->last_ssthresh) {
+            recovery_add(st, b->rel_time[i], st->last_cwnd, b->ssthresh[i],
+                         b->cwnd[i]);
+        }
+        st->last_cwnd = b->cwnd[i];
+        st->last_ssthresh = b->ssthresh[i];
+    }
+}
+
+static void
+recovery_merge(void *dst, const void *src)
+{
+    struct recovery_state *d = dst;
+    const struct recovery_state *s = src;
+
+    if (!s->has_recs) {
+        return;
+    }
+    if (!d->has_recs) {
+        memcpy(d, s, sizeof(*d));
+        return;
+    }
+    /* the cut between the last record of `d` and the first of `s` */
+    if (s->first_ssthresh < d->last_ssthresh) {
+        recovery_add(d, s->first_time, d->last_cwnd, s->first_ssthresh,
+                     s->first_cwnd);
+    }
+    d->event_cnt += s->event_cnt;
+    d->timeout_cnt += s->timeout_cnt;
+    for (uint32_t e = 0; e < s->listed && d->listed < ANALYZE_MAX_EVENTS; e++) {
+        d->events[d->listed++] = s->events[e];
+    }
+    d->last_cwnd = s->last_cwnd;
+    d->last_ssthresh = s->last_ssthresh;
+}
+
+static void
+recovery_finalize(void *state, const struct file_basic_stats *f_basics,
+                  struct flow_info *f_info)
+{
+    const struct recovery_state *st = state;
+    (void)f_basics;
+    (void)f_info;
+
+    printf("++++++++++++++++++++++++++ recovery events ++++++++++++++++++++++++\n");
+    printf("%" PRIu64 " ssthresh cuts, %" PRIu64 " of them with cwnd at or below "
+           "2 mss (timeouts)\n", st->event_cnt, st->timeout_cnt);
+    if (st->listed == 0) {
+        return;
+    }
+    printf("%10s %12s %12s %12s\n", "time(s)", "cwnd_before", "ssthresh",
+           "cwnd_after");
+    for (uint32_t e = 0; e < st->listed; e++) {
+        const struct recovery_event *ev = &st->events[e];
+        printf("%10.3f %12u %12u %12u\n", ev->time / 1000.0, ev->cwnd_before,
+               ev->ssthresh, ev->cwnd_after);
+    }
+    if (st->event_cnt > st->listed) {
+        printf("... and %" PRIu64 " more\n", st->event_cnt - st->listed);
+    }
+}
+
+/* limits: what holds the sender back from one record of the flow to the
+ * next. The smaller of cwnd and the window the peer advertised is full
+ * (cwnd- or rwnd-limited); else nothing is in flight or queued (idle); else
+ * the application or the send buffer hands over too little data. snd_wnd is
+ * logged in bytes, already scaled.
+ *
+ * A record alone decides only its own count. The sender moves to another
+ * limit once that limit holds for LIMIT_DWELL_RECS records in a row, or for
+ * one srtt (as of the first of them), whichever comes first; the transition
+ * is dated at the first of those records and the time from there on is the
+ * new limit's. A shorter excursion is counted as time in the limit it left,
+ * so inflight bytes hovering around the window edge do not count as a
+ * transition per ACK.
+ */
+enum limit_state {
+    LIMIT_CWND,
+    LIMIT_RWND,
+    LIMIT_APP,
+    LIMIT_IDLE,
+    TOTAL_LIMIT_STATES,
+};
+
+static const char *const limit_name[TOTAL_LIMIT_STATES] = {
+    [LIMIT_CWND] = "cwnd-limited",
+    [LIMIT_RWND] = "rwnd-limited",
+    [LIMIT_APP]  = "sndbuf/app-limited",
+    [LIMIT_IDLE] = "idle",
+};
+
+struct limit_change {
+    uint32_t    time;
+    uint8_t     from;
+    uint8_t     to;
+};
+
+struct limits_state {
+    uint32_t    mss;
+    bool        has_recs;
+    uint8_t     state;          /* the limit the sender is in */
+    uint8_t     cand;           /* another one it may be moving to */
+    uint32_t    cand_cnt;       /* records of `cand` in a row, 0 for none */
+    uint32_t    cand_time;      /* the first of them */
+    uint32_t    cand_srtt;      /* µs, of the first of them */
+    uint64_t    cand_ms;        /* time in `cand` not counted yet */
+    uint32_t    last_time;
+    uint64_t    time_in[TOTAL_LIMIT_STATES];    /* ms */
+    uint64_t    rec_in[TOTAL_LIMIT_STATES];
+    uint64_t    change_cnt;
+    uint32_t    listed;
+    struct limit_change changes[ANALYZE_MAX_EVENTS];
+};
+
+static inline uint8_t
+limit_of(uint32_t cwnd, uint32_t snd_wnd, uint32_t pipe, uint32_t snd_buf_cc,
+         uint32_t mss)
+{
+    if ((uint64_t)pipe + mss > AGG_MIN(cwnd, snd_wnd)) {
+        return (snd_wnd < cwnd) ? LIMIT_RWND : LIMIT_CWND;
+    }
+    if (pipe == 0 && snd_buf_cc == 0) {
+        return LIMIT_IDLE;
+    }
+    return LIMIT_APP;
+}
+
+static void
+limits_init(void *state, const struct file_basic_stats *f_basics,
+            const struct flow_info *f_info)
+{
+    struct limits_state *st = state;
+    (void)f_basics;
+
+    memset(st, 0, offsetof(struct limits_state, changes));
+    st->mss = (f_info->mss > 0) ? f_info->mss : 1;
+}
+
+/* the record at `time` is in limit `s` */
+static void
+limits_step(struct limits_state *st, uint32_t time, uint8_t s, uint32_t srtt)
+{
+    uint64_t gap = (time > st->last_time) ? time - st->last_time : 0;
+
+    st->last_time = time;
+    if (s == st->state) {
+        /* an excursion that did not hold is time in the limit it left */
+        st->time_in[st->state] += st->cand_ms + gap;
+        st->cand_cnt = 0;
+        st->cand_ms = 0;
+        return;
+    }
+    if (st->cand_cnt > 0 && s == st->cand) {
+        st->cand_cnt++;
+        st->cand_ms += gap;
+    } else {
+        st->time_in[st->state] += st->cand_ms + gap;
+        st->cand = s;
+        st->cand_cnt = 1;
+        st->cand_time = time;
+        st->cand_srtt = srtt;
+        st->cand_ms = 0;
+    }
+    if (st->cand_cnt >= LIMIT_DWELL_RECS ||
+        (st->cand_srtt > 0 && time >= st->cand_time &&
+         (uint64_t)(time - st->cand_time) * 1000 >= st->cand_srtt)) {
+        st->change_cnt++;
+        if (st->listed < ANALYZE_MAX_EVENTS) {
+            st->changes[st->listed++] = (struct limit_change){
+                st->cand_time, st->state, st->cand,
+            };
+        }
+        st->time_in[st->cand] += st->cand_ms;
+        st->state = st->cand;
+        st->cand_cnt = 0;
+        st->cand_ms = 0;
+    }
+}
+
+/* No merge: whether a limit holds long enough can depend on the records of
+ * the batches before, so the batches come in file order.
+ */
+static void
+limits_batch(void *state, const struct rec_batch *b)
+{
+    struct limits_state *st = state;
+
+    for (uint32_t i = 0; i < b->cnt; i++) {
+        uint8_t s = limit_of(b->cwnd[i], b->snd_wnd[i], b->pipe[i],
+                             b->snd_buf_cc[i], st->mss);
+        st->rec_in[s]++;
+        if (!st->has_recs) {
+            st->has_recs = true;
+            st->last_time = b->rel_time[i];
+            st->state = s;
+        } else {
+            limits_step(st, b->rel_time[i], s, b->srtt[i]);
+        }
+    }
+}
+
+static void
+limits_finalize(void *state, const struct file_basic_stats *f_basics,
+                struct flow_info *f_info)
+{
+    const struct limits_state *st = state;
+    uint64_t time_in[TOTAL_LIMIT_STATES];
+    uint64_t total_ms = 0, total_recs = 0;
+    (void)f_basics;
+    (void)f_info;
+
+    for (int k = 0; k < TOTAL_LIMIT_STATES; k++) {
+        /* an excursion still open at the end did not hold */
+        time_in[k] = st->time_in[k] + ((k == st->state) ? st->cand_ms : 0);
+        total_ms += time_in[k];
+        total_recs += st->rec_in[k];
+    }
+    printf("+++++++++++++++++++++++++ throughput limits +++++++++++++++++++++++\n");
+    for (int k = 0; k < TOTAL_LIMIT_STATES; k++) {
+        printf("%-19s %6.2f%% of %.3f s, %" PRIu64 " records\n",
+               limit_name[k], (total_ms > 0) ? 100.0 * time_in[k] / total_ms : 0.0,
+               total_ms / 1000.0, st->rec_in[k]);
+    }
+    printf("%" PRIu64 " transitions (held %d records or one srtt)\n",
+           st->change_cnt, LIMIT_DWELL_RECS);
+    if (st->listed == 0) {
+        return;
+    }
+    printf("%10s  %-19s %s\n", "time(s)", "from", "to");
+    for (uint32_t e = 0; e < st->listed; e++) {
+        const struct limit_change *c = &st->changes[e];
+        printf("%10.3f  %-19s %s\n", c->time / 1000.0, limit_name[c->from],
+               limit_name[c->to]);
+    }
+    if (st->change_cnt > st->listed) {
+        printf("... and %" PRIu64 " more\n", st->change_cnt - st->listed);
+    }
+}
+
+static const struct analyzer analyzers[] = {
+    {"summary", sizeof(struct summary_state),
+     summary_init, summary_batch, summary_merge, summary_finalize},
+    {"percentiles", sizeof(struct pct_state),
+     pct_init, pct_batch, pct_merge, pct_finalize},
+    {"bins", sizeof(struct bins_state),
+     bins_init, bins_batch, bins_merge, bins_finalize},
+    {"recovery", sizeof(struct recovery_state),
+     recovery_init, recovery_batch, recovery_merge, recovery_finalize},
+    {"limits", sizeof(struct limits_state),
+     limits_init, limits_batch, NULL, limits_finalize},
+};
+
+static int
+analysis_add(struct analysis *a, const struct analyzer *an)
+{
+    for (uint32_t i = 0; i < a->cnt; i++) {
+        if (a->an[i] == an) {
+            return EXIT_SUCCESS;
+        }
+    }
+    if (a->cnt == ANALYZER_MAX) {
+        printf("at most %d analyzers\n", ANALYZER_MAX);
+        return EXIT_FAILURE;
+    }
+    a->state[a->cnt] = malloc(an->state_size);
+    if (a->state[a->cnt] == NULL) {
+        PERROR_FUNCTION("malloc failed for an analyzer");
+        return EXIT_FAILURE;
+    }
+    a->an[a->cnt++] = an;
+    return EXIT_SUCCESS;
+}
+
+static void
+analysis_free(struct analysis *a)
+{
+    for (uint32_t i = 0; i < a->cnt; i++) {
+        free(a->state[i]);
+    }
+    a->cnt = 0;
+}
+
+/* The summary and the analyzers of the comma separated `names` (or none). */
+static int
+analysis_open(struct analysis *a, const char *names)
+{
+    const uint32_t total = sizeof(analyzers) / sizeof(analyzers[0]);
+
+    a->cnt = 0;
+    if (analysis_add(a, &analyzers[0]) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    while (names != NULL && *names != '\0') {
+        size_t len = strcspn(names, ",");
+        uint32_t k = 0;
+        while (k < total && (strlen(analyzers[k].name) != len ||
+                             strncmp(analyzers[k].name, names, len) != 0)) {
+            k++;
+        }
+        if (k == total) {
+            printf("analyzer must be summary, percentiles, bins, recovery or "
+                   "limits: %.*s\n", (int)len, names);
+            analysis_free(a);
+            return EXIT_FAILURE;
+        }
+        if (analysis_add(a, &analyzers[k]) != EXIT_SUCCESS) {
+            analysis_free(a);
+            return EXIT_FAILURE;
+        }
+        names += len + (names[len] == ',');
+    }
+    return EXIT_SUCCESS;
+}
+
+/* the analyzers of `src` with states of their own, for a parallel worker */
+static int
+analysis_clone(struct analysis *dst, const struct analysis *src)
+{
+    dst->cnt = 0;
+    for (uint32_t i = 0; i < src->cnt; i++) {
+        if (analysis_add(dst, src->an[i]) != EXIT_SUCCESS) {
+            analysis_free(dst);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+static inline void
+analysis_init(struct analysis *a, const struct file_basic_stats *f_basics,
+              const struct flow_info *f_info)
+{
+    for (uint32_t i = 0; i < a->cnt; i++) {
+        a->an[i]->init(a->state[i], f_basics, f_info);
+    }
+}
+
+/* `b` in file order: every analyzer; on a parallel worker
+ * (`is_worker`): only those with a merge hook
+ */
+static inline void
+analysis_batch(struct analysis *a, const struct rec_batch *b, bool is_worker)
+{
+    for (uint32_t i = 0; i < a->cnt; i++) {
+        if (!is_worker || a->an[i]->merge != NULL) {
+            a->an[i]->batch(a->state[i], b);
+        }
+    }
+}
+
+/* the state a worker filled from `b`, or `b` itself to those without merge */
+static inline void
+analysis_merge(struct analysis *dst, const struct analysis *src,
+               const struct rec_batch *b)
+{
+    for (uint32_t i = 0; i < dst->cnt; i++) {
+        if (dst->an[i]->merge != NULL) {
+            dst->an[i]->merge(dst->state[i], src->state[i]);
+        } else {
+            dst->an[i]->batch(dst->state[i], b);
+        }
+    }
+}
+
+void
+analysis_finalize(struct analysis *a, const struct file_basic_stats *f_basics,
+                  struct flow_info *f_info)
+{
+    for (uint32_t i = 0; i < a->cnt; i++) {
+        a->an[i]->finalize(a->state[i], f_basics, f_info);
+    }
+}
+
+#endif /* ANALYZE_H_ */
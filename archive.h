@@ -0,0 +1,979 @@
+/*
+ * archive.h
+ *
+ *  Compact archive of a siftr2 log, restored byte for byte.
+ *
+ *  The body is cut into blocks of ARCHIVE_BLOCK_RECORDS records in file
+ *  order. A block stores the 18 fields of its records column by column, each
+ *  value as a varint: the flowid as an index into the block's sorted flowid
+ *  set, tval as the zigzag delta from the previous record, and every other
+ *  field as the zigzag delta from the previous record of the same flow, so
+ *  the cwnd and ssthresh that rarely change cost one byte. The head note,
+ *  the foot note and anything between the body and the foot note are kept
+ *  as they are.
+ *
+ *  A footer index holds the offset, record count, min/max tval, flowid set
+ *  and CRC32C of every block, so blocks decode independently. Import checks
+ *  and decodes them on parallel workers and writes them back in order.
+ *  Version 1 archives have no CRC32C and are restored unchecked.
+ *
+ *  A text log is archived only if every body line is in the form siftr2
+ *  writes ("%08x,%c,%x,...,%x"); anything else would not come back the same.
+ */
+
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+enum {
+    ARCHIVE_VERSION             = 2,
+    ARCHIVE_CRC_VERSION         = 2,        /* the first with block CRCs */
+    ARCHIVE_BLOCK_RECORDS       = 64 * 1024,
+    ARCHIVE_READ_SIZE           = 1024 * 1024,
+    ARCHIVE_MAX_VARINT          = 5,        /* bytes of a 32-bit varint */
+    ARCHIVE_MAX_TEXT_LINE       = 8 + 2 + 2 + (TOTAL_FIELDS - 2) * 9,
+    ARCHIVE_SLOTS_PER_WORKER    = 2,
+};
+
+#define ARCHIVE_MAGIC   "S2ARCHV"
+#define ARCHIVE_SUFFIX  ".s2a"
+
+struct archive_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    is_binary;
+    uint32_t    block_records;
+    uint32_t    block_count;
+    uint64_t    record_count;
+    uint64_t    head_len;           /* head note, right after this header */
+    uint64_t    tail_offset;        /* bytes after the body: the foot note and */
+    uint64_t    tail_len;           /* what a binary body leaves in front of it */
+    uint64_t    index_offset;       /* block_count archive_blocks, then ... */
+    uint64_t    flowid_count;       /* ... the flowid sets of all blocks */
+};
+
+struct archive_block {
+    uint64_t    offset;
+    uint32_t    size;
+    uint32_t    rec_cnt;
+    uint32_t    tval_min;
+    uint32_t    tval_max;
+    uint64_t    first_flowid;       /* sorted set in the flowid table */
+    uint32_t    flowid_cnt;
+    uint32_t    crc;                /* CRC32C of the encoded block */
+};
+
+/* a block starts with the byte size of each column */
+struct archive_block_head {
+    uint32_t    col_size[TOTAL_FIELDS];
+};
+
+static inline uint8_t *
+archive_put_varint(uint8_t *p, uint32_t val)
+{
+    while (val >= 0x80) {
+        *p++ = (uint8_t)(val | 0x80);
+        val >>= 7;
+    }
+    *p++ = (uint8_t)val;
+    return p;
+}
+
+/* NULL if the varint runs past `end` or over 32 bits */
+static inline const uint8_t *
+archive_get_varint(const uint8_t *p, const uint8_t *end, uint32_t *val)
+{
+    uint32_t v = 0;
+
+    /* most deltas fit in one byte */
+    if (p < end && *p < 0x80) {
+        *val = *p;
+        return p + 1;
+    }
+    for (int shift = 0; shift < 7 * ARCHIVE_MAX_VARINT; shift += 7) {
+        if (p == end) {
+            return NULL;
+        }
+        uint8_t byte = *p++;
+        v |= (uint32_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            *val = v;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* CRC32C (Castagnoli, reflected) by bytes, the table built by archive_crc_init() */
+static uint32_t archive_crc_table[256];
+
+static void
+archive_crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+        }
+        archive_crc_table[i] = crc;
+    }
+}
+
+static uint32_t
+archive_crc32c_table(uint32_t crc, const uint8_t *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        crc = archive_crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+__attribute__((target("sse4.2"))) static uint32_t
+archive_crc32c_sse42(uint32_t crc, const uint8_t *p, size_t n)
+{
+    uint64_t c = crc;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    for (; i < n; i++) {
+        c = _mm_crc32_u8((uint32_t)c, p[i]);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+static uint32_t
+archive_crc32c(const uint8_t *p, size_t n)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return ~archive_crc32c_sse42(~0u, p, n);
+    }
+#endif
+    return ~archive_crc32c_table(~0u, p, n);
+}
+
+static inline uint32_t
+zigzag_delta(uint32_t cur, uint32_t prev)
+{
+    int32_t d = (int32_t)(cur - prev);
+    return ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+}
+
+static inline uint32_t
+unzigzag_delta(uint32_t val, uint32_t prev)
+{
+    return prev + ((val >> 1) ^ (0u - (val & 1)));
+}
+
+static int
+archive_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static inline uint32_t
+archive_flowid_index(const uint32_t *set, uint32_t cnt, uint32_t flowid)
+{
+    uint32_t lo = 0, hi = cnt;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (set[mid] < flowid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Parse a text body line [p, eol) in the exact form siftr2 writes: an 8-digit
+ * flowid, 'i' or 'o', then lower case hex fields without leading zeros.
+ */
+static bool
+archive_parse_text_line(const char *p, const char *eol, uint32_t vals[])
+{
+    if (eol - p < 11 || p[8] != ',' || (p[9] != 'i' && p[9] != 'o') ||
+        p[10] != ',') {
+        return false;
+    }
+    for (int i = 0; i < 8; i++) {
+        if (!isdigit((uint8_t)p[i]) && !(p[i] >= 'a' && p[i] <= 'f')) {
+            return false;
+        }
+    }
+    vals[FLOW_ID] = fast_hex8_to_u32(p);
+    vals[DIRECTION] = (p[9] == 'o') ? DIR_OUT : DIR_IN;
+    p += 11;
+
+    for (int field = RELATIVE_TIME; field < TOTAL_FIELDS; field++) {
+        const char *start = p;
+        uint32_t val = 0;
+
+        while (p < eol && *p != ',') {
+            char c = *p;
+            if (!isdigit((uint8_t)c) && !(c >= 'a' && c <= 'f')) {
+                return false;
+            }
+            val = (val << 4) | (uint32_t)hexval[(uint8_t)c];
+            p++;
+        }
+        size_t len = (size_t)(p - start);
+        if (len == 0 || len > 8 || (len > 1 && *start == '0')) {
+            return false;
+        }
+        vals[field] = val;
+        if (field < TOTAL_FIELDS - 1) {
+            if (p == eol) {
+                return false;
+            }
+            p++;
+        }
+    }
+    return p == eol;
+}
+
+static const char archive_hex_digits[16] = "0123456789abcdef";
+
+static inline char *
+archive_put_hex(char *p, uint32_t val, int min_digits)
+{
+    int digits = (val == 0) ? 1 : (32 - __builtin_clz(val) + 3) / 4;
+
+    if (digits < min_digits) {
+        digits = min_digits;
+    }
+    for (int i = digits - 1; i >= 0; i--) {
+        p[i] = archive_hex_digits[val & 0xf];
+        val >>= 4;
+    }
+    return p + digits;
+}
+
+/* per block scratch space of the encoder and of each decoder */
+struct archive_block_buf {
+    uint32_t    *vals;          /* rec_cnt rows of TOTAL_FIELDS */
+    uint32_t    *idx;           /* flowid set index of each row */
+    uint32_t    *prev;          /* last values of each flow of the set */
+    uint32_t    *set;
+    uint8_t     *bytes;
+};
+
+static void
+archive_block_buf_free(struct archive_block_buf *bb)
+{
+    free(bb->vals);
+    free(bb->idx);
+    free(bb->prev);
+    free(bb->set);
+    free(bb->bytes);
+}
+
+static int
+archive_block_buf_init(struct archive_block_buf *bb, uint32_t max_flowids,
+                       size_t max_bytes)
+{
+    bb->vals = malloc((size_t)ARCHIVE_BLOCK_RECORDS * TOTAL_FIELDS * sizeof(uint32_t));
+    bb->idx = malloc(ARCHIVE_BLOCK_RECORDS * sizeof(uint32_t));
+    bb->prev = malloc((size_t)max_flowids * TOTAL_FIELDS * sizeof(uint32_t));
+    bb->set = malloc((size_t)max_flowids * sizeof(uint32_t));
+    bb->bytes = malloc(max_bytes);
+    if (bb->vals == NULL || bb->idx == NULL || bb->prev == NULL ||
+        bb->set == NULL || bb->bytes == NULL) {
+        PERROR_FUNCTION("malloc failed for an archive block");
+        archive_block_buf_free(bb);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Encode the `rec_cnt` rows in bb->vals into bb->bytes. Fills the index
+ * entry except the offset; the sorted flowid set is left in bb->set.
+ */
+static size_t
+archive_encode_block(struct archive_block_buf *bb, uint32_t rec_cnt,
+                     struct archive_block *blk)
+{
+    const uint32_t *vals = bb->vals;
+    uint32_t set_cnt = 0;
+
+    for (uint32_t i = 0; i < rec_cnt; i++) {
+        bb->set[i] = vals[i * TOTAL_FIELDS + FLOW_ID];
+    }
+    qsort(bb->set, rec_cnt, sizeof(*bb->set), archive_cmp_u32);
+    for (uint32_t i = 0; i < rec_cnt; i++) {
+        if (set_cnt == 0 || bb->set[set_cnt - 1] != bb->set[i]) {
+            bb->set[set_cnt++] = bb->set[i];
+        }
+    }
+
+    blk->rec_cnt = rec_cnt;
+    blk->flowid_cnt = set_cnt;
+    blk->tval_min = UINT32_MAX;
+    blk->tval_max = 0;
+    for (uint32_t i = 0; i < rec_cnt; i++) {
+        uint32_t tval = vals[i * TOTAL_FIELDS + RELATIVE_TIME];
+        bb->idx[i] = archive_flowid_index(bb->set, set_cnt,
+                                          vals[i * TOTAL_FIELDS + FLOW_ID]);
+        blk->tval_min = AGG_MIN(blk->tval_min, tval);
+        blk->tval_max = AGG_MAX(blk->tval_max, tval);
+    }
+    memset(bb->prev, 0, (size_t)set_cnt * TOTAL_FIELDS * sizeof(uint32_t));
+
+    struct archive_block_head head;
+    uint8_t *p = bb->bytes + sizeof(head);
+    for (int field = 0; field < TOTAL_FIELDS; field++) {
+        uint8_t *col = p;
+        uint32_t last = 0;
+
+        for (uint32_t i = 0; i < rec_cnt; i++) {
+            uint32_t val = vals[i * TOTAL_FIELDS + field];
+
+            if (field == FLOW_ID) {
+                p = archive_put_varint(p, bb->idx[i]);
+            } else if (field == DIRECTION) {
+                p = archive_put_varint(p, val);
+            } else if (field == RELATIVE_TIME) {
+                p = archive_put_varint(p, zigzag_delta(val, last));
+                last = val;
+            } else {
+                uint32_t *prev = &bb->prev[bb->idx[i] * TOTAL_FIELDS + field];
+                p = archive_put_varint(p, zigzag_delta(val, *prev));
+                *prev = val;
+            }
+        }
+        head.col_size[field] = (uint32_t)(p - col);
+    }
+    memcpy(bb->bytes, &head, sizeof(head));
+    blk->size = (uint32_t)(p - bb->bytes);
+    return blk->size;
+}
+
+/* Decode the block in bb->bytes back into bb->vals, using its flowid set
+ * `set`. Fails on a block that does not match its index entry.
+ */
+static int
+archive_decode_block(struct archive_block_buf *bb, const struct archive_block *blk,
+                     const uint32_t *set)
+{
+    struct archive_block_head head;
+    const uint32_t rec_cnt = blk->rec_cnt;
+    uint32_t *vals = bb->vals;
+
+    if (blk->size < sizeof(head) || rec_cnt > ARCHIVE_BLOCK_RECORDS) {
+        return EXIT_FAILURE;
+    }
+    memcpy(&head, bb->bytes, sizeof(head));
+    memset(bb->prev, 0, (size_t)blk->flowid_cnt * TOTAL_FIELDS * sizeof(uint32_t));
+
+    /* one cursor per column, so the rows are filled one after the other */
+    const uint8_t *cur[TOTAL_FIELDS], *col_end[TOTAL_FIELDS];
+    const uint8_t *p = bb->bytes + sizeof(head);
+    const uint8_t *end = bb->bytes + blk->size;
+    for (int field = 0; field < TOTAL_FIELDS; field++) {
+        if ((size_t)(end - p) < head.col_size[field]) {
+            return EXIT_FAILURE;
+        }
+        cur[field] = p;
+        p += head.col_size[field];
+        col_end[field] = p;
+    }
+    if (p != end) {
+        return EXIT_FAILURE;
+    }
+
+    uint32_t last_tval = 0;
+    for (uint32_t i = 0; i < rec_cnt; i++) {
+        uint32_t *row = &vals[i * TOTAL_FIELDS];
+        uint32_t val;
+
+        cur[FLOW_ID] = archive_get_varint(cur[FLOW_ID], col_end[FLOW_ID], &val);
+        if (cur[FLOW_ID] == NULL || val >= blk->flowid_cnt) {
+            return EXIT_FAILURE;
+        }
+        row[FLOW_ID] = set[val];
+        uint32_t *prev = &bb->prev[val * TOTAL_FIELDS];
+
+        cur[DIRECTION] = archive_get_varint(cur[DIRECTION], col_end[DIRECTION],
+                                            &row[DIRECTION]);
+        cur[RELATIVE_TIME] = archive_get_varint(cur[RELATIVE_TIME],
+                                                col_end[RELATIVE_TIME], &val);
+        if (cur[DIRECTION] == NULL || cur[RELATIVE_TIME] == NULL) {
+            return EXIT_FAILURE;
+        }
+        last_tval = row[RELATIVE_TIME] = unzigzag_delta(val, last_tval);
+        if (last_tval < blk->tval_min || last_tval > blk->tval_max) {
+            return EXIT_FAILURE;
+        }
+
+        for (int field = RELATIVE_TIME + 1; field < TOTAL_FIELDS; field++) {
+            cur[field] = archive_get_varint(cur[field], col_end[field], &val);
+            if (cur[field] == NULL) {
+                return EXIT_FAILURE;
+            }
+            row[field] = prev[field] = unzigzag_delta(val, prev[field]);
+        }
+    }
+    for (int field = 0; field < TOTAL_FIELDS; field++) {
+        if (cur[field] != col_end[field]) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Write the rows of bb->vals in the record format of the log into `out`,
+ * returns the bytes written.
+ */
+static size_t
+archive_format_block(const struct archive_block_buf *bb, uint32_t rec_cnt,
+                     bool is_binary, char *out)
+{
+    char *p = out;
+
+    if (is_binary) {
+        _Static_assert(sizeof(struct pkt_node) == TOTAL_FIELDS * sizeof(uint32_t),
+                       "pkt_node must be the TOTAL_FIELDS words of a record");
+        memcpy(out, bb->vals, (size_t)rec_cnt * sizeof(struct pkt_node));
+        return (size_t)rec_cnt * sizeof(struct pkt_node);
+    }
+    for (uint32_t i = 0; i < rec_cnt; i++) {
+        const uint32_t *row = &bb->vals[i * TOTAL_FIELDS];
+
+        p = archive_put_hex(p, row[FLOW_ID], 8);
+        *p++ = ',';
+        *p++ = (row[DIRECTION] == DIR_OUT) ? 'o' : 'i';
+        for (int field = RELATIVE_TIME; field < TOTAL_FIELDS; field++) {
+            *p++ = ',';
+            p = archive_put_hex(p, row[field], 1);
+        }
+        *p++ = '\n';
+    }
+    return (size_t)(p - out);
+}
+
+/* copy [offset, offset + len) of `fd` to `dst` */
+static int
+archive_copy_range(int fd, off_t offset, uint64_t len, FILE *dst)
+{
+    char block[FOOTER_SCAN_BLOCK];
+
+    while (len > 0) {
+        size_t want = (len < sizeof(block)) ? (size_t)len : sizeof(block);
+        ssize_t got = pread_full(fd, block, want, offset);
+        if (got != (ssize_t)want || fwrite(block, 1, want, dst) != want) {
+            return EXIT_FAILURE;
+        }
+        offset += (off_t)want;
+        len -= want;
+    }
+    return EXIT_SUCCESS;
+}
+
+struct archive_writer {
+    FILE        *file;
+    struct archive_header hdr;
+    struct archive_block_buf bb;
+    uint32_t    rec_cnt;            /* rows waiting in bb.vals */
+    struct archive_block *blocks;
+    uint32_t    block_cap;
+    uint32_t    *flowids;
+    uint64_t    flowid_cap;
+    uint64_t    body_bytes;         /* of the log, for the ratio */
+};
+
+static int
+archive_flush_block(struct archive_writer *w)
+{
+    if (w->rec_cnt == 0) {
+        return EXIT_SUCCESS;
+    }
+    if (w->hdr.block_count == w->block_cap) {
+        uint32_t cap = (w->block_cap == 0) ? 64 : w->block_cap * 2;
+        struct archive_block *tmp = realloc(w->blocks, cap * sizeof(*tmp));
+        if (tmp == NULL) {
+            PERROR_FUNCTION("realloc failed for the block index");
+            return EXIT_FAILURE;
+        }
+        w->blocks = tmp;
+        w->block_cap = cap;
+    }
+
+    struct archive_block *blk = &w->blocks[w->hdr.block_count];
+    memset(blk, 0, sizeof(*blk));
+    size_t size = archive_encode_block(&w->bb, w->rec_cnt, blk);
+
+    if (w->hdr.flowid_count + blk->flowid_cnt > w->flowid_cap) {
+        uint64_t cap = (w->flowid_cap == 0) ? 1024 : w->flowid_cap;
+        while (cap < w->hdr.flowid_count + blk->flowid_cnt) {
+            cap *= 2;
+        }
+        uint32_t *tmp = realloc(w->flowids, cap * sizeof(*tmp));
+        if (tmp == NULL) {
+            PERROR_FUNCTION("realloc failed for the flowid table");
+            return EXIT_FAILURE;
+        }
+        w->flowids = tmp;
+        w->flowid_cap = cap;
+    }
+    memcpy(&w->flowids[w->hdr.flowid_count], w->bb.set,
+           blk->flowid_cnt * sizeof(uint32_t));
+    blk->first_flowid = w->hdr.flowid_count;
+    w->hdr.flowid_count += blk->flowid_cnt;
+
+    blk->offset = (uint64_t)ftell(w->file);
+    blk->crc = archive_crc32c(w->bb.bytes, size);
+    if (fwrite(w->bb.bytes, 1, size, w->file) != size) {
+        PERROR_FUNCTION("Failed to write an archive block");
+        return EXIT_FAILURE;
+    }
+    w->hdr.block_count++;
+    w->hdr.record_count += w->rec_cnt;
+    w->rec_cnt = 0;
+    return EXIT_SUCCESS;
+}
+
+/* Read the body and hand its records to the block encoder in file order. */
+static int
+archive_encode_body(struct archive_writer *w, const struct file_basic_stats *f_basics,
+                    long *body_end)
+{
+    const bool is_binary = is_rec_fmt_binary;
+    const size_t rec_size = sizeof(struct pkt_node);
+    int fd = fileno(f_basics->file);
+    long pos = f_basics->body_offset;
+    long end = f_basics->last_line_offset;
+    size_t keep = 0;                /* bytes of a partial line or record */
+    uint64_t line_no = 1;           /* the head note */
+    int ret = EXIT_FAILURE;
+
+    if (is_binary) {
+        end = pos + (end - pos) / (long)rec_size * (long)rec_size;
+    }
+    char *buf = malloc(ARCHIVE_READ_SIZE + ARCHIVE_MAX_TEXT_LINE + 1);
+    if (buf == NULL) {
+        PERROR_FUNCTION("malloc failed for the archive reader");
+        return EXIT_FAILURE;
+    }
+
+    while (pos < end || keep > 0) {
+        size_t want = (size_t)AGG_MIN((long)ARCHIVE_READ_SIZE, end - pos);
+        ssize_t got = pread_full(fd, buf + keep, want, pos);
+        if (got != (ssize_t)want) {
+            PERROR_FUNCTION("pread");
+            goto out;
+        }
+        pos += got;
+
+        const char *p = buf;
+        const char *lim = buf + keep + (size_t)got;
+        while (p < lim) {
+            uint32_t *row = &w->bb.vals[(size_t)w->rec_cnt * TOTAL_FIELDS];
+
+            if (is_binary) {
+                if ((size_t)(lim - p) < rec_size) {
+                    break;
+                }
+                memcpy(row, p, rec_size);
+                p += rec_size;
+            } else {
+                const char *nl = memchr(p, '\n', (size_t)(lim - p));
+                if (nl == NULL) {
+                    break;
+                }
+                line_no++;
+                if (!archive_parse_text_line(p, nl, row)) {
+                    printf("line %" PRIu64 " is not a siftr2 text record, the "
+                           "archive would not restore it byte for byte\n", line_no);
+                    goto out;
+                }
+                p = nl + 1;
+            }
+            if (++w->rec_cnt == ARCHIVE_BLOCK_RECORDS &&
+                archive_flush_block(w) != EXIT_SUCCESS) {
+                goto out;
+            }
+        }
+        keep = (size_t)(lim - p);
+        if (keep > ARCHIVE_MAX_TEXT_LINE) {
+            printf("line %" PRIu64 " is too long for a siftr2 text record\n",
+                   line_no + 1);
+            goto out;
+        }
+        memmove(buf, p, keep);
+        if (pos == end && keep > 0) {
+            /* the foot note starts after a '\n', and `end` of a binary
+             * body is a whole number of records */
+            printf("line %" PRIu64 " has no newline\n", line_no + 1);
+            goto out;
+        }
+    }
+    ret = archive_flush_block(w);
+    *body_end = end;
+
+out:
+    free(buf);
+    return ret;
+}
+
+/* Write the archive of the log in `f_basics` to `path`. */
+int
+archive_export(const struct file_basic_stats *f_basics, const char *path)
+{
+    struct archive_writer w = {};
+    int fd = fileno(f_basics->file);
+    char tmp_path[PATH_MAX];
+    int ret = EXIT_FAILURE;
+    long body_end = 0;
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        PERROR_FUNCTION("fstat");
+        return EXIT_FAILURE;
+    }
+    archive_crc_init();
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    w.file = fopen(tmp_path, "wb");
+    if (w.file == NULL) {
+        PERROR_FUNCTION("Failed to create the archive file");
+        return EXIT_FAILURE;
+    }
+    if (archive_block_buf_init(&w.bb, ARCHIVE_BLOCK_RECORDS,
+                               sizeof(struct archive_block_head) +
+                               (size_t)ARCHIVE_BLOCK_RECORDS * TOTAL_FIELDS *
+                               ARCHIVE_MAX_VARINT) != EXIT_SUCCESS) {
+        fclose(w.file);
+        remove(tmp_path);
+        return EXIT_FAILURE;
+    }
+
+    memcpy(w.hdr.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    w.hdr.version = ARCHIVE_VERSION;
+    w.hdr.is_binary = is_rec_fmt_binary;
+    w.hdr.block_records = ARCHIVE_BLOCK_RECORDS;
+    w.hdr.head_len = (uint64_t)f_basics->body_offset;
+
+    /* the header is written again once the index is known */
+    if (fwrite(&w.hdr, sizeof(w.hdr), 1, w.file) != 1 ||
+        archive_copy_range(fd, 0, w.hdr.head_len, w.file) != EXIT_SUCCESS) {
+        printf("failed to write the archive head: %s\n", tmp_path);
+        goto out;
+    }
+    if (archive_encode_body(&w, f_basics, &body_end) != EXIT_SUCCESS) {
+        goto out;
+    }
+
+    w.hdr.tail_offset = (uint64_t)ftell(w.file);
+    w.hdr.tail_len = (uint64_t)(st.st_size - body_end);
+    if (archive_copy_range(fd, body_end, w.hdr.tail_len, w.file) != EXIT_SUCCESS) {
+        printf("failed to write the archive tail: %s\n", tmp_path);
+        goto out;
+    }
+    w.hdr.index_offset = (uint64_t)ftell(w.file);
+    if (fwrite(w.blocks, sizeof(*w.blocks), w.hdr.block_count,
+               w.file) != w.hdr.block_count ||
+        fwrite(w.flowids, sizeof(*w.flowids), w.hdr.flowid_count,
+               w.file) != w.hdr.flowid_count ||
+        fseek(w.file, 0, SEEK_SET) != 0 ||
+        fwrite(&w.hdr, sizeof(w.hdr), 1, w.file) != 1) {
+        printf("failed to write the archive index: %s\n", tmp_path);
+        goto out;
+    }
+    ret = EXIT_SUCCESS;
+
+out:
+    free(w.blocks);
+    free(w.flowids);
+    archive_block_buf_free(&w.bb);
+    if (fclose(w.file) != 0) {
+        PERROR_FUNCTION("Failed to close the archive file");
+        ret = EXIT_FAILURE;
+    }
+    if (ret == EXIT_SUCCESS && rename(tmp_path, path) != 0) {
+        PERROR_FUNCTION("Failed to rename the archive file");
+        ret = EXIT_FAILURE;
+    }
+    if (ret != EXIT_SUCCESS) {
+        remove(tmp_path);
+        return EXIT_FAILURE;
+    }
+
+    long archive_size = (long)w.hdr.index_offset +
+                        (long)(w.hdr.block_count * sizeof(struct archive_block) +
+                               w.hdr.flowid_count * sizeof(uint32_t));
+    printf("archive_file_name: %s\n", path);
+    printf("  %" PRIu64 " records in %u blocks, %ld -> %ld bytes (%.1f%%)\n",
+           w.hdr.record_count, w.hdr.block_count, (long)st.st_size, archive_size,
+           (st.st_size > 0) ? 100.0 * archive_size / st.st_size : 0.0);
+    return EXIT_SUCCESS;
+}
+
+/* Block k goes to slot k % slot_cnt, taken in turn as in pscan.h. */
+struct archive_slot {
+    atomic_uint_fast64_t turn;
+    atomic_bool is_ready;
+    bool        has_failed;
+    char        *out;
+    size_t      out_len;
+};
+
+struct archive_reader {
+    int         fd;
+    struct archive_header hdr;
+    struct archive_block *blocks;
+    uint32_t    *flowids;
+    uint32_t    max_flowids;        /* largest flowid set of a block */
+    uint32_t    max_size;           /* largest encoded block */
+    atomic_uint_fast64_t next_block;
+    struct archive_slot *slots;
+    uint32_t    slot_cnt;
+};
+
+static size_t
+archive_out_size(const struct archive_reader *r)
+{
+    return (size_t)r->hdr.block_records *
+           (r->hdr.is_binary ? sizeof(struct pkt_node) : ARCHIVE_MAX_TEXT_LINE);
+}
+
+int archive_worker(void *arg)
+{
+    struct archive_reader *r = arg;
+    struct archive_block_buf bb;
+
+    bool has_buf = archive_block_buf_init(&bb, r->max_flowids, r->max_size) ==
+                   EXIT_SUCCESS;
+
+    while (true) {
+        uint64_t k = atomic_fetch_add(&r->next_block, 1);
+        if (k >= r->hdr.block_count) {
+            break;
+        }
+        struct archive_slot *slot = &r->slots[k % r->slot_cnt];
+        while (atomic_load_explicit(&slot->turn, memory_order_acquire) != k) {
+            sched_yield();
+        }
+
+        const struct archive_block *blk = &r->blocks[k];
+        slot->out_len = 0;
+        slot->has_failed = !has_buf ||
+            pread_full(r->fd, bb.bytes, blk->size,
+                       (off_t)blk->offset) != (ssize_t)blk->size ||
+            (r->hdr.version >= ARCHIVE_CRC_VERSION &&
+             archive_crc32c(bb.bytes, blk->size) != blk->crc) ||
+            archive_decode_block(&bb, blk, &r->flowids[blk->first_flowid]) !=
+            EXIT_SUCCESS;
+        if (!slot->has_failed) {
+            slot->out_len = archive_format_block(&bb, blk->rec_cnt,
+                                                 r->hdr.is_binary, slot->out);
+        }
+        atomic_store_explicit(&slot->is_ready, true, memory_order_release);
+    }
+
+    if (has_buf) {
+        archive_block_buf_free(&bb);
+    }
+    return EXIT_SUCCESS;
+}
+
+static int
+archive_read_index(struct archive_reader *r, const char *path)
+{
+    struct archive_header *hdr = &r->hdr;
+
+    if (pread_full(r->fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+        memcmp(hdr->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0) {
+        printf("not a siftr2 archive: %s\n", path);
+        return EXIT_FAILURE;
+    }
+    if (hdr->version < 1 || hdr->version > ARCHIVE_VERSION ||
+        hdr->block_records > ARCHIVE_BLOCK_RECORDS) {
+        printf("unsupported archive version %u: %s\n", hdr->version, path);
+        return EXIT_FAILURE;
+    }
+
+    size_t index_size = hdr->block_count * sizeof(*r->blocks);
+    size_t flowid_size = hdr->flowid_count * sizeof(*r->flowids);
+    r->blocks = malloc(index_size ? index_size : 1);
+    r->flowids = malloc(flowid_size ? flowid_size : 1);
+    if (r->blocks == NULL || r->flowids == NULL ||
+        pread_full(r->fd, r->blocks, index_size,
+                   (off_t)hdr->index_offset) != (ssize_t)index_size ||
+        pread_full(r->fd, r->flowids, flowid_size,
+                   (off_t)(hdr->index_offset + index_size)) != (ssize_t)flowid_size) {
+        printf("the block index of the archive is truncated: %s\n", path);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t rec_cnt = 0;
+    for (uint32_t k = 0; k < hdr->block_count; k++) {
+        const struct archive_block *blk = &r->blocks[k];
+        if (blk->rec_cnt > hdr->block_records ||
+            blk->first_flowid + blk->flowid_cnt > hdr->flowid_count) {
+            printf("block %u of the archive is corrupt: %s\n", k, path);
+            return EXIT_FAILURE;
+        }
+        r->max_flowids = AGG_MAX(r->max_flowids, blk->flowid_cnt);
+        r->max_size = AGG_MAX(r->max_size, blk->size);
+        rec_cnt += blk->rec_cnt;
+    }
+    if (rec_cnt != hdr->record_count) {
+        printf("the block index does not add up to %" PRIu64 " records: %s\n",
+               hdr->record_count, path);
+        return EXIT_FAILURE;
+    }
+    if (verbose) {
+        for (uint32_t k = 0; k < hdr->block_count; k++) {
+            const struct archive_block *blk = &r->blocks[k];
+            printf("[%s] block %u: %u records, %u bytes, tval %u-%u, %u flows\n",
+                   __FUNCTION__, k, blk->rec_cnt, blk->size, blk->tval_min,
+                   blk->tval_max, blk->flowid_cnt);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* The log restored from `path`: the name without ARCHIVE_SUFFIX, or with
+ * ".log" appended if it has none.
+ */
+static void
+archive_log_name(const char *path, char *name, size_t size)
+{
+    size_t len = strlen(path);
+    size_t suffix_len = strlen(ARCHIVE_SUFFIX);
+
+    if (len > suffix_len && strcmp(path + len - suffix_len, ARCHIVE_SUFFIX) == 0) {
+        snprintf(name, size, "%.*s", (int)(len - suffix_len), path);
+    } else {
+        snprintf(name, size, "%s.log", path);
+    }
+}
+
+/* Restore the log archived in `path` next to it, never over an existing file. */
+int
+archive_import(const char *path)
+{
+    struct archive_reader r = {};
+    char log_name[PATH_MAX];
+    FILE *log = NULL;
+    int ret = EXIT_FAILURE;
+
+    r.fd = open(path, O_RDONLY);
+    if (r.fd < 0) {
+        PERROR_FUNCTION("Failed to open the archive file");
+        return EXIT_FAILURE;
+    }
+    if (archive_read_index(&r, path) != EXIT_SUCCESS) {
+        goto out;
+    }
+    archive_crc_init();
+
+    archive_log_name(path, log_name, sizeof(log_name));
+    log = fopen(log_name, "wx");
+    if (log == NULL) {
+        printf("cannot create %s: %s\n", log_name, strerror(errno));
+        goto out;
+    }
+    if (archive_copy_range(r.fd, sizeof(r.hdr), r.hdr.head_len, log) != EXIT_SUCCESS) {
+        printf("failed to restore the head note: %s\n", log_name);
+        goto out;
+    }
+
+    uint32_t workers = pscan_worker_count(r.hdr.block_count);
+    r.slot_cnt = workers * ARCHIVE_SLOTS_PER_WORKER;
+    r.slots = calloc(r.slot_cnt, sizeof(*r.slots));
+    if (r.slots == NULL) {
+        PERROR_FUNCTION("calloc failed for archive slots");
+        goto out;
+    }
+    for (uint32_t s = 0; s < r.slot_cnt; s++) {
+        atomic_init(&r.slots[s].turn, s);
+        atomic_init(&r.slots[s].is_ready, false);
+        r.slots[s].out = malloc(archive_out_size(&r));
+        if (r.slots[s].out == NULL) {
+            PERROR_FUNCTION("malloc failed for archive slots");
+            goto out;
+        }
+    }
+    atomic_init(&r.next_block, 0);
+
+    thrd_t threads[PSCAN_MAX_WORKERS];
+    uint32_t started = 0;
+    while (started < workers &&
+           thrd_create(&threads[started], archive_worker, &r) == thrd_success) {
+        started++;
+    }
+    /* the workers that did start take every block, so they are drained
+     * before the import fails */
+    bool has_failed = (started < workers);
+    if (has_failed) {
+        printf("started %u of %u archive workers\n", started, workers);
+    }
+    for (uint64_t k = 0; k < r.hdr.block_count && started > 0; k++) {
+        struct archive_slot *slot = &r.slots[k % r.slot_cnt];
+        while (!atomic_load_explicit(&slot->is_ready, memory_order_acquire)) {
+            sched_yield();
+        }
+        if (!has_failed && slot->has_failed) {
+            printf("block %" PRIu64 " of the archive is corrupt: %s\n", k, path);
+            has_failed = true;
+        }
+        if (!has_failed &&
+            fwrite(slot->out, 1, slot->out_len, log) != slot->out_len) {
+            PERROR_FUNCTION("Failed to write the restored body");
+            has_failed = true;
+        }
+        atomic_store_explicit(&slot->is_ready, false, memory_order_relaxed);
+        atomic_store_explicit(&slot->turn, k + r.slot_cnt, memory_order_release);
+    }
+    for (uint32_t w = 0; w < started; w++) {
+        thrd_join(threads[w], NULL);
+    }
+
+    if (has_failed) {
+        goto out;
+    }
+    if (archive_copy_range(r.fd, (off_t)r.hdr.tail_offset, r.hdr.tail_len,
+                           log) != EXIT_SUCCESS) {
+        printf("failed to restore the foot note: %s\n", log_name);
+        goto out;
+    }
+    ret = EXIT_SUCCESS;
+
+out:
+    if (log != NULL && fclose(log) != 0) {
+        ret = EXIT_FAILURE;
+    }
+    if (log != NULL && ret != EXIT_SUCCESS) {
+        remove(log_name);
+    }
+    if (r.slots != NULL) {
+        for (uint32_t s = 0; s < r.slot_cnt; s++) {
+            free(r.slots[s].out);
+        }
+    }
+    free(r.slots);
+    free(r.blocks);
+    free(r.flowids);
+    close(r.fd);
+
+    if (ret == EXIT_SUCCESS) {
+        printf("restored_file_name: %s\n", log_name);
+        printf("  %" PRIu64 " records from %u blocks\n",
+               r.hdr.record_count, r.hdr.block_count);
+    }
+    return ret;
+}
+
+#endif /* ARCHIVE_H_ */
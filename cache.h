@@ -0,0 +1,472 @@
+/*
+ * cache.h
+ *
+ *  On-disk cache of per-chunk, per-flow partial aggregates.
+ *
+ *  The first run with `--cache path` scans the body once for all flows and
+ *  stores a flow_agg for every (chunk, flow) pair that has records. Later
+ *  runs answer a flow summary by merging the cached aggregates; with a time
+ *  window from `--where time...` only the chunks straddling the window edges
+ *  are parsed again. The cache is keyed on the size, mtime and head/foot note
+ *  hashes of the log and is rebuilt when any of them changes.
+ */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <sys/stat.h>
+
+enum {
+    CACHE_VERSION       = 2,
+    CACHE_SCAN_SPAN     = 4 * 1024 * 1024,  /* bytes read per scan step */
+    CACHE_MIN_CHUNKS    = 4,
+    CACHE_SIZE_RATIO    = 8,                /* cache <= log size / ratio */
+};
+
+#define CACHE_MAGIC     "S2CACHE"
+
+struct cache_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    entry_size;
+    uint64_t    file_size;
+    int64_t     mtime;
+    uint64_t    head_hash;
+    uint64_t    foot_hash;
+    uint64_t    scan_span;          /* span of the body_chunks scan steps */
+    uint64_t    group;              /* scan steps per cached chunk */
+    uint64_t    chunk_count;
+    uint64_t    entry_count;
+};
+
+struct cache_chunk {
+    uint64_t    first_entry;
+    uint64_t    entry_count;        /* entries are sorted by flowid */
+    uint32_t    time_min;
+    uint32_t    time_max;
+};
+
+struct cache_entry {
+    uint32_t    flowid;
+    uint32_t    pad;
+    struct flow_agg agg;
+};
+
+struct agg_cache {
+    struct cache_header hdr;
+    struct cache_chunk *chunks;
+    struct cache_entry *entries;
+};
+
+/* FNV-1a over [offset, offset + len) of the file */
+static inline uint64_t
+cache_hash_range(int fd, long offset, long len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    char block[FOOTER_SCAN_BLOCK];
+
+    while (len > 0) {
+        size_t want = (len < (long)sizeof(block)) ? (size_t)len : sizeof(block);
+        ssize_t got = pread_full(fd, block, want, offset);
+        if (got <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < got; i++) {
+            hash = (hash ^ (uint8_t)block[i]) * 0x100000001b3ull;
+        }
+        offset += got;
+        len -= got;
+    }
+    return hash;
+}
+
+static inline int
+cache_identity(const struct file_basic_stats *f_basics, struct cache_header *hdr)
+{
+    int fd = fileno(f_basics->file);
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        PERROR_FUNCTION("fstat");
+        return EXIT_FAILURE;
+    }
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    hdr->version = CACHE_VERSION;
+    hdr->entry_size = sizeof(struct cache_entry);
+    hdr->file_size = (uint64_t)st.st_size;
+    hdr->mtime = (int64_t)st.st_mtime;
+    hdr->head_hash = cache_hash_range(fd, 0, f_basics->body_offset);
+    hdr->foot_hash = cache_hash_range(fd, f_basics->last_line_offset,
+                                      (long)st.st_size - f_basics->last_line_offset);
+    return EXIT_SUCCESS;
+}
+
+static inline void
+agg_cache_free(struct agg_cache *cache)
+{
+    free(cache->chunks);
+    free(cache->entries);
+    cache->chunks = NULL;
+    cache->entries = NULL;
+}
+
+struct cache_build_ctx {
+    const struct file_basic_stats *f_basics;
+    struct flow_agg *aggs;          /* one per flow_list slot */
+    uint32_t    *touched;           /* slots with records in this chunk */
+    uint32_t    touched_cnt;
+};
+
+static void
+cache_build_record(void *arg, uint32_t flowid, const record_t *rec)
+{
+    struct cache_build_ctx *ctx = arg;
+    uint32_t idx;
+
+    if (!flow_table_lookup(&ctx->f_basics->flow_table, flowid, &idx)) {
+        return;
+    }
+    if (ctx->aggs[idx].rec_cnt == 0) {
+        ctx->touched[ctx->touched_cnt++] = idx;
+    }
+    flow_agg_update(&ctx->aggs[idx], rec, ctx->f_basics->flow_list[idx].mss);
+}
+
+static int
+cache_cmp_entry(const void *a, const void *b)
+{
+    uint32_t x = ((const struct cache_entry *)a)->flowid;
+    uint32_t y = ((const struct cache_entry *)b)->flowid;
+    return (x > y) - (x < y);
+}
+
+/* Scan the whole body once and fill `cache` with per-chunk aggregates. */
+static int
+agg_cache_build(struct agg_cache *cache, const struct file_basic_stats *f_basics)
+{
+    struct body_chunks bc;
+    body_chunks_init(&bc, f_basics, CACHE_SCAN_SPAN);
+
+    /* finer chunks answer windows better, but every flow may have an entry in
+     * every chunk, so the chunk count is bounded by the cache size budget */
+    uint64_t per_chunk = (uint64_t)(f_basics->flow_count ? f_basics->flow_count : 1) *
+                         sizeof(struct cache_entry);
+    uint64_t max_chunks = (uint64_t)(bc.end - bc.begin) / CACHE_SIZE_RATIO / per_chunk;
+    if (max_chunks < CACHE_MIN_CHUNKS) {
+        max_chunks = CACHE_MIN_CHUNKS;
+    }
+    uint64_t group = (bc.count + max_chunks - 1) / max_chunks;
+    if (group == 0) {
+        group = 1;
+    }
+
+    cache->hdr.scan_span = bc.span;
+    cache->hdr.group = group;
+    cache->hdr.chunk_count = (bc.count + group - 1) / group;
+    cache->hdr.entry_count = 0;
+    cache->chunks = calloc(cache->hdr.chunk_count ? cache->hdr.chunk_count : 1,
+                           sizeof(*cache->chunks));
+
+    struct cache_build_ctx ctx = {
+        .f_basics = f_basics,
+        .aggs = malloc(f_basics->flow_count * sizeof(struct flow_agg)),
+        .touched = malloc(f_basics->flow_count * sizeof(uint32_t)),
+    };
+    char *buf = malloc(body_chunks_buf_size(&bc));
+    uint64_t entry_cap = 0;
+
+    if (cache->chunks == NULL || ctx.aggs == NULL || ctx.touched == NULL ||
+        buf == NULL) {
+        PERROR_FUNCTION("malloc failed for the cache");
+        free(ctx.aggs);
+        free(ctx.touched);
+        free(buf);
+        agg_cache_free(cache);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < f_basics->flow_count; i++) {
+        flow_agg_init(&ctx.aggs[i]);
+    }
+
+    for (uint64_t c = 0; c < cache->hdr.chunk_count; c++) {
+        struct cache_chunk *chunk = &cache->chunks[c];
+        uint64_t last = ((c + 1) * group < bc.count) ? (c + 1) * group : bc.count;
+
+        for (uint64_t k = c * group; k < last; k++) {
+            if (body_chunk_scan(&bc, k, buf, NULL, cache_build_record, &ctx) < 0) {
+                PERROR_FUNCTION("pread");
+                free(ctx.aggs);
+                free(ctx.touched);
+                free(buf);
+                agg_cache_free(cache);
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (cache->hdr.entry_count + ctx.touched_cnt > entry_cap) {
+            uint64_t cap = entry_cap ? entry_cap : 1024;
+            while (cap < cache->hdr.entry_count + ctx.touched_cnt) {
+                cap *= 2;
+            }
+            struct cache_entry *tmp = realloc(cache->entries, cap * sizeof(*tmp));
+            if (tmp == NULL) {
+                PERROR_FUNCTION("realloc failed for cache entries");
+                free(ctx.aggs);
+                free(ctx.touched);
+                free(buf);
+                agg_cache_free(cache);
+                return EXIT_FAILURE;
+            }
+            cache->entries = tmp;
+            entry_cap = cap;
+        }
+
+        chunk->first_entry = cache->hdr.entry_count;
+        chunk->entry_count = ctx.touched_cnt;
+        chunk->time_min = UINT32_MAX;
+        chunk->time_max = 0;
+        for (uint32_t i = 0; i < ctx.touched_cnt; i++) {
+            uint32_t idx = ctx.touched[i];
+            struct cache_entry *e = &cache->entries[cache->hdr.entry_count++];
+
+            e->flowid = f_basics->flow_list[idx].flowid;
+            e->pad = 0;
+            e->agg = ctx.aggs[idx];
+            chunk->time_min = AGG_MIN(chunk->time_min, e->agg.time_min);
+            chunk->time_max = AGG_MAX(chunk->time_max, e->agg.time_max);
+            flow_agg_init(&ctx.aggs[idx]);
+        }
+        qsort(&cache->entries[chunk->first_entry], chunk->entry_count,
+              sizeof(struct cache_entry), cache_cmp_entry);
+        ctx.touched_cnt = 0;
+    }
+
+    free(ctx.aggs);
+    free(ctx.touched);
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
+static int
+agg_cache_save(const struct agg_cache *cache, const char *path)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        PERROR_FUNCTION("Failed to create the cache file");
+        return EXIT_FAILURE;
+    }
+    bool ok = fwrite(&cache->hdr, sizeof(cache->hdr), 1, file) == 1 &&
+              fwrite(cache->chunks, sizeof(*cache->chunks),
+                     cache->hdr.chunk_count, file) == cache->hdr.chunk_count &&
+              fwrite(cache->entries, sizeof(*cache->entries),
+                     cache->hdr.entry_count, file) == cache->hdr.entry_count;
+    if (fclose(file) != 0 || !ok) {
+        PERROR_FUNCTION("Failed to write the cache file");
+        remove(tmp_path);
+        return EXIT_FAILURE;
+    }
+    /* replace an old cache in one step, readers never see a partial one */
+    if (rename(tmp_path, path) != 0) {
+        PERROR_FUNCTION("Failed to rename the cache file");
+        remove(tmp_path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Load a cache matching `identity`; fails if it is missing or stale. */
+static int
+agg_cache_load(struct agg_cache *cache, const char *path,
+               const struct cache_header *identity)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    struct cache_header *hdr = &cache->hdr;
+    if (fread(hdr, sizeof(*hdr), 1, file) != 1 ||
+        memcmp(hdr->magic, identity->magic, sizeof(hdr->magic)) != 0 ||
+        hdr->version != identity->version ||
+        hdr->entry_size != identity->entry_size ||
+        hdr->file_size != identity->file_size ||
+        hdr->mtime != identity->mtime ||
+        hdr->head_hash != identity->head_hash ||
+        hdr->foot_hash != identity->foot_hash) {
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    cache->chunks = malloc((hdr->chunk_count ? hdr->chunk_count : 1) *
+                           sizeof(*cache->chunks));
+    cache->entries = malloc((hdr->entry_count ? hdr->entry_count : 1) *
+                            sizeof(*cache->entries));
+    bool ok = cache->chunks != NULL && cache->entries != NULL &&
+              fread(cache->chunks, sizeof(*cache->chunks), hdr->chunk_count,
+                    file) == hdr->chunk_count &&
+              fread(cache->entries, sizeof(*cache->entries), hdr->entry_count,
+                    file) == hdr->entry_count;
+    fclose(file);
+    if (!ok) {
+        agg_cache_free(cache);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Load the cache at `path`, or build and save it if it is missing or stale. */
+int
+agg_cache_open(struct agg_cache *cache, const char *path,
+               const struct file_basic_stats *f_basics)
+{
+    struct cache_header identity;
+
+    memset(cache, 0, sizeof(*cache));
+    if (cache_identity(f_basics, &identity) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (agg_cache_load(cache, path, &identity) == EXIT_SUCCESS) {
+        if (verbose) {
+            printf("[%s] loaded %s: %" PRIu64 " chunks, %" PRIu64 " entries\n",
+                   __FUNCTION__, path, cache->hdr.chunk_count,
+                   cache->hdr.entry_count);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    printf("building the aggregate cache: %s\n", path);
+    cache->hdr = identity;
+    if (agg_cache_build(cache, f_basics) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (agg_cache_save(cache, path) != EXIT_SUCCESS) {
+        /* still usable for this run */
+        printf("the aggregate cache is not saved\n");
+    }
+    if (verbose) {
+        printf("[%s] built %s: %" PRIu64 " chunks, %" PRIu64 " entries\n",
+               __FUNCTION__, path, cache->hdr.chunk_count, cache->hdr.entry_count);
+    }
+    return EXIT_SUCCESS;
+}
+
+static const struct cache_entry *
+agg_cache_find(const struct agg_cache *cache, const struct cache_chunk *chunk,
+               uint32_t flowid)
+{
+    const struct cache_entry *base = &cache->entries[chunk->first_entry];
+    uint64_t lo = 0, hi = chunk->entry_count;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (base[mid].flowid < flowid) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < chunk->entry_count && base[lo].flowid == flowid) ? &base[lo] : NULL;
+}
+
+struct cache_edge_ctx {
+    const struct rec_filter *rec_filter;
+    struct flow_agg *agg;
+    uint32_t    mss;
+};
+
+static void
+cache_edge_record(void *arg, uint32_t flowid, const record_t *rec)
+{
+    struct cache_edge_ctx *ctx = arg;
+    (void)flowid;
+
+    if (rec_filter_match(ctx->rec_filter, rec)) {
+        flow_agg_update(ctx->agg, rec, ctx->mss);
+    }
+}
+
+/* Answer the flow summary from the cache. Chunks whose records of the flow
+ * all fall inside the time window are merged as they are, chunks straddling
+ * an edge of the window are parsed again.
+ */
+int
+cache_body_by_flowid(struct file_basic_stats *f_basics, uint32_t flowid,
+                     const struct agg_cache *cache)
+{
+    const struct rec_filter *rec_filter = f_basics->rec_filter;
+    uint32_t lo = 0, hi = UINT32_MAX;
+    uint64_t merged = 0, reparsed = 0;
+    int idx;
+
+    printf("input flow id is: %08x\n", flowid);
+
+    if (!is_flowid_in_file(f_basics, flowid, &idx)) {
+        printf("but the flow id: %08x not found in file\n", flowid);
+        return EXIT_SUCCESS;
+    }
+    if (rec_filter != NULL && !rec_filter_is_time_only(rec_filter)) {
+        printf("the cache answers time windows only, scanning the body\n");
+        return read_body_by_flowid(f_basics, flowid);
+    }
+    if (rec_filter != NULL) {
+        lo = rec_filter->lo[RF_TIME];
+        hi = rec_filter->hi[RF_TIME];
+    }
+
+    struct flow_info *f_info = &f_basics->flow_list[idx];
+    struct flow_agg total;
+    flow_agg_init(&total);
+
+    struct body_chunks bc;
+    body_chunks_init(&bc, f_basics, cache->hdr.scan_span);
+    char *buf = NULL;
+    int ret = EXIT_SUCCESS;
+
+    for (uint64_t c = 0; c < cache->hdr.chunk_count && ret == EXIT_SUCCESS; c++) {
+        const struct cache_entry *e = agg_cache_find(cache, &cache->chunks[c], flowid);
+
+        if (e == NULL || e->agg.time_max < lo || e->agg.time_min > hi) {
+            continue;
+        }
+        if (lo <= e->agg.time_min && e->agg.time_max <= hi) {
+            flow_agg_merge(&total, &e->agg);
+            merged++;
+            continue;
+        }
+
+        if (buf == NULL && (buf = malloc(body_chunks_buf_size(&bc))) == NULL) {
+            PERROR_FUNCTION("malloc failed for the edge chunks");
+            return EXIT_FAILURE;
+        }
+        struct cache_edge_ctx ctx = { rec_filter, &total, f_info->mss };
+        uint64_t first = c * cache->hdr.group;
+        uint64_t last = (first + cache->hdr.group < bc.count) ?
+                        first + cache->hdr.group : bc.count;
+        for (uint64_t k = first; k < last; k++) {
+            if (body_chunk_scan(&bc, k, buf, &flowid, cache_edge_record, &ctx) < 0) {
+                PERROR_FUNCTION("pread");
+                ret = EXIT_FAILURE;
+                break;
+            }
+        }
+        reparsed++;
+    }
+    free(buf);
+
+    flow_agg_to_flow_info(&total, f_info);
+
+    printf("cached chunks merged: %" PRIu64 ", edge chunks parsed: %" PRIu64
+           " (of %" PRIu64 ")\n", merged, reparsed, cache->hdr.chunk_count);
+    print_flow_summary(f_basics, f_info);
+    printf("           srtt p50: ~%u, p90: ~%u, p99: ~%u µs\n",
+           flow_agg_srtt_percentile(&total, 50),
+           flow_agg_srtt_percentile(&total, 90),
+           flow_agg_srtt_percentile(&total, 99));
+    return ret;
+}
+
+#endif /* CACHE_H_ */
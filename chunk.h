@@ -0,0 +1,257 @@
+/*
+ * chunk.h
+ *
+ *  Random access to the body of a siftr2 log in fixed size chunks.
+ *
+ *  A text chunk owns every line that starts inside it, so chunks can be read
+ *  independently, in any order and from any thread with pread(). A binary
+ *  chunk is a whole number of pkt_node records.
+ */
+
+#ifndef CHUNK_H_
+#define CHUNK_H_
+
+struct body_chunks {
+    int         fd;
+    long        begin;          /* first byte of the body */
+    long        end;            /* first byte after the last record */
+    size_t      span;           /* nominal bytes per chunk */
+    uint64_t    count;          /* number of chunks */
+    size_t      line_len;       /* longest text line, including '\n' */
+    uint32_t    start_time;
+};
+
+typedef void (*chunk_record_fn)(void *arg, uint32_t flowid, const record_t *rec);
+
+/* pread() until `len` bytes are read or EOF, returns bytes read or -1 */
+static inline ssize_t
+pread_full(int fd, void *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = pread(fd, (char *)buf + done, len - done,
+                            offset + (off_t)done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        done += (size_t)ret;
+    }
+    return (ssize_t)done;
+}
+
+/* for text lines of up to `line_len` bytes, when the foot note that bounds
+ * them is not known yet
+ */
+static inline void
+body_chunks_init_len(struct body_chunks *bc, const struct file_basic_stats *f_basics,
+                     size_t span, size_t line_len)
+{
+    bc->fd = fileno(f_basics->file);
+    bc->begin = f_basics->body_offset;
+    bc->end = f_basics->last_line_offset;
+    bc->line_len = line_len;
+    bc->start_time = f_basics->first_flow_start_time;
+
+    if (is_rec_fmt_binary) {
+        const size_t rec_size = sizeof(struct pkt_node);
+        /* drop the partial record or '\n' in front of the foot note */
+        bc->end = bc->begin + (bc->end - bc->begin) / (long)rec_size * (long)rec_size;
+        span = (span < rec_size) ? rec_size : span / rec_size * rec_size;
+        bc->line_len = 0;
+    }
+    bc->span = span;
+    bc->count = (bc->end > bc->begin) ?
+                ((uint64_t)(bc->end - bc->begin) + span - 1) / span : 0;
+}
+
+static inline void
+body_chunks_init(struct body_chunks *bc, const struct file_basic_stats *f_basics,
+                 size_t span)
+{
+    body_chunks_init_len(bc, f_basics, span, body_line_len(f_basics->last_line_stats));
+}
+
+/* buffer size needed by body_chunk_scan() */
+static inline size_t
+body_chunks_buf_size(const struct body_chunks *bc)
+{
+    return bc->span + bc->line_len + 1;
+}
+
+/* Lines cut out of a buffer, at most SIMD_BATCH per call: the offsets from
+ * `base` and lengths of those long enough to hold a record, and a count of
+ * all of them.
+ */
+struct text_lines {
+    const char  *base;
+    uint32_t    cnt;                /* lines of more than 10 bytes */
+    uint32_t    bol[SIMD_BATCH];
+    uint32_t    len[SIMD_BATCH];
+    uint32_t    hit[SIMD_BATCH];    /* of match_hex8() */
+    uint64_t    line_cnt;           /* every line, counted over all calls */
+    uint64_t    non_empty_cnt;
+};
+
+static inline void
+text_lines_add(struct text_lines *tl, const char *p, const char *eol)
+{
+    tl->line_cnt++;
+    tl->non_empty_cnt += (eol > p);
+    if (eol - p > 10) {
+        tl->bol[tl->cnt] = (uint32_t)(p - tl->base);
+        tl->len[tl->cnt] = (uint32_t)(eol - p);
+        tl->cnt++;
+    }
+}
+
+/* Cut the next lines of [p, lim) that start before `stop` into `tl`. With
+ * `is_tail_line`, a rest without '\n' is a line too. Returns where the next
+ * call goes on, `p` when there is no line left.
+ */
+static inline const char *
+text_lines_next(struct text_lines *tl, const char *p, const char *lim,
+                const char *stop, bool is_tail_line)
+{
+    uint32_t eol[SIMD_BATCH];
+    uint32_t k = simd->find_eols(p, (size_t)(lim - p), eol, SIMD_BATCH);
+
+    tl->base = p;
+    tl->cnt = 0;
+    for (uint32_t i = 0; i < k && p < stop; i++) {
+        const char *nl = tl->base + eol[i];
+        text_lines_add(tl, p, nl);
+        p = nl + 1;
+    }
+    if (k == 0 && is_tail_line && p < stop) {
+        text_lines_add(tl, p, lim);
+        p = lim;
+    }
+    return p;
+}
+
+/* Read text chunk `k` into `buf` of body_chunks_buf_size() bytes. The lines
+ * of the chunk start in [*p, *stop) and end before *lim, *p == *stop when
+ * none starts in it. Returns EXIT_FAILURE on read error.
+ */
+static inline int
+body_chunk_read_text(const struct body_chunks *bc, uint64_t k, char *buf,
+                     const char **p, const char **stop, const char **lim)
+{
+    long lo = bc->begin + (long)(k * bc->span);
+    long hi = (lo + (long)bc->span < bc->end) ? lo + (long)bc->span : bc->end;
+
+    *p = *stop = *lim = buf;
+    if (lo >= hi) {
+        return EXIT_SUCCESS;
+    }
+
+    /* start one byte early to see whether a line begins exactly at `lo`, and
+     * read past `hi` to finish the last line starting before it */
+    long from = (lo > bc->begin) ? lo - 1 : lo;
+    long to = (hi + (long)bc->line_len < bc->end) ? hi + (long)bc->line_len : bc->end;
+    ssize_t got = pread_full(bc->fd, buf, (size_t)(to - from), from);
+    if (got < 0) {
+        return EXIT_FAILURE;
+    }
+
+    *stop = buf + (hi - from);
+    *lim = buf + got;
+    if (lo > bc->begin) {
+        const char *nl = memchr(buf, '\n', (size_t)got);
+        *p = (nl != NULL) ? nl + 1 : *stop;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Call `fn` for every record of chunk `k`, or only for the records of
+ * `*only_flowid` when it is not NULL. `buf` holds body_chunks_buf_size()
+ * bytes. Returns the number of records in the chunk, or -1 on read error.
+ */
+static inline int64_t
+body_chunk_scan(const struct body_chunks *bc, uint64_t k, char *buf,
+                const uint32_t *only_flowid, chunk_record_fn fn, void *arg)
+{
+    long lo = bc->begin + (long)(k * bc->span);
+    long hi = (lo + (long)bc->span < bc->end) ? lo + (long)bc->span : bc->end;
+    int64_t num_records = 0;
+    record_t rec;
+
+    if (lo >= hi) {
+        return 0;
+    }
+
+    if (is_rec_fmt_binary) {
+        const size_t rec_size = sizeof(struct pkt_node);
+        ssize_t got = pread_full(bc->fd, buf, (size_t)(hi - lo), lo);
+        if (got < 0) {
+            return -1;
+        }
+        struct pkt_node node;
+        num_records = got / (ssize_t)rec_size;
+        if (only_flowid == NULL) {
+            for (int64_t i = 0; i < num_records; i++) {
+                memcpy(&node, buf + i * rec_size, rec_size);
+                decode_binary_record(&node, bc->start_time, &rec);
+                fn(arg, node.flowid, &rec);
+            }
+            return num_records;
+        }
+        uint32_t hit[SIMD_BATCH];
+        for (int64_t i = 0; i < num_records; i += SIMD_BATCH) {
+            const char *recs = buf + i * rec_size;
+            uint32_t n = (num_records - i < SIMD_BATCH) ?
+                         (uint32_t)(num_records - i) : SIMD_BATCH;
+            uint32_t hits = simd->match_stride(recs, n, *only_flowid, hit);
+            for (uint32_t h = 0; h < hits; h++) {
+                memcpy(&node, recs + hit[h] * rec_size, rec_size);
+                decode_binary_record(&node, bc->start_time, &rec);
+                fn(arg, node.flowid, &rec);
+            }
+        }
+        return num_records;
+    }
+
+    const char *p, *stop, *lim;
+    if (body_chunk_read_text(bc, k, buf, &p, &stop, &lim) != EXIT_SUCCESS) {
+        return -1;
+    }
+
+    struct text_lines tl = {};
+    uint64_t key = (only_flowid != NULL) ? simd_hex8_key(*only_flowid) : 0;
+    while (p < stop) {
+        const char *next = text_lines_next(&tl, p, lim, stop, true);
+
+        if (only_flowid != NULL) {
+            uint32_t hits = simd->match_hex8(tl.base, tl.bol, tl.cnt, key, tl.hit);
+            for (uint32_t h = 0; h < hits; h++) {
+                const char *line = tl.base + tl.bol[tl.hit[h]];
+                if (decode_text_record(line, line + tl.len[tl.hit[h]],
+                                       bc->start_time, &rec)) {
+                    fn(arg, *only_flowid, &rec);
+                }
+            }
+        } else {
+            for (uint32_t i = 0; i < tl.cnt; i++) {
+                const char *line = tl.base + tl.bol[i];
+                if (decode_text_record(line, line + tl.len[i], bc->start_time,
+                                       &rec)) {
+                    fn(arg, fast_hex8_to_u32(line), &rec);
+                }
+            }
+        }
+        if (next == p) {
+            break;
+        }
+        p = next;
+    }
+    return (int64_t)tl.non_empty_cnt;
+}
+
+#endif /* CHUNK_H_ */
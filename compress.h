@@ -0,0 +1,638 @@
+/*
+ * compress.h
+ *
+ *  Reading a log compressed with gzip, bgzip or zstd without a scratch copy
+ *  on disk. The format is told by the magic bytes, not by the file name.
+ *
+ *  The log is decompressed into an anonymous memory file (memfd), which the
+ *  readers see like the log itself: pread(), fseek() and the read-ahead
+ *  work on it as they are. When the container tells the size of every frame
+ *  - the zstd frames with their content size, as written by `zstd -B` or the
+ *  seekable format, or the gzip members of bgzip with their BSIZE field -
+ *  the frames are decompressed straight into their offsets on parallel
+ *  workers. Then only the frames of the head note and those at the end up
+ *  to the foot note are decompressed first; the rest of the body follows in
+ *  compress_load_body() once an action reads it, and never for a log that is
+ *  only listed with `-f`. Other gzip files, and zstd frames without their
+ *  content size, are decompressed in one pass.
+ *
+ *  zlib and libzstd are used when their headers are found at build time.
+ */
+
+#ifndef COMPRESS_H_
+#define COMPRESS_H_
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define HAVE_ZLIB 1
+#endif
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define HAVE_ZSTD 1
+#endif
+#if defined(__linux__) && __has_include(<linux/memfd.h>)
+#include <linux/memfd.h>
+#include <sys/syscall.h>
+#if defined(__NR_memfd_create)
+#define HAVE_MEMFD 1
+#endif
+#endif
+
+enum {
+    COMPRESS_HEAD_SIZE  = 64 * 1024,    /* decompressed before the body */
+    COMPRESS_BUF_SIZE   = 1024 * 1024,  /* output of the one pass decoder */
+    COMPRESS_MIN_FRAMES = 64,
+    GZIP_HEADER_LEN     = 18,           /* with the BGZF extra field */
+};
+
+enum compress_fmt {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+};
+
+static const char *compress_name[] = { "none", "gzip", "zstd" };
+
+struct compress_frame {
+    uint64_t    c_off;          /* in the compressed file */
+    uint64_t    c_size;
+    uint64_t    d_off;          /* in the decompressed log */
+    uint64_t    d_size;
+    bool        is_done;
+};
+
+struct compressed_log {
+    enum compress_fmt fmt;
+    int         fd;             /* of the compressed file */
+    struct stat st;
+    const uint8_t *src;         /* the compressed file, mapped */
+    int         log_fd;         /* of the decompressed log */
+    uint8_t     *log;           /* log_fd mapped while frames are missing */
+    uint64_t    size;           /* of the decompressed log */
+    struct compress_frame *frames;  /* NULL: not split into known frames */
+    uint32_t    frame_cnt;
+    uint32_t    frame_cap;
+    atomic_uint next_frame;
+    atomic_bool has_failed;
+};
+
+static enum compress_fmt
+compress_format(const uint8_t *magic, size_t len)
+{
+    static const uint8_t gzip_magic[] = { 0x1f, 0x8b };
+    static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+    if (len >= sizeof(zstd_magic) && memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0) {
+        return COMPRESS_ZSTD;
+    }
+    if (len >= sizeof(gzip_magic) && memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0) {
+        return COMPRESS_GZIP;
+    }
+    return COMPRESS_NONE;
+}
+
+static int
+compress_add_frame(struct compressed_log *c, uint64_t c_off, uint64_t c_size,
+                   uint64_t d_size)
+{
+    if (c->frame_cnt == c->frame_cap) {
+        uint32_t cap = (c->frame_cap == 0) ? COMPRESS_MIN_FRAMES : 2 * c->frame_cap;
+        struct compress_frame *grown = realloc(c->frames, cap * sizeof(*grown));
+        if (grown == NULL) {
+            PERROR_FUNCTION("realloc failed for the frames");
+            return EXIT_FAILURE;
+        }
+        c->frames = grown;
+        c->frame_cap = cap;
+    }
+    c->frames[c->frame_cnt++] = (struct compress_frame){
+        .c_off = c_off, .c_size = c_size, .d_off = c->size, .d_size = d_size,
+    };
+    c->size += d_size;
+    return EXIT_SUCCESS;
+}
+
+/* The size of the bgzip member at `p`, 0 if it is another kind of member. */
+static uint64_t
+bgzf_member_size(const uint8_t *p, uint64_t len)
+{
+    if (len < GZIP_HEADER_LEN || p[2] != 8 /* deflate */ || (p[3] & 4) == 0) {
+        return 0;
+    }
+    uint64_t xlen = p[10] | (uint64_t)p[11] << 8;
+    for (uint64_t i = 12; i + 4 <= 12 + xlen && i + 4 <= len; ) {
+        uint64_t slen = p[i + 2] | (uint64_t)p[i + 3] << 8;
+        if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2 && i + 6 <= len) {
+            return (p[i + 4] | (uint64_t)p[i + 5] << 8) + 1;
+        }
+        i += 4 + slen;
+    }
+    return 0;
+}
+
+/* Split the compressed file into frames of known size. Returns false when
+ * the container doesn't tell them, or the file is cut within a frame.
+ */
+static bool
+compress_find_frames(struct compressed_log *c)
+{
+    const uint64_t len = (uint64_t)c->st.st_size;
+    uint64_t off = 0;
+
+    while (off < len) {
+        uint64_t c_size = 0, d_size = 0;
+
+        if (c->fmt == COMPRESS_GZIP) {
+            c_size = bgzf_member_size(c->src + off, len - off);
+            if (c_size < GZIP_HEADER_LEN + 8 || c_size > len - off) {
+                break;
+            }
+            /* ISIZE, the last 4 bytes of the member */
+            const uint8_t *isize = c->src + off + c_size - 4;
+            d_size = isize[0] | (uint64_t)isize[1] << 8 |
+                     (uint64_t)isize[2] << 16 | (uint64_t)isize[3] << 24;
+#ifdef HAVE_ZSTD
+        } else {
+            size_t ret = ZSTD_findFrameCompressedSize(c->src + off, len - off);
+            unsigned long long content = ZSTD_getFrameContentSize(c->src + off,
+                                                                  len - off);
+            if (ZSTD_isError(ret) || content == ZSTD_CONTENTSIZE_UNKNOWN ||
+                content == ZSTD_CONTENTSIZE_ERROR) {
+                break;
+            }
+            /* 0 for a skippable frame, such as the seek table */
+            c_size = ret;
+            d_size = content;
+#else
+        } else {
+            break;
+#endif
+        }
+        if (compress_add_frame(c, off, c_size, d_size) != EXIT_SUCCESS) {
+            break;
+        }
+        off += c_size;
+    }
+
+    if (off < len) {
+        free(c->frames);
+        c->frames = NULL;
+        c->frame_cnt = c->frame_cap = 0;
+        c->size = 0;
+        return false;
+    }
+    return true;
+}
+
+/* Append what the one pass decoder put out to the decompressed log. */
+static int
+compress_append(struct compressed_log *c, const uint8_t *buf, size_t len)
+{
+    if (pwrite_full(c->log_fd, buf, len, (off_t)c->size) < 0) {
+        PERROR_FUNCTION("pwrite of the decompressed log");
+        return EXIT_FAILURE;
+    }
+    c->size += len;
+    return EXIT_SUCCESS;
+}
+
+/* Decompress frame `i` into its place of the mapped log. */
+static int
+compress_decode_frame(struct compressed_log *c, uint32_t i, void *dctx)
+{
+    struct compress_frame *fr = &c->frames[i];
+    const uint8_t *in = c->src + fr->c_off;
+    uint8_t *out = c->log + fr->d_off;
+    bool is_ok = false;
+
+    (void)in;
+    (void)out;
+    (void)dctx;
+    if (fr->is_done || fr->d_size == 0) {
+        fr->is_done = true;
+        return EXIT_SUCCESS;
+    }
+    if (c->fmt == COMPRESS_GZIP) {
+#ifdef HAVE_ZLIB
+        z_stream zs = {0};
+        if (inflateInit2(&zs, 16 + MAX_WBITS) == Z_OK) {
+            /* a bgzip member is at most 64 KiB either way */
+            zs.next_in = (Bytef *)in;
+            zs.avail_in = (uInt)fr->c_size;
+            zs.next_out = out;
+            zs.avail_out = (uInt)fr->d_size;
+            is_ok = inflate(&zs, Z_FINISH) == Z_STREAM_END &&
+                    zs.total_out == fr->d_size;
+            inflateEnd(&zs);
+        }
+#endif
+    } else {
+#ifdef HAVE_ZSTD
+        size_t ret = ZSTD_decompressDCtx(dctx, out, fr->d_size, in, fr->c_size);
+        is_ok = !ZSTD_isError(ret) && ret == fr->d_size;
+#endif
+    }
+    if (!is_ok) {
+        printf("[%s] %s frame at byte %" PRIu64 " does not decompress\n",
+               __FUNCTION__, compress_name[c->fmt], fr->c_off);
+        return EXIT_FAILURE;
+    }
+    fr->is_done = true;
+    return EXIT_SUCCESS;
+}
+
+static void *
+compress_dctx_create(const struct compressed_log *c)
+{
+#ifdef HAVE_ZSTD
+    if (c->fmt == COMPRESS_ZSTD) {
+        return ZSTD_createDCtx();
+    }
+#endif
+    (void)c;
+    return NULL;
+}
+
+static void
+compress_dctx_free(void *dctx)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeDCtx(dctx);
+#else
+    (void)dctx;
+#endif
+}
+
+int compress_worker(void *arg)
+{
+    struct compressed_log *c = arg;
+    void *dctx = compress_dctx_create(c);
+    uint32_t i;
+
+    if (c->fmt == COMPRESS_ZSTD && dctx == NULL) {
+        atomic_store(&c->has_failed, true);
+        return EXIT_SUCCESS;
+    }
+    while (!atomic_load(&c->has_failed) &&
+           (i = atomic_fetch_add(&c->next_frame, 1)) < c->frame_cnt) {
+        if (compress_decode_frame(c, i, dctx) != EXIT_SUCCESS) {
+            atomic_store(&c->has_failed, true);
+        }
+    }
+    compress_dctx_free(dctx);
+    return EXIT_SUCCESS;
+}
+
+/* Decompress the frames that are not yet, on parallel workers. */
+static int
+compress_decode_frames(struct compressed_log *c)
+{
+    uint32_t workers = pscan_worker_count(c->frame_cnt);
+    thrd_t threads[PSCAN_MAX_WORKERS];
+
+    atomic_init(&c->next_frame, 0);
+    atomic_init(&c->has_failed, false);
+    uint32_t started = 0;
+    while (started < workers &&
+           thrd_create(&threads[started], compress_worker, c) == thrd_success) {
+        started++;
+    }
+    if (started < workers) {
+        printf("started %u of %u decompression workers\n", started, workers);
+        atomic_store(&c->has_failed, true);
+    }
+    for (uint32_t w = 0; w < started; w++) {
+        thrd_join(threads[w], NULL);
+    }
+    if (verbose) {
+        printf("[%s] %u %s frames, %" PRIu64 " bytes on %u workers\n",
+               __FUNCTION__, c->frame_cnt, compress_name[c->fmt], c->size, workers);
+    }
+    return atomic_load(&c->has_failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Does the log have the foot note within [from, to)? */
+static bool
+compress_has_foot_note(const struct compressed_log *c, uint64_t from, uint64_t to)
+{
+    const size_t key_len = sizeof(FOOT_NOTE_KEY) - 1;
+    const uint8_t *p = c->log + from;
+    const uint8_t *end = c->log + AGG_MIN(to + key_len + 1, c->size);
+
+    while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        p++;
+        if ((size_t)(end - p) >= key_len && memcmp(p, FOOT_NOTE_KEY, key_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Decompress the frames of the head note and those at the end back to the
+ * foot note, one at a time. Without a foot note, that is every frame.
+ */
+static int
+compress_decode_ends(struct compressed_log *c)
+{
+    void *dctx = compress_dctx_create(c);
+    uint32_t head = 0;
+    int ret = EXIT_FAILURE;
+
+    if (c->fmt == COMPRESS_ZSTD && dctx == NULL) {
+        PERROR_FUNCTION("ZSTD_createDCtx");
+        return EXIT_FAILURE;
+    }
+    for (; head < c->frame_cnt && c->frames[head].d_off < COMPRESS_HEAD_SIZE; head++) {
+        if (compress_decode_frame(c, head, dctx) != EXIT_SUCCESS) {
+            goto out;
+        }
+    }
+    for (uint32_t i = c->frame_cnt; i > head; i--) {
+        struct compress_frame *fr = &c->frames[i - 1];
+        if (compress_decode_frame(c, i - 1, dctx) != EXIT_SUCCESS) {
+            goto out;
+        }
+        if (fr->d_size > 0 &&
+            compress_has_foot_note(c, fr->d_off, fr->d_off + fr->d_size)) {
+            break;
+        }
+    }
+    ret = EXIT_SUCCESS;
+out:
+    compress_dctx_free(dctx);
+    return ret;
+}
+
+/* Decompress the whole file in one pass into log_fd. A cut file
+ * keeps what was decompressed, for --recover.
+ */
+static int
+compress_decode_stream(struct compressed_log *c)
+{
+    const uint64_t len = (uint64_t)c->st.st_size;
+    uint8_t *buf = malloc(COMPRESS_BUF_SIZE);
+    bool is_cut = false, is_ok = false;
+
+    (void)len;
+    (void)compress_append;
+    if (buf == NULL) {
+        PERROR_FUNCTION("malloc failed for decompression");
+        return EXIT_FAILURE;
+    }
+    if (c->fmt == COMPRESS_GZIP) {
+#ifdef HAVE_ZLIB
+        z_stream zs = {0};
+        uint64_t off = 0;
+        int zr = inflateInit2(&zs, 16 + MAX_WBITS);
+
+        is_ok = (zr == Z_OK);
+        while (is_ok) {
+            if (zs.avail_in == 0 && off < len) {
+                zs.next_in = (Bytef *)(c->src + off);
+                zs.avail_in = (uInt)AGG_MIN(len - off, (uint64_t)UINT_MAX);
+                off += zs.avail_in;
+            }
+            zs.next_out = buf;
+            zs.avail_out = COMPRESS_BUF_SIZE;
+            zr = inflate(&zs, Z_NO_FLUSH);
+            if (compress_append(c, buf, COMPRESS_BUF_SIZE - zs.avail_out) !=
+                EXIT_SUCCESS) {
+                is_ok = false;
+            } else if (zr == Z_STREAM_END) {
+                /* gzip and pigz may write more members one after another */
+                uint64_t rest = zs.avail_in + (len - off);
+                const uint8_t *next = c->src + (len - rest);
+                if (rest < 2 || next[0] != 0x1f || next[1] != 0x8b) {
+                    break;      /* the end, or trailing garbage */
+                }
+                is_ok = inflateReset(&zs) == Z_OK;
+            } else if (zr == Z_BUF_ERROR && zs.avail_in == 0 && off == len) {
+                is_cut = true;
+                break;
+            } else if (zr != Z_OK) {
+                printf("[%s] gzip: %s\n", __FUNCTION__, zs.msg ? zs.msg : "corrupt data");
+                is_ok = false;
+            }
+        }
+        inflateEnd(&zs);
+#endif
+    } else {
+#ifdef HAVE_ZSTD
+        ZSTD_DCtx *dctx = ZSTD_createDCtx();
+        ZSTD_inBuffer in = { c->src, len, 0 };
+        size_t zr = 0;
+
+        is_ok = (dctx != NULL);
+        while (is_ok) {
+            ZSTD_outBuffer out = { buf, COMPRESS_BUF_SIZE, 0 };
+            zr = ZSTD_decompressStream(dctx, &out, &in);
+            if (ZSTD_isError(zr)) {
+                printf("[%s] zstd: %s\n", __FUNCTION__, ZSTD_getErrorName(zr));
+                is_ok = false;
+            } else if (compress_append(c, buf, out.pos) != EXIT_SUCCESS) {
+                is_ok = false;
+            } else if (in.pos == in.size && out.pos < out.size) {
+                break;      /* nothing left to flush */
+            }
+        }
+        /* the input ended within a frame */
+        is_cut = is_ok && zr != 0;
+        ZSTD_freeDCtx(dctx);
+#endif
+    }
+    if (is_cut) {
+        printf("the %s log is cut, it ends within a frame\n", compress_name[c->fmt]);
+    }
+    free(buf);
+    return is_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Give the decompressed log the mtime of the compressed file, which keeps a
+ * --cache of it valid across runs.
+ */
+static void
+compress_stamp(const struct compressed_log *c, int log_fd)
+{
+    struct timespec times[2] = {
+        { .tv_nsec = UTIME_OMIT },
+        { .tv_sec = c->st.st_mtime },
+    };
+
+    if (futimens(log_fd, times) != 0 && verbose) {
+        printf("[%s] futimens: %s\n", __FUNCTION__, strerror(errno));
+    }
+}
+
+static int
+compress_memfd(void)
+{
+    int fd = -1;
+
+#ifdef HAVE_MEMFD
+    fd = (int)syscall(__NR_memfd_create, "siftr2-log", MFD_CLOEXEC);
+    if (fd >= 0) {
+        return fd;
+    }
+#endif
+    /* already unlinked, gone with the last descriptor */
+    FILE *tmp = tmpfile();
+    fd = (tmp != NULL) ? dup(fileno(tmp)) : -1;
+    if (tmp != NULL) {
+        fclose(tmp);
+    }
+    if (fd < 0) {
+        PERROR_FUNCTION("no memory file for the decompressed log");
+    }
+    return fd;
+}
+
+void
+compress_close(struct compressed_log *c)
+{
+    if (c == NULL) {
+        return;
+    }
+    if (c->log != NULL) {
+        munmap(c->log, c->size);
+    }
+    if (c->src != NULL) {
+        munmap((void *)c->src, (size_t)c->st.st_size);
+    }
+    if (c->fd >= 0) {
+        close(c->fd);
+    }
+    free(c->frames);
+    free(c);
+}
+
+/* Decompress the frames of the body that compress_fopen() left out. */
+static int
+compress_load_body(struct file_basic_stats *f_basics)
+{
+    struct compressed_log *c = f_basics->compressed;
+
+    if (c == NULL || c->log == NULL) {
+        return EXIT_SUCCESS;
+    }
+    int ret = compress_decode_frames(c);
+    munmap(c->log, c->size);
+    c->log = NULL;
+    compress_stamp(c, fileno(f_basics->file));
+    /* drop what the stream has read ahead of the frames */
+    fflush(f_basics->file);
+    return ret;
+}
+
+/* Open `file_name` for reading, decompressed if it is a gzip or zstd file.
+ * Unless f_basics->is_body_deferred, the whole log is decompressed here.
+ */
+FILE *
+compress_fopen(struct file_basic_stats *f_basics, const char *file_name)
+{
+    struct compressed_log *c = calloc(1, sizeof(*c));
+    uint8_t magic[4];
+    FILE *file = NULL;
+
+    if (c == NULL) {
+        PERROR_FUNCTION("calloc failed for the compressed log");
+        return NULL;
+    }
+    c->log_fd = -1;
+    c->fd = open(file_name, O_RDONLY);
+    if (c->fd < 0 || fstat(c->fd, &c->st) != 0) {
+        goto out;
+    }
+    ssize_t got = pread_full(c->fd, magic, sizeof(magic), 0);
+    c->fmt = compress_format(magic, (got > 0) ? (size_t)got : 0);
+    if (c->fmt == COMPRESS_NONE) {
+        file = fdopen(c->fd, "r");
+        if (file != NULL) {
+            c->fd = -1;
+        }
+        goto out;
+    }
+
+    c->src = mmap(NULL, (size_t)c->st.st_size, PROT_READ, MAP_PRIVATE, c->fd, 0);
+    if (c->src == MAP_FAILED) {
+        c->src = NULL;
+        PERROR_FUNCTION("mmap of the compressed log");
+        goto out;
+    }
+#ifndef HAVE_ZLIB
+    if (c->fmt == COMPRESS_GZIP) {
+        printf("this build reads no gzip logs, it needs zlib\n");
+        errno = ENOTSUP;
+        goto out;
+    }
+#endif
+#ifndef HAVE_ZSTD
+    if (c->fmt == COMPRESS_ZSTD) {
+        printf("this build reads no zstd logs, it needs libzstd\n");
+        errno = ENOTSUP;
+        goto out;
+    }
+#endif
+
+    madvise((void *)c->src, (size_t)c->st.st_size, MADV_WILLNEED);
+    if ((c->log_fd = compress_memfd()) < 0) {
+        goto out;
+    }
+
+    bool is_framed = compress_find_frames(c) && c->size > 0;
+    if (is_framed) {
+        if (ftruncate(c->log_fd, (off_t)c->size) != 0) {
+            PERROR_FUNCTION("ftruncate of the decompressed log");
+            goto out;
+        }
+        c->log = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      c->log_fd, 0);
+        if (c->log == MAP_FAILED) {
+            c->log = NULL;
+            PERROR_FUNCTION("mmap of the decompressed log");
+            goto out;
+        }
+        if (compress_decode_ends(c) != EXIT_SUCCESS) {
+            goto out;
+        }
+        /* --recover scans the body right away */
+        if (!f_basics->is_body_deferred || is_recover_mode) {
+            int ret = compress_decode_frames(c);
+            munmap(c->log, c->size);
+            c->log = NULL;
+            if (ret != EXIT_SUCCESS) {
+                goto out;
+            }
+        }
+    } else if (compress_decode_stream(c) != EXIT_SUCCESS) {
+        goto out;
+    }
+    compress_stamp(c, c->log_fd);
+
+    printf("%s log: %" PRIu64 " bytes from %lld", compress_name[c->fmt], c->size,
+           (long long)c->st.st_size);
+    if (is_framed) {
+        printf(" in %u frames%s", c->frame_cnt,
+               (c->log != NULL) ? ", the body on demand" : "");
+    }
+    printf("\n");
+    file = fdopen(c->log_fd, "r");
+    if (file != NULL) {
+        c->log_fd = -1;
+        f_basics->compressed = c;
+        return file;
+    }
+out:
+    if (file == NULL) {
+        PERROR_FUNCTION("Failed to open file");
+    }
+    if (c->log_fd >= 0) {
+        close(c->log_fd);
+    }
+    compress_close(c);
+    return file;
+}
+
+#endif /* COMPRESS_H_ */
@@ -0,0 +1,274 @@
+/*
+ * fairness.h
+ *
+ *  Cross-flow fairness and aggregate utilization over time, for all flows in
+ *  one pass over the body.
+ *
+ *  Records are binned by rel_time. Only the bin being filled is kept, as one
+ *  byte counter per flow plus the list of flows touched in it, so memory is
+ *  O(flows) however long the log is. When the records move on to a later bin,
+ *  the finished bin is reported: aggregate goodput, Jain's fairness index over
+ *  the flows active in it, and each flow's share. Goodput is counted from the
+ *  data_sz of the outputs, retransmissions included.
+ */
+
+#ifndef FAIRNESS_H_
+#define FAIRNESS_H_
+
+enum {
+    FAIRNESS_CHUNK_SIZE = 1024 * 1024,
+    FAIRNESS_TOP_FLOWS  = 20,       /* flows listed in the summary */
+};
+
+struct fairness_ctx {
+    const struct file_basic_stats *f_basics;
+    const bool  *is_selected;       /* per flow_list index */
+    uint32_t    bin_ms;
+    uint64_t    cur_bin;
+    bool        has_bin;
+
+    uint64_t    *bin_bytes;         /* per flow, in the current bin */
+    uint64_t    *touched_bin;       /* per flow, last bin it was active + 1 */
+    uint32_t    *touched;           /* flows with records in the current bin */
+    uint32_t    touched_cnt;
+    uint64_t    *total_bytes;       /* per flow, over the whole log */
+
+    FILE        *bin_file;
+    FILE        *share_file;
+
+    uint64_t    bin_cnt;
+    double      jain_sum;
+    double      jain_min;
+    uint64_t    peak_bytes;         /* of the busiest bin */
+};
+
+/* Jain's index (sum x)^2 / (n * sum x^2): 1 when all n flows get the same,
+ * 1/n when one flow gets everything.
+ */
+static inline double
+jain_index(double sum, double sum_sq, uint32_t n)
+{
+    return (sum_sq > 0) ? sum * sum / (n * sum_sq) : 1.0;
+}
+
+static void
+fairness_flush_bin(struct fairness_ctx *ctx)
+{
+    if (!ctx->has_bin || ctx->touched_cnt == 0) {
+        return;
+    }
+
+    double secs = ctx->bin_ms / 1000.0;
+    double start = (double)ctx->cur_bin * secs;
+    double sum = 0, sum_sq = 0;
+
+    for (uint32_t i = 0; i < ctx->touched_cnt; i++) {
+        double x = (double)ctx->bin_bytes[ctx->touched[i]];
+        sum += x;
+        sum_sq += x * x;
+    }
+    double jain = jain_index(sum, sum_sq, ctx->touched_cnt);
+
+    fprintf(ctx->bin_file, "%.3f" TAB "%u" TAB "%.3f" TAB "%.4f\n",
+            start, ctx->touched_cnt, sum * 8 / secs / 1e6, jain);
+
+    for (uint32_t i = 0; i < ctx->touched_cnt; i++) {
+        uint32_t idx = ctx->touched[i];
+        double x = (double)ctx->bin_bytes[idx];
+        fprintf(ctx->share_file, "%.3f" TAB "%08x" TAB "%.3f" TAB "%.4f\n",
+                start, ctx->f_basics->flow_list[idx].flowid,
+                x * 8 / secs / 1e6, (sum > 0) ? x / sum : 0.0);
+        ctx->bin_bytes[idx] = 0;
+    }
+
+    ctx->bin_cnt++;
+    ctx->jain_sum += jain;
+    if (ctx->jain_min > jain) {
+        ctx->jain_min = jain;
+    }
+    if (ctx->peak_bytes < (uint64_t)sum) {
+        ctx->peak_bytes = (uint64_t)sum;
+    }
+    ctx->touched_cnt = 0;
+}
+
+static void
+fairness_record(void *arg, uint32_t flowid, const record_t *rec)
+{
+    struct fairness_ctx *ctx = arg;
+    uint32_t idx;
+
+    if (!flow_table_lookup(&ctx->f_basics->flow_table, flowid, &idx) ||
+        !ctx->is_selected[idx]) {
+        return;
+    }
+    if (ctx->f_basics->rec_filter != NULL &&
+        !rec_filter_match(ctx->f_basics->rec_filter, rec)) {
+        return;
+    }
+
+    /* the body is in time order; a record stamped slightly behind the
+     * current bin is counted in it */
+    uint64_t bin = rec->rel_time / ctx->bin_ms;
+    if (!ctx->has_bin || bin > ctx->cur_bin) {
+        fairness_flush_bin(ctx);
+        ctx->cur_bin = bin;
+        ctx->has_bin = true;
+    }
+
+    /* a flow is active in the bin once it has a record there */
+    if (ctx->touched_bin[idx] != ctx->cur_bin + 1) {
+        ctx->touched_bin[idx] = ctx->cur_bin + 1;
+        ctx->touched[ctx->touched_cnt++] = idx;
+    }
+    if (rec->direction == 'o') {
+        ctx->bin_bytes[idx] += rec->data_sz;
+        ctx->total_bytes[idx] += rec->data_sz;
+    }
+}
+
+struct flow_rank {
+    uint64_t    bytes;
+    uint32_t    idx;
+};
+
+static int
+cmp_flow_rank_desc(const void *a, const void *b)
+{
+    uint64_t x = ((const struct flow_rank *)a)->bytes;
+    uint64_t y = ((const struct flow_rank *)b)->bytes;
+    return (x < y) - (x > y);
+}
+
+/* One pass over all records of the flows picked by `filter` (all flows when
+ * it is not set), binned by `bin_ms`.
+ */
+int
+fairness_report(const struct file_basic_stats *f_basics,
+                const struct flow_filter *filter, uint32_t bin_ms)
+{
+    const uint32_t n = f_basics->flow_count;
+    struct fairness_ctx ctx = {
+        .f_basics = f_basics,
+        .bin_ms = bin_ms,
+        .jain_min = 1.0,
+    };
+    bool *is_selected = calloc(n, sizeof(*is_selected));
+    ctx.bin_bytes = calloc(n, sizeof(*ctx.bin_bytes));
+    ctx.touched_bin = calloc(n, sizeof(*ctx.touched_bin));
+    ctx.touched = malloc(n * sizeof(*ctx.touched));
+    ctx.total_bytes = calloc(n, sizeof(*ctx.total_bytes));
+    struct flow_rank *order = malloc(n * sizeof(*order));
+    int ret = EXIT_FAILURE;
+
+    struct body_chunks bc;
+    body_chunks_init(&bc, f_basics, FAIRNESS_CHUNK_SIZE);
+    char *buf = malloc(body_chunks_buf_size(&bc));
+
+    if (n == 0 || is_selected == NULL || ctx.bin_bytes == NULL ||
+        ctx.touched_bin == NULL || ctx.touched == NULL ||
+        ctx.total_bytes == NULL || order == NULL || buf == NULL) {
+        PERROR_FUNCTION("malloc failed for fairness");
+        goto out;
+    }
+
+    uint32_t selected = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        is_selected[i] = !filter->is_set ||
+                         flow_filter_match(filter, &f_basics->flow_list[i]);
+        selected += is_selected[i];
+    }
+    if (selected == 0) {
+        printf("no flow matches the flow filter\n");
+        goto out;
+    }
+    ctx.is_selected = is_selected;
+
+    char bin_file_name[PATH_MAX], share_file_name[PATH_MAX];
+    if (strlen(f_basics->prefix) == 0) {
+        snprintf(bin_file_name, PATH_MAX, "fairness.txt");
+        snprintf(share_file_name, PATH_MAX, "fairness_shares.txt");
+    } else {
+        snprintf(bin_file_name, PATH_MAX, "%s.fairness.txt", f_basics->prefix);
+        snprintf(share_file_name, PATH_MAX, "%s.fairness_shares.txt",
+                 f_basics->prefix);
+    }
+    ctx.bin_file = fopen(bin_file_name, "w");
+    ctx.share_file = fopen(share_file_name, "w");
+    if (ctx.bin_file == NULL || ctx.share_file == NULL) {
+        PERROR_FUNCTION("open fairness file");
+        goto out;
+    }
+    fprintf(ctx.bin_file, "##bin_start" TAB "active_flows" TAB
+            "aggregate_mbps" TAB "jain_index\n");
+    fprintf(ctx.share_file, "##bin_start" TAB "flowid" TAB "goodput_mbps" TAB
+            "share\n");
+
+    for (uint64_t k = 0; k < bc.count; k++) {
+        if (body_chunk_scan(&bc, k, buf, NULL, fairness_record, &ctx) < 0) {
+            PERROR_FUNCTION("pread");
+            goto out;
+        }
+    }
+    fairness_flush_bin(&ctx);
+
+    /* fairness of the whole run, over the per flow totals */
+    double sum = 0, sum_sq = 0;
+    uint32_t ranked = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (is_selected[i]) {
+            double x = (double)ctx.total_bytes[i];
+            sum += x;
+            sum_sq += x * x;
+            order[ranked++] = (struct flow_rank){ctx.total_bytes[i], i};
+        }
+    }
+    qsort(order, ranked, sizeof(*order), cmp_flow_rank_desc);
+
+    struct timeval duration;
+    timeval_subtract(&duration, &f_basics->last_line_stats->disable_time,
+                     &f_basics->first_line_stats->enable_time);
+    double log_secs = duration.tv_sec + duration.tv_usec / 1e6;
+    double bin_secs = bin_ms / 1000.0;
+
+    printf("fairness_file_name: %s, %s\n", bin_file_name, share_file_name);
+    printf("++++++++++++++++++++++++++ fairness summary ++++++++++++++++++++++\n");
+    printf("  %u flows, %" PRIu64 " bins of %.3f seconds\n",
+           selected, ctx.bin_cnt, bin_secs);
+    printf("  aggregate goodput: avg %.3f Mbps over %.3f seconds, peak bin "
+           "%.3f Mbps\n", (log_secs > 0) ? sum * 8 / log_secs / 1e6 : 0.0,
+           log_secs, ctx.peak_bytes * 8 / bin_secs / 1e6);
+    printf("  jain index: whole run %.4f, per bin avg %.4f, min %.4f\n",
+           jain_index(sum, sum_sq, selected),
+           (ctx.bin_cnt > 0) ? ctx.jain_sum / ctx.bin_cnt : 1.0, ctx.jain_min);
+    for (uint32_t r = 0; r < ranked && (r < FAIRNESS_TOP_FLOWS || verbose); r++) {
+        const struct flow_info *f_info = &f_basics->flow_list[order[r].idx];
+        printf("  %08x %s:%hu->%s:%hu %-8s share %.4f, %" PRIu64 " bytes\n",
+               f_info->flowid, f_info->laddr, f_info->lport, f_info->faddr,
+               f_info->fport, f_info->tcp_cc_name,
+               (sum > 0) ? order[r].bytes / sum : 0.0, order[r].bytes);
+    }
+    if (ranked > FAIRNESS_TOP_FLOWS && !verbose) {
+        printf("  ... %u more flows, use -v to list all\n",
+               ranked - FAIRNESS_TOP_FLOWS);
+    }
+    ret = EXIT_SUCCESS;
+
+out:
+    if (ctx.bin_file != NULL) {
+        fclose(ctx.bin_file);
+    }
+    if (ctx.share_file != NULL) {
+        fclose(ctx.share_file);
+    }
+    free(is_selected);
+    free(ctx.bin_bytes);
+    free(ctx.touched_bin);
+    free(ctx.touched);
+    free(ctx.total_bytes);
+    free(order);
+    free(buf);
+    return ret;
+}
+
+#endif /* FAIRNESS_H_ */
@@ -0,0 +1,296 @@
+/*
+ * filter.h
+ *
+ *  Flow selection by tuple and record-level predicates.
+ *
+ *  Flow filters are resolved once against the flow list of the foot note.
+ *  Record predicates such as "srtt>20000,dir=o" are compiled into one closed
+ *  interval per record field plus a direction mask, so the reader evaluates a
+ *  fixed, branch-free range check per record instead of interpreting the
+ *  expression.
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+/* flow selection, resolved against flow_list at startup */
+struct flow_filter {
+    int32_t     port;                       /* local or foreign port, -1: any */
+    char        laddr[INET6_ADDRSTRLEN];
+    char        faddr[INET6_ADDRSTRLEN];
+    char        tcp_stack_name[NAME_MAX];
+    char        tcp_cc_name[NAME_MAX];
+    bool        is_set;
+};
+
+static inline void
+flow_filter_init(struct flow_filter *filter)
+{
+    memset(filter, 0, sizeof(*filter));
+    filter->port = -1;
+}
+
+/* --port: a decimal port number, 0..65535 */
+static inline int
+flow_filter_set_port(struct flow_filter *filter, const char *str)
+{
+    char *endptr;
+    long port;
+
+    errno = 0;
+    port = strtol(str, &endptr, BASE10);
+    if (errno != 0 || endptr == str || *endptr != '\0' ||
+        port < 0 || port > UINT16_MAX) {
+        printf("port must be a number of 0..65535: \"%s\"\n", str);
+        return EXIT_FAILURE;
+    }
+    filter->port = (int32_t)port;
+    filter->is_set = true;
+    return EXIT_SUCCESS;
+}
+
+static inline bool
+flow_filter_match(const struct flow_filter *filter, const struct flow_info *flow)
+{
+    if (filter->port >= 0 &&
+        flow->lport != filter->port && flow->fport != filter->port) {
+        return false;
+    }
+    if (filter->laddr[0] != '\0' && strcmp(flow->laddr, filter->laddr) != 0) {
+        return false;
+    }
+    if (filter->faddr[0] != '\0' && strcmp(flow->faddr, filter->faddr) != 0) {
+        return false;
+    }
+    if (filter->tcp_stack_name[0] != '\0' &&
+        strcmp(flow->tcp_stack_name, filter->tcp_stack_name) != 0) {
+        return false;
+    }
+    if (filter->tcp_cc_name[0] != '\0' &&
+        strcmp(flow->tcp_cc_name, filter->tcp_cc_name) != 0) {
+        return false;
+    }
+    return true;
+}
+
+/* record fields a predicate can test */
+#define REC_FILTER_FIELDS(X)        \
+    X(RF_TIME,      "time")         \
+    X(RF_CWND,      "cwnd")         \
+    X(RF_SSTHRESH,  "ssthresh")     \
+    X(RF_SRTT,      "srtt")         \
+    X(RF_DATA_SZ,   "data_sz")
+
+enum {
+#define X(name, str) name,
+    REC_FILTER_FIELDS(X)
+#undef X
+    TOTAL_REC_FILTER_FIELDS
+};
+
+static const char *const rec_filter_field_names[] = {
+#define X(name, str) [name] = str,
+    REC_FILTER_FIELDS(X)
+#undef X
+};
+
+/* compiled form of all predicates, ANDed together */
+struct rec_filter {
+    uint32_t    lo[TOTAL_REC_FILTER_FIELDS];
+    uint32_t    span[TOTAL_REC_FILTER_FIELDS];  /* hi - lo */
+    uint32_t    hi[TOTAL_REC_FILTER_FIELDS];
+    uint8_t     dir_mask;       /* bit 0: inputs, bit 1: outputs */
+    uint32_t    num_preds;
+};
+
+static inline void
+rec_filter_init(struct rec_filter *filter)
+{
+    for (int i = 0; i < TOTAL_REC_FILTER_FIELDS; i++) {
+        filter->lo[i] = 0;
+        filter->hi[i] = UINT32_MAX;
+        filter->span[i] = UINT32_MAX;
+    }
+    filter->dir_mask = 0x3;
+    filter->num_preds = 0;
+}
+
+/* An unsigned (x - lo) <= (hi - lo) tests lo <= x <= hi with one compare, and
+ * an untouched field has span UINT32_MAX so it always passes. All fields are
+ * tested every time, which keeps the check free of data dependent branches.
+ */
+static inline bool
+rec_filter_match(const struct rec_filter *filter, const record_t *rec)
+{
+    uint32_t ok = (filter->dir_mask >> (rec->direction == 'o')) & 1;
+
+    ok &= (rec->rel_time - filter->lo[RF_TIME]) <= filter->span[RF_TIME];
+    ok &= (rec->cwnd - filter->lo[RF_CWND]) <= filter->span[RF_CWND];
+    ok &= (rec->ssthresh - filter->lo[RF_SSTHRESH]) <= filter->span[RF_SSTHRESH];
+    ok &= (rec->srtt - filter->lo[RF_SRTT]) <= filter->span[RF_SRTT];
+    ok &= (rec->data_sz - filter->lo[RF_DATA_SZ]) <= filter->span[RF_DATA_SZ];
+
+    return ok;
+}
+
+/* True if the predicates only bound `time`, e.g. a time window. */
+static inline bool
+rec_filter_is_time_only(const struct rec_filter *filter)
+{
+    if (filter->dir_mask != 0x3) {
+        return false;
+    }
+    for (int i = 0; i < TOTAL_REC_FILTER_FIELDS; i++) {
+        if (i != RF_TIME && (filter->lo[i] != 0 || filter->hi[i] != UINT32_MAX)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Narrow the interval of `field` with "field op value". */
+static inline void
+rec_filter_narrow(struct rec_filter *filter, int field, const char *op,
+                  uint64_t value)
+{
+    uint32_t *lo = &filter->lo[field];
+    uint32_t *hi = &filter->hi[field];
+    uint32_t v = (value > UINT32_MAX) ? UINT32_MAX : (uint32_t)value;
+
+    if (strcmp(op, ">") == 0) {
+        if (v == UINT32_MAX) {
+            *lo = UINT32_MAX;
+            *hi = 0;
+        } else if (v + 1 > *lo) {
+            *lo = v + 1;
+        }
+    } else if (strcmp(op, ">=") == 0) {
+        if (v > *lo) {
+            *lo = v;
+        }
+    } else if (strcmp(op, "<") == 0) {
+        if (v == 0) {
+            *lo = UINT32_MAX;
+            *hi = 0;
+        } else if (v - 1 < *hi) {
+            *hi = v - 1;
+        }
+    } else if (strcmp(op, "<=") == 0) {
+        if (v < *hi) {
+            *hi = v;
+        }
+    } else {    /* "=" or "==" */
+        if (v > *lo) {
+            *lo = v;
+        }
+        if (v < *hi) {
+            *hi = v;
+        }
+    }
+}
+
+/* Compile a comma separated predicate list such as "srtt>20000,dir=o" into
+ * `filter`. Predicates accumulate over calls, so the option can be repeated.
+ * `time` is given in seconds relative to the first record, the other fields
+ * in the units of the log.
+ */
+static inline int
+rec_filter_compile(struct rec_filter *filter, const char *expr)
+{
+    char *copy = strdup(expr);
+    char *saveptr = NULL;
+
+    if (copy == NULL) {
+        PERROR_FUNCTION("strdup() failed for predicate");
+        return EXIT_FAILURE;
+    }
+
+    for (char *pred = strtok_r(copy, COMMA_DELIMITER, &saveptr); pred != NULL;
+         pred = strtok_r(NULL, COMMA_DELIMITER, &saveptr)) {
+        size_t name_len = strcspn(pred, "<>=!");
+        char *op = pred + name_len;
+        size_t op_len = strspn(op, "<>=!");
+        char *value = op + op_len;
+        char op_str[3] = {};
+        int field = -1;
+
+        if (name_len == 0 || op_len == 0 || op_len > 2 || *value == '\0') {
+            printf("invalid predicate: \"%s\"\n", pred);
+            free(copy);
+            return EXIT_FAILURE;
+        }
+        memcpy(op_str, op, op_len);
+        if (strcmp(op_str, "<") != 0 && strcmp(op_str, "<=") != 0 &&
+            strcmp(op_str, ">") != 0 && strcmp(op_str, ">=") != 0 &&
+            strcmp(op_str, "=") != 0 && strcmp(op_str, "==") != 0) {
+            printf("unsupported operator \"%s\" in predicate: \"%s\"\n",
+                   op_str, pred);
+            free(copy);
+            return EXIT_FAILURE;
+        }
+
+        if (name_len == strlen("dir") && strncmp(pred, "dir", name_len) == 0) {
+            if ((strcmp(op_str, "=") != 0 && strcmp(op_str, "==") != 0) ||
+                (strcmp(value, "i") != 0 && strcmp(value, "o") != 0)) {
+                printf("direction predicate must be dir=i or dir=o: \"%s\"\n",
+                       pred);
+                free(copy);
+                return EXIT_FAILURE;
+            }
+            filter->dir_mask &= (value[0] == 'o') ? 0x2 : 0x1;
+            filter->num_preds++;
+            continue;
+        }
+
+        for (int i = 0; i < TOTAL_REC_FILTER_FIELDS; i++) {
+            if (strlen(rec_filter_field_names[i]) == name_len &&
+                strncmp(pred, rec_filter_field_names[i], name_len) == 0) {
+                field = i;
+                break;
+            }
+        }
+        if (field < 0) {
+            printf("unknown field in predicate: \"%s\"\n", pred);
+            free(copy);
+            return EXIT_FAILURE;
+        }
+
+        char *endptr;
+        uint64_t number;
+        errno = 0;
+        if (value[strspn(value, " \t")] == '-') {
+            /* strtoull() would wrap it around */
+            printf("negative value in predicate: \"%s\"\n", pred);
+            free(copy);
+            return EXIT_FAILURE;
+        } else if (field == RF_TIME) {
+            double secs = strtod(value, &endptr);
+            number = (secs <= 0) ? 0 : (uint64_t)(secs * 1000.0 + 0.5);
+        } else {
+            number = strtoull(value, &endptr, BASE10);
+        }
+        if (errno != 0 || endptr == value || *endptr != '\0') {
+            printf("invalid value in predicate: \"%s\"\n", pred);
+            free(copy);
+            return EXIT_FAILURE;
+        }
+
+        rec_filter_narrow(filter, field, op_str, number);
+        filter->num_preds++;
+    }
+    free(copy);
+
+    for (int i = 0; i < TOTAL_REC_FILTER_FIELDS; i++) {
+        if (filter->lo[i] > filter->hi[i]) {
+            /* contradicting predicates: nothing can match */
+            filter->dir_mask = 0;
+            filter->span[i] = 0;
+        } else {
+            filter->span[i] = filter->hi[i] - filter->lo[i];
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+#endif /* FILTER_H_ */
@@ -0,0 +1,235 @@
+/*
+ * fixedrow.h
+ *
+ *  Plot file with rows of one fixed width, formatted and written by parallel
+ *  threads.
+ *
+ *  Every row is FIXED_ROW_WIDTH bytes: the direction, the time in seconds as
+ *  "%7u.%03u" (exact, from the milliseconds) and cwnd, ssthresh, srtt and
+ *  data_size as "%10u", which any uint32 fits. Record n of the flow therefore
+ *  starts at header_len + n * FIXED_ROW_WIDTH, known as soon as the record is
+ *  counted. The writer hands batches of records with their offset to the
+ *  formatter threads, which pwrite() them without waiting for each other.
+ *  gnuplot reads the rows like the variable width ones.
+ */
+
+#ifndef FIXEDROW_H_
+#define FIXEDROW_H_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+enum {
+    FIXED_ROW_BATCH_SIZE    = 16384,    /* records per pwrite() */
+    FIXED_ROW_MAX_WORKERS   = 16,
+    FIXED_ROW_SLOTS_PER_WORKER = 2,
+};
+
+/* Batch k goes to slot k % slot_cnt, taken in turn as in pscan.h: the writer
+ * fills it when `turn` is k, a formatter empties it and moves `turn` on.
+ */
+struct fixed_row_slot {
+    atomic_uint_fast64_t turn;      /* batch the slot waits for */
+    atomic_bool is_ready;           /* records of batch `turn` are in */
+    off_t       offset;
+    struct rec_batch batch;
+};
+
+struct fixed_row_writer {
+    int         fd;
+    off_t       next_offset;        /* of the next record's row */
+    uint64_t    batch_cnt;          /* handed to the formatters */
+    struct rec_batch pending;       /* records not handed over yet */
+    struct fixed_row_slot *slots;
+    uint32_t    slot_cnt;
+    atomic_uint_fast64_t next_claim;
+    atomic_uint_fast64_t total;     /* UINT64_MAX until closed */
+    atomic_bool has_failed;
+    thrd_t      threads[FIXED_ROW_MAX_WORKERS];
+    uint32_t    thread_cnt;
+    uint64_t    yield_cnt;
+};
+
+static ssize_t
+pwrite_full(int fd, const void *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = pwrite(fd, (const char *)buf + done, len - done,
+                             offset + (off_t)done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)ret;
+    }
+    return (ssize_t)done;
+}
+
+int fixed_row_worker(void *arg)
+{
+    struct fixed_row_writer *w = arg;
+    char *buf = malloc((size_t)FIXED_ROW_BATCH_SIZE * FIXED_ROW_WIDTH);
+
+    if (buf == NULL) {
+        PERROR_FUNCTION("malloc failed for row buffer");
+        atomic_store(&w->has_failed, true);
+    }
+    while (true) {
+        uint64_t k = atomic_fetch_add(&w->next_claim, 1);
+        struct fixed_row_slot *slot = &w->slots[k % w->slot_cnt];
+
+        /* wait for the writer to fill batch k, or to close with fewer. The
+         * turn goes first: is_ready may still be left over from batch
+         * k - slot_cnt until the turn has moved on to k. */
+        while (!(atomic_load_explicit(&slot->turn, memory_order_acquire) == k &&
+                 atomic_load_explicit(&slot->is_ready, memory_order_acquire))) {
+            if (k >= atomic_load_explicit(&w->total, memory_order_acquire)) {
+                free(buf);
+                return EXIT_SUCCESS;
+            }
+            sched_yield();
+        }
+
+        const struct rec_batch *b = &slot->batch;
+        if (buf != NULL) {
+            for (uint32_t i = 0; i < b->cnt; i++) {
+                fixed_row_format(buf + (size_t)i * FIXED_ROW_WIDTH, b, i);
+            }
+            size_t len = (size_t)b->cnt * FIXED_ROW_WIDTH;
+            if (pwrite_full(w->fd, buf, len, slot->offset) != (ssize_t)len) {
+                PERROR_FUNCTION("pwrite");
+                atomic_store(&w->has_failed, true);
+            }
+        }
+        atomic_store_explicit(&slot->is_ready, false, memory_order_relaxed);
+        atomic_store_explicit(&slot->turn, k + w->slot_cnt, memory_order_release);
+    }
+}
+
+/* Create `file_name` with the plot file header and start the formatters. */
+static int
+fixed_row_open(struct fixed_row_writer *w, const char *file_name)
+{
+    static const char header[] =
+        "##direction" TAB "relative_timestamp" TAB "cwnd" TAB "ssthresh" TAB
+        "srtt" TAB "data_size\n";
+
+    memset(w, 0, sizeof(*w));
+    w->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w->fd < 0) {
+        perror("open plot file");
+        return EXIT_FAILURE;
+    }
+    if (pwrite_full(w->fd, header, sizeof(header) - 1, 0) < 0) {
+        PERROR_FUNCTION("pwrite");
+        close(w->fd);
+        return EXIT_FAILURE;
+    }
+    w->next_offset = sizeof(header) - 1;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t workers = (cpus > 2) ? (uint32_t)AGG_MIN(cpus - 1, FIXED_ROW_MAX_WORKERS) : 1;
+    w->slot_cnt = workers * FIXED_ROW_SLOTS_PER_WORKER;
+    w->slots = calloc(w->slot_cnt, sizeof(*w->slots));
+    bool is_ok = (w->slots != NULL) &&
+                 rec_batch_reserve(&w->pending, FIXED_ROW_BATCH_SIZE) == EXIT_SUCCESS;
+    for (uint32_t s = 0; is_ok && s < w->slot_cnt; s++) {
+        atomic_init(&w->slots[s].turn, s);
+        atomic_init(&w->slots[s].is_ready, false);
+        is_ok = rec_batch_reserve(&w->slots[s].batch,
+                                  FIXED_ROW_BATCH_SIZE) == EXIT_SUCCESS;
+    }
+    if (!is_ok) {
+        PERROR_FUNCTION("malloc failed for row batches");
+    } else {
+        atomic_init(&w->next_claim, 0);
+        atomic_init(&w->total, UINT64_MAX);
+        atomic_init(&w->has_failed, false);
+
+        /* the formatters claim the batches in turn, so any of them will do */
+        while (w->thread_cnt < workers &&
+               thrd_create(&w->threads[w->thread_cnt], fixed_row_worker, w) ==
+               thrd_success) {
+            w->thread_cnt++;
+        }
+        if (w->thread_cnt == 0) {
+            printf("no plot row formatter started\n");
+            is_ok = false;
+        }
+    }
+    if (!is_ok) {
+        for (uint32_t s = 0; w->slots != NULL && s < w->slot_cnt; s++) {
+            rec_batch_free(&w->slots[s].batch);
+        }
+        rec_batch_free(&w->pending);
+        free(w->slots);
+        close(w->fd);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Hand the pending records to the formatters, at the rows they own. */
+static void
+fixed_row_submit(struct fixed_row_writer *w)
+{
+    uint64_t k = w->batch_cnt++;
+    struct fixed_row_slot *slot = &w->slots[k % w->slot_cnt];
+
+    while (atomic_load_explicit(&slot->turn, memory_order_acquire) != k) {
+        w->yield_cnt++;
+        sched_yield();
+    }
+    /* swap the columns, the slot's emptied batch becomes the pending one */
+    struct rec_batch tmp = slot->batch;
+    slot->batch = w->pending;
+    w->pending = tmp;
+    w->pending.cnt = 0;
+
+    slot->offset = w->next_offset;
+    w->next_offset += (off_t)slot->batch.cnt * FIXED_ROW_WIDTH;
+    atomic_store_explicit(&slot->is_ready, true, memory_order_release);
+}
+
+static inline void
+fixed_row_add(struct fixed_row_writer *w, const record_t *rec)
+{
+    rec_batch_push(&w->pending, rec);
+    if (w->pending.cnt == FIXED_ROW_BATCH_SIZE) {
+        fixed_row_submit(w);
+    }
+}
+
+static int
+fixed_row_close(struct fixed_row_writer *w)
+{
+    if (w->pending.cnt > 0) {
+        fixed_row_submit(w);
+    }
+    atomic_store_explicit(&w->total, w->batch_cnt, memory_order_release);
+    for (uint32_t t = 0; t < w->thread_cnt; t++) {
+        thrd_join(w->threads[t], NULL);
+    }
+    for (uint32_t s = 0; s < w->slot_cnt; s++) {
+        rec_batch_free(&w->slots[s].batch);
+    }
+    rec_batch_free(&w->pending);
+    free(w->slots);
+
+    int ret = atomic_load(&w->has_failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (close(w->fd) != 0) {
+        PERROR_FUNCTION("close plot file");
+        ret = EXIT_FAILURE;
+    }
+    if (verbose) {
+        printf("[%s] %u formatters, %" PRIu64 " batches, yield_cnt =  %" PRIu64 "\n",
+               __FUNCTION__, w->thread_cnt, w->batch_cnt, w->yield_cnt);
+    }
+    return ret;
+}
+
+#endif /* FIXEDROW_H_ */
@@ -35,14 +35,9 @@ enum {
     TF_ARRAY_MAX_LENGTH = 550,
     TF2_ARRAY_MAX_LENGTH = 560,
     PER_FLOW_STRING_LENGTH = (INET6_ADDRSTRLEN*2 + 5*2 + 1),
-    QUEUE_SIZE = 256 * 256 * 2,
-    QUEUE_MASK = QUEUE_SIZE - 1,
+    FOOTER_SCAN_BLOCK = 64 * 1024,
 };
 
-_Static_assert(QUEUE_SIZE > 0, "QUEUE_SIZE must be > 0");
-_Static_assert((QUEUE_SIZE & (QUEUE_SIZE - 1)) == 0, "QUEUE_SIZE must be a power of two");
-_Static_assert(QUEUE_MASK == (QUEUE_SIZE - 1), "QUEUE_MASK must equal QUEUE_SIZE - 1");
-
 struct pkt_info {
     uint32_t    flowid;     /* flowid of the connection */
     tcp_seq     th_seq;     /* TCP sequence number */
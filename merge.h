@@ -0,0 +1,302 @@
+/*
+ * merge.h
+ *
+ *  Merge the logs captured at both ends of the same connections.
+ *
+ *  A flow of the local log is paired with the flow of the peer log that has
+ *  the reversed 4-tuple. Both record streams are put on one timeline of
+ *  enable_time + tval and merged in time order. Each stream is read forward
+ *  one chunk at a time, so neither log is loaded into memory.
+ *
+ *  The merged file carries, for each direction, the bytes in flight as the
+ *  two ends see it together (data sent by one end minus data received by the
+ *  other end so far) next to the sender's own pipe.
+ */
+
+#ifndef MERGE_H_
+#define MERGE_H_
+
+enum {
+    MERGE_CHUNK_SIZE    = 1024 * 1024,
+    MERGE_SIDES         = 2,        /* the local and the peer log */
+};
+
+/* forward cursor over the records of one flow of one log */
+struct merge_cursor {
+    struct body_chunks bc;
+    uint64_t    next_chunk;
+    char        *buf;
+    record_t    *recs;          /* records of the flow in the current chunk */
+    size_t      rec_cnt;
+    size_t      rec_cap;
+    size_t      pos;
+    uint64_t    enable_us;      /* enable_time of the log */
+    uint32_t    start_time;     /* tval of the first record of the log */
+    const struct rec_filter *rec_filter;    /* --where, of the local log */
+    bool        has_failed;
+};
+
+static void
+merge_collect(void *arg, uint32_t flowid, const record_t *rec)
+{
+    struct merge_cursor *cur = arg;
+    (void)flowid;
+
+    if (cur->rec_filter != NULL && !rec_filter_match(cur->rec_filter, rec)) {
+        return;
+    }
+    if (cur->rec_cnt == cur->rec_cap) {
+        size_t cap = (cur->rec_cap == 0) ? 1024 : cur->rec_cap * 2;
+        record_t *tmp = realloc(cur->recs, cap * sizeof(*tmp));
+        if (tmp == NULL) {
+            cur->has_failed = true;
+            return;
+        }
+        cur->recs = tmp;
+        cur->rec_cap = cap;
+    }
+    cur->recs[cur->rec_cnt++] = *rec;
+}
+
+static int
+merge_cursor_init(struct merge_cursor *cur, const struct file_basic_stats *f_basics)
+{
+    memset(cur, 0, sizeof(*cur));
+    body_chunks_init(&cur->bc, f_basics, MERGE_CHUNK_SIZE);
+    cur->buf = malloc(body_chunks_buf_size(&cur->bc));
+    if (cur->buf == NULL) {
+        PERROR_FUNCTION("malloc failed for merge cursor");
+        return EXIT_FAILURE;
+    }
+    cur->enable_us = (uint64_t)f_basics->first_line_stats->enable_time.tv_sec * 1000000 +
+                     (uint64_t)f_basics->first_line_stats->enable_time.tv_usec;
+    cur->start_time = f_basics->first_flow_start_time;
+    cur->rec_filter = f_basics->rec_filter;
+    return EXIT_SUCCESS;
+}
+
+static void
+merge_cursor_free(struct merge_cursor *cur)
+{
+    free(cur->buf);
+    free(cur->recs);
+}
+
+/* The next record of `flowid`, or NULL at the end of the body. */
+static const record_t *
+merge_cursor_peek(struct merge_cursor *cur, uint32_t flowid)
+{
+    while (cur->pos == cur->rec_cnt) {
+        if (cur->next_chunk == cur->bc.count || cur->has_failed) {
+            return NULL;
+        }
+        cur->rec_cnt = 0;
+        cur->pos = 0;
+        if (body_chunk_scan(&cur->bc, cur->next_chunk++, cur->buf, &flowid,
+                            merge_collect, cur) < 0) {
+            PERROR_FUNCTION("pread");
+            cur->has_failed = true;
+            return NULL;
+        }
+        if (cur->has_failed) {
+            PERROR_FUNCTION("realloc failed for merge records");
+            return NULL;
+        }
+    }
+    return &cur->recs[cur->pos];
+}
+
+/* tval is in ms since enable_time */
+static inline uint64_t
+merge_abs_time_us(const struct merge_cursor *cur, const record_t *rec)
+{
+    return cur->enable_us + (uint64_t)(rec->rel_time + cur->start_time) * 1000;
+}
+
+/* The flow of `peer` with the reversed 4-tuple of `flow`, or -1. */
+static int
+find_peer_flow(const struct file_basic_stats *peer, const struct flow_info *flow)
+{
+    for (uint32_t i = 0; i < peer->flow_count; i++) {
+        const struct flow_info *p = &peer->flow_list[i];
+        if (p->lport == flow->fport && p->fport == flow->lport &&
+            strcmp(p->laddr, flow->faddr) == 0 &&
+            strcmp(p->faddr, flow->laddr) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/* in-flight vs pipe of one direction, sampled at every send */
+struct merge_dir_stats {
+    uint64_t    sample_cnt;
+    int64_t     in_flight_sum;
+    uint64_t    pipe_sum;
+    uint64_t    abs_diff_sum;
+};
+
+/* Merge flow `flowid` of `f_basics` with its reversed flow in `peer` into
+ * one time ordered file. --where picks the records of `f_basics` only.
+ */
+int
+merge_body_by_flowid(struct file_basic_stats *f_basics,
+                     struct file_basic_stats *peer, uint32_t flowid)
+{
+    int idx;
+    int ret = EXIT_SUCCESS;
+
+    printf("input flow id is: %08x\n", flowid);
+
+    if (!is_flowid_in_file(f_basics, flowid, &idx)) {
+        printf("but the flow id: %08x not found in file\n", flowid);
+        return EXIT_SUCCESS;
+    }
+
+    const struct flow_info *flow = &f_basics->flow_list[idx];
+    int peer_idx = find_peer_flow(peer, flow);
+    if (peer_idx < 0) {
+        printf("no flow %s:%hu->%s:%hu in the peer log\n",
+               flow->faddr, flow->fport, flow->laddr, flow->lport);
+        return EXIT_SUCCESS;
+    }
+    const struct flow_info *peer_flow = &peer->flow_list[peer_idx];
+    const uint32_t flowids[MERGE_SIDES] = {flowid, peer_flow->flowid};
+    const char side_names[MERGE_SIDES] = {'l', 'p'};
+
+    char merge_file_name[PATH_MAX];
+    if (strlen(f_basics->prefix) == 0) {
+        snprintf(merge_file_name, PATH_MAX, "merge_%08x_%08x.txt",
+                 flowids[0], flowids[1]);
+    } else {
+        snprintf(merge_file_name, PATH_MAX, "%s.%08x_%08x.txt",
+                 f_basics->prefix, flowids[0], flowids[1]);
+    }
+
+    struct merge_cursor cursors[MERGE_SIDES];
+    if (merge_cursor_init(&cursors[0], f_basics) != EXIT_SUCCESS ||
+        merge_cursor_init(&cursors[1], peer) != EXIT_SUCCESS) {
+        merge_cursor_free(&cursors[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *merge_file = fopen(merge_file_name, "w");
+    if (merge_file == NULL) {
+        PERROR_FUNCTION("open merge file");
+        merge_cursor_free(&cursors[0]);
+        merge_cursor_free(&cursors[1]);
+        return EXIT_FAILURE;
+    }
+    const size_t large_buffer_size = 1u << 20;  // 1 MiB
+    char *io_buffer = malloc(large_buffer_size);
+    if (io_buffer) {
+        setvbuf(merge_file, io_buffer, _IOFBF, large_buffer_size);
+    }
+
+    fprintf(merge_file,
+            "##side" TAB "direction" TAB "time" TAB "cwnd" TAB "ssthresh" TAB
+            "srtt" TAB "data_size" TAB "pipe" TAB "l2p_in_flight" TAB "l_pipe" TAB
+            "p2l_in_flight" TAB "p_pipe\n");
+
+    /* time zero is the earlier of the two enable times */
+    uint64_t time_base = AGG_MIN(cursors[0].enable_us, cursors[1].enable_us);
+    uint64_t sent[MERGE_SIDES] = {}, received[MERGE_SIDES] = {};
+    uint32_t last_pipe[MERGE_SIDES] = {};
+    uint64_t rec_cnt[MERGE_SIDES] = {};
+    struct merge_dir_stats dir_stats[MERGE_SIDES] = {};
+
+    while (true) {
+        const record_t *heads[MERGE_SIDES];
+        int next = -1;
+        uint64_t next_time = 0;
+
+        /* k-way merge: pick the earliest head, the local log on ties */
+        for (int s = 0; s < MERGE_SIDES; s++) {
+            heads[s] = merge_cursor_peek(&cursors[s], flowids[s]);
+            if (heads[s] == NULL) {
+                continue;
+            }
+            uint64_t t = merge_abs_time_us(&cursors[s], heads[s]);
+            if (next < 0 || t < next_time) {
+                next = s;
+                next_time = t;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+
+        const record_t *rec = heads[next];
+        if (rec->direction == 'o') {
+            sent[next] += rec->data_sz;
+            last_pipe[next] = rec->pipe;
+        } else {
+            received[next] += rec->data_sz;
+        }
+        int64_t l2p = (int64_t)sent[0] - (int64_t)received[1];
+        int64_t p2l = (int64_t)sent[1] - (int64_t)received[0];
+
+        if (rec->direction == 'o' && rec->data_sz > 0) {
+            struct merge_dir_stats *ds = &dir_stats[next];
+            int64_t in_flight = (next == 0) ? l2p : p2l;
+            ds->sample_cnt++;
+            ds->in_flight_sum += in_flight;
+            ds->pipe_sum += rec->pipe;
+            ds->abs_diff_sum += (uint64_t)llabs(in_flight - (int64_t)rec->pipe);
+        }
+
+        fprintf(merge_file,
+                "%c" TAB "%c" TAB "%.3f" TAB "%8u" TAB "%10u" TAB "%6u" TAB "%5u"
+                TAB "%8u" TAB "%" PRId64 TAB "%u" TAB "%" PRId64 TAB "%u\n",
+                side_names[next], rec->direction,
+                (next_time - time_base) / 1000000.0, rec->cwnd, rec->ssthresh,
+                rec->srtt, rec->data_sz, rec->pipe, l2p, last_pipe[0], p2l,
+                last_pipe[1]);
+        rec_cnt[next]++;
+        cursors[next].pos++;
+    }
+
+    /* a cursor stops early on a failed read */
+    if (cursors[0].has_failed || cursors[1].has_failed) {
+        ret = EXIT_FAILURE;
+    }
+    if (fclose(merge_file) != 0) {
+        PERROR_FUNCTION("close merge file");
+        ret = EXIT_FAILURE;
+    }
+    free(io_buffer);
+    if (ret != EXIT_SUCCESS) {
+        merge_cursor_free(&cursors[0]);
+        merge_cursor_free(&cursors[1]);
+        return ret;
+    }
+
+    printf("merge_file_name: %s\n", merge_file_name);
+    printf("++++++++++++++++++++++++++ merged summary ++++++++++++++++++++++++\n");
+    printf("  local %s:%hu->%s:%hu flowid: %08x, %" PRIu64 " records\n",
+           flow->laddr, flow->lport, flow->faddr, flow->fport, flowids[0],
+           rec_cnt[0]);
+    printf("  peer  %s:%hu->%s:%hu flowid: %08x, %" PRIu64 " records\n",
+           peer_flow->laddr, peer_flow->lport, peer_flow->faddr,
+           peer_flow->fport, flowids[1], rec_cnt[1]);
+    printf("  enable time offset (peer - local): %.6f seconds\n",
+           ((double)cursors[1].enable_us - (double)cursors[0].enable_us) / 1e6);
+    for (int s = 0; s < MERGE_SIDES; s++) {
+        const struct merge_dir_stats *ds = &dir_stats[s];
+        if (ds->sample_cnt == 0) {
+            continue;
+        }
+        printf("  %s -> %s: %" PRIu64 " sends, avg_in_flight: %.0f, avg_pipe: "
+               "%.0f, avg |in_flight - pipe|: %.0f bytes\n",
+               (s == 0) ? "local" : "peer", (s == 0) ? "peer" : "local",
+               ds->sample_cnt, (double)ds->in_flight_sum / ds->sample_cnt,
+               (double)ds->pipe_sum / ds->sample_cnt,
+               (double)ds->abs_diff_sum / ds->sample_cnt);
+    }
+
+    merge_cursor_free(&cursors[0]);
+    merge_cursor_free(&cursors[1]);
+    return EXIT_SUCCESS;
+}
+
+#endif /* MERGE_H_ */
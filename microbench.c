@@ -0,0 +1,430 @@
+/*
+ ============================================================================
+ Name        : microbench.c
+ Author      : Cheng Cui
+ Version     :
+ Copyright   : see the LICENSE file
+ Description : Microbenchmarks of the parsing, scan and formatting kernels
+ ============================================================================
+ */
+/*
+ * Each benchmark runs a kernel over generated inputs shaped like a siftr2
+ * text body: 8-digit flowids, 8-digit time stamps, 4 to 6 digit windows and
+ * a few 1 or 2 digit fields. A run is repeated `reps` times (default 15);
+ * the first run warms up and is not counted. Reported per benchmark:
+ *
+ *   ns/op       mean over the runs, and the relative standard deviation
+ *   min         the fastest run
+ *   B/cycle     input (or output) bytes per TSC cycle, on x86_64 only; the
+ *               TSC ticks at the nominal clock, not the boosted one
+ *
+ * Usage: ./microbench [reps] [filter]; only the benchmarks whose name has
+ * `filter` in it are run.
+ */
+#define _DEFAULT_SOURCE
+#include "record.h"
+#include "simd.h"
+
+#include <math.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(_M_X64)
+#include <x86intrin.h>
+#endif
+
+enum {
+    BENCH_LINES     = 1 << 16,      /* generated body lines */
+    BENCH_MAX_REPS  = 100,
+};
+
+/* a sink the compiler cannot see through */
+static volatile uint64_t bench_sink;
+
+struct bench_input {
+    char        *body;              /* BENCH_LINES lines, '\n' terminated */
+    size_t      body_len;
+    uint32_t    *bol;               /* offset of each line */
+    uint32_t    *len;               /* without the '\n' */
+    char        (*hex)[12];         /* a NUL-terminated hex field per line */
+    char        (*secs)[24];        /* "%u.%06u" time stamps */
+    record_t    *recs;
+    struct pkt_node *nodes;         /* the lines as binary records */
+    struct rec_batch batch;         /* the records in columns */
+    char        *rows;              /* BENCH_LINES fixed width rows */
+};
+
+struct bench {
+    const char  *name;
+    /* one run over the input: returns the ops done, adds the bytes */
+    uint64_t (*run)(const struct bench_input *in, uint64_t *bytes);
+};
+
+static uint64_t bench_rng = 0x9e3779b97f4a7c15ull;
+
+static inline uint32_t
+bench_rand(void)
+{
+    /* xorshift64* */
+    bench_rng ^= bench_rng >> 12;
+    bench_rng ^= bench_rng << 25;
+    bench_rng ^= bench_rng >> 27;
+    return (uint32_t)((bench_rng * 0x2545f4914f6cdd1dull) >> 32);
+}
+
+static inline uint64_t
+bench_ticks(void)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static inline uint64_t
+bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int
+bench_input_init(struct bench_input *in)
+{
+    const uint32_t flowids[] = {0x2265b1f5, 0x91b7584a, 0xd8f16adf, 0x0c4e7a12};
+    const size_t line_max = 160;
+
+    in->body = malloc((size_t)BENCH_LINES * line_max);
+    in->bol = malloc(BENCH_LINES * sizeof(*in->bol));
+    in->len = malloc(BENCH_LINES * sizeof(*in->len));
+    in->hex = malloc(BENCH_LINES * sizeof(*in->hex));
+    in->secs = malloc(BENCH_LINES * sizeof(*in->secs));
+    in->recs = malloc(BENCH_LINES * sizeof(*in->recs));
+    in->nodes = calloc(BENCH_LINES, sizeof(*in->nodes));
+    in->rows = malloc((size_t)BENCH_LINES * FIXED_ROW_WIDTH);
+    if (in->body == NULL || in->bol == NULL || in->len == NULL ||
+        in->hex == NULL || in->secs == NULL || in->recs == NULL ||
+        in->nodes == NULL || in->rows == NULL ||
+        rec_batch_reserve(&in->batch, BENCH_LINES) != EXIT_SUCCESS) {
+        PERROR_FUNCTION("malloc failed for the bench input");
+        return EXIT_FAILURE;
+    }
+
+    uint32_t tval = 0x65a1b2c3;
+    size_t off = 0;
+    for (uint32_t i = 0; i < BENCH_LINES; i++) {
+        bool is_out = (bench_rand() & 3) != 0;
+        uint32_t cwnd = 14480 + bench_rand() % 500000;
+        uint32_t srtt = 200 + bench_rand() % 60000;
+        uint32_t data_sz = is_out ? 1448 * (1 + bench_rand() % 4) : 0;
+        tval += bench_rand() % 40;
+
+        uint32_t flowid = flowids[bench_rand() % 4];
+        int n = snprintf(in->body + off, line_max,
+                         "%08x,%c,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x\n",
+                         flowid, is_out ? 'o' : 'i', tval,
+                         cwnd, 0x3fffffffu, srtt, data_sz,
+                         65535 + bench_rand() % 1000000, 4194304u,
+                         0x1c0u + (bench_rand() & 0x3f), 0x20u, 0x30d40u,
+                         2097152u, bench_rand() % 2000000, 2097152u,
+                         bench_rand() % 4096, bench_rand() % 400000,
+                         bench_rand() % 8);
+        in->bol[i] = (uint32_t)off;
+        in->len[i] = (uint32_t)n - 1;
+        off += (size_t)n;
+
+        snprintf(in->hex[i], sizeof(in->hex[i]), "%x",
+                 (i % 3 == 0) ? tval : (i % 3 == 1) ? cwnd : srtt);
+        snprintf(in->secs[i], sizeof(in->secs[i]), "%u.%06u",
+                 1700000000u + bench_rand() % 10000000, bench_rand() % 1000000);
+        in->recs[i] = (record_t){
+            .direction = is_out ? 'o' : 'i',
+            .rel_time = tval - 0x65a1b2c3,
+            .cwnd = cwnd,
+            .ssthresh = 0x3fffffff,
+            .srtt = srtt,
+            .data_sz = data_sz,
+        };
+        in->nodes[i].flowid = flowid;
+        in->nodes[i].direction = is_out ? DIR_OUT : DIR_IN;
+        in->nodes[i].tval = tval;
+        rec_batch_push(&in->batch, &in->recs[i]);
+    }
+    in->body_len = off;
+    return EXIT_SUCCESS;
+}
+
+static void
+bench_input_free(struct bench_input *in)
+{
+    free(in->body);
+    free(in->bol);
+    free(in->len);
+    free(in->hex);
+    free(in->secs);
+    free(in->recs);
+    free(in->nodes);
+    free(in->rows);
+    rec_batch_free(&in->batch);
+}
+
+/* ------------------------------ parsing ----------------------------- */
+
+static uint64_t
+run_fast_hex8_to_u32(const struct bench_input *in, uint64_t *bytes)
+{
+    uint64_t acc = 0;
+
+    for (uint32_t i = 0; i < BENCH_LINES; i++) {
+        acc += fast_hex8_to_u32(in->body + in->bol[i]);
+    }
+    bench_sink += acc;
+    *bytes += (uint64_t)BENCH_LINES * 8;
+    return BENCH_LINES;
+}
+
+static uint64_t
+run_fast_hex_to_u32(const struct bench_input *in, uint64_t *bytes)
+{
+    uint64_t acc = 0;
+
+    for (uint32_t i = 0; i < BENCH_LINES; i++) {
+        acc += fast_hex_to_u32(in->hex[i]);
+        *bytes += strlen(in->hex[i]);
+    }
+    bench_sink += acc;
+    return BENCH_LINES;
+}
+
+static uint64_t
+run_fill_fields_from_line(const struct bench_input *in, uint64_t *bytes)
+{
+    char line[256];
+    char *fields[TOTAL_FIELDS];
+    uint64_t acc = 0;
+
+    /* strtok() writes into the line: each op copies it first */
+    for (uint32_t i = 0; i < BENCH_LINES; i++) {
+        memcpy(line, in->body + in->bol[i], in->len[i] + 1);
+        line[in->len[i] + 1] = '\0';
+        fill_fields_from_line(fields, line, BODY);
+        acc += (uintptr_t)fields[SRTT];
+        *bytes += in->len[i] + 1;
+    }
+    bench_sink += acc;
+    return BENCH_LINES;
+}
+
+static uint64_t
+run_decode_text_record(const struct bench_input *in, uint64_t *bytes)
+{
+    record_t rec = {};
+    uint64_t acc = 0;
+
+    for (uint32_t i = 0; i < BENCH_LINES; i++) {
+        const char *p = in->body + in->bol[i];
+        decode_text_record(p, p + in->len[i], 0, &rec);
+        acc += rec.srtt;
+        *bytes += in->len[i] + 1;
+    }
+    bench_sink += acc;
+    return BENCH_LINES;
+}
+
+static uint64_t
+run_fast_atof_fixed6(const struct bench_input *in, uint64_t *bytes)
+{
+    double acc = 0;
+
+    for (uint32_t i = 0; i < BENCH_LINES; i++) {
+        acc += fast_atof_fixed6(in->secs[i]);
+        *bytes += strlen(in->secs[i]);
+    }
+    bench_sink += (uint64_t)acc;
+    return BENCH_LINES;
+}
+
+/* one op per line: the kernels of the set picked by simd_init() */
+static uint64_t
+run_find_eols(const struct bench_input *in, uint64_t *bytes)
+{
+    uint32_t eol[SIMD_BATCH];
+    const char *p = in->body, *lim = in->body + in->body_len;
+    uint64_t lines = 0;
+
+    while (p < lim) {
+        uint32_t k = simd->find_eols(p, (size_t)(lim - p), eol, SIMD_BATCH);
+        if (k == 0) {
+            break;
+        }
+        lines += k;
+        p += eol[k - 1] + 1;
+    }
+    bench_sink += lines;
+    *bytes += in->body_len;
+    return lines;
+}
+
+static uint64_t
+run_match_hex8(const struct bench_input *in, uint64_t *bytes)
+{
+    const uint64_t key = simd_hex8_key(0x91b7584a);
+    uint32_t hit[SIMD_BATCH];
+    uint64_t hits = 0;
+
+    for (uint32_t i = 0; i < BENCH_LINES; i += SIMD_BATCH) {
+        hits += simd->match_hex8(in->body, in->bol + i, SIMD_BATCH, key, hit);
+    }
+    bench_sink += hits;
+    *bytes += (uint64_t)BENCH_LINES * 8;
+    return BENCH_LINES;
+}
+
+static uint64_t
+run_match_stride(const struct bench_input *in, uint64_t *bytes)
+{
+    const char *nodes = (const char *)in->nodes;
+    uint32_t hit[SIMD_BATCH];
+    uint64_t hits = 0;
+
+    for (uint32_t i = 0; i < BENCH_LINES; i += SIMD_BATCH) {
+        hits += simd->match_stride(nodes + (size_t)i * sizeof(struct pkt_node),
+                                   SIMD_BATCH, 0x91b7584a, hit);
+    }
+    bench_sink += hits;
+    *bytes += (uint64_t)BENCH_LINES * sizeof(struct pkt_node);
+    return BENCH_LINES;
+}
+
+/* ----------------------------- formatting --------------------------- */
+
+/* the --fixed-width row, into memory */
+static uint64_t
+run_fixed_row_format(const struct bench_input *in, uint64_t *bytes)
+{
+    for (uint32_t i = 0; i < BENCH_LINES; i++) {
+        fixed_row_format(in->rows + (size_t)i * FIXED_ROW_WIDTH, &in->batch, i);
+    }
+    bench_sink += (uint8_t)in->rows[FIXED_ROW_WIDTH + 3];
+    *bytes += (uint64_t)BENCH_LINES * FIXED_ROW_WIDTH;
+    return BENCH_LINES;
+}
+
+/* ------------------------------ harness ----------------------------- */
+
+static const struct bench benches[] = {
+    {"fast_hex8_to_u32",        run_fast_hex8_to_u32},
+    {"fast_hex_to_u32",         run_fast_hex_to_u32},
+    {"fill_fields_from_line",   run_fill_fields_from_line},
+    {"decode_text_record",      run_decode_text_record},
+    {"fast_atof_fixed6",        run_fast_atof_fixed6},
+    {"find_eols",               run_find_eols},
+    {"match_hex8",              run_match_hex8},
+    {"match_stride",            run_match_stride},
+    {"fixed_row_format",        run_fixed_row_format},
+};
+
+static void
+bench_report(const char *name, const char *variant, const struct bench *b,
+             const struct bench_input *in, int reps)
+{
+    double ns_per_op[BENCH_MAX_REPS] = {};
+    double bytes_per_tick = 0;
+
+    for (int r = 0; r <= reps; r++) {
+        uint64_t bytes = 0;
+        uint64_t t0 = bench_now_ns(), c0 = bench_ticks();
+        uint64_t ops = b->run(in, &bytes);
+        uint64_t c1 = bench_ticks(), t1 = bench_now_ns();
+
+        if (r == 0) {
+            continue;       /* warm up */
+        }
+        ns_per_op[r - 1] = (ops > 0) ? (double)(t1 - t0) / ops : 0;
+        if (c1 > c0) {
+            bytes_per_tick += (double)bytes / (c1 - c0) / reps;
+        }
+    }
+
+    double mean = 0, var = 0, min = ns_per_op[0];
+    for (int r = 0; r < reps; r++) {
+        mean += ns_per_op[r] / reps;
+        min = (ns_per_op[r] < min) ? ns_per_op[r] : min;
+    }
+    for (int r = 0; r < reps; r++) {
+        var += (ns_per_op[r] - mean) * (ns_per_op[r] - mean) / reps;
+    }
+
+    char label[64];
+    snprintf(label, sizeof(label), "%s%s%s", name, variant ? "/" : "",
+             variant ? variant : "");
+    printf("%-28s %10.3f ns/op  +-%5.1f%%  min %10.3f", label, mean,
+           (mean > 0) ? 100 * sqrt(var) / mean : 0.0, min);
+    if (bytes_per_tick > 0) {
+        printf("  %7.3f B/cycle\n", bytes_per_tick);
+    } else {
+        printf("        n/a B/cycle\n");
+    }
+}
+
+/* Does a set after `ops` in simd_table run the same kernel for `b`? Then
+ * the kernel is reported under the name of that, the least capable, set.
+ */
+static bool
+bench_kernel_shared(const struct bench *b, const struct simd_ops *ops)
+{
+    const struct simd_ops *end = simd_table + sizeof(simd_table) / sizeof(simd_table[0]);
+
+    for (const struct simd_ops *x = ops + 1; x < end; x++) {
+        if ((b->run == run_find_eols && x->find_eols == ops->find_eols) ||
+            (b->run == run_match_hex8 && x->match_hex8 == ops->match_hex8) ||
+            (b->run == run_match_stride && x->match_stride == ops->match_stride)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int reps = (argc > 1) ? atoi(argv[1]) : 15;
+    const char *filter = (argc > 2) ? argv[2] : NULL;
+    struct bench_input in = {};
+
+    if (reps < 1 || reps > BENCH_MAX_REPS) {
+        printf("Usage: %s [reps (1-%d)] [filter]\n", argv[0], BENCH_MAX_REPS);
+        return EXIT_FAILURE;
+    }
+
+    if (bench_input_init(&in) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    simd_init(NULL);
+
+    printf("%d lines of %.1f bytes on average, %d runs each, simd: %s\n",
+           BENCH_LINES, (double)in.body_len / BENCH_LINES, reps, simd->name);
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        const struct bench *b = &benches[i];
+        if (filter != NULL && strstr(b->name, filter) == NULL) {
+            continue;
+        }
+        if (b->run != run_find_eols && b->run != run_match_hex8 &&
+            b->run != run_match_stride) {
+            bench_report(b->name, NULL, b, &in, reps);
+            continue;
+        }
+        /* the SIMD kernels: every set this CPU has, each kernel once */
+        for (size_t s = 0; s < sizeof(simd_table) / sizeof(simd_table[0]); s++) {
+            if (simd_table[s].is_supported() &&
+                !bench_kernel_shared(b, &simd_table[s])) {
+                simd = &simd_table[s];
+                bench_report(b->name, simd->name, b, &in, reps);
+            }
+        }
+        simd_init(NULL);
+    }
+
+    bench_input_free(&in);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,179 @@
+/*
+ * perfcnt.h
+ *
+ *  Hardware performance counters of one pipeline stage, for --perf-counters.
+ *
+ *  Each thread opens its own counters with perf_event_open() on itself, so
+ *  the reader, the writer and the scan workers are counted apart; the counts
+ *  of the workers of one stage are added up. Only user space is counted,
+ *  which perf_event_paranoid up to 2 allows. A counter the kernel or the CPU
+ *  refuses (EACCES, ENOENT in a VM, ...) is reported as n/a, the others are
+ *  still counted. Counts are scaled when the kernel had to multiplex them.
+ */
+
+#ifndef PERFCNT_H_
+#define PERFCNT_H_
+
+#if defined(__linux__) && __has_include(<linux/perf_event.h>)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#if defined(__NR_perf_event_open)
+#define HAVE_PERF_EVENT 1
+#endif
+#endif
+
+enum perf_counter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_PAGE_FAULTS,
+    PERF_COUNTER_CNT,
+};
+
+static const char *const perf_counter_name[PERF_COUNTER_CNT] = {
+    "cycles", "instructions", "cache misses", "branch misses", "page faults",
+};
+
+bool is_perf_counters = false;
+
+struct perf_sample {
+    uint64_t    val[PERF_COUNTER_CNT];
+    bool        has[PERF_COUNTER_CNT];  /* the counter could be opened */
+};
+
+/* the counters of the calling thread */
+struct perf_counters {
+    int         fd[PERF_COUNTER_CNT];   /* -1: not counted */
+    int         err[PERF_COUNTER_CNT];  /* errno of perf_event_open() */
+};
+
+static void
+perf_counters_open(struct perf_counters *pc)
+{
+    for (int c = 0; c < PERF_COUNTER_CNT; c++) {
+        pc->fd[c] = -1;
+        pc->err[c] = ENOSYS;
+    }
+    if (!is_perf_counters) {
+        return;
+    }
+
+#ifdef HAVE_PERF_EVENT
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[PERF_COUNTER_CNT] = {
+        [PERF_CYCLES]        = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        [PERF_INSTRUCTIONS]  = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        [PERF_CACHE_MISSES]  = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        [PERF_PAGE_FAULTS]   = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    };
+
+    for (int c = 0; c < PERF_COUNTER_CNT; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[c].type;
+        attr.config = events[c].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        /* pid 0, cpu -1: this thread on any CPU */
+        pc->fd[c] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (pc->fd[c] < 0) {
+            pc->err[c] = errno;
+            continue;
+        }
+        pc->err[c] = 0;
+        ioctl(pc->fd[c], PERF_EVENT_IOC_RESET, 0);
+        ioctl(pc->fd[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+/* Stop the counters and add their counts to `sample`. */
+static void
+perf_counters_close(struct perf_counters *pc, struct perf_sample *sample)
+{
+#ifdef HAVE_PERF_EVENT
+    for (int c = 0; c < PERF_COUNTER_CNT; c++) {
+        if (pc->fd[c] < 0) {
+            continue;
+        }
+        uint64_t rd[3];     /* value, time enabled, time running */
+        ioctl(pc->fd[c], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(pc->fd[c], rd, sizeof(rd)) == (ssize_t)sizeof(rd)) {
+            if (rd[2] > 0 && rd[2] < rd[1]) {
+                rd[0] = (uint64_t)((double)rd[0] * rd[1] / rd[2]);
+            }
+            sample->val[c] += rd[0];
+            sample->has[c] = true;
+        }
+        close(pc->fd[c]);
+        pc->fd[c] = -1;
+    }
+#else
+    (void)pc;
+    (void)sample;
+#endif
+}
+
+static void
+perf_sample_add(struct perf_sample *dst, const struct perf_sample *src)
+{
+    for (int c = 0; c < PERF_COUNTER_CNT; c++) {
+        dst->val[c] += src->val[c];
+        dst->has[c] |= src->has[c];
+    }
+}
+
+/* One line per stage: each counter per record, and the IPC. The line is
+ * put together first, the stages run at the same time.
+ */
+static void
+perf_sample_report(const char *stage, const struct perf_sample *sample,
+                   uint64_t records, const struct perf_counters *pc)
+{
+    char line[512];
+    int len = 0;
+
+    if (!is_perf_counters) {
+        return;
+    }
+
+    len += snprintf(line + len, sizeof(line) - len, "[perf] %s: %" PRIu64 " records",
+                    stage, records);
+    for (int c = 0; c < PERF_COUNTER_CNT; c++) {
+        if (!sample->has[c]) {
+            len += snprintf(line + len, sizeof(line) - len, ", %s n/a",
+                            perf_counter_name[c]);
+        } else {
+            len += snprintf(line + len, sizeof(line) - len, ", %s %.4g",
+                            perf_counter_name[c],
+                            (records > 0) ? (double)sample->val[c] / records : 0.0);
+        }
+    }
+    if (sample->has[PERF_CYCLES] && sample->has[PERF_INSTRUCTIONS] &&
+        sample->val[PERF_CYCLES] > 0) {
+        len += snprintf(line + len, sizeof(line) - len, ", IPC %.2f",
+                        (double)sample->val[PERF_INSTRUCTIONS] /
+                        sample->val[PERF_CYCLES]);
+    }
+    printf("%s per record\n", line);
+
+    /* why the hardware counters are missing, from a thread that tried */
+    if (pc != NULL && !sample->has[PERF_CYCLES]) {
+        int err = pc->err[PERF_CYCLES];
+        printf("[perf] %s: no hardware counters: %s%s\n", stage, strerror(err),
+               (err == EACCES || err == EPERM) ?
+               " (see /proc/sys/kernel/perf_event_paranoid)" : "");
+    }
+}
+
+#endif /* PERFCNT_H_ */
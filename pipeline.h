@@ -0,0 +1,472 @@
+/*
+ * pipeline.h
+ *
+ *  The text body of one flow as a pipeline of stages over batches of a few
+ *  thousand lines:
+ *
+ *  - read:   the next PIPE_BLOCK_SIZE bytes from the read-ahead ring, cut
+ *            after the last '\n'; the partial line starts the next block.
+ *  - frame:  the lines of the block (find_eols of simd.h).
+ *  - decode: the lines of the flow (match_hex8) decoded into a column batch.
+ *  - filter: the --where predicates, compacting the batch.
+ *  - agg:    the batch run through the analyzers (analyze.h).
+ *  - format: the records handed to the plot output.
+ *
+ *  A layout such as "read+frame,decode+filter,agg+format" puts the stages
+ *  joined by '+' on one thread and starts a new thread at each ','. Thread t
+ *  takes batches from queue t and passes them on to queue t + 1; the last
+ *  thread hands them back to the read thread. The PIPE_BATCH_CNT batches go
+ *  round this ring, so the queues are bounded and nothing is allocated
+ *  while the body is read. Every queue has a single producer and a single
+ *  consumer and keeps the batches in file order.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+enum pipe_stage {
+    PIPE_READ,
+    PIPE_FRAME,
+    PIPE_DECODE,
+    PIPE_FILTER,
+    PIPE_AGG,
+    PIPE_FORMAT,
+    PIPE_STAGE_CNT,
+};
+
+static const char *const pipe_stage_name[PIPE_STAGE_CNT] = {
+    "read", "frame", "decode", "filter", "agg", "format",
+};
+
+enum {
+    PIPE_BLOCK_SIZE     = 256 * 1024,   /* about 2500 body lines */
+    PIPE_BATCH_CNT      = 16,           /* batches in flight, all threads */
+    PIPE_MIN_LINE_LEN   = 11,           /* shorter lines are no records */
+};
+
+/* the first stage of each thread */
+struct pipe_layout {
+    uint32_t    thread_cnt;
+    uint8_t     first[PIPE_STAGE_CNT];
+};
+
+/* "read+frame,decode+filter,agg+format" */
+struct pipe_layout pipe_layout = {
+    .thread_cnt = 3,
+    .first = {PIPE_READ, PIPE_DECODE, PIPE_AGG},
+};
+
+struct pipe_batch {
+    char        *data;              /* whole lines of the body */
+    size_t      len;
+    bool        is_last;            /* the read stage reached the end */
+    uint64_t    line_cnt;           /* every line of the block */
+    uint32_t    cnt;                /* lines of PIPE_MIN_LINE_LEN or more */
+    uint32_t    *bol;
+    uint32_t    *eol;
+    struct rec_batch recs;
+};
+
+struct pipe_queue {
+    struct pipe_batch *ring[PIPE_BATCH_CNT];
+    atomic_size_t head;
+    atomic_size_t tail;
+};
+
+struct pipe_ctx {
+    struct file_basic_stats *f_basics;
+    uint32_t    flowid;
+    struct analysis *an;
+    chunk_record_fn fn;
+    void        *arg;
+    struct pipe_layout layout;
+    struct pipe_queue queues[PIPE_STAGE_CNT];   /* queue t feeds thread t */
+    struct pipe_batch batches[PIPE_BATCH_CNT];
+    atomic_uint next_thread;
+    atomic_bool has_failed;
+
+    /* of the read stage */
+    struct readahead ra;
+    const char  *chunk;             /* rest of the read-ahead chunk */
+    size_t      chunk_len;
+    char        *carry;             /* partial line at the end of a block */
+    size_t      carry_len;
+    bool        is_eof;
+
+    uint64_t    line_cnt;           /* of the frame stage */
+    uint64_t    rec_cnt;            /* of the format stage */
+
+    /* per thread */
+    uint64_t    yield_cnt[PIPE_STAGE_CNT];
+    struct perf_counters pcs[PIPE_STAGE_CNT];
+    struct perf_sample samples[PIPE_STAGE_CNT];
+};
+
+/* Parse a layout: the stages in order, each followed by '+' to stay on the
+ * thread or by ',' to start the next one.
+ */
+static int
+pipe_layout_parse(struct pipe_layout *layout, const char *spec)
+{
+    const char *p = spec;
+    bool is_new_thread = true;
+
+    layout->thread_cnt = 0;
+    for (int s = 0; s < PIPE_STAGE_CNT; s++) {
+        size_t len = strlen(pipe_stage_name[s]);
+        if (strncmp(p, pipe_stage_name[s], len) != 0) {
+            break;
+        }
+        if (is_new_thread) {
+            layout->first[layout->thread_cnt++] = (uint8_t)s;
+        }
+        p += len;
+        if (s == PIPE_STAGE_CNT - 1) {
+            if (*p == '\0') {
+                return EXIT_SUCCESS;
+            }
+            break;
+        }
+        if (*p != ',' && *p != '+') {
+            break;
+        }
+        is_new_thread = (*p++ == ',');
+    }
+    printf("pipeline must list read,frame,decode,filter,agg,format in this "
+           "order, joined by ',' (next thread) or '+' (same thread): %s\n", spec);
+    return EXIT_FAILURE;
+}
+
+/* the stages of thread t are [first, last) */
+static inline uint32_t
+pipe_layout_last(const struct pipe_layout *layout, uint32_t t)
+{
+    return (t + 1 < layout->thread_cnt) ? layout->first[t + 1] : PIPE_STAGE_CNT;
+}
+
+/* The ring holds every batch, so a push always finds room. */
+static inline void
+pipe_queue_push(struct pipe_queue *q, struct pipe_batch *b)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    assert(tail - atomic_load_explicit(&q->head, memory_order_acquire) <
+           PIPE_BATCH_CNT);
+    q->ring[tail % PIPE_BATCH_CNT] = b;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+/* NULL when the queue is empty */
+static inline struct pipe_batch *
+pipe_queue_pop(struct pipe_queue *q)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+    if (head == tail) {
+        return NULL;
+    }
+    struct pipe_batch *b = q->ring[head % PIPE_BATCH_CNT];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return b;
+}
+
+static void
+pipe_read(struct pipe_ctx *ctx, struct pipe_batch *b)
+{
+    size_t len = ctx->carry_len;
+
+    memcpy(b->data, ctx->carry, len);
+    while (len < PIPE_BLOCK_SIZE && !ctx->is_eof) {
+        if (ctx->chunk_len == 0) {
+            ssize_t n = readahead_next(&ctx->ra, &ctx->chunk);
+            if (n <= 0) {
+                if (n < 0) {
+                    atomic_store(&ctx->has_failed, true);
+                }
+                ctx->is_eof = true;
+                break;
+            }
+            ctx->chunk_len = (size_t)n;
+        }
+        size_t take = AGG_MIN(PIPE_BLOCK_SIZE - len, ctx->chunk_len);
+        memcpy(b->data + len, ctx->chunk, take);
+        ctx->chunk += take;
+        ctx->chunk_len -= take;
+        len += take;
+    }
+
+    /* A body ends with a '\n', a rest without one is dropped at the end. A
+     * line longer than a block is cut into two. */
+    size_t end = len;
+    while (end > 0 && b->data[end - 1] != '\n') {
+        end--;
+    }
+    if (end == 0 && !ctx->is_eof) {
+        end = len;
+    }
+    ctx->carry_len = ctx->is_eof ? 0 : len - end;
+    memcpy(ctx->carry, b->data + end, ctx->carry_len);
+    b->len = end;
+    b->is_last = ctx->is_eof;
+}
+
+static void
+pipe_frame(struct pipe_ctx *ctx, struct pipe_batch *b)
+{
+    const char *p = b->data;
+    const char *lim = b->data + b->len;
+    uint32_t eol[SIMD_BATCH];
+    uint32_t k;
+
+    b->cnt = 0;
+    b->line_cnt = 0;
+    while (p < lim && (k = simd->find_eols(p, (size_t)(lim - p), eol, SIMD_BATCH)) > 0) {
+        const char *base = p;
+        for (uint32_t i = 0; i < k; i++) {
+            const char *nl = base + eol[i];
+            if (nl - p >= PIPE_MIN_LINE_LEN) {
+                b->bol[b->cnt] = (uint32_t)(p - b->data);
+                b->eol[b->cnt] = (uint32_t)(nl - b->data);
+                b->cnt++;
+            }
+            p = nl + 1;
+        }
+        b->line_cnt += k;
+    }
+    ctx->line_cnt += b->line_cnt;
+}
+
+static void
+pipe_decode(struct pipe_ctx *ctx, struct pipe_batch *b)
+{
+    const uint64_t key = simd_hex8_key(ctx->flowid);
+    const uint32_t start_time = ctx->f_basics->first_flow_start_time;
+    uint32_t hit[SIMD_BATCH];
+    record_t rec;
+
+    b->recs.cnt = 0;
+    for (uint32_t i = 0; i < b->cnt; i += SIMD_BATCH) {
+        uint32_t n = AGG_MIN(b->cnt - i, (uint32_t)SIMD_BATCH);
+        uint32_t hits = simd->match_hex8(b->data, b->bol + i, n, key, hit);
+        for (uint32_t h = 0; h < hits; h++) {
+            uint32_t l = i + hit[h];
+            if (decode_text_record(b->data + b->bol[l], b->data + b->eol[l],
+                                   start_time, &rec) &&
+                rec_batch_push(&b->recs, &rec) != EXIT_SUCCESS) {
+                PERROR_FUNCTION("malloc failed for record batch");
+                atomic_store(&ctx->has_failed, true);
+                return;
+            }
+        }
+    }
+}
+
+/* keep the records matching the --where predicates, in order */
+static void
+pipe_filter(struct pipe_ctx *ctx, struct pipe_batch *b)
+{
+    const struct rec_filter *rec_filter = ctx->f_basics->rec_filter;
+    struct rec_batch *r = &b->recs;
+    uint32_t kept = 0;
+    record_t rec;
+
+    if (rec_filter == NULL) {
+        return;
+    }
+    for (uint32_t i = 0; i < r->cnt; i++) {
+        rec_batch_get(r, i, &rec);
+        if (rec_filter_match(rec_filter, &rec)) {
+            r->is_out[kept] = r->is_out[i];
+            r->rel_time[kept] = r->rel_time[i];
+            r->cwnd[kept] = r->cwnd[i];
+            r->ssthresh[kept] = r->ssthresh[i];
+            r->srtt[kept] = r->srtt[i];
+            r->data_sz[kept] = r->data_sz[i];
+            r->pipe[kept] = r->pipe[i];
+            kept++;
+        }
+    }
+    r->cnt = kept;
+}
+
+static void
+pipe_format(struct pipe_ctx *ctx, struct pipe_batch *b)
+{
+    record_t rec;
+
+    for (uint32_t i = 0; i < b->recs.cnt; i++) {
+        rec_batch_get(&b->recs, i, &rec);
+        ctx->fn(ctx->arg, ctx->flowid, &rec);
+    }
+    ctx->rec_cnt += b->recs.cnt;
+}
+
+static void
+pipe_stage_run(struct pipe_ctx *ctx, enum pipe_stage s, struct pipe_batch *b)
+{
+    switch (s) {
+        case PIPE_READ:
+            pipe_read(ctx, b);
+            break;
+        case PIPE_FRAME:
+            pipe_frame(ctx, b);
+            break;
+        case PIPE_DECODE:
+            pipe_decode(ctx, b);
+            break;
+        case PIPE_FILTER:
+            pipe_filter(ctx, b);
+            break;
+        case PIPE_AGG:
+            analysis_batch(ctx->an, &b->recs, false);
+            break;
+        case PIPE_FORMAT:
+            pipe_format(ctx, b);
+            break;
+        default:
+            break;
+    }
+}
+
+int pipe_thread(void *arg)
+{
+    struct pipe_ctx *ctx = arg;
+    uint32_t t = atomic_fetch_add(&ctx->next_thread, 1);
+    uint32_t first = ctx->layout.first[t];
+    uint32_t last = pipe_layout_last(&ctx->layout, t);
+    struct pipe_queue *in = &ctx->queues[t];
+    struct pipe_queue *out = &ctx->queues[(t + 1) % ctx->layout.thread_cnt];
+
+    perf_counters_open(&ctx->pcs[t]);
+    while (true) {
+        struct pipe_batch *b;
+        while ((b = pipe_queue_pop(in)) == NULL) {
+            /* a stage failed or a thread did not start: nothing more comes */
+            if (atomic_load(&ctx->has_failed)) {
+                goto out;
+            }
+            ctx->yield_cnt[t]++;
+            sched_yield();
+        }
+        for (uint32_t s = first; s < last; s++) {
+            pipe_stage_run(ctx, s, b);
+        }
+        /* the batch belongs to the next thread once pushed */
+        bool is_last = b->is_last;
+        pipe_queue_push(out, b);
+        if (is_last) {
+            break;
+        }
+    }
+out:
+    perf_counters_close(&ctx->pcs[t], &ctx->samples[t]);
+    return EXIT_SUCCESS;
+}
+
+static void
+pipe_batches_free(struct pipe_ctx *ctx)
+{
+    for (uint32_t i = 0; i < PIPE_BATCH_CNT; i++) {
+        free(ctx->batches[i].data);
+        free(ctx->batches[i].bol);
+        free(ctx->batches[i].eol);
+        rec_batch_free(&ctx->batches[i].recs);
+    }
+    free(ctx->carry);
+}
+
+/* Run the text body of `f_basics` through the stages of pipe_layout and hand
+ * the records of `flowid` to `fn` in file order. The records run through the
+ * analyzers of `an` batch by batch.
+ */
+int
+pipe_body_by_flowid(struct file_basic_stats *f_basics, uint32_t flowid,
+                    struct analysis *an, chunk_record_fn fn, void *arg)
+{
+    const uint32_t max_lines = PIPE_BLOCK_SIZE / PIPE_MIN_LINE_LEN + 1;
+    struct pipe_ctx *ctx = calloc(1, sizeof(*ctx));
+
+    if (ctx == NULL) {
+        PERROR_FUNCTION("calloc failed for the pipeline");
+        return EXIT_FAILURE;
+    }
+    ctx->f_basics = f_basics;
+    ctx->flowid = flowid;
+    ctx->an = an;
+    ctx->fn = fn;
+    ctx->arg = arg;
+    ctx->layout = pipe_layout;
+    atomic_init(&ctx->next_thread, 0);
+    atomic_init(&ctx->has_failed, false);
+    for (uint32_t t = 0; t < PIPE_STAGE_CNT; t++) {
+        atomic_init(&ctx->queues[t].head, 0);
+        atomic_init(&ctx->queues[t].tail, 0);
+    }
+
+    bool is_ok = (ctx->carry = malloc(PIPE_BLOCK_SIZE)) != NULL;
+    for (uint32_t i = 0; is_ok && i < PIPE_BATCH_CNT; i++) {
+        struct pipe_batch *b = &ctx->batches[i];
+        b->data = malloc(PIPE_BLOCK_SIZE);
+        b->bol = malloc(max_lines * sizeof(*b->bol));
+        b->eol = malloc(max_lines * sizeof(*b->eol));
+        is_ok = b->data != NULL && b->bol != NULL && b->eol != NULL &&
+                rec_batch_reserve(&b->recs, 4096) == EXIT_SUCCESS;
+        pipe_queue_push(&ctx->queues[0], b);
+    }
+    if (!is_ok) {
+        PERROR_FUNCTION("malloc failed for pipeline batches");
+        pipe_batches_free(ctx);
+        free(ctx);
+        return EXIT_FAILURE;
+    }
+    if (readahead_open(&ctx->ra, fileno(f_basics->file), f_basics->body_offset,
+                       f_basics->last_line_offset, readahead_mode) != EXIT_SUCCESS) {
+        pipe_batches_free(ctx);
+        free(ctx);
+        return EXIT_FAILURE;
+    }
+
+    thrd_t threads[PIPE_STAGE_CNT];
+    uint32_t started = 0;
+    while (started < ctx->layout.thread_cnt &&
+           thrd_create(&threads[started], pipe_thread, ctx) == thrd_success) {
+        started++;
+    }
+    if (started < ctx->layout.thread_cnt) {
+        printf("started %u of %u pipeline threads\n", started, ctx->layout.thread_cnt);
+        atomic_store(&ctx->has_failed, true);
+    }
+    for (uint32_t t = 0; t < started; t++) {
+        thrd_join(threads[t], NULL);
+    }
+    readahead_close(&ctx->ra);
+
+    /* the head note, the body and the foot note */
+    f_basics->num_lines = 1 + ctx->line_cnt + 1;
+
+    for (uint32_t t = 0; t < ctx->layout.thread_cnt; t++) {
+        char stages[64];
+        int len = 0;
+        for (uint32_t s = ctx->layout.first[t]; s < pipe_layout_last(&ctx->layout, t); s++) {
+            len += snprintf(stages + len, sizeof(stages) - len, "%s%s",
+                            (len > 0) ? "+" : "", pipe_stage_name[s]);
+        }
+        if (verbose) {
+            printf("[%s] %s: yield_cnt =  %" PRIu64 "\n", __FUNCTION__, stages,
+                   ctx->yield_cnt[t]);
+        }
+        /* stages up to decode see lines, the later ones records */
+        perf_sample_report(stages, &ctx->samples[t],
+                           (ctx->layout.first[t] <= PIPE_DECODE) ?
+                           ctx->line_cnt : ctx->rec_cnt,
+                           (t == 0) ? &ctx->pcs[t] : NULL);
+    }
+
+    int ret = atomic_load(&ctx->has_failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+    pipe_batches_free(ctx);
+    free(ctx);
+    return ret;
+}
+
+#endif /* PIPELINE_H_ */
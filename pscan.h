@@ -0,0 +1,260 @@
+/*
+ * pscan.h
+ *
+ *  Parallel scan of the pkt_node array of a binary log.
+ *
+ *  Worker threads claim body chunks in file order and filter them by flowid
+ *  with a strided compare over the 72-byte records (match_stride of simd.h).
+ *  The matching records are compacted into a per-chunk batch of columns,
+ *  which the worker runs through the analyzers (analyze.h) into per-chunk
+ *  states. The consumer takes the batches back in chunk order, so the output
+ *  is the same as the single reader's, and merges the states in that order.
+ *
+ *  At most PSCAN_SLOTS_PER_WORKER batches per worker are in flight, so memory
+ *  stays bounded for logs of any size.
+ */
+
+#ifndef PSCAN_H_
+#define PSCAN_H_
+
+#include <unistd.h>
+
+enum {
+    PSCAN_CHUNK_SIZE        = 4 * 1024 * 1024,
+    PSCAN_MAX_WORKERS       = 32,
+    PSCAN_SLOTS_PER_WORKER  = 2,
+};
+
+/* Chunk k goes to slot k % slot_cnt. A slot only takes the chunk whose turn
+ * it is, so a worker that is ahead cannot overtake one that is behind.
+ */
+struct pscan_slot {
+    atomic_uint_fast64_t turn;      /* chunk the slot waits for */
+    atomic_bool is_ready;           /* batch of chunk `turn` is filled */
+    bool        has_failed;
+    struct rec_batch batch;
+    struct analysis part;           /* the analyzers over `batch` */
+};
+
+struct pscan_ctx {
+    struct body_chunks bc;
+    const struct file_basic_stats *f_basics;
+    const struct flow_info *f_info;
+    uint32_t    flowid;
+    const struct rec_filter *rec_filter;
+    atomic_uint_fast64_t next_chunk;
+    struct pscan_slot *slots;
+    uint32_t    slot_cnt;
+    atomic_uint next_worker;
+    struct perf_sample samples[PSCAN_MAX_WORKERS];  /* per worker */
+};
+
+static int
+pscan_append(struct rec_batch *b, const char *node_ptr, uint32_t start_time,
+             const struct rec_filter *rec_filter)
+{
+    struct pkt_node node;
+    record_t rec;
+
+    memcpy(&node, node_ptr, sizeof(node));
+    decode_binary_record(&node, start_time, &rec);
+    if (rec_filter != NULL && !rec_filter_match(rec_filter, &rec)) {
+        return EXIT_SUCCESS;
+    }
+    return rec_batch_push(b, &rec);
+}
+
+/* Compact the records of `flowid` among the `n` pkt_nodes at `buf`. */
+static int
+pscan_filter(struct rec_batch *b, const char *buf, size_t n, uint32_t flowid,
+             uint32_t start_time, const struct rec_filter *rec_filter)
+{
+    const size_t rec_size = sizeof(struct pkt_node);
+    uint32_t hit[SIMD_BATCH];
+
+    for (size_t i = 0; i < n; i += SIMD_BATCH) {
+        const char *recs = buf + i * rec_size;
+        uint32_t cnt = (uint32_t)AGG_MIN(n - i, (size_t)SIMD_BATCH);
+        uint32_t hits = simd->match_stride(recs, cnt, flowid, hit);
+        for (uint32_t h = 0; h < hits; h++) {
+            if (pscan_append(b, recs + hit[h] * rec_size, start_time,
+                             rec_filter) != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int pscan_worker(void *arg)
+{
+    struct pscan_ctx *ctx = arg;
+    char *buf = malloc(body_chunks_buf_size(&ctx->bc));
+    uint64_t yield_cnt = 0;
+    uint32_t w = atomic_fetch_add(&ctx->next_worker, 1);
+    struct perf_counters pc;
+
+    perf_counters_open(&pc);
+    while (true) {
+        uint64_t k = atomic_fetch_add(&ctx->next_chunk, 1);
+        if (k >= ctx->bc.count) {
+            break;
+        }
+        struct pscan_slot *slot = &ctx->slots[k % ctx->slot_cnt];
+
+        /* wait for the consumer to take chunk k - slot_cnt out of the slot */
+        while (atomic_load_explicit(&slot->turn, memory_order_acquire) != k) {
+            yield_cnt++;
+            sched_yield();
+        }
+
+        struct rec_batch *b = &slot->batch;
+        long lo = ctx->bc.begin + (long)(k * ctx->bc.span);
+        long hi = (lo + (long)ctx->bc.span < ctx->bc.end) ?
+                  lo + (long)ctx->bc.span : ctx->bc.end;
+        b->cnt = 0;
+        b->num_records = 0;
+        slot->has_failed = (buf == NULL);
+        if (!slot->has_failed) {
+            ssize_t got = pread_full(ctx->bc.fd, buf, (size_t)(hi - lo), lo);
+            if (got < 0) {
+                PERROR_FUNCTION("pread");
+                slot->has_failed = true;
+            } else {
+                b->num_records = (uint64_t)got / sizeof(struct pkt_node);
+                slot->has_failed =
+                    pscan_filter(b, buf, b->num_records, ctx->flowid,
+                                 ctx->bc.start_time, ctx->rec_filter) != EXIT_SUCCESS;
+            }
+            if (!slot->has_failed) {
+                analysis_init(&slot->part, ctx->f_basics, ctx->f_info);
+                analysis_batch(&slot->part, b, true);
+            }
+        }
+        atomic_store_explicit(&slot->is_ready, true, memory_order_release);
+    }
+
+    perf_counters_close(&pc, &ctx->samples[w]);
+    free(buf);
+    if (verbose) {
+        printf("[%s] yield_cnt =  %" PRIu64 "\n", __FUNCTION__, yield_cnt);
+    }
+    return EXIT_SUCCESS;
+}
+
+static uint32_t
+pscan_worker_count(uint64_t chunk_cnt)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t n = (cpus > 1) ? (uint64_t)cpus - 1 : 1;   /* one for the consumer */
+
+    n = AGG_MIN(n, (uint64_t)PSCAN_MAX_WORKERS);
+    n = AGG_MIN(n, chunk_cnt);
+    return (n > 0) ? (uint32_t)n : 1;
+}
+
+/* Scan the binary body of `f_basics` for the flow of `f_info` on parallel
+ * workers and hand the matching records to `fn` in file order. The states
+ * the workers fill for the analyzers of `an` are merged into `an`.
+ */
+int
+pscan_body_by_flowid(struct file_basic_stats *f_basics,
+                     const struct flow_info *f_info, struct analysis *an,
+                     chunk_record_fn fn, void *arg)
+{
+    const uint32_t flowid = f_info->flowid;
+    struct pscan_ctx ctx = {
+        .f_basics = f_basics,
+        .f_info = f_info,
+        .flowid = flowid,
+        .rec_filter = f_basics->rec_filter,
+    };
+    body_chunks_init(&ctx.bc, f_basics, PSCAN_CHUNK_SIZE);
+    atomic_init(&ctx.next_chunk, 0);
+    atomic_init(&ctx.next_worker, 0);
+
+    uint32_t workers = pscan_worker_count(ctx.bc.count);
+    ctx.slot_cnt = workers * PSCAN_SLOTS_PER_WORKER;
+    ctx.slots = calloc(ctx.slot_cnt, sizeof(*ctx.slots));
+    if (ctx.slots == NULL) {
+        PERROR_FUNCTION("calloc failed for scan slots");
+        return EXIT_FAILURE;
+    }
+    for (uint32_t s = 0; s < ctx.slot_cnt; s++) {
+        atomic_init(&ctx.slots[s].turn, s);
+        atomic_init(&ctx.slots[s].is_ready, false);
+        if (analysis_clone(&ctx.slots[s].part, an) != EXIT_SUCCESS) {
+            for (uint32_t p = 0; p < s; p++) {
+                analysis_free(&ctx.slots[p].part);
+            }
+            free(ctx.slots);
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct perf_counters pc;
+    struct perf_sample sample = {};
+    perf_counters_open(&pc);
+
+    thrd_t threads[PSCAN_MAX_WORKERS];
+    uint32_t started = 0;
+    while (started < workers &&
+           thrd_create(&threads[started], pscan_worker, &ctx) == thrd_success) {
+        started++;
+    }
+
+    int ret = EXIT_SUCCESS;
+    if (started < workers) {
+        printf("started %u of %u scan workers\n", started, workers);
+        ret = EXIT_FAILURE;
+    }
+    uint64_t num_records = 0, rec_cnt = 0, yield_cnt = 0;
+    record_t rec;
+    /* the started workers take every chunk, which is drained unused */
+    for (uint64_t k = 0; k < ctx.bc.count && started > 0; k++) {
+        struct pscan_slot *slot = &ctx.slots[k % ctx.slot_cnt];
+        while (!atomic_load_explicit(&slot->is_ready, memory_order_acquire)) {
+            yield_cnt++;
+            sched_yield();
+        }
+
+        const struct rec_batch *b = &slot->batch;
+        if (slot->has_failed) {
+            ret = EXIT_FAILURE;
+        } else if (ret == EXIT_SUCCESS) {
+            num_records += b->num_records;
+            rec_cnt += b->cnt;
+            analysis_merge(an, &slot->part, b);
+            for (uint32_t i = 0; i < b->cnt; i++) {
+                rec_batch_get(b, i, &rec);
+                fn(arg, flowid, &rec);
+            }
+        }
+        atomic_store_explicit(&slot->is_ready, false, memory_order_relaxed);
+        atomic_store_explicit(&slot->turn, k + ctx.slot_cnt, memory_order_release);
+    }
+
+    perf_counters_close(&pc, &sample);
+    for (uint32_t w = 0; w < started; w++) {
+        thrd_join(threads[w], NULL);
+    }
+    for (uint32_t s = 0; s < ctx.slot_cnt; s++) {
+        rec_batch_free(&ctx.slots[s].batch);
+        analysis_free(&ctx.slots[s].part);
+    }
+    free(ctx.slots);
+
+    f_basics->num_records = num_records;
+    if (verbose) {
+        printf("[%s] %u workers, %" PRIu64 " chunks, yield_cnt =  %" PRIu64 "\n",
+               __FUNCTION__, workers, ctx.bc.count, yield_cnt);
+    }
+    for (uint32_t w = 1; w < workers; w++) {
+        perf_sample_add(&ctx.samples[0], &ctx.samples[w]);
+    }
+    perf_sample_report("scan", &ctx.samples[0], num_records, &pc);
+    perf_sample_report("writer", &sample, rec_cnt, NULL);
+    return ret;
+}
+
+#endif /* PSCAN_H_ */
@@ -0,0 +1,494 @@
+/*
+ * readahead.h
+ *
+ *  Sequential input of a byte range with several large reads in flight, so
+ *  parsing never waits on the disk.
+ *
+ *  On Linux the reads go through io_uring, set up with raw syscalls, into
+ *  buffers registered with the ring. READAHEAD_DIRECT reads the file through
+ *  a second descriptor opened with O_DIRECT, bypassing the page cache. Where
+ *  io_uring is not available, prefetch threads pread() into the same ring of
+ *  buffers. Either way the chunks are handed out in file order, and a read
+ *  that comes back short is finished with a plain pread().
+ */
+
+#ifndef READAHEAD_H_
+#define READAHEAD_H_
+
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+/* O_DIRECT is only declared under _GNU_SOURCE */
+#if !defined(O_DIRECT) && defined(__O_DIRECT)
+#define O_DIRECT __O_DIRECT
+#endif
+#endif
+
+enum readahead_mode {
+    READAHEAD_URING,            /* io_uring, prefetch threads as the fallback */
+    READAHEAD_DIRECT,           /* io_uring with O_DIRECT */
+    READAHEAD_PREAD,            /* prefetch threads only */
+};
+
+enum {
+    READAHEAD_CHUNK_SIZE    = 4 * 1024 * 1024,
+    READAHEAD_DEPTH         = 8,        /* reads in flight */
+    READAHEAD_ALIGN         = 4096,     /* O_DIRECT offsets and lengths */
+    READAHEAD_THREADS       = 2,
+};
+
+enum readahead_mode readahead_mode = READAHEAD_URING;
+
+/* Chunk k is read into buffer k % READAHEAD_DEPTH, which the prefetch
+ * threads take in turn as in pscan.h.
+ */
+struct readahead_buf {
+    atomic_uint_fast64_t turn;      /* chunk the buffer waits for */
+    atomic_bool is_done;
+    off_t       offset;
+    size_t      len;
+    ssize_t     res;                /* bytes read, or -errno */
+    char        *data;
+};
+
+#ifdef HAVE_IO_URING
+struct readahead_uring {
+    int         ring_fd;
+    void        *sq_ptr;
+    void        *cq_ptr;
+    size_t      sq_size;
+    size_t      cq_size;
+    struct io_uring_sqe *sqes;
+    size_t      sqes_size;
+    atomic_uint *sq_tail;
+    unsigned    *sq_mask;
+    unsigned    *sq_array;
+    atomic_uint *cq_head;
+    atomic_uint *cq_tail;
+    unsigned    *cq_mask;
+    struct io_uring_cqe *cqes;
+    bool        is_fixed;           /* buffers registered with the ring */
+    bool        is_broken;          /* a submit failed, read with pread() */
+    uint32_t    inflight;
+};
+#endif
+
+struct readahead {
+    int         src_fd;             /* the caller's descriptor */
+    int         fd;                 /* the one read from, maybe O_DIRECT */
+    off_t       begin;
+    off_t       end;
+    off_t       base;               /* begin aligned down */
+    uint64_t    chunk_cnt;
+    uint64_t    next_submit;
+    uint64_t    next_out;
+    bool        has_out;            /* chunk next_out - 1 is with the caller */
+    char        *mem;
+    struct readahead_buf bufs[READAHEAD_DEPTH];
+    bool        is_uring;
+#ifdef HAVE_IO_URING
+    struct readahead_uring uring;
+#endif
+    thrd_t      threads[READAHEAD_THREADS];
+    uint32_t    thread_cnt;
+    atomic_uint_fast64_t next_claim;
+    atomic_bool is_stopping;
+    uint64_t    wait_cnt;           /* chunks not read yet when asked for */
+    uint64_t    fixup_cnt;          /* short reads finished with pread() */
+};
+
+static inline void
+readahead_buf_setup(struct readahead *ra, uint64_t k)
+{
+    struct readahead_buf *b = &ra->bufs[k % READAHEAD_DEPTH];
+    off_t round_end = (ra->end + READAHEAD_ALIGN - 1) & ~(off_t)(READAHEAD_ALIGN - 1);
+
+    b->offset = ra->base + (off_t)(k * READAHEAD_CHUNK_SIZE);
+    b->len = (size_t)AGG_MIN((off_t)READAHEAD_CHUNK_SIZE, round_end - b->offset);
+    b->res = 0;
+}
+
+#ifdef HAVE_IO_URING
+static inline int
+io_uring_enter_retry(int ring_fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags)
+{
+    int ret;
+
+    do {
+        ret = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                           flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static int
+readahead_uring_setup(struct readahead *ra)
+{
+    struct readahead_uring *u = &ra->uring;
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    u->ring_fd = (int)syscall(__NR_io_uring_setup, READAHEAD_DEPTH, &p);
+    if (u->ring_fd < 0) {
+        return EXIT_FAILURE;
+    }
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->sq_size = u->cq_size = AGG_MAX(u->sq_size, u->cq_size);
+    }
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = (p.features & IORING_FEAT_SINGLE_MMAP) ? u->sq_ptr :
+                mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED ||
+        u->sqes == MAP_FAILED) {
+        if (u->sqes != MAP_FAILED) {
+            munmap(u->sqes, u->sqes_size);
+        }
+        if (u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr) {
+            munmap(u->cq_ptr, u->cq_size);
+        }
+        if (u->sq_ptr != MAP_FAILED) {
+            munmap(u->sq_ptr, u->sq_size);
+        }
+        close(u->ring_fd);
+        return EXIT_FAILURE;
+    }
+
+    char *sq = u->sq_ptr, *cq = u->cq_ptr;
+    u->sq_tail = (atomic_uint *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (atomic_uint *)(cq + p.cq_off.head);
+    u->cq_tail = (atomic_uint *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* fixed buffers save the page pinning per read, but count against
+     * RLIMIT_MEMLOCK on older kernels; plain reads work without them */
+    struct iovec iovs[READAHEAD_DEPTH];
+    for (int i = 0; i < READAHEAD_DEPTH; i++) {
+        iovs[i].iov_base = ra->bufs[i].data;
+        iovs[i].iov_len = READAHEAD_CHUNK_SIZE;
+    }
+    u->is_fixed = syscall(__NR_io_uring_register, u->ring_fd,
+                          IORING_REGISTER_BUFFERS, iovs, READAHEAD_DEPTH) == 0;
+    u->is_broken = false;
+    u->inflight = 0;
+    return EXIT_SUCCESS;
+}
+
+static void
+readahead_uring_submit(struct readahead *ra, uint64_t k)
+{
+    struct readahead_uring *u = &ra->uring;
+    struct readahead_buf *b = &ra->bufs[k % READAHEAD_DEPTH];
+
+    if (u->is_broken) {
+        /* the short read fixup reads the whole chunk */
+        b->res = 0;
+        atomic_store_explicit(&b->is_done, true, memory_order_relaxed);
+        return;
+    }
+
+    unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = u->is_fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = ra->fd;
+    sqe->off = (uint64_t)b->offset;
+    sqe->addr = (uint64_t)(uintptr_t)b->data;
+    sqe->len = (uint32_t)b->len;
+    sqe->buf_index = (uint16_t)(k % READAHEAD_DEPTH);
+    sqe->user_data = k;
+    u->sq_array[idx] = idx;
+    atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+
+    if (io_uring_enter_retry(u->ring_fd, 1, 0, 0) < 0) {
+        /* the entry stays unsubmitted as the ring is not entered again */
+        if (verbose) {
+            printf("[%s] io_uring_enter: %s\n", __FUNCTION__, strerror(errno));
+        }
+        u->is_broken = true;
+        b->res = 0;
+        atomic_store_explicit(&b->is_done, true, memory_order_relaxed);
+        return;
+    }
+    u->inflight++;
+}
+
+/* Reap completions until chunk k is in, fails if the ring cannot be waited on. */
+static int
+readahead_uring_wait(struct readahead *ra, uint64_t k)
+{
+    struct readahead_uring *u = &ra->uring;
+    struct readahead_buf *b = &ra->bufs[k % READAHEAD_DEPTH];
+
+    while (!atomic_load_explicit(&b->is_done, memory_order_relaxed)) {
+        unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(u->cq_tail, memory_order_acquire);
+
+        if (head == tail) {
+            if (io_uring_enter_retry(u->ring_fd, 0, 1,
+                                     IORING_ENTER_GETEVENTS) < 0) {
+                PERROR_FUNCTION("io_uring_enter");
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        struct readahead_buf *done = &ra->bufs[cqe->user_data % READAHEAD_DEPTH];
+        done->res = cqe->res;
+        atomic_store_explicit(&done->is_done, true, memory_order_relaxed);
+        atomic_store_explicit(u->cq_head, head + 1, memory_order_release);
+        u->inflight--;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void
+readahead_uring_close(struct readahead *ra)
+{
+    struct readahead_uring *u = &ra->uring;
+
+    /* the kernel may still write into the buffers */
+    while (u->inflight > 0) {
+        unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(u->cq_tail, memory_order_acquire);
+        if (head == tail) {
+            if (io_uring_enter_retry(u->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+                break;
+            }
+            continue;
+        }
+        atomic_store_explicit(u->cq_head, head + 1, memory_order_release);
+        u->inflight--;
+    }
+    munmap(u->sqes, u->sqes_size);
+    if (u->cq_ptr != u->sq_ptr) {
+        munmap(u->cq_ptr, u->cq_size);
+    }
+    munmap(u->sq_ptr, u->sq_size);
+    close(u->ring_fd);
+}
+#endif /* HAVE_IO_URING */
+
+int readahead_worker(void *arg)
+{
+    struct readahead *ra = arg;
+
+    while (true) {
+        uint64_t k = atomic_fetch_add(&ra->next_claim, 1);
+        if (k >= ra->chunk_cnt) {
+            break;
+        }
+        struct readahead_buf *b = &ra->bufs[k % READAHEAD_DEPTH];
+
+        /* wait for the caller to hand back chunk k - READAHEAD_DEPTH */
+        while (atomic_load_explicit(&b->turn, memory_order_acquire) != k) {
+            if (atomic_load_explicit(&ra->is_stopping, memory_order_relaxed)) {
+                return EXIT_SUCCESS;
+            }
+            sched_yield();
+        }
+        ssize_t got = pread_full(ra->fd, b->data, b->len, b->offset);
+        b->res = (got < 0) ? -errno : got;
+        atomic_store_explicit(&b->is_done, true, memory_order_release);
+    }
+    return EXIT_SUCCESS;
+}
+
+static inline void
+readahead_submit(struct readahead *ra, uint64_t k)
+{
+    readahead_buf_setup(ra, k);
+#ifdef HAVE_IO_URING
+    if (ra->is_uring) {
+        readahead_uring_submit(ra, k);
+        return;
+    }
+#endif
+    atomic_store_explicit(&ra->bufs[k % READAHEAD_DEPTH].turn, k,
+                          memory_order_release);
+}
+
+/* Start reading [begin, end) of `fd` in `mode`. */
+int
+readahead_open(struct readahead *ra, int fd, off_t begin, off_t end,
+               enum readahead_mode mode)
+{
+    memset(ra, 0, sizeof(*ra));
+    ra->src_fd = ra->fd = fd;
+    ra->begin = begin;
+    ra->end = (end > begin) ? end : begin;
+    ra->base = begin & ~(off_t)(READAHEAD_ALIGN - 1);
+    ra->chunk_cnt = (ra->end > begin) ?
+                    (uint64_t)(ra->end - ra->base + READAHEAD_CHUNK_SIZE - 1) /
+                    READAHEAD_CHUNK_SIZE : 0;
+    atomic_init(&ra->next_claim, 0);
+    atomic_init(&ra->is_stopping, false);
+
+    ra->mem = aligned_alloc(READAHEAD_ALIGN,
+                            (size_t)READAHEAD_DEPTH * READAHEAD_CHUNK_SIZE);
+    if (ra->mem == NULL) {
+        PERROR_FUNCTION("aligned_alloc failed for read-ahead buffers");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < READAHEAD_DEPTH; i++) {
+        ra->bufs[i].data = ra->mem + (size_t)i * READAHEAD_CHUNK_SIZE;
+        /* nothing to wait for until a chunk is submitted into the buffer */
+        atomic_init(&ra->bufs[i].turn, UINT64_MAX);
+        atomic_init(&ra->bufs[i].is_done, false);
+    }
+
+#ifdef HAVE_IO_URING
+#ifdef O_DIRECT
+    if (mode == READAHEAD_DIRECT) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        int direct_fd = open(path, O_RDONLY | O_DIRECT);
+        if (direct_fd >= 0) {
+            ra->fd = direct_fd;
+        } else if (verbose) {
+            printf("[%s] no O_DIRECT: %s\n", __FUNCTION__, strerror(errno));
+        }
+    }
+#endif
+    if (mode != READAHEAD_PREAD && readahead_uring_setup(ra) == EXIT_SUCCESS) {
+        ra->is_uring = true;
+    }
+#else
+    (void)mode;
+#endif
+
+    if (!ra->is_uring) {
+        uint32_t workers = (uint32_t)AGG_MIN(ra->chunk_cnt, (uint64_t)READAHEAD_THREADS);
+        /* the threads claim the chunks in turn, so any of them will do */
+        while (ra->thread_cnt < workers &&
+               thrd_create(&ra->threads[ra->thread_cnt], readahead_worker, ra) ==
+               thrd_success) {
+            ra->thread_cnt++;
+        }
+        if (ra->thread_cnt == 0 && workers > 0) {
+            printf("no read-ahead thread started\n");
+            if (ra->fd != ra->src_fd) {
+                close(ra->fd);
+            }
+            free(ra->mem);
+            return EXIT_FAILURE;
+        }
+    }
+    for (; ra->next_submit < AGG_MIN(ra->chunk_cnt, (uint64_t)READAHEAD_DEPTH);
+         ra->next_submit++) {
+        readahead_submit(ra, ra->next_submit);
+    }
+
+    if (verbose) {
+        printf("[%s] %s%s%s, %" PRIu64 " chunks of %d bytes\n", __FUNCTION__,
+               ra->is_uring ? "io_uring" : "pread threads",
+#ifdef HAVE_IO_URING
+               (ra->is_uring && ra->uring.is_fixed) ? ", fixed buffers" : "",
+#else
+               "",
+#endif
+               (ra->fd != ra->src_fd) ? ", O_DIRECT" : "",
+               ra->chunk_cnt, READAHEAD_CHUNK_SIZE);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Point `*data` at the next chunk of the range, valid until the next call.
+ * Returns its length, 0 at the end of the range, or -1 on a read error.
+ */
+ssize_t
+readahead_next(struct readahead *ra, const char **data)
+{
+    if (ra->has_out) {
+        struct readahead_buf *prev = &ra->bufs[(ra->next_out - 1) % READAHEAD_DEPTH];
+        atomic_store_explicit(&prev->is_done, false, memory_order_relaxed);
+        ra->has_out = false;
+        if (ra->next_submit < ra->chunk_cnt) {
+            readahead_submit(ra, ra->next_submit++);
+        }
+    }
+    if (ra->next_out == ra->chunk_cnt) {
+        return 0;
+    }
+
+    uint64_t k = ra->next_out;
+    struct readahead_buf *b = &ra->bufs[k % READAHEAD_DEPTH];
+    if (!atomic_load_explicit(&b->is_done, memory_order_acquire)) {
+        ra->wait_cnt++;
+#ifdef HAVE_IO_URING
+        if (ra->is_uring && readahead_uring_wait(ra, k) != EXIT_SUCCESS) {
+            return -1;
+        }
+#endif
+        while (!atomic_load_explicit(&b->is_done, memory_order_acquire)) {
+            sched_yield();
+        }
+    }
+
+    /* the bytes of the range in this chunk */
+    off_t lo = AGG_MAX(ra->begin, b->offset);
+    off_t hi = AGG_MIN(ra->end, b->offset + (off_t)b->len);
+    ssize_t want = (ssize_t)(hi - b->offset);
+    if (b->res < want) {
+        ssize_t have = (b->res > 0) ? b->res : 0;
+        ssize_t got = pread_full(ra->src_fd, b->data + have, (size_t)(want - have),
+                                 b->offset + have);
+        if (got != want - have) {
+            PERROR_FUNCTION("pread");
+            return -1;
+        }
+        b->res = want;
+        ra->fixup_cnt++;
+    }
+
+    *data = b->data + (lo - b->offset);
+    ra->next_out++;
+    ra->has_out = true;
+    return (ssize_t)(hi - lo);
+}
+
+void
+readahead_close(struct readahead *ra)
+{
+#ifdef HAVE_IO_URING
+    if (ra->is_uring) {
+        readahead_uring_close(ra);
+    }
+#endif
+    atomic_store_explicit(&ra->is_stopping, true, memory_order_relaxed);
+    for (uint32_t t = 0; t < ra->thread_cnt; t++) {
+        thrd_join(ra->threads[t], NULL);
+    }
+    if (ra->fd != ra->src_fd) {
+        close(ra->fd);
+    }
+    free(ra->mem);
+
+    if (verbose) {
+        printf("[%s] %" PRIu64 " of %" PRIu64 " chunks waited on, %" PRIu64
+               " short reads finished with pread\n", __FUNCTION__,
+               ra->wait_cnt, ra->next_out, ra->fixup_cnt);
+    }
+}
+
+#endif /* READAHEAD_H_ */
@@ -0,0 +1,325 @@
+/*
+ * record.h
+ *
+ *  The records of a siftr2 log body: the fields of a text line, the binary
+ *  pkt_node, the record_t both decode to, and the kernels that parse, batch
+ *  and format them. It needs nothing but lib.h, so microbench.c builds the
+ *  kernels without the rest of the tool.
+ */
+
+#ifndef RECORD_H_
+#define RECORD_H_
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lib.h"
+
+enum line_type {
+    HEAD,
+    BODY,
+    FOOT,
+};
+
+/* flow list fields in the foot note of the siftr2 log */
+enum {
+    FL_FLOW_ID,     FL_IPVER,       FL_LOIP,        FL_LPORT,
+    FL_FOIP,        FL_FPORT,       FL_TCP_STACK_NAME,  FL_TCP_CC_NAME,
+    FL_MSS,         FL_ISSACK,      FL_SNDSCALE,    FL_RCVSCALE,
+    FL_NUMRECORD,   FL_NTRANS,      TOTAL_FLOWLIST_FIELDS,
+};
+
+/* TCP traffic record fields */
+enum {
+    FLOW_ID,        DIRECTION,      RELATIVE_TIME,      CWND,   SSTHRESH,
+    SRTT,           TCP_DATA_SZ,
+    SNDWIN,         RCVWIN,         FLAG,           FLAG2,          RTO,
+    SND_BUF_HIWAT,  SND_BUF_CC,     RCV_BUF_HIWAT,  RCV_BUF_CC,
+    INFLIGHT_BYTES, REASS_QLEN,
+    TOTAL_FIELDS,
+};
+
+/* TCP traffic record structure from siftr2.c */
+struct pkt_node {
+    /* Flowid for the connection. */
+    uint32_t        flowid;
+    /* Direction pkt is travelling. */
+    enum {
+        DIR_IN = 0,
+        DIR_OUT = 1,
+    }           direction;
+    /* Timestamp (milliseconds) since SIFTR enable. */
+    uint32_t        tval;
+    /* Congestion Window (bytes). */
+    uint32_t        snd_cwnd;
+    /* Slow Start Threshold (bytes). */
+    uint32_t        snd_ssthresh;
+    /* Smoothed RTT (usecs). */
+    uint32_t        srtt;
+    /* the length of TCP segment payload in bytes */
+    uint32_t        data_sz;
+    /* Sending Window (bytes). */
+    uint32_t        snd_wnd;
+    /* Receive Window (bytes). */
+    uint32_t        rcv_wnd;
+    /* TCP control block flags. */
+    uint32_t        t_flags;
+    /* More tcpcb flags storage */
+    uint32_t        t_flags2;
+    /* Retransmission timeout (usec). */
+    uint32_t        rto;
+    /* Size of the TCP send buffer in bytes. */
+    uint32_t        snd_buf_hiwater;
+    /* Current num bytes in the send socket buffer. */
+    uint32_t        snd_buf_cc;
+    /* Size of the TCP receive buffer in bytes. */
+    uint32_t        rcv_buf_hiwater;
+    /* Current num bytes in the receive socket buffer. */
+    uint32_t        rcv_buf_cc;
+    /* Number of bytes inflight that we are waiting on ACKs for. */
+    uint32_t        pipe;
+    /* Number of segments currently in the reassembly queue. */
+    int32_t         t_segqlen;
+} __packed;
+
+_Static_assert(sizeof(struct pkt_node) == 72, "pkt_node must be 72 bytes");
+
+typedef struct {
+    char        direction;  // 'i' or 'o'
+    uint32_t    rel_time;
+    uint32_t    cwnd;
+    uint32_t    ssthresh;
+    uint32_t    srtt;
+    uint32_t    data_sz;
+    uint32_t    pipe;       // bytes in flight waiting on ACKs
+    uint32_t    snd_wnd;    // send window the peer advertised, bytes
+    uint32_t    snd_buf_cc; // bytes in the send socket buffer
+} record_t;
+
+void
+fill_fields_from_line(char **fields, char *line, enum line_type type)
+{
+    int field_cnt = 0;
+
+    // Strip newline characters at the end
+    line[strcspn(line, "\r\n")] = '\0';
+
+    // Tokenize the line using comma as the delimiter
+    char *token = strtok(line, COMMA_DELIMITER);
+    while (token != NULL) {
+        fields[field_cnt++] = token;
+        token = strtok(NULL, COMMA_DELIMITER);
+    }
+
+    if (type == BODY && field_cnt != TOTAL_FIELDS){
+        printf("\nfield_cnt:%d != TOTAL_FIELDS:%d\n", field_cnt, TOTAL_FIELDS);
+        PERROR_FUNCTION("field_cnt != TOTAL_FIELDS");
+    } else if (type == FOOT && field_cnt != TOTAL_FLOWLIST_FIELDS) {
+        printf("\nfield_cnt:%d != TOTAL_FLOWLIST_FIELDS:%d\n",
+               field_cnt, TOTAL_FLOWLIST_FIELDS);
+        PERROR_FUNCTION("field_cnt != TOTAL_FLOWLIST_FIELDS");
+    }
+}
+
+/* Parse the hex digits up to the next ',' (or `eol`) and step past it. */
+static inline uint32_t
+next_hex_field(const char **pp, const char *eol)
+{
+    const char *p = *pp;
+    uint32_t val = 0;
+
+    while (p < eol && *p != ',') {
+        val = (val << 4) | (uint32_t)hexval[(uint8_t)*p++];
+    }
+    *pp = (p < eol) ? p + 1 : p;
+    return val;
+}
+
+/* Decode the record_t fields of the text body line [p, eol). The line must
+ * start with the 8-digit flowid; the fields after the in-flight bytes are not
+ * looked at.
+ */
+static inline bool
+decode_text_record(const char *p, const char *eol, uint32_t start_time,
+                   record_t *rec)
+{
+    if (eol - p < 11 || p[8] != ',' || p[10] != ',') {
+        return false;
+    }
+    p += 9;
+    rec->direction = *p;
+    p += 2;
+    rec->rel_time = next_hex_field(&p, eol) - start_time;
+    rec->cwnd = next_hex_field(&p, eol);
+    rec->ssthresh = next_hex_field(&p, eol);
+    rec->srtt = next_hex_field(&p, eol);
+    rec->data_sz = next_hex_field(&p, eol);
+    rec->snd_wnd = next_hex_field(&p, eol);
+    for (int field = RCVWIN; field < SND_BUF_CC; field++) {
+        next_hex_field(&p, eol);
+    }
+    rec->snd_buf_cc = next_hex_field(&p, eol);
+    for (int field = RCV_BUF_HIWAT; field < INFLIGHT_BYTES; field++) {
+        next_hex_field(&p, eol);
+    }
+    rec->pipe = next_hex_field(&p, eol);
+    return true;
+}
+
+static inline void
+decode_binary_record(const struct pkt_node *node, uint32_t start_time,
+                     record_t *rec)
+{
+    rec->direction  = (node->direction == DIR_IN) ? 'i' : 'o';
+    rec->rel_time   = node->tval - start_time;
+    rec->cwnd       = node->snd_cwnd;
+    rec->ssthresh   = node->snd_ssthresh;
+    rec->srtt       = node->srtt;
+    rec->data_sz    = node->data_sz;
+    rec->pipe       = node->pipe;
+    rec->snd_wnd    = node->snd_wnd;
+    rec->snd_buf_cc = node->snd_buf_cc;
+}
+
+/* a batch of records in columns, one array per field */
+struct rec_batch {
+    uint32_t    cnt;
+    uint32_t    cap;
+    uint64_t    num_records;        /* records scanned for it, of any flow */
+    uint8_t     *is_out;
+    uint32_t    *rel_time;
+    uint32_t    *cwnd;
+    uint32_t    *ssthresh;
+    uint32_t    *srtt;
+    uint32_t    *data_sz;
+    uint32_t    *pipe;
+    uint32_t    *snd_wnd;
+    uint32_t    *snd_buf_cc;
+};
+
+static int
+rec_batch_reserve(struct rec_batch *b, uint32_t cap)
+{
+    if (cap <= b->cap) {
+        return EXIT_SUCCESS;
+    }
+    uint8_t *is_out = realloc(b->is_out, cap * sizeof(*is_out));
+    if (is_out != NULL) {
+        b->is_out = is_out;
+    }
+    uint32_t **cols[] = {&b->rel_time, &b->cwnd, &b->ssthresh, &b->srtt,
+                         &b->data_sz, &b->pipe, &b->snd_wnd, &b->snd_buf_cc};
+    bool is_ok = (is_out != NULL);
+    for (size_t c = 0; c < sizeof(cols) / sizeof(cols[0]) && is_ok; c++) {
+        uint32_t *col = realloc(*cols[c], cap * sizeof(*col));
+        if (col == NULL) {
+            is_ok = false;
+        } else {
+            *cols[c] = col;
+        }
+    }
+    if (!is_ok) {
+        return EXIT_FAILURE;
+    }
+    b->cap = cap;
+    return EXIT_SUCCESS;
+}
+
+static void
+rec_batch_free(struct rec_batch *b)
+{
+    free(b->is_out);
+    free(b->rel_time);
+    free(b->cwnd);
+    free(b->ssthresh);
+    free(b->srtt);
+    free(b->data_sz);
+    free(b->pipe);
+    free(b->snd_wnd);
+    free(b->snd_buf_cc);
+}
+
+static inline int
+rec_batch_push(struct rec_batch *b, const record_t *rec)
+{
+    if (b->cnt == b->cap &&
+        rec_batch_reserve(b, (b->cap == 0) ? 4096 : b->cap * 2) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    uint32_t i = b->cnt++;
+    b->is_out[i] = (rec->direction == 'o');
+    b->rel_time[i] = rec->rel_time;
+    b->cwnd[i] = rec->cwnd;
+    b->ssthresh[i] = rec->ssthresh;
+    b->srtt[i] = rec->srtt;
+    b->data_sz[i] = rec->data_sz;
+    b->pipe[i] = rec->pipe;
+    b->snd_wnd[i] = rec->snd_wnd;
+    b->snd_buf_cc[i] = rec->snd_buf_cc;
+    return EXIT_SUCCESS;
+}
+
+static inline void
+rec_batch_get(const struct rec_batch *b, uint32_t i, record_t *rec)
+{
+    rec->direction = b->is_out[i] ? 'o' : 'i';
+    rec->rel_time = b->rel_time[i];
+    rec->cwnd = b->cwnd[i];
+    rec->ssthresh = b->ssthresh[i];
+    rec->srtt = b->srtt[i];
+    rec->data_sz = b->data_sz[i];
+    rec->pipe = b->pipe[i];
+    rec->snd_wnd = b->snd_wnd[i];
+    rec->snd_buf_cc = b->snd_buf_cc[i];
+}
+
+enum {
+    FIXED_ROW_WIDTH         = 58,   /* bytes of a fixedrow.h row */
+};
+
+/* right aligned decimal of `v` in the `width` bytes at `p` */
+static inline void
+fixed_row_put_u32(char *p, int width, uint32_t v)
+{
+    int i = width - 1;
+    do {
+        p[i--] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0 && i >= 0);
+    while (i >= 0) {
+        p[i--] = ' ';
+    }
+}
+
+static inline void
+fixed_row_format(char *p, const struct rec_batch *b, uint32_t i)
+{
+    p[0] = b->is_out[i] ? 'o' : 'i';
+    p[1] = '\t';
+    fixed_row_put_u32(p + 2, 7, b->rel_time[i] / 1000);
+    p[9] = '.';
+    fixed_row_put_u32(p + 10, 3, b->rel_time[i] % 1000);
+    for (int d = 10; d < 12 && p[d] == ' '; d++) {
+        p[d] = '0';
+    }
+    p[13] = '\t';
+    fixed_row_put_u32(p + 14, 10, b->cwnd[i]);
+    p[24] = '\t';
+    fixed_row_put_u32(p + 25, 10, b->ssthresh[i]);
+    p[35] = '\t';
+    fixed_row_put_u32(p + 36, 10, b->srtt[i]);
+    p[46] = '\t';
+    fixed_row_put_u32(p + 47, 10, b->data_sz[i]);
+    p[57] = '\n';
+}
+
+#endif /* RECORD_H_ */
@@ -0,0 +1,452 @@
+/*
+ * recover.h
+ *
+ *  Rebuild the foot note of a log that has none, or only part of one, after
+ *  siftr2 was killed or the host crashed.
+ *
+ *  The body is scanned once on parallel workers. Each counts the records per
+ *  flowid of the chunks it claims into a flow map of its own; the maps are
+ *  added up afterwards and the flows listed in the order of their first
+ *  record. The body only tells the flowid, the record count and the time of
+ *  the last record: the addresses, ports, stack and cc names are written as
+ *  "unknown", the IP version, mss, SACK and window scales as 0. The rebuilt
+ *  foot note is parsed like the one of a complete log, and with
+ *  `--recover=path` written with the head note and body into path.
+ */
+
+#ifndef RECOVER_H_
+#define RECOVER_H_
+
+#include <sys/stat.h>
+
+enum {
+    RECOVER_CHUNK_SIZE  = 4 * 1024 * 1024,
+    RECOVER_MIN_FLOWS   = 64,
+    RECOVER_HEAD_LEN    = 256,          /* the foot note before the flow list */
+    RECOVER_ENTRY_LEN   = 128,          /* one entry of the flow list */
+    RECOVER_COPY_SIZE   = 1024 * 1024,
+    /* longest text record: 8 hex digits and a ',' per field */
+    RECOVER_TEXT_LINE_MAX = TOTAL_FIELDS * 9,
+};
+
+#define RECOVER_UNKNOWN     "unknown"
+
+struct recover_flow {
+    uint32_t    flowid;
+    uint64_t    first_pos;      /* file offset of its first record */
+    uint64_t    record_cnt;     /* 0 marks an empty bucket */
+};
+
+/* flowid -> recover_flow, open addressing */
+struct recover_map {
+    struct recover_flow *flows;
+    uint32_t    mask;
+    uint32_t    used;
+};
+
+/* what one worker found in the chunks it claimed */
+struct recover_part {
+    struct recover_map map;
+    uint64_t    num_records;
+    uint64_t    skip_cnt;       /* lines or zero-filled pkt_nodes, no record */
+    uint32_t    max_tval;
+    uint32_t    max_line;       /* longest record line, without '\n' */
+    bool        has_failed;
+};
+
+struct recover_ctx {
+    struct body_chunks bc;
+    atomic_uint_fast64_t next_chunk;
+    atomic_uint next_worker;
+    struct recover_part parts[PSCAN_MAX_WORKERS];
+};
+
+static int
+recover_map_grow(struct recover_map *m)
+{
+    uint32_t cap = (m->flows == NULL) ? RECOVER_MIN_FLOWS : (m->mask + 1) * 2;
+    struct recover_flow *flows = calloc(cap, sizeof(*flows));
+
+    if (flows == NULL) {
+        PERROR_FUNCTION("calloc failed for the flow map");
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; m->flows != NULL && i <= m->mask; i++) {
+        if (m->flows[i].record_cnt == 0) {
+            continue;
+        }
+        uint32_t pos = flow_table_hash(m->flows[i].flowid) & (cap - 1);
+        while (flows[pos].record_cnt != 0) {
+            pos = (pos + 1) & (cap - 1);
+        }
+        flows[pos] = m->flows[i];
+    }
+    free(m->flows);
+    m->flows = flows;
+    m->mask = cap - 1;
+    return EXIT_SUCCESS;
+}
+
+/* Count `cnt` records of `flowid`, the first of them at file offset `pos`. */
+static int
+recover_map_add(struct recover_map *m, uint32_t flowid, uint64_t pos,
+                uint64_t cnt)
+{
+    if (m->flows == NULL || (m->used + 1) * 2 > m->mask + 1) {
+        if (recover_map_grow(m) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint32_t b = flow_table_hash(flowid) & m->mask;
+    while (m->flows[b].record_cnt != 0 && m->flows[b].flowid != flowid) {
+        b = (b + 1) & m->mask;
+    }
+    struct recover_flow *f = &m->flows[b];
+    if (f->record_cnt == 0) {
+        f->flowid = flowid;
+        f->first_pos = pos;
+        m->used++;
+    } else if (pos < f->first_pos) {
+        f->first_pos = pos;
+    }
+    f->record_cnt += cnt;
+    return EXIT_SUCCESS;
+}
+
+static int
+recover_text_chunk(struct recover_ctx *ctx, struct recover_part *part,
+                   uint64_t k, char *buf)
+{
+    const struct body_chunks *bc = &ctx->bc;
+    long lo = bc->begin + (long)(k * bc->span);
+    long hi = (lo + (long)bc->span < bc->end) ? lo + (long)bc->span : bc->end;
+    const char *p, *stop, *lim;
+    uint64_t rec_cnt = 0;
+    record_t rec;
+
+    if (body_chunk_read_text(bc, k, buf, &p, &stop, &lim) != EXIT_SUCCESS) {
+        PERROR_FUNCTION("pread");
+        return EXIT_FAILURE;
+    }
+
+    struct text_lines tl = {};
+    while (p < stop) {
+        const char *next = text_lines_next(&tl, p, lim, stop, true);
+
+        for (uint32_t i = 0; i < tl.cnt; i++) {
+            const char *line = tl.base + tl.bol[i];
+            /* start_time 0 leaves the tval in rel_time */
+            if (!decode_text_record(line, line + tl.len[i], 0, &rec)) {
+                continue;
+            }
+            rec_cnt++;
+            part->max_line = AGG_MAX(part->max_line, tl.len[i]);
+            part->max_tval = AGG_MAX(part->max_tval, rec.rel_time);
+            /* `stop` is at file offset `hi` */
+            if (recover_map_add(&part->map, fast_hex8_to_u32(line),
+                                (uint64_t)(hi - (stop - line)), 1) != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+        }
+        if (next == p) {
+            break;
+        }
+        p = next;
+    }
+    part->num_records += rec_cnt;
+    part->skip_cnt += tl.non_empty_cnt - rec_cnt;
+    return EXIT_SUCCESS;
+}
+
+static int
+recover_binary_chunk(struct recover_ctx *ctx, struct recover_part *part,
+                     uint64_t k, char *buf)
+{
+    static const struct pkt_node zero_node;
+    const size_t rec_size = sizeof(struct pkt_node);
+    const struct body_chunks *bc = &ctx->bc;
+    long lo = bc->begin + (long)(k * bc->span);
+    long hi = (lo + (long)bc->span < bc->end) ? lo + (long)bc->span : bc->end;
+    struct pkt_node node;
+
+    ssize_t got = pread_full(bc->fd, buf, (size_t)(hi - lo), lo);
+    if (got < 0) {
+        PERROR_FUNCTION("pread");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < (size_t)got / rec_size; i++) {
+        memcpy(&node, buf + i * rec_size, rec_size);
+        /* blocks the file system never got to write read back as zeros */
+        if (memcmp(&node, &zero_node, rec_size) == 0) {
+            part->skip_cnt++;
+            continue;
+        }
+        part->num_records++;
+        part->max_tval = AGG_MAX(part->max_tval, node.tval);
+        if (recover_map_add(&part->map, node.flowid, (uint64_t)lo + i * rec_size,
+                            1) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int recover_worker(void *arg)
+{
+    struct recover_ctx *ctx = arg;
+    struct recover_part *part = &ctx->parts[atomic_fetch_add(&ctx->next_worker, 1)];
+    char *buf = malloc(body_chunks_buf_size(&ctx->bc));
+
+    part->has_failed = (buf == NULL);
+    while (!part->has_failed) {
+        uint64_t k = atomic_fetch_add(&ctx->next_chunk, 1);
+        if (k >= ctx->bc.count) {
+            break;
+        }
+        part->has_failed = (is_rec_fmt_binary ?
+                            recover_binary_chunk(ctx, part, k, buf) :
+                            recover_text_chunk(ctx, part, k, buf)) != EXIT_SUCCESS;
+    }
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
+static int
+recover_first_pos_cmp(const void *a, const void *b)
+{
+    const struct recover_flow *fa = a;
+    const struct recover_flow *fb = b;
+
+    return (fa->first_pos > fb->first_pos) - (fa->first_pos < fb->first_pos);
+}
+
+/* The foot note line of the `cnt` flows in `flows`, the last record at
+ * `max_tval` milliseconds after the enable time. The caller frees it.
+ */
+static char *
+recover_make_foot_note(const struct file_basic_stats *f_basics,
+                       const struct recover_flow *flows, uint32_t cnt,
+                       uint32_t max_tval, uint32_t max_str_size)
+{
+    struct timeval disable_time = f_basics->first_line_stats->enable_time;
+    size_t cap = RECOVER_HEAD_LEN + (size_t)cnt * RECOVER_ENTRY_LEN + 1;
+    char *foot = malloc(cap);
+
+    if (foot == NULL) {
+        PERROR_FUNCTION("malloc failed for the foot note");
+        return NULL;
+    }
+    disable_time.tv_sec += max_tval / 1000;
+    disable_time.tv_usec += (max_tval % 1000) * 1000;
+    if (disable_time.tv_usec >= 1000000) {
+        disable_time.tv_sec++;
+        disable_time.tv_usec -= 1000000;
+    }
+
+    size_t len = (size_t)snprintf(foot, cap, "disable_time_secs=%ld\t"
+                                  "disable_time_usecs=%ld\tglobal_flow_cnt=%u\t"
+                                  "ring_drops=0\tmax_str_size=%u\t"
+                                  "gen_flowid_cnt=%u\tflow_list=",
+                                  (long)disable_time.tv_sec,
+                                  (long)disable_time.tv_usec, cnt,
+                                  max_str_size, cnt);
+    for (uint32_t i = 0; i < cnt; i++) {
+        len += (size_t)snprintf(foot + len, cap - len,
+                                "%08x,0," RECOVER_UNKNOWN ",0," RECOVER_UNKNOWN
+                                ",0," RECOVER_UNKNOWN "," RECOVER_UNKNOWN
+                                ",0,0,0,0,%" PRIu64 ",%" PRIu64 ";",
+                                flows[i].flowid, flows[i].record_cnt,
+                                flows[i].record_cnt);
+    }
+    return foot;
+}
+
+/* Write the head note and the first `body_end` bytes of the log, then `foot`,
+ * to `path`.
+ */
+static int
+recover_write_log(const struct file_basic_stats *f_basics, long body_end,
+                  const char *foot, const char *path)
+{
+    int fd = fileno(f_basics->file);
+    FILE *out = fopen(path, "w");
+    char *buf = malloc(RECOVER_COPY_SIZE);
+    int ret = EXIT_FAILURE;
+
+    if (out == NULL || buf == NULL) {
+        PERROR_FUNCTION("open repaired log");
+        goto out;
+    }
+    for (long off = 0; off < body_end;) {
+        size_t n = (size_t)AGG_MIN((long)RECOVER_COPY_SIZE, body_end - off);
+        ssize_t got = pread_full(fd, buf, n, off);
+        if (got <= 0 || fwrite(buf, 1, (size_t)got, out) != (size_t)got) {
+            PERROR_FUNCTION("copy the body");
+            goto out;
+        }
+        off += got;
+    }
+    /* a binary body ends with the last pkt_node, the foot note on a line */
+    if (is_rec_fmt_binary) {
+        fputc('\n', out);
+    }
+    fprintf(out, "%s\n", foot);
+    ret = EXIT_SUCCESS;
+
+out:
+    if (out != NULL && fclose(out) == EOF) {
+        PERROR_FUNCTION("close repaired log");
+        ret = EXIT_FAILURE;
+    }
+    free(buf);
+    return ret;
+}
+
+/* Parse `foot` into the foot note of f_basics, like the one of a log. */
+static int
+recover_set_foot_note(struct file_basic_stats *f_basics, const char *foot)
+{
+    char *line = strdup(foot);
+
+    if (line == NULL) {
+        PERROR_FUNCTION("strdup failed for the foot note");
+        return EXIT_FAILURE;
+    }
+    f_basics->last_line_stats = parse_last_line(line);
+    free(line);
+    return (f_basics->last_line_stats != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Rebuild the missing or cut foot note of the log of `f_basics` from its
+ * body on parallel workers, and write the repaired log to repair_path.
+ */
+int
+recover_foot_note(struct file_basic_stats *f_basics)
+{
+    struct recover_ctx *ctx = NULL;
+    struct recover_flow *flows = NULL;
+    char *line = NULL, *foot = NULL;
+    struct stat st;
+    char last_byte = '\0';
+    int ret = EXIT_FAILURE;
+
+    /* sets last_line_offset at the start of the last line */
+    if (read_last_line(f_basics, &line) != EXIT_SUCCESS ||
+        fstat(fileno(f_basics->file), &st) != 0 ||
+        pread_full(fileno(f_basics->file), &last_byte, 1, st.st_size - 1) != 1) {
+        PERROR_FUNCTION("read the end of the log");
+        goto out;
+    }
+
+    /* where the records end: before a foot note cut short, and for a text
+     * body before a last line without '\n'. body_chunks_init() drops a
+     * pkt_node cut short.
+     */
+    bool is_foot_cut = strncmp(line, FOOT_NOTE_KEY, sizeof(FOOT_NOTE_KEY) - 1) == 0;
+    long end = st.st_size;
+    if (is_rec_fmt_binary) {
+        end = is_foot_cut ? f_basics->last_line_offset - 1 : end;
+    } else if (is_foot_cut || last_byte != '\n') {
+        end = f_basics->last_line_offset;
+    }
+    f_basics->last_line_offset = AGG_MAX(end, f_basics->body_offset);
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        PERROR_FUNCTION("calloc failed for the recovery scan");
+        goto out;
+    }
+    /* max_str_size is not known yet: body lines of up to PATH_MAX */
+    body_chunks_init_len(&ctx->bc, f_basics, RECOVER_CHUNK_SIZE, PATH_MAX);
+    atomic_init(&ctx->next_chunk, 0);
+    atomic_init(&ctx->next_worker, 0);
+
+    uint32_t workers = pscan_worker_count(ctx->bc.count);
+    thrd_t threads[PSCAN_MAX_WORKERS];
+    uint32_t started = 0;
+    while (started < workers &&
+           thrd_create(&threads[started], recover_worker, ctx) == thrd_success) {
+        started++;
+    }
+    for (uint32_t w = 0; w < started; w++) {
+        thrd_join(threads[w], NULL);
+    }
+    if (started < workers) {
+        printf("started %u of %u recovery workers\n", started, workers);
+        goto out;
+    }
+
+    /* add the maps of the other workers up into that of the first */
+    struct recover_part *all = &ctx->parts[0];
+    bool has_failed = all->has_failed;
+    for (uint32_t w = 1; w < workers; w++) {
+        struct recover_part *part = &ctx->parts[w];
+        has_failed |= part->has_failed;
+        for (uint32_t i = 0; part->map.flows != NULL && i <= part->map.mask; i++) {
+            const struct recover_flow *f = &part->map.flows[i];
+            if (f->record_cnt > 0 && !has_failed) {
+                has_failed = recover_map_add(&all->map, f->flowid, f->first_pos,
+                                             f->record_cnt) != EXIT_SUCCESS;
+            }
+        }
+        all->num_records += part->num_records;
+        all->skip_cnt += part->skip_cnt;
+        all->max_tval = AGG_MAX(all->max_tval, part->max_tval);
+        all->max_line = AGG_MAX(all->max_line, part->max_line);
+    }
+    if (has_failed) {
+        goto out;
+    }
+    if (all->map.used == 0) {
+        printf("no record in the body to rebuild the flow list from\n");
+        goto out;
+    }
+
+    /* the flows in the order they started */
+    uint32_t cnt = 0;
+    flows = malloc(all->map.used * sizeof(*flows));
+    if (flows == NULL) {
+        PERROR_FUNCTION("malloc failed for the flow list");
+        goto out;
+    }
+    for (uint32_t i = 0; i <= all->map.mask; i++) {
+        if (all->map.flows[i].record_cnt > 0) {
+            flows[cnt++] = all->map.flows[i];
+        }
+    }
+    qsort(flows, cnt, sizeof(*flows), recover_first_pos_cmp);
+
+    foot = recover_make_foot_note(f_basics, flows, cnt, all->max_tval,
+                                  is_rec_fmt_binary ? sizeof(struct pkt_node) :
+                                  all->max_line + 1);
+    if (foot == NULL || recover_set_foot_note(f_basics, foot) != EXIT_SUCCESS) {
+        goto out;
+    }
+    f_basics->last_line_offset = ctx->bc.end;
+
+    printf("rebuilt the foot note from %" PRIu64 " records of %u flows in the "
+           "body, skipped %" PRIu64 " %s\n", all->num_records, cnt,
+           all->skip_cnt, is_rec_fmt_binary ? "zero-filled records" : "lines");
+    printf("the addresses, ports, stack, cc, mss, SACK and window scales of "
+           "the flows are unknown\n");
+    ret = EXIT_SUCCESS;
+    if (repair_path != NULL) {
+        ret = recover_write_log(f_basics, ctx->bc.end, foot, repair_path);
+        if (ret == EXIT_SUCCESS) {
+            printf("repaired log: %s\n", repair_path);
+        }
+    }
+
+out:
+    for (uint32_t w = 0; ctx != NULL && w < PSCAN_MAX_WORKERS; w++) {
+        free(ctx->parts[w].map.flows);
+    }
+    free(ctx);
+    free(flows);
+    free(foot);
+    free(line);
+    return ret;
+}
+
+#endif /* RECOVER_H_ */
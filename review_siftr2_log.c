@@ -7,235 +7,367 @@
  Description : Check siftr log stats in C, Ansi-style
  ============================================================================
  */
+/* glibc hides POSIX interfaces such as pread() under a strict -std=c23 */
+#define _DEFAULT_SOURCE
 #include "review_siftr2_log.h"
 #include "threads_compat.h"
-
-int reader_thread(void *arg) {
-    struct {
-        struct file_basic_stats *f_basics;
-        uint32_t flowid;
-        queue_t *queue;
-    } *ctx = arg;
-
-    const size_t line_len = ctx->f_basics->last_line_stats->line_len;
-    char buf1[line_len];
-    char buf2[line_len];
-    char *cur_line = buf1;
-    char *prev_line = buf2;
-    bool have_prev = false;
-    uint32_t start_time = ctx->f_basics->first_flow_start_time;
-
-    char *fields[TOTAL_FIELDS];
-    uint64_t line_cnt = 0;
-    uint64_t num_records = 0;
-    uint64_t yield_cnt = 0;
-    record_t rec;
-
-    rewind(ctx->f_basics->file);
-    /* Read and discard the first line */
-    if (fgets(cur_line, line_len, ctx->f_basics->file) == NULL) {
-        PERROR_FUNCTION("Failed to read first line");
-        return EXIT_FAILURE;
-    }
-    line_cnt++; // Increment line counter, now shall be at the 2nd line
-
-    if (is_rec_fmt_binary) {
-        struct pkt_node node;
-        size_t rec_size = sizeof(struct pkt_node);
-
-        while (true) {
-            long pos = ftell(ctx->f_basics->file);
-            if (pos < 0) {
-                PERROR_FUNCTION("ftell");
-                break;
-            }
-            if ((long)(pos + rec_size) > ctx->f_basics->last_line_offset) {
-                // no more record: would cross into the footer — stop.
-                break;
-            }
-            fread(&node, 1, rec_size, ctx->f_basics->file);
-
-            if (node.flowid == ctx->flowid) {
-                // Build record_t from node
-                // Adjust field names and direction mapping to your definition
-                rec.direction = (node.direction == DIR_IN) ? 'i' : 'o';
-                rec.rel_time  = node.tval - start_time;
-                rec.cwnd      = node.snd_cwnd;
-                rec.ssthresh  = node.snd_ssthresh;
-                rec.srtt      = node.srtt;
-                rec.data_sz   = node.data_sz;
-
-                // Push to queue (same backoff as before)
-                while (!queue_push(ctx->queue, &rec)) {
-                    yield_cnt++;
-                    sched_yield();
-                }
-            }
-            num_records++;
-        }
-    } else {
-        while (fgets(cur_line, line_len, ctx->f_basics->file)) {
-            if (have_prev && (fast_hex8_to_u32(prev_line) == ctx->flowid)) {
-                fill_fields_from_line(fields, prev_line, BODY);
-
-                rec.direction = *fields[DIRECTION];
-                rec.rel_time = fast_hex_to_u32(fields[RELATIVE_TIME]) - start_time;
-                rec.cwnd = fast_hex_to_u32(fields[CWND]);
-                rec.ssthresh = fast_hex_to_u32(fields[SSTHRESH]);
-                rec.srtt = fast_hex_to_u32(fields[SRTT]);
-                rec.data_sz = fast_hex_to_u32(fields[TCP_DATA_SZ]);
-
-                // Try to push; if full, yield briefly (lock-free backoff)
-                while (!queue_push(ctx->queue, &rec)) {
-                    yield_cnt++;
-                    sched_yield(); // or nanosleep for gentler backoff
-                }
-            }
-            line_cnt++;
-            char *tmp = cur_line; cur_line = prev_line; prev_line = tmp;
-            have_prev = true;
-        }
+#include "filter.h"
+#include "simd.h"
+#include "chunk.h"
+#include "sample.h"
+#include "agg.h"
+#include "analyze.h"
+#include "cache.h"
+#include "svg.h"
+#include "timing.h"
+#include "merge.h"
+#include "fairness.h"
+#include "perfcnt.h"
+#include "pscan.h"
+#include "summary.h"
+#include "archive.h"
+#include "readahead.h"
+#include "fixedrow.h"
+#include "pipeline.h"
+#include "compress.h"
+#include "recover.h"
+#include "verify.h"
+#include "stream.h"
+#include "serve.h"
+
+/* where the records of a reviewed flow go besides the stats */
+struct plot_out {
+    FILE        *plot_file;     /* NULL when rendering the svg */
+    char        *io_buffer;
+    bool        is_fixed_width; /* rows go to `rows` instead of plot_file */
+    struct fixed_row_writer rows;
+    struct svg_plot *svg;
+    struct flow_timing *timing;
+};
+
+static int
+plot_out_open(struct plot_out *out, const char *file_name)
+{
+    // the svg is reduced in memory and written after the last record
+    if (out->svg != NULL) {
+        return EXIT_SUCCESS;
     }
-
-    // Signal completion
-    queue_set_done(ctx->queue);
-
-    ctx->f_basics->num_lines = line_cnt;
-    ctx->f_basics->num_records = num_records;
-
-    if (verbose) {
-        printf("[%s] yield_cnt =  %" PRIu64 "\n", __FUNCTION__, yield_cnt);
+    if (out->is_fixed_width) {
+        return fixed_row_open(&out->rows, file_name);
     }
 
-    return EXIT_SUCCESS;
-}
-
-int writer_thread(void *arg) {
-    struct {
-        struct file_basic_stats *f_basics;
-        int idx;
-        char *file_name;
-        queue_t *queue;
-    } *ctx = arg;
-
-    uint64_t yield_cnt = 0;
-
-    struct flow_info *f_info = &ctx->f_basics->flow_list[ctx->idx];
-
-    FILE *plot_file = fopen(ctx->file_name, "w");
-    if (!plot_file) {
+    out->plot_file = fopen(file_name, "w");
+    if (!out->plot_file) {
         perror("open plot file");
         return EXIT_FAILURE;
     }
 
     // Allocate a large heap buffer for stdio
     const size_t large_buffer_size = 1u << 20;  // 1 MiB
-    char *io_buffer = malloc(large_buffer_size);
-    if (io_buffer) {
+    out->io_buffer = malloc(large_buffer_size);
+    if (out->io_buffer) {
         // If malloc fails, stdio falls back to default internal buffering.
         // If setvbuf fails, we still proceed with default buffering,
         // but keep io_buffer allocated to free later for simplicity.
-        setvbuf(plot_file, io_buffer, _IOFBF, large_buffer_size);
+        setvbuf(out->plot_file, out->io_buffer, _IOFBF, large_buffer_size);
     }
 
-    fprintf(plot_file,
+    fprintf(out->plot_file,
             "##direction" TAB "relative_timestamp" TAB "cwnd" TAB "ssthresh" TAB
             "srtt" TAB "data_size\n");
+    return EXIT_SUCCESS;
+}
 
-    record_t rec;
-    while (true) {
-        if (queue_pop(ctx->queue, &rec)) {
-            // update stats
-            f_info->srtt_sum += rec.srtt;
-            if (f_info->srtt_min > rec.srtt) {
-                f_info->srtt_min = rec.srtt;
-            }
-            if (f_info->srtt_max < rec.srtt) {
-                f_info->srtt_max = rec.srtt;
-            }
+static void
+plot_out_record(void *arg, uint32_t flowid, const record_t *rec)
+{
+    struct plot_out *out = arg;
+    (void)flowid;
 
-            f_info->cwnd_sum += rec.cwnd;
-            if (f_info->cwnd_min > rec.cwnd) {
-                f_info->cwnd_min = rec.cwnd;
-            }
-            if (f_info->cwnd_max < rec.cwnd) {
-                f_info->cwnd_max = rec.cwnd;
-            }
+    if (out->timing != NULL) {
+        flow_timing_update(out->timing, rec);
+    }
 
-            if (rec.data_sz > 0) {
-                f_info->total_data_sz += rec.data_sz;
-                f_info->data_pkt_cnt++;
-                if (f_info->min_payload_sz > rec.data_sz) {
-                    f_info->min_payload_sz = rec.data_sz;
-                }
-                if (f_info->max_payload_sz < rec.data_sz) {
-                    f_info->max_payload_sz = rec.data_sz;
-                }
-            }
-            if ((rec.data_sz % f_info->mss) > 0) {
-                f_info->fragment_cnt++;
-            }
+    if (out->svg != NULL) {
+        svg_plot_add(out->svg, rec);
+    } else if (out->is_fixed_width) {
+        fixed_row_add(&out->rows, rec);
+    } else {
+        fprintf(out->plot_file,
+                "%c" TAB "%.3f" TAB "%8u" TAB "%10u" TAB "%6u" TAB "%5u\n",
+                rec->direction, rec->rel_time / 1000.0f, rec->cwnd,
+                rec->ssthresh, rec->srtt, rec->data_sz);
+    }
+}
 
-            if (rec.direction == 'o') {
-                f_info->dir_out++;
-            } else {
-                f_info->dir_in++;
-            }
+static int
+plot_out_close(struct plot_out *out)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (out->timing != NULL) {
+        flow_timing_finish(out->timing);
+    }
+    if (out->svg == NULL && out->is_fixed_width) {
+        if (fixed_row_close(&out->rows) != EXIT_SUCCESS) {
+            printf("failed to write plot file\n");
+            ret = EXIT_FAILURE;
+        }
+    }
+    if (out->plot_file != NULL) {
+        if (fclose(out->plot_file) == EOF) {
+            PERROR_FUNCTION("fclose plot file");
+            ret = EXIT_FAILURE;
+        }
+        free(out->io_buffer); // only if you allocated it
+    }
+    return ret;
+}
+
+int stats_into_plot_file(struct file_basic_stats *f_basics, uint32_t flowid,
+                         char plot_file_name[])
+{
+    int idx;
+    int ret = EXIT_FAILURE;
+    if (!is_flowid_in_file(f_basics, flowid, &idx)) {
+        printf("%s:%u: flow id %u not found\n", __FUNCTION__, __LINE__, flowid);
+        return EXIT_FAILURE;
+    }
+
+    struct flow_info *f_info = &f_basics->flow_list[idx];
+    struct plot_out out = {
+        .timing = f_basics->timing,
+        .is_fixed_width = f_basics->is_fixed_width,
+    };
+
+    analysis_init(f_basics->analysis, f_basics, f_info);
+    if (f_basics->timing != NULL) {
+        flow_timing_init(f_basics->timing);
+    }
 
-            fprintf(plot_file,
-                    "%c" TAB "%.3f" TAB "%8u" TAB "%10u" TAB "%6u" TAB "%5u\n",
-                    rec.direction, rec.rel_time / 1000.0f, rec.cwnd,
-                    rec.ssthresh, rec.srtt, rec.data_sz);
+    if (f_basics->svg_path != NULL) {
+        struct timeval duration;
+        timeval_subtract(&duration, &f_basics->last_line_stats->disable_time,
+                         &f_basics->first_line_stats->enable_time);
+        out.svg = malloc(sizeof(*out.svg));
+        if (out.svg == NULL) {
+            PERROR_FUNCTION("malloc failed for svg plot");
+            return EXIT_FAILURE;
+        }
+        svg_plot_init(out.svg, (uint32_t)(duration.tv_sec * 1000 +
+                                          duration.tv_usec / 1000));
+    }
+
+    if (plot_out_open(&out, plot_file_name) == EXIT_SUCCESS) {
+        /* fixed size records: scan on parallel workers, text: the stages of
+         * pipeline.h; either way the analyzers run per batch, and
+         * read_body_by_flowid() finalizes them */
+        if (is_rec_fmt_binary) {
+            ret = pscan_body_by_flowid(f_basics, f_info, f_basics->analysis,
+                                       plot_out_record, &out);
+            if (ret != EXIT_SUCCESS) {
+                printf("pscan_body_by_flowid() failed\n");
+            }
         } else {
-            if (queue_is_done(ctx->queue) && queue_is_empty(ctx->queue)) {
-                break; // nothing left to consume
+            ret = pipe_body_by_flowid(f_basics, flowid, f_basics->analysis,
+                                      plot_out_record, &out);
+            if (ret != EXIT_SUCCESS) {
+                printf("pipe_body_by_flowid() failed\n");
             }
-            yield_cnt++;
-            sched_yield(); // brief backoff when empty
+        }
+        if (plot_out_close(&out) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
         }
     }
-    fflush(plot_file);
-    fclose(plot_file);
-    free(io_buffer); // only if you allocated it
 
-    if (verbose) {
-        printf("[%s] yield_cnt =  %" PRIu64 "\n", __FUNCTION__, yield_cnt);
+    if (out.svg != NULL) {
+        char title[2 * INET6_ADDRSTRLEN + 64];
+        snprintf(title, sizeof(title), "%s:%hu-&gt;%s:%hu flowid: %08x",
+                 f_info->laddr, f_info->lport, f_info->faddr, f_info->fport,
+                 flowid);
+        if (svg_plot_write(out.svg, plot_file_name, title) != EXIT_SUCCESS) {
+            printf("failed to write svg file: %s\n", plot_file_name);
+            ret = EXIT_FAILURE;
+        }
+        free(out.svg);
     }
+    return ret;
+}
 
-    return EXIT_SUCCESS;
+/* how each selected flow is reviewed */
+struct review_opts {
+    double      sample_pct;         /* > 0: estimate from sampled chunks */
+    uint64_t    seed;
+    const char  *cache_path;        /* answer from the aggregate cache */
+    struct agg_cache cache;
+    bool        is_cache_open;
+    struct file_basic_stats *peer;  /* merge with the log of the other end */
+};
+
+/* Review one flow: a full scan into the plot file, a sampled estimate, a
+ * summary answered from the aggregate cache, or a merge with the peer log.
+ */
+static int
+review_flow(struct file_basic_stats *f_basics, uint32_t flowid,
+            struct review_opts *opts)
+{
+    if (opts->peer != NULL) {
+        return merge_body_by_flowid(f_basics, opts->peer, flowid);
+    } else if (opts->cache_path != NULL) {
+        if (!opts->is_cache_open) {
+            if (agg_cache_open(&opts->cache, opts->cache_path, f_basics) !=
+                EXIT_SUCCESS) {
+                PERROR_FUNCTION("agg_cache_open() failed");
+                return EXIT_FAILURE;
+            }
+            opts->is_cache_open = true;
+        }
+        return cache_body_by_flowid(f_basics, flowid, &opts->cache);
+    } else if (opts->sample_pct > 0) {
+        return sample_body_by_flowid(f_basics, flowid, opts->sample_pct, opts->seed);
+    } else {
+        return read_body_by_flowid(f_basics, flowid);
+    }
 }
 
-void stats_into_plot_file(struct file_basic_stats *f_basics, uint32_t flowid,
-                          char plot_file_name[])
+/* Pick the flows for the summaries: flowid `*only_flowid` if given, else
+ * all the flows or those matching the flow filter. Returns how many.
+ */
+static uint32_t
+select_flows(const struct file_basic_stats *f_basics,
+             const struct flow_filter *flow_filter, const uint32_t *only_flowid,
+             bool *is_selected)
 {
+    uint32_t selected = 0;
     int idx;
-    if (!is_flowid_in_file(f_basics, flowid, &idx)) {
-        printf("%s:%u: flow id %u not found\n", __FUNCTION__, __LINE__, flowid);
-        return;
+
+    if (only_flowid != NULL) {
+        if (is_flowid_in_file(f_basics, *only_flowid, &idx) &&
+            (!flow_filter->is_set ||
+             flow_filter_match(flow_filter, &f_basics->flow_list[idx]))) {
+            is_selected[idx] = true;
+            selected = 1;
+        } else {
+            printf("flow id %08x not found or filtered out\n", *only_flowid);
+        }
+    } else {
+        for (uint32_t i = 0; i < f_basics->flow_count; i++) {
+            is_selected[i] = !flow_filter->is_set ||
+                             flow_filter_match(flow_filter, &f_basics->flow_list[i]);
+            selected += is_selected[i];
+        }
+        if (selected == 0) {
+            printf("no flow matches the flow filter\n");
+        }
     }
+    return selected;
+}
 
-    queue_t queue;
-    queue_init(&queue);
+/* Review a log that can only be read once (stream.h). The plot file of -s is
+ * written while the body streams in; the flow list and the summaries follow
+ * the foot note. Flows picked by the flow filters only get their summaries.
+ */
+static int
+review_stream(struct file_basic_stats *f_basics, const char *file_name,
+              const uint32_t *flowid, const struct flow_filter *flow_filter,
+              bool is_summary_only, enum summary_format summary_format)
+{
+    struct stream_ctx ctx;
+    struct plot_out out = {
+        .timing = f_basics->timing,
+        .is_fixed_width = f_basics->is_fixed_width,
+    };
+    char plot_file_name[NAME_MAX];
+    const bool is_plot = (flowid != NULL && !is_summary_only);
+    int ret = EXIT_FAILURE;
 
-    struct {
-        struct file_basic_stats *f_basics;
-        uint32_t flowid;
-        queue_t *queue;
-    } reader_ctx = {f_basics, flowid, &queue};
+    if (stream_open(&ctx, f_basics, file_name) != EXIT_SUCCESS) {
+        stream_free(&ctx);
+        return EXIT_FAILURE;
+    }
+    if (is_plot) {
+        plot_file_name_of(f_basics, *flowid, plot_file_name);
+        if (f_basics->timing != NULL) {
+            flow_timing_init(f_basics->timing);
+        }
+        if (plot_out_open(&out, plot_file_name) != EXIT_SUCCESS) {
+            stream_free(&ctx);
+            return EXIT_FAILURE;
+        }
+    }
+    int body_ret = stream_body(&ctx, f_basics, is_plot ? flowid : NULL,
+                               plot_out_record, &out);
+    int plot_ret = is_plot ? plot_out_close(&out) : EXIT_SUCCESS;
+    if (body_ret != EXIT_SUCCESS) {
+        printf("%s ended before the foot note\n", file_name);
+        stream_free(&ctx);
+        return EXIT_FAILURE;
+    }
 
-    struct {
-        struct file_basic_stats *f_basics;
+    struct flow_agg *aggs = calloc(f_basics->flow_count, sizeof(*aggs));
+    bool *is_selected = calloc(f_basics->flow_count, sizeof(*is_selected));
+    if (aggs == NULL || is_selected == NULL) {
+        PERROR_FUNCTION("calloc failed for the flow aggregates");
+        goto out;
+    }
+    stream_reconcile(&ctx, f_basics, aggs);
+    if (!is_summary_only || summary_format == SUMMARY_TEXT) {
+        show_file_basic_stats(f_basics);
+    }
+
+    if (is_plot) {
         int idx;
-        char *file_name;
-        queue_t *queue;
-    } writer_ctx = {f_basics, idx, plot_file_name, &queue};
+        printf("input flow id is: %08x\n", *flowid);
+        if (!is_flowid_in_file(f_basics, *flowid, &idx)) {
+            uint32_t slot;
+            printf("but the flow id: %08x not found in file\n", *flowid);
+            /* as without streaming, no plot file of a flow without records */
+            if (!flow_table_lookup(&ctx.table, *flowid, &slot)) {
+                remove(plot_file_name);
+            }
+        } else if (flow_filter->is_set &&
+                   !flow_filter_match(flow_filter, &f_basics->flow_list[idx])) {
+            printf("flow id %08x does not match the flow filter\n", *flowid);
+        } else {
+            if (is_rec_fmt_binary) {
+                printf("input file has total records: %" PRIu64 "\n",
+                       f_basics->num_records);
+            } else {
+                printf("input file has total lines: %" PRIu64 "\n",
+                       f_basics->num_lines);
+            }
+            printf("plot_file_name: %s\n", plot_file_name);
+            print_flow_summary(f_basics, &f_basics->flow_list[idx]);
+            if (f_basics->timing != NULL) {
+                print_flow_timing(f_basics->timing);
+            }
+        }
+    } else if (is_summary_only || flow_filter->is_set) {
+        if (select_flows(f_basics, flow_filter, flowid, is_selected) > 0) {
+            summary_print(f_basics, is_selected, aggs,
+                          is_summary_only ? summary_format : SUMMARY_TEXT);
+        }
+    }
+    ret = plot_ret;
 
-    thrd_t t_reader, t_writer;
-    thrd_create(&t_reader, reader_thread, &reader_ctx);
-    thrd_create(&t_writer, writer_thread, &writer_ctx);
+out:
+    free(is_selected);
+    free(aggs);
+    stream_free(&ctx);
+    return ret;
+}
 
-    thrd_join(t_reader, NULL);
-    thrd_join(t_writer, NULL);
+static void
+print_usage(const char *prog)
+{
+    printf("Usage: %s [-v | -h] [-f file_name] [-p prefix] [-s flow_id] "
+           "[flow filters]\n"
+           "       [--where predicates] [--sample pct [--seed n]] [--cache path]\n"
+           "       [--svg path] [--timing] [--peer file] [--fairness secs]\n"
+           "       [--summary-only[=json|tsv]] [--export path] [--import path]\n"
+           "       [--analyze names] [--recover[=path]] [--verify] [--serve path]\n"
+           "       [--io uring|direct|pread] [--fixed-width] [--perf-counters]\n"
+           "       [--simd name] [--pipeline layout]\n", prog);
 }
 
 int main(int argc, char *argv[]) {
@@ -244,15 +376,71 @@ int main(int argc, char *argv[]) {
     gettimeofday(&start, NULL);
 
     struct file_basic_stats f_basics = {};
+    struct flow_filter flow_filter;
+    struct rec_filter rec_filter;
+    uint32_t stats_flowid = 0;
+    struct review_opts review_opts = {};
+    struct flow_timing flow_timing;
+    struct file_basic_stats peer_basics = {};
+    const char *peer_file_name = NULL;
+    uint32_t fairness_bin_ms = 0;
+    bool is_summary_only = false;
+    enum summary_format summary_format = SUMMARY_TEXT;
+    const char *export_path = NULL;
+    const char *import_path = NULL;
+    const char *stream_file_name = NULL;
+    const char *file_name = NULL;
+    const char *serve_path = NULL;
+    const char *analyze_names = NULL;
+    struct analysis analysis;
+    bool is_verify = false;
+    int ret = EXIT_SUCCESS;
+
+    flow_filter_init(&flow_filter);
+    rec_filter_init(&rec_filter);
+    simd_init(NULL);
+
+    enum {
+        OPT_PORT = 256, OPT_LADDR, OPT_FADDR, OPT_CC, OPT_STACK, OPT_WHERE,
+        OPT_SAMPLE, OPT_SEED, OPT_CACHE, OPT_SVG, OPT_TIMING, OPT_PEER,
+        OPT_FAIRNESS, OPT_SUMMARY_ONLY, OPT_EXPORT, OPT_IMPORT, OPT_IO,
+        OPT_FIXED_WIDTH, OPT_PERF_COUNTERS, OPT_SIMD, OPT_PIPELINE, OPT_SERVE,
+        OPT_ANALYZE, OPT_RECOVER, OPT_VERIFY,
+    };
 
     int opt;
     int opt_idx = 0;
-    bool opt_match = false, f_opt_match = false;
+    bool opt_match = false, f_opt_match = false, s_opt_match = false;
     struct option long_opts[] = {
         {"help", no_argument, 0, 'h'},
         {"file", required_argument, 0, 'f'},
         {"stats", required_argument, 0, 's'},
         {"verbose", no_argument, 0, 'v'},
+        {"port", required_argument, 0, OPT_PORT},
+        {"laddr", required_argument, 0, OPT_LADDR},
+        {"faddr", required_argument, 0, OPT_FADDR},
+        {"cc", required_argument, 0, OPT_CC},
+        {"stack", required_argument, 0, OPT_STACK},
+        {"where", required_argument, 0, OPT_WHERE},
+        {"sample", required_argument, 0, OPT_SAMPLE},
+        {"seed", required_argument, 0, OPT_SEED},
+        {"cache", required_argument, 0, OPT_CACHE},
+        {"svg", required_argument, 0, OPT_SVG},
+        {"timing", no_argument, 0, OPT_TIMING},
+        {"peer", required_argument, 0, OPT_PEER},
+        {"fairness", required_argument, 0, OPT_FAIRNESS},
+        {"summary-only", optional_argument, 0, OPT_SUMMARY_ONLY},
+        {"export", required_argument, 0, OPT_EXPORT},
+        {"import", required_argument, 0, OPT_IMPORT},
+        {"io", required_argument, 0, OPT_IO},
+        {"fixed-width", no_argument, 0, OPT_FIXED_WIDTH},
+        {"perf-counters", no_argument, 0, OPT_PERF_COUNTERS},
+        {"simd", required_argument, 0, OPT_SIMD},
+        {"pipeline", required_argument, 0, OPT_PIPELINE},
+        {"serve", required_argument, 0, OPT_SERVE},
+        {"analyze", required_argument, 0, OPT_ANALYZE},
+        {"recover", optional_argument, 0, OPT_RECOVER},
+        {"verify", no_argument, 0, OPT_VERIFY},
         {0, 0, 0, 0}
     };
 
@@ -267,18 +455,81 @@ int main(int argc, char *argv[]) {
                 opt_match = true;
                 printf("Usage: %s [options]\n", argv[0]);
                 printf(" -h, --help          Display this help message\n");
-                printf(" -f, --file          Get siftr log basics\n");
+                printf(" -f, --file          Get siftr log basics; \"-\", a pipe or a\n"
+                       "                     process substitution is read as a stream,\n"
+                       "                     a gzip or zstd file is decompressed\n");
                 printf(" -s, --stats flowid  Get stats from flowid\n");
                 printf(" -v, --verbose       Verbose mode\n");
+                printf("     --port port     Select flows by local or foreign port\n");
+                printf("     --laddr addr    Select flows by local IP address\n");
+                printf("     --faddr addr    Select flows by foreign IP address\n");
+                printf("     --cc name       Select flows by TCP congestion control\n");
+                printf("     --stack name    Select flows by TCP stack\n");
+                printf("     --where preds   Keep records matching all predicates,\n"
+                       "                     e.g. \"srtt>20000,data_sz>0,dir=o\" on\n"
+                       "                     time (seconds), cwnd, ssthresh, srtt,\n"
+                       "                     data_sz with < <= > >= =, and dir=i|o\n");
+                printf("     --sample pct    Estimate the stats from pct%% of the body\n");
+                printf("     --seed n        Seed for picking the sampled chunks\n");
+                printf("     --cache path    Answer the summary from per-chunk aggregates\n"
+                       "                     cached in path, built on first use\n");
+                printf("     --svg path      Render cwnd, ssthresh and srtt into an svg\n"
+                       "                     file instead of writing the plot file\n");
+                printf("     --timing        Add inter-send/inter-ACK gap and burst\n"
+                       "                     histograms and the ACK clocking ratio\n");
+                printf("     --peer file     Merge each flow with the reversed flow in\n"
+                       "                     the log of the other end, in time order\n");
+                printf("     --fairness secs Per bin goodput, shares and Jain's index\n"
+                       "                     of all (or the filtered) flows in one pass\n");
+                printf("     --summary-only[=json|tsv]\n"
+                       "                     Only the summary of the flow (-s) or of all\n"
+                       "                     (or the filtered) flows, no plot file; json\n"
+                       "                     and tsv print one row per flow\n");
+                printf("     --export path   Write the log into a compact archive\n");
+                printf("     --import path   Restore the log archived in path (without\n"
+                       "                     the .s2a suffix), byte for byte\n");
+                printf("     --io uring|direct|pread\n"
+                       "                     How the reader reads ahead: io_uring\n"
+                       "                     (default), io_uring with O_DIRECT, or\n"
+                       "                     pread threads\n");
+                printf("     --fixed-width   Write plot rows of one width, formatted\n"
+                       "                     and written on parallel threads\n");
+                printf("     --perf-counters Count cycles, instructions, cache and\n"
+                       "                     branch misses and page faults per record\n"
+                       "                     in each reader and writer stage\n");
+                printf("     --simd name     Use the avx512bw, avx2, neon or\n"
+                       "                     scalar scan kernels instead of the best\n"
+                       "                     ones the CPU supports\n");
+                printf("     --pipeline layout\n"
+                       "                     Threads of the text body stages, e.g.\n"
+                       "                     read+frame,decode+filter,agg+format\n"
+                       "                     (default): ',' starts the next thread\n");
+                printf("     --analyze names Also run the percentiles, bins (per second\n"
+                       "                     goodput, cwnd, srtt), recovery (ssthresh\n"
+                       "                     cuts) or limits (cwnd-, rwnd-, app-limited\n"
+                       "                     or idle) analyzers over the reviewed flows\n"
+                       "                     in the same scan, e.g. percentiles,limits\n");
+                printf("     --serve path    Index the log, and the logs named after\n"
+                       "                     the options, once and answer flows,\n"
+                       "                     summary, window and series requests on\n"
+                       "                     the Unix socket path\n");
+                printf("     --recover[=path]\n"
+                       "                     Rebuild a missing or cut foot note of\n"
+                       "                     the -f log from its body, and write the\n"
+                       "                     log with it to path\n");
+                printf("     --verify        Check every body line or pkt_node, the\n"
+                       "                     tval order and the flow list counts on\n"
+                       "                     parallel workers, and report violations\n"
+                       "                     with their byte offsets\n");
                 break;
             case 'f':
                 f_opt_match = opt_match = true;
-                printf("input file name: %s\n", optarg);
-                if (get_file_basics(&f_basics, optarg) != EXIT_SUCCESS) {
-                    PERROR_FUNCTION("get_file_basics() failed");
-                    return EXIT_FAILURE;
+                file_name = optarg;
+                /* opened once all the options are in, e.g. --recover */
+                if (stream_is_needed(optarg)) {
+                    /* and read once (stream.h) */
+                    stream_file_name = optarg;
                 }
-                show_file_basic_stats(&f_basics);
                 break;
             case 'p':
                 opt_match = true;
@@ -288,36 +539,366 @@ int main(int argc, char *argv[]) {
                 snprintf(f_basics.prefix, sizeof(f_basics.prefix), "%s", optarg);
                 break;
             case 's':
+                s_opt_match = opt_match = true;
+                stats_flowid = (uint32_t)my_atol(optarg, BASE16);
+                break;
+            case OPT_PORT:
                 opt_match = true;
-
-                if (!f_opt_match) {
-                    printf("no data file is given\n");
+                if (flow_filter_set_port(&flow_filter, optarg) != EXIT_SUCCESS) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_LADDR:
+                flow_filter.is_set = opt_match = true;
+                snprintf(flow_filter.laddr, sizeof(flow_filter.laddr), "%s", optarg);
+                break;
+            case OPT_FADDR:
+                flow_filter.is_set = opt_match = true;
+                snprintf(flow_filter.faddr, sizeof(flow_filter.faddr), "%s", optarg);
+                break;
+            case OPT_CC:
+                flow_filter.is_set = opt_match = true;
+                snprintf(flow_filter.tcp_cc_name, sizeof(flow_filter.tcp_cc_name),
+                         "%s", optarg);
+                break;
+            case OPT_STACK:
+                flow_filter.is_set = opt_match = true;
+                snprintf(flow_filter.tcp_stack_name,
+                         sizeof(flow_filter.tcp_stack_name), "%s", optarg);
+                break;
+            case OPT_WHERE:
+                opt_match = true;
+                if (rec_filter_compile(&rec_filter, optarg) != EXIT_SUCCESS) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_SAMPLE:
+                opt_match = true;
+                review_opts.sample_pct = strtod(optarg, NULL);
+                if (!(review_opts.sample_pct > 0 && review_opts.sample_pct <= 100)) {
+                    printf("sample percentage must be in (0, 100]: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_SEED:
+                opt_match = true;
+                review_opts.seed = strtoull(optarg, NULL, BASE10);
+                break;
+            case OPT_CACHE:
+                opt_match = true;
+                review_opts.cache_path = optarg;
+                break;
+            case OPT_SVG:
+                opt_match = true;
+                f_basics.svg_path = optarg;
+                break;
+            case OPT_TIMING:
+                opt_match = true;
+                f_basics.timing = &flow_timing;
+                break;
+            case OPT_PEER:
+                opt_match = true;
+                peer_file_name = optarg;
+                break;
+            case OPT_SUMMARY_ONLY:
+                opt_match = is_summary_only = true;
+                if (optarg == NULL || strcmp(optarg, "text") == 0) {
+                    summary_format = SUMMARY_TEXT;
+                } else if (strcmp(optarg, "json") == 0) {
+                    summary_format = SUMMARY_JSON;
+                } else if (strcmp(optarg, "tsv") == 0) {
+                    summary_format = SUMMARY_TSV;
+                } else {
+                    printf("summary format must be json or tsv: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_EXPORT:
+                opt_match = true;
+                export_path = optarg;
+                break;
+            case OPT_IMPORT:
+                opt_match = true;
+                import_path = optarg;
+                break;
+            case OPT_ANALYZE:
+                opt_match = true;
+                analyze_names = optarg;
+                break;
+            case OPT_RECOVER:
+                opt_match = true;
+                is_recover_mode = true;
+                repair_path = optarg;
+                break;
+            case OPT_VERIFY:
+                opt_match = is_verify = true;
+                break;
+            case OPT_SERVE:
+                opt_match = true;
+                serve_path = optarg;
+                break;
+            case OPT_PIPELINE:
+                opt_match = true;
+                if (pipe_layout_parse(&pipe_layout, optarg) != EXIT_SUCCESS) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_SIMD:
+                opt_match = true;
+                if (simd_init(optarg) != EXIT_SUCCESS) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_PERF_COUNTERS:
+                opt_match = true;
+                is_perf_counters = true;
+                break;
+            case OPT_FIXED_WIDTH:
+                opt_match = true;
+                f_basics.is_fixed_width = true;
+                break;
+            case OPT_IO:
+                opt_match = true;
+                if (strcmp(optarg, "uring") == 0) {
+                    readahead_mode = READAHEAD_URING;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    readahead_mode = READAHEAD_DIRECT;
+                } else if (strcmp(optarg, "pread") == 0) {
+                    readahead_mode = READAHEAD_PREAD;
+                } else {
+                    printf("io must be uring, direct or pread: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_FAIRNESS:
+                opt_match = true;
+                fairness_bin_ms = (uint32_t)llround(strtod(optarg, NULL) * 1000.0);
+                if (fairness_bin_ms == 0) {
+                    printf("fairness bin must be at least 0.001 seconds: %s\n",
+                           optarg);
                     return EXIT_FAILURE;
                 }
-                read_body_by_flowid(&f_basics, my_atol(optarg, BASE16));
                 break;
             default:
-                printf("Usage: %s [-v | -h] [-f file_name] "
-                       "[-p prefix] [-s flow_id]\n", argv[0]);
+                print_usage(argv[0]);
                 return EXIT_FAILURE;
         }
     }
+    /* json and tsv rows load as they are, with no banner nor timing line */
+    const bool is_rows_only = is_summary_only && summary_format != SUMMARY_TEXT;
+    if (file_name != NULL && !is_rows_only) {
+        printf("input file name: %s\n", file_name);
+    }
+    if (verbose) {
+        printf("simd kernels: %s\n", simd->name);
+    }
 
     /* Handle case where no options are provided or non-option arguments */
     if (!opt_match) {
         printf("Un-expected argument!\n");
-        printf("Usage: %s [-v | -h] [-f file_name] [-p prefix] [-s flow_id]\n",
-               argv[0]);
+        print_usage(argv[0]);
         return EXIT_FAILURE;
     }
 
+    if (import_path != NULL) {
+        if (archive_import(import_path) != EXIT_SUCCESS) {
+            printf("archive_import() failed\n");
+            return EXIT_FAILURE;
+        }
+        if (!f_opt_match) {
+            return EXIT_SUCCESS;
+        }
+    }
+
     if (opt_match && !f_opt_match) {
+        if (s_opt_match || flow_filter.is_set || serve_path != NULL || is_verify ||
+            analyze_names != NULL || is_recover_mode) {
+            printf("no data file is given\n");
+            return EXIT_FAILURE;
+        }
         return EXIT_SUCCESS;
     }
 
+    /* one mode per run, the chain below runs only the first */
+    int mode_cnt = is_verify + (serve_path != NULL) + (export_path != NULL) +
+                   (fairness_bin_ms > 0) + is_summary_only;
+    if (mode_cnt > 1) {
+        printf("only one of --verify, --serve, --export, --fairness and "
+               "--summary-only per run\n");
+        return EXIT_FAILURE;
+    }
+    if ((is_verify || serve_path != NULL || export_path != NULL) &&
+        (s_opt_match || flow_filter.is_set)) {
+        printf("--verify, --serve and --export take the whole log, not -s or "
+               "the flow filters\n");
+        return EXIT_FAILURE;
+    }
+    if (fairness_bin_ms > 0 && s_opt_match) {
+        printf("--fairness takes the flow filters, not -s\n");
+        return EXIT_FAILURE;
+    }
+
+    /* no plot file to shape, nor records to time */
+    if ((review_opts.sample_pct > 0 || review_opts.cache_path != NULL) &&
+        (f_basics.svg_path != NULL || f_basics.timing != NULL || f_basics.is_fixed_width)) {
+        printf("--sample and --cache write no plot file, so no --svg, --timing "
+               "or --fixed-width\n");
+        return EXIT_FAILURE;
+    }
+
+    /* the analyzers share the scan of the full review of a flow only */
+    if (analyze_names != NULL &&
+        (stream_file_name != NULL || is_summary_only || review_opts.sample_pct > 0 ||
+         review_opts.cache_path != NULL || peer_file_name != NULL ||
+         fairness_bin_ms > 0 || is_verify || serve_path != NULL || export_path != NULL)) {
+        printf("--analyze needs the full review of a flow of a seekable file, not "
+               "--summary-only, --sample, --cache, --peer, --fairness, --verify, "
+               "--serve or --export\n");
+        return EXIT_FAILURE;
+    }
+
+    if (stream_file_name == NULL) {
+        /* until an action reads the body of a compressed log */
+        f_basics.is_body_deferred = true;
+        if (get_file_basics(&f_basics, file_name) != EXIT_SUCCESS) {
+            printf("get_file_basics() failed\n");
+            return EXIT_FAILURE;
+        }
+        if (!is_rows_only) {
+            show_file_basic_stats(&f_basics);
+        }
+    }
+
+    if (rec_filter.num_preds > 0) {
+        f_basics.rec_filter = &rec_filter;
+    }
+    /* the summary and the --analyze analyzers of each reviewed flow */
+    if (analysis_open(&analysis, analyze_names) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    f_basics.analysis = &analysis;
+    /* flows picked by the flow filters get one svg each */
+    f_basics.is_svg_per_flow = !s_opt_match;
+
+    if (stream_file_name != NULL) {
+        if (peer_file_name != NULL || review_opts.sample_pct > 0 ||
+            review_opts.cache_path != NULL || fairness_bin_ms > 0 ||
+            export_path != NULL || f_basics.svg_path != NULL ||
+            serve_path != NULL || repair_path != NULL || is_verify) {
+            printf("--peer, --sample, --cache, --fairness, --export, --svg, "
+                   "--serve, --recover=path and --verify need a seekable file, "
+                   "not %s\n", stream_file_name);
+            return EXIT_FAILURE;
+        }
+    } else if (peer_file_name != NULL) {
+        bool is_local_binary = is_rec_fmt_binary;
+        printf("peer file name: %s\n", peer_file_name);
+        if (get_file_basics(&peer_basics, peer_file_name) != EXIT_SUCCESS) {
+            printf("get_file_basics() failed for the peer log\n");
+            return EXIT_FAILURE;
+        }
+        if (verbose) {
+            show_file_basic_stats(&peer_basics);
+        }
+        /* the body readers follow the global record format */
+        if (is_rec_fmt_binary != is_local_binary) {
+            printf("the peer log must have the same rec_fmt as the input log\n");
+            cleanup_file_basic_stats(&peer_basics);
+            return EXIT_FAILURE;
+        }
+        review_opts.peer = &peer_basics;
+    }
+
+    if (stream_file_name == NULL &&
+        (is_verify || serve_path != NULL || export_path != NULL ||
+         fairness_bin_ms > 0 || is_summary_only || s_opt_match || flow_filter.is_set) &&
+        compress_load_body(&f_basics) != EXIT_SUCCESS) {
+        printf("compress_load_body() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (stream_file_name != NULL) {
+        if (review_stream(&f_basics, stream_file_name, s_opt_match ? &stats_flowid : NULL,
+                          &flow_filter, is_summary_only, summary_format) !=
+            EXIT_SUCCESS) {
+            printf("review_stream() failed\n");
+            ret = EXIT_FAILURE;
+        }
+    } else if (is_verify) {
+        ret = verify_log(&f_basics);
+    } else if (serve_path != NULL) {
+        if (serve_run(&f_basics, file_name, argv + optind, argc - optind,
+                      serve_path) != EXIT_SUCCESS) {
+            printf("serve_run() failed\n");
+            ret = EXIT_FAILURE;
+        }
+    } else if (export_path != NULL) {
+        if (archive_export(&f_basics, export_path) != EXIT_SUCCESS) {
+            printf("archive_export() failed\n");
+            ret = EXIT_FAILURE;
+        }
+    } else if (fairness_bin_ms > 0) {
+        if (fairness_report(&f_basics, &flow_filter, fairness_bin_ms) != EXIT_SUCCESS) {
+            printf("fairness_report() failed\n");
+            ret = EXIT_FAILURE;
+        }
+    } else if (is_summary_only) {
+        bool *is_selected = calloc(f_basics.flow_count, sizeof(*is_selected));
+        uint32_t selected = 0;
+
+        if (is_selected == NULL) {
+            PERROR_FUNCTION("calloc failed for flow selection");
+            ret = EXIT_FAILURE;
+        } else {
+            selected = select_flows(&f_basics, &flow_filter,
+                                    s_opt_match ? &stats_flowid : NULL, is_selected);
+        }
+        if (selected > 0 &&
+            summary_report(&f_basics, is_selected, s_opt_match ? &stats_flowid : NULL,
+                           summary_format) != EXIT_SUCCESS) {
+            printf("summary_report() failed\n");
+            ret = EXIT_FAILURE;
+        }
+        free(is_selected);
+    } else if (s_opt_match) {
+        int idx;
+        if (flow_filter.is_set &&
+            is_flowid_in_file(&f_basics, stats_flowid, &idx) &&
+            !flow_filter_match(&flow_filter, &f_basics.flow_list[idx])) {
+            printf("flow id %08x does not match the flow filter\n", stats_flowid);
+        } else if (review_flow(&f_basics, stats_flowid, &review_opts) !=
+                   EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    } else if (flow_filter.is_set) {
+        uint32_t selected = 0;
+        for (uint32_t i = 0; i < f_basics.flow_count; i++) {
+            if (flow_filter_match(&flow_filter, &f_basics.flow_list[i])) {
+                selected++;
+                if (review_flow(&f_basics, f_basics.flow_list[i].flowid,
+                                &review_opts) != EXIT_SUCCESS) {
+                    ret = EXIT_FAILURE;
+                }
+            }
+        }
+        if (selected == 0) {
+            printf("no flow matches the flow filter\n");
+        }
+    }
+
+    if (review_opts.is_cache_open) {
+        agg_cache_free(&review_opts.cache);
+    }
+    if (review_opts.peer != NULL &&
+        cleanup_file_basic_stats(review_opts.peer) != EXIT_SUCCESS) {
+        PERROR_FUNCTION("terminate_file_basics() failed for the peer log");
+    }
+
     if (cleanup_file_basic_stats(&f_basics) != EXIT_SUCCESS) {
         PERROR_FUNCTION("terminate_file_basics() failed");
+        ret = EXIT_FAILURE;
     }
+    analysis_free(&analysis);
 
     // Record the end time
     gettimeofday(&end, NULL);
@@ -325,7 +906,9 @@ int main(int argc, char *argv[]) {
     double seconds = (end.tv_sec - start.tv_sec);
     double micros = ((seconds * 1000000) + end.tv_usec) - (start.tv_usec);
 
-    printf("\nthis program execution time: %.3f seconds\n", micros / 1000000.0);
+    if (!is_rows_only) {
+        printf("\nthis program execution time: %.3f seconds\n", micros / 1000000.0);
+    }
 
-    return EXIT_SUCCESS;
+    return ret;
 }
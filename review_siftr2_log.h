@@ -25,12 +25,7 @@
 #include <unistd.h>
 
 #include "lib.h"
-
-enum line_type {
-    HEAD,
-    BODY,
-    FOOT,
-};
+#include "record.h"
 
 // header fields
 /* first_line_fields.def */
@@ -87,68 +82,8 @@ struct last_line_fields {
 
 _Static_assert(TOTAL_LAST_LINE_FIELDS == 7, "First line format changed");
 
-/* flow list fields in the foot note of the siftr2 log */
-enum {
-    FL_FLOW_ID,     FL_IPVER,       FL_LOIP,        FL_LPORT,
-    FL_FOIP,        FL_FPORT,       FL_TCP_STACK_NAME,  FL_TCP_CC_NAME,
-    FL_MSS,         FL_ISSACK,      FL_SNDSCALE,    FL_RCVSCALE,
-    FL_NUMRECORD,   FL_NTRANS,      TOTAL_FLOWLIST_FIELDS,
-};
-
-/* TCP traffic record fields */
-enum {
-    FLOW_ID,        DIRECTION,      RELATIVE_TIME,      CWND,   SSTHRESH,
-    SRTT,           TCP_DATA_SZ,
-    SNDWIN,         RCVWIN,         FLAG,           FLAG2,          RTO,
-    SND_BUF_HIWAT,  SND_BUF_CC,     RCV_BUF_HIWAT,  RCV_BUF_CC,
-    INFLIGHT_BYTES, REASS_QLEN,
-    TOTAL_FIELDS,
-};
-
-/* TCP traffic record structure from siftr2.c */
-struct pkt_node {
-    /* Flowid for the connection. */
-    uint32_t        flowid;
-    /* Direction pkt is travelling. */
-    enum {
-        DIR_IN = 0,
-        DIR_OUT = 1,
-    }           direction;
-    /* Timestamp (milliseconds) since SIFTR enable. */
-    uint32_t        tval;
-    /* Congestion Window (bytes). */
-    uint32_t        snd_cwnd;
-    /* Slow Start Threshold (bytes). */
-    uint32_t        snd_ssthresh;
-    /* Smoothed RTT (usecs). */
-    uint32_t        srtt;
-    /* the length of TCP segment payload in bytes */
-    uint32_t        data_sz;
-    /* Sending Window (bytes). */
-    uint32_t        snd_wnd;
-    /* Receive Window (bytes). */
-    uint32_t        rcv_wnd;
-    /* TCP control block flags. */
-    uint32_t        t_flags;
-    /* More tcpcb flags storage */
-    uint32_t        t_flags2;
-    /* Retransmission timeout (usec). */
-    uint32_t        rto;
-    /* Size of the TCP send buffer in bytes. */
-    uint32_t        snd_buf_hiwater;
-    /* Current num bytes in the send socket buffer. */
-    uint32_t        snd_buf_cc;
-    /* Size of the TCP receive buffer in bytes. */
-    uint32_t        rcv_buf_hiwater;
-    /* Current num bytes in the receive socket buffer. */
-    uint32_t        rcv_buf_cc;
-    /* Number of bytes inflight that we are waiting on ACKs for. */
-    uint32_t        pipe;
-    /* Number of segments currently in the reassembly queue. */
-    int32_t         t_segqlen;
-} __packed;
-
-_Static_assert(sizeof(struct pkt_node) == 72, "pkt_node must be 72 bytes");
+/* the foot note starts with this key, a body line or pkt_node never does */
+#define FOOT_NOTE_KEY       "disable_time_secs="
 
 struct flow_info {
     /* permanent info */
@@ -188,6 +123,19 @@ struct flow_info {
     bool        is_info_set;
 };
 
+/* Open-addressing (linear probing) index from flowid to the flow_list slot,
+ * so per-record lookups stay O(1) with 100k+ flows in the foot note.
+ */
+struct flow_table {
+    uint32_t    *keys;
+    uint32_t    *slots;     /* flow_list index + 1, 0 marks an empty bucket */
+    uint32_t    mask;
+};
+
+struct rec_filter;
+struct flow_timing;
+struct analysis;
+
 struct file_basic_stats {
     FILE        *file;
     uint64_t    num_lines;
@@ -195,29 +143,138 @@ struct file_basic_stats {
     uint32_t    flow_count;
     char        prefix[NAME_MAX - 20];
     uint32_t    first_flow_start_time;
+    long        body_offset;            /* first byte after the head note */
     long        last_line_offset;
     struct flow_info *flow_list;
+    struct flow_table flow_table;
     struct first_line_fields *first_line_stats;
     struct last_line_fields *last_line_stats;
+    const struct rec_filter *rec_filter;    /* NULL: keep every record */
+    const char  *svg_path;      /* render an svg instead of the plot file */
+    bool        is_svg_per_flow;        /* more flows: "<svg_path>.<flowid>.svg" */
+    bool        is_fixed_width;         /* plot rows of FIXED_ROW_WIDTH bytes */
+    struct flow_timing *timing;         /* NULL: no timing analysis */
+    struct analysis *analysis;          /* the summary and --analyze */
+    struct compressed_log *compressed;  /* NULL: not a gzip or zstd log */
+    bool        is_body_deferred;       /* decompress the body on demand */
 };
 
 bool verbose = false;
 bool is_rec_fmt_binary = false;
-void stats_into_plot_file(struct file_basic_stats *f_basics, uint32_t flowid,
-                          char plot_file_name[]);
+bool is_recover_mode = false;       /* rebuild a missing foot note (recover.h) */
+const char *repair_path = NULL;     /* and write the log with it there */
+int stats_into_plot_file(struct file_basic_stats *f_basics, uint32_t flowid,
+                         char plot_file_name[]);
+void print_flow_timing(const struct flow_timing *timing);
+int recover_foot_note(struct file_basic_stats *f_basics);
+FILE *compress_fopen(struct file_basic_stats *f_basics, const char *file_name);
+void compress_close(struct compressed_log *c);
+void analysis_finalize(struct analysis *a, const struct file_basic_stats *f_basics,
+                       struct flow_info *f_info);
+
+static inline uint32_t
+flow_table_hash(uint32_t flowid)
+{
+    /* murmur3 finalizer, spreads the flowid over the low bits */
+    flowid ^= flowid >> 16;
+    flowid *= 0x85ebca6bu;
+    flowid ^= flowid >> 13;
+    flowid *= 0xc2b2ae35u;
+    flowid ^= flowid >> 16;
+    return flowid;
+}
 
-bool
-is_flowid_in_file(const struct file_basic_stats *f_basics, uint32_t flowid, int *idx)
+static inline int
+flow_table_init(struct flow_table *tbl, uint32_t flow_cnt)
 {
-    for (uint32_t i = 0; i < f_basics->flow_count; i++) {
-        if (f_basics->flow_list[i].flowid == flowid) {
-            *idx = i;
+    uint32_t capacity = 16;
+
+    /* keep the load factor at or below 0.5 */
+    while (capacity < 2 * (uint64_t)flow_cnt) {
+        capacity <<= 1;
+    }
+    tbl->keys = calloc(capacity, sizeof(*tbl->keys));
+    tbl->slots = calloc(capacity, sizeof(*tbl->slots));
+    if (tbl->keys == NULL || tbl->slots == NULL) {
+        PERROR_FUNCTION("calloc failed for flow_table");
+        free(tbl->keys);
+        free(tbl->slots);
+        tbl->keys = tbl->slots = NULL;
+        tbl->mask = 0;
+        return EXIT_FAILURE;
+    }
+    tbl->mask = capacity - 1;
+    return EXIT_SUCCESS;
+}
+
+/* Returns false if the flowid is already in the table (the first one wins). */
+static inline bool
+flow_table_insert(struct flow_table *tbl, uint32_t flowid, uint32_t idx)
+{
+    uint32_t pos = flow_table_hash(flowid) & tbl->mask;
+
+    while (tbl->slots[pos] != 0) {
+        if (tbl->keys[pos] == flowid) {
+            return false;
+        }
+        pos = (pos + 1) & tbl->mask;
+    }
+    tbl->keys[pos] = flowid;
+    tbl->slots[pos] = idx + 1;
+    return true;
+}
+
+static inline bool
+flow_table_lookup(const struct flow_table *tbl, uint32_t flowid, uint32_t *idx)
+{
+    if (tbl->slots == NULL) {
+        return false;
+    }
+
+    uint32_t pos = flow_table_hash(flowid) & tbl->mask;
+
+    while (tbl->slots[pos] != 0) {
+        if (tbl->keys[pos] == flowid) {
+            *idx = tbl->slots[pos] - 1;
             return true;
         }
+        pos = (pos + 1) & tbl->mask;
     }
     return false;
 }
 
+static inline void
+flow_table_free(struct flow_table *tbl)
+{
+    free(tbl->keys);
+    free(tbl->slots);
+    tbl->keys = tbl->slots = NULL;
+    tbl->mask = 0;
+}
+
+bool
+is_flowid_in_file(const struct file_basic_stats *f_basics, uint32_t flowid, int *idx)
+{
+    uint32_t slot;
+
+    if (flow_table_lookup(&f_basics->flow_table, flowid, &slot)) {
+        *idx = (int)slot;
+        return true;
+    }
+    return false;
+}
+
+/* Size of a body line buffer. The foot note can be megabytes long with many
+ * flows, so body lines are bounded by `max_str_size` instead, but never below
+ * PATH_MAX which also covers the head note.
+ */
+static inline size_t
+body_line_len(const struct last_line_fields *l_line_stats)
+{
+    size_t len = (size_t)l_line_stats->max_str_size + 2; /* '\n' and '\0' */
+    return (len < PATH_MAX) ? PATH_MAX : len;
+}
+
 void
 init_flow_info(struct flow_info *target_flow, char *fields[])
 {
@@ -261,65 +318,70 @@ init_flow_info(struct flow_info *target_flow, char *fields[])
     }
 }
 
-/* Function to read the last line of a file */
+/* Function to read the last line of a file into a heap buffer. The foot note
+ * grows with the flow list, so it is found by scanning backwards in blocks and
+ * then read whole. The caller frees *lastLine.
+ */
 int
-read_last_line(struct file_basic_stats *f_basics, char *lastLine)
+read_last_line(struct file_basic_stats *f_basics, char **lastLine)
 {
-    long fileSize;
-    int pos;
+    char block[FOOTER_SCAN_BLOCK];
+    long fileSize, end, start = 0;
     FILE *file = f_basics->file;
 
     if (lastLine == NULL) {
         PERROR_FUNCTION("empty buffer");
         return EXIT_FAILURE;
     }
+    *lastLine = NULL;
 
-    fseek(file, 0, SEEK_END);
-    fileSize = ftell(file);
-
-    for (pos = 1; pos < fileSize; pos++) {
-        fseek(file, -pos, SEEK_END);
-        if (fgetc(file) == '\n') {
-            // After finding '\n' by scanning back:
-            f_basics->last_line_offset = ftell(file);
-            if (fgets(lastLine, PATH_MAX, file) != NULL) {
-                return EXIT_SUCCESS;
-            }
-        }
-    }
-    /* If file has only one line, handle that case */
-    rewind(file);
-    if (fgets(lastLine, sizeof(lastLine), file) != NULL) {
-        return EXIT_SUCCESS;
-    } else {
-        PERROR_FUNCTION("fgets");
+    if (fseek(file, 0, SEEK_END) != 0 || (fileSize = ftell(file)) < 0) {
+        PERROR_FUNCTION("fseek/ftell");
         return EXIT_FAILURE;
     }
-}
 
-void
-fill_fields_from_line(char **fields, char *line, enum line_type type)
-{
-    int field_cnt = 0;
+    /* skip the newline that terminates the last line */
+    end = fileSize;
+    if (end > 0 && fseek(file, end - 1, SEEK_SET) == 0 && fgetc(file) == '\n') {
+        end--;
+    }
 
-    // Strip newline characters at the end
-    line[strcspn(line, "\r\n")] = '\0';
+    bool found = false;
+    while (end > 0 && !found) {
+        size_t blk = (end < (long)sizeof(block)) ? (size_t)end : sizeof(block);
 
-    // Tokenize the line using comma as the delimiter
-    char *token = strtok(line, COMMA_DELIMITER);
-    while (token != NULL) {
-        fields[field_cnt++] = token;
-        token = strtok(NULL, COMMA_DELIMITER);
+        if (fseek(file, end - (long)blk, SEEK_SET) != 0 ||
+            fread(block, 1, blk, file) != blk) {
+            PERROR_FUNCTION("fread");
+            return EXIT_FAILURE;
+        }
+        for (size_t i = blk; i-- > 0;) {
+            if (block[i] == '\n') {
+                start = end - (long)blk + (long)i + 1;
+                found = true;
+                break;
+            }
+        }
+        end -= (long)blk;
     }
+    /* If file has only one line, it is the last line */
+    f_basics->last_line_offset = start;
 
-    if (type == BODY && field_cnt != TOTAL_FIELDS){
-        printf("\nfield_cnt:%d != TOTAL_FIELDS:%d\n", field_cnt, TOTAL_FIELDS);
-        PERROR_FUNCTION("field_cnt != TOTAL_FIELDS");
-    } else if (type == FOOT && field_cnt != TOTAL_FLOWLIST_FIELDS) {
-        printf("\nfield_cnt:%d != TOTAL_FLOWLIST_FIELDS:%d\n",
-               field_cnt, TOTAL_FLOWLIST_FIELDS);
-        PERROR_FUNCTION("field_cnt != TOTAL_FLOWLIST_FIELDS");
+    size_t len = (size_t)(fileSize - start);
+    char *line = malloc(len + 1);
+    if (line == NULL) {
+        PERROR_FUNCTION("malloc failed for the last line");
+        return EXIT_FAILURE;
+    }
+    if (fseek(file, start, SEEK_SET) != 0 || fread(line, 1, len, file) != len) {
+        PERROR_FUNCTION("fread");
+        free(line);
+        return EXIT_FAILURE;
     }
+    line[len] = '\0';
+    *lastLine = line;
+
+    return EXIT_SUCCESS;
 }
 
 static inline bool
@@ -345,6 +407,50 @@ file_has_3lines(const struct file_basic_stats *f_basics)
     return (true);
 }
 
+/* Parse the head note in `line`, which is cut up in the process. */
+static inline struct first_line_fields *
+parse_first_line(char *line)
+{
+    /* 6 fields in the first line */
+    char *fields[TOTAL_FIRST_LINE_FIELDS];
+    uint32_t field_count = 0;
+    struct first_line_fields *f_line_stats = malloc(sizeof(*f_line_stats));
+
+    if (f_line_stats == NULL) {
+        PERROR_FUNCTION("malloc failed for f_line_stats");
+        return NULL;
+    }
+
+    /* Strip newline characters at the end */
+    line[strcspn(line, "\r\n")] = '\0';
+
+    /* Tokenize the line using comma as the delimiter */
+    char *token = strtok(line, TAB_DELIMITER);
+    while (token != NULL && field_count < TOTAL_FIRST_LINE_FIELDS) {
+        fields[field_count++] = token;
+        token = strtok(NULL, TAB_DELIMITER);
+    }
+    if (field_count < TOTAL_FIRST_LINE_FIELDS) {
+        PERROR_FUNCTION("field_count < TOTAL_FIRST_LINE_FIELDS");
+        free(f_line_stats);
+        return NULL;
+    }
+
+    f_line_stats->enable_time.tv_sec = GET_VALUE(fields[ENABLE_TIME_SECS]);
+    f_line_stats->enable_time.tv_usec = GET_VALUE(fields[ENABLE_TIME_USECS]);
+    snprintf(f_line_stats->siftrver, sizeof(f_line_stats->siftrver), "%s",
+             next_sub_str_from(fields[SIFTRVER], EQUAL_DELIMITER));
+    snprintf(f_line_stats->rec_fmt, sizeof(f_line_stats->rec_fmt), "%s",
+             next_sub_str_from(fields[REC_FMT], EQUAL_DELIMITER));
+    snprintf(f_line_stats->sysver, sizeof(f_line_stats->sysver), "%s",
+             next_sub_str_from(fields[SYSVER], EQUAL_DELIMITER));
+
+    /* set either way, the format of the log opened last counts */
+    is_rec_fmt_binary = (strncmp(f_line_stats->rec_fmt, "binary",
+                                 sizeof("binary")) == 0);
+    return f_line_stats;
+}
+
 static inline void
 get_first_2lines_stats(struct file_basic_stats *f_basics)
 {
@@ -354,34 +460,11 @@ get_first_2lines_stats(struct file_basic_stats *f_basics)
 
     /* read the first line of the file */
     if (fgets(line, sizeof(line), file) != NULL) {
-        /* 6 fields in the first line */
-        char *fields[TOTAL_FIRST_LINE_FIELDS];
-        uint32_t field_count = 0;
-        f_line_stats = (struct first_line_fields *)malloc(sizeof(*f_line_stats));
-
-        /* Strip newline characters at the end */
-        line[strcspn(line, "\r\n")] = '\0';
-
-        /* Tokenize the line using comma as the delimiter */
-        char *token = strtok(line, TAB_DELIMITER);
-        while (token != NULL) {
-            fields[field_count++] = token;
-            token = strtok(NULL, TAB_DELIMITER);
+        f_basics->body_offset = ftell(file);
+        f_line_stats = parse_first_line(line);
+        if (f_line_stats == NULL) {
+            return;
         }
-
-        f_line_stats->enable_time.tv_sec = GET_VALUE(fields[ENABLE_TIME_SECS]);
-        f_line_stats->enable_time.tv_usec = GET_VALUE(fields[ENABLE_TIME_USECS]);
-        snprintf(f_line_stats->siftrver, sizeof(f_line_stats->siftrver), "%s",
-                 next_sub_str_from(fields[SIFTRVER], EQUAL_DELIMITER));
-        snprintf(f_line_stats->rec_fmt, sizeof(f_line_stats->rec_fmt), "%s",
-                 next_sub_str_from(fields[REC_FMT], EQUAL_DELIMITER));
-        snprintf(f_line_stats->sysver, sizeof(f_line_stats->sysver), "%s",
-                 next_sub_str_from(fields[SYSVER], EQUAL_DELIMITER));
-
-        if (strncmp(f_line_stats->rec_fmt, "binary", sizeof("binary")) == 0) {
-            is_rec_fmt_binary = true;
-        }
-
     } else {
         PERROR_FUNCTION("Failed to read the first line.");
         return;
@@ -421,54 +504,75 @@ get_first_2lines_stats(struct file_basic_stats *f_basics)
     f_basics->first_line_stats = f_line_stats;
 }
 
-static inline void
-get_last_line_stats(struct file_basic_stats *f_basics)
+/* Parse the foot note in `line`, which is cut up in the process. */
+static inline struct last_line_fields *
+parse_last_line(char *line)
 {
-    struct last_line_fields *l_line_stats = NULL;
-    char line[PATH_MAX] = {};
+    char *fields[TOTAL_LAST_LINE_FIELDS];
+    uint32_t field_count = 0;
+    struct last_line_fields *l_line_stats = malloc(sizeof(*l_line_stats));
 
-    if (read_last_line(f_basics, line) == EXIT_SUCCESS) {
-        char *fields[TOTAL_LAST_LINE_FIELDS];
-        uint32_t field_count = 0;
-        l_line_stats = (struct last_line_fields *)malloc(sizeof(*l_line_stats));
-        if (l_line_stats == NULL) {
-            PERROR_FUNCTION("malloc failed for l_line_stats");
-        }
+    if (l_line_stats == NULL) {
+        PERROR_FUNCTION("malloc failed for l_line_stats");
+        return NULL;
+    }
 
-        /* includes the null terminator */
-        l_line_stats->line_len = strlen(line) + 1;
+    /* includes the null terminator */
+    l_line_stats->line_len = strlen(line) + 1;
 
-        /* Strip newline characters at the end */
-        line[strcspn(line, "\r\n")] = '\0';
+    /* Strip newline characters at the end */
+    line[strcspn(line, "\r\n")] = '\0';
 
-        // Tokenize the line using tab as the delimiter
-        char *token = strtok(line, TAB_DELIMITER);
-        while (token != NULL) {
-            fields[field_count++] = token;
-            token = strtok(NULL, TAB_DELIMITER);
-        }
+    // Tokenize the line using tab as the delimiter
+    char *token = strtok(line, TAB_DELIMITER);
+    while (token != NULL && field_count < TOTAL_LAST_LINE_FIELDS) {
+        fields[field_count++] = token;
+        token = strtok(NULL, TAB_DELIMITER);
+    }
 
-        if (field_count != TOTAL_LAST_LINE_FIELDS) {
-            PERROR_FUNCTION("field_count != TOTAL_LAST_LINE_FIELDS");
-        }
+    if (field_count != TOTAL_LAST_LINE_FIELDS) {
+        PERROR_FUNCTION("field_count != TOTAL_LAST_LINE_FIELDS");
+        free(l_line_stats);
+        return NULL;
+    }
 
-        l_line_stats->disable_time.tv_sec = GET_VALUE(fields[DISABLE_TIME_SECS]);
-        l_line_stats->disable_time.tv_usec = GET_VALUE(fields[DISABLE_TIME_USECS]);
+    l_line_stats->disable_time.tv_sec = GET_VALUE(fields[DISABLE_TIME_SECS]);
+    l_line_stats->disable_time.tv_usec = GET_VALUE(fields[DISABLE_TIME_USECS]);
 
-        l_line_stats->global_flow_cnt = GET_VALUE(fields[GLOBAL_FLOW_CNT]);
-        l_line_stats->ring_drops = GET_VALUE(fields[RING_DROPS]);
-        l_line_stats->max_str_size = GET_VALUE(fields[MAX_STR_SIZE]);
-        l_line_stats->gen_flowid_cnt = GET_VALUE(fields[GEN_FLOWID_CNT]);
+    l_line_stats->global_flow_cnt = GET_VALUE(fields[GLOBAL_FLOW_CNT]);
+    l_line_stats->ring_drops = GET_VALUE(fields[RING_DROPS]);
+    l_line_stats->max_str_size = GET_VALUE(fields[MAX_STR_SIZE]);
+    l_line_stats->gen_flowid_cnt = GET_VALUE(fields[GEN_FLOWID_CNT]);
 
-        char *sub_str = next_sub_str_from(fields[FLOW_LIST], EQUAL_DELIMITER);
+    char *sub_str = next_sub_str_from(fields[FLOW_LIST], EQUAL_DELIMITER);
 
-        l_line_stats->flow_list_str = strdup(sub_str);
-        if (l_line_stats->flow_list_str == NULL) {
-            PERROR_FUNCTION("Failed to strdup the last line.");
+    /* no flow at all when the foot note is cut right after "flow_list=" */
+    l_line_stats->flow_list_str = strdup((sub_str != NULL) ? sub_str : "");
+    if (l_line_stats->flow_list_str == NULL) {
+        PERROR_FUNCTION("Failed to strdup the last line.");
+    }
+
+    /* entries of the flow list are separated by ';', which may or may not
+     * follow the last one too; a last entry short of fields was cut
+     */
+    uint32_t entry_cnt = 0, field_cnt = 1;
+    for (const char *c = l_line_stats->flow_list_str; c != NULL && *c != '\0'; c++) {
+        if (*c == ';') {
+            entry_cnt++;
+            field_cnt = 1;
+        } else if (*c == ',') {
+            field_cnt++;
         }
-    } else {
-        PERROR_FUNCTION("Failed to read the last line.");
-        return;
+    }
+    if (field_cnt == TOTAL_FLOWLIST_FIELDS) {
+        entry_cnt++;
+    }
+    if (entry_cnt < l_line_stats->global_flow_cnt) {
+        printf("the foot note is cut short: %u of %u flows in the flow list\n",
+               entry_cnt, l_line_stats->global_flow_cnt);
+        free(l_line_stats->flow_list_str);
+        free(l_line_stats);
+        return NULL;
     }
 
     if (verbose) {
@@ -482,6 +586,30 @@ get_last_line_stats(struct file_basic_stats *f_basics)
                l_line_stats->gen_flowid_cnt,
                l_line_stats->flow_list_str);
     }
+    return l_line_stats;
+}
+
+static inline void
+get_last_line_stats(struct file_basic_stats *f_basics)
+{
+    struct last_line_fields *l_line_stats = NULL;
+    char *line = NULL;
+
+    if (read_last_line(f_basics, &line) == EXIT_SUCCESS) {
+        if (strncmp(line, FOOT_NOTE_KEY, sizeof(FOOT_NOTE_KEY) - 1) != 0) {
+            printf("the log has no foot note\n");
+            free(line);
+            return;
+        }
+        l_line_stats = parse_last_line(line);
+        free(line);
+        if (l_line_stats == NULL) {
+            return;
+        }
+    } else {
+        PERROR_FUNCTION("Failed to read the last line.");
+        return;
+    }
 
     f_basics->last_line_stats = l_line_stats;
     assert(l_line_stats->line_len >= l_line_stats->max_str_size);
@@ -492,7 +620,8 @@ print_flow_info(struct flow_info *flow_info)
 {
     printf(" id:%08x %s (%s:%hu<->%s:%hu) stack:%s tcp_cc:%s mss:%u SACK:%d"
            " snd/rcv_scal:%hhu/%hhu cnt:%" PRIu64 "/%" PRIu64 "\n",
-           flow_info->flowid, (flow_info->ipver == IPV4) ? "IPv4" : "IPv6",
+           flow_info->flowid, (flow_info->ipver == IPV4) ? "IPv4" :
+                              (flow_info->ipver == IPV6) ? "IPv6" : "IP unknown",
            flow_info->laddr, flow_info->lport,
            flow_info->faddr, flow_info->fport,
            flow_info->tcp_stack_name, flow_info->tcp_cc_name,
@@ -501,57 +630,78 @@ print_flow_info(struct flow_info *flow_info)
            flow_info->record_cnt, flow_info->trans_cnt);
 }
 
+/* Walk the flow list of the foot note one entry at a time. Only the current
+ * entry is copied out, so a list of 100k+ flows needs neither a second copy
+ * of the whole list nor an array of token pointers.
+ */
 static inline void
 get_flow_count_and_info(struct file_basic_stats *f_basics)
 {
     uint32_t flow_cnt = f_basics->last_line_stats->global_flow_cnt;
-    char **flow_list_arr;
+    const char *cur = f_basics->last_line_stats->flow_list_str;
+    char *entry = NULL;
+    size_t entry_size = 0;
+    uint32_t i = 0;
 
-    char *flow_list_str = strdup(f_basics->last_line_stats->flow_list_str);
-    if (flow_list_str == NULL) {
-        PERROR_FUNCTION("strdup() failed for flow_list_str");
-        return;
-    }
     if (flow_cnt == 0) {
         printf("%s%u: no flow in flow list of the foot note:%u\n",
                __FUNCTION__, __LINE__, flow_cnt);
         PERROR_FUNCTION("flow list not set");
         return;
     }
-    f_basics->flow_count = flow_cnt;
     f_basics->flow_list = (struct flow_info*)calloc(flow_cnt, sizeof(struct flow_info));
-    flow_list_arr = (char **)malloc(flow_cnt * sizeof(char **));
-
-    flow_cnt = 0;
-    /* get the total number of flows */
-    char *token = strtok(flow_list_str, SEMICOLON_DELIMITER);
-    while (token != NULL) {
-        flow_list_arr[flow_cnt] = token;
-        flow_cnt++;
-        token = strtok(NULL, SEMICOLON_DELIMITER);
+    if (f_basics->flow_list == NULL ||
+        flow_table_init(&f_basics->flow_table, flow_cnt) != EXIT_SUCCESS) {
+        PERROR_FUNCTION("calloc failed for flow_list");
+        return;
     }
 
-    assert(flow_cnt == f_basics->last_line_stats->global_flow_cnt);
+    while (cur != NULL && *cur != '\0') {
+        const char *sep = strchr(cur, ';');
+        size_t len = (sep != NULL) ? (size_t)(sep - cur) : strlen(cur);
 
-    for (uint32_t i = 0; i < flow_cnt; i++) {
-        char *fields[TOTAL_FLOWLIST_FIELDS];
-        struct flow_info target_flow;
-
-        fill_fields_from_line(fields, flow_list_arr[i], FOOT);
-        init_flow_info(&target_flow, fields);
-        f_basics->flow_list[i] = target_flow;
+        if (len > 0) {
+            if (i == flow_cnt) {
+                printf("%s:%u: flow list has more than %u flows\n",
+                       __FUNCTION__, __LINE__, flow_cnt);
+                break;
+            }
+            if (len + 1 > entry_size) {
+                char *tmp = realloc(entry, len + 1);
+                if (tmp == NULL) {
+                    PERROR_FUNCTION("realloc failed for flow list entry");
+                    break;
+                }
+                entry = tmp;
+                entry_size = len + 1;
+            }
+            memcpy(entry, cur, len);
+            entry[len] = '\0';
+
+            char *fields[TOTAL_FLOWLIST_FIELDS];
+            fill_fields_from_line(fields, entry, FOOT);
+            init_flow_info(&f_basics->flow_list[i], fields);
+            if (!flow_table_insert(&f_basics->flow_table,
+                                   f_basics->flow_list[i].flowid, i)) {
+                printf("%s:%u: duplicated flow id %08x in flow list\n",
+                       __FUNCTION__, __LINE__, f_basics->flow_list[i].flowid);
+            }
+            i++;
+        }
+        cur = (sep != NULL) ? sep + 1 : NULL;
     }
 
-    free(flow_list_arr);
-    free(flow_list_str);
+    assert(i == f_basics->last_line_stats->global_flow_cnt);
+    f_basics->flow_count = i;
+
+    free(entry);
 }
 
 int
 get_file_basics(struct file_basic_stats *f_basics, const char *file_name)
 {
-    FILE *file = fopen(file_name, "r");
+    FILE *file = compress_fopen(f_basics, file_name);
     if (!file) {
-        PERROR_FUNCTION("Failed to open file");
         return EXIT_FAILURE;
     }
     f_basics->file = file;
@@ -563,13 +713,20 @@ get_file_basics(struct file_basic_stats *f_basics, const char *file_name)
 
     get_first_2lines_stats(f_basics);
     if (f_basics->first_line_stats == NULL) {
-        PERROR_FUNCTION("head note not exist");
+        printf("the log has no head note\n");
         return EXIT_FAILURE;
     }
 
     get_last_line_stats(f_basics);
+    if (f_basics->last_line_stats == NULL && is_recover_mode &&
+        recover_foot_note(f_basics) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
     if (f_basics->last_line_stats == NULL) {
-        PERROR_FUNCTION("foot note not exist");
+        if (!is_recover_mode) {
+            printf("--recover rebuilds the foot note from the body\n");
+        }
+        /* get_last_line_stats() has said why */
         return EXIT_FAILURE;
     }
 
@@ -629,11 +786,82 @@ show_file_basic_stats(const struct file_basic_stats *f_basics)
     printf("log duration: %.2f seconds\n", time_in_seconds);
 }
 
-/* Read the body of the per-flow stats, and skip the head or foot note. */
+/* Print the summary block of the stats accumulated in `f_info`. */
 void
+print_flow_summary(const struct file_basic_stats *f_basics,
+                   const struct flow_info *f_info)
+{
+    uint64_t rec_cnt = f_info->record_cnt;
+
+    if (f_basics->rec_filter != NULL) {
+        /* only the records passing the predicates were accumulated */
+        rec_cnt = f_info->dir_in + f_info->dir_out;
+    }
+    /* no record or data packet, the mins are still at their start value */
+    uint32_t min_payload = (f_info->data_pkt_cnt > 0) ? f_info->min_payload_sz : 0;
+    uint32_t srtt_min = (rec_cnt > 0) ? f_info->srtt_min : 0;
+    uint32_t cwnd_min = (rec_cnt > 0) ? f_info->cwnd_min : 0;
+
+    printf("++++++++++++++++++++++++++++++ summary ++++++++++++++++++++++++++++\n");
+    printf("  %s:%hu->%s:%hu flowid: %08x\n",
+           f_info->laddr, f_info->lport, f_info->faddr, f_info->fport,
+           f_info->flowid);
+
+    printf("input flow data_pkt_cnt: %" PRIu64 ", fragment_cnt: %" PRIu64
+           ", fragment_ratio: %.3f\n"
+           "           avg_payload: %.0f, min_payload: %u, max_payload: %u bytes\n"
+           "           avg_srtt: %" PRIu64 ", min_srtt: %u, max_srtt: %u µs\n"
+           "           avg_cwnd: %" PRIu64 ", min_cwnd: %u, max_cwnd: %u bytes\n",
+           f_info->data_pkt_cnt, f_info->fragment_cnt,
+           (f_info->data_pkt_cnt > 0) ?
+           (double)f_info->fragment_cnt / f_info->data_pkt_cnt : 0.0,
+           (f_info->data_pkt_cnt > 0) ?
+           (double)f_info->total_data_sz / f_info->data_pkt_cnt : 0.0,
+           min_payload, f_info->max_payload_sz,
+           (rec_cnt > 0) ? f_info->srtt_sum / rec_cnt : 0,
+           srtt_min, f_info->srtt_max,
+           (rec_cnt > 0) ? f_info->cwnd_sum / rec_cnt : 0,
+           cwnd_min, f_info->cwnd_max);
+
+    if (f_basics->rec_filter != NULL) {
+        printf("           has %" PRIu64 " of %" PRIu64 " records matching "
+               "the predicates (%" PRIu64 " outputs, %" PRIu64 " inputs)\n",
+               rec_cnt, f_info->record_cnt, f_info->dir_out, f_info->dir_in);
+    } else {
+        printf("           has %" PRIu64 " useful records "
+               "(%" PRIu64 " outputs, %" PRIu64 " inputs)\n",
+               f_info->record_cnt, f_info->dir_out, f_info->dir_in);
+    }
+}
+
+/* The plot (or svg) file of `flowid`, in a buffer of NAME_MAX bytes. */
+static void
+plot_file_name_of(const struct file_basic_stats *f_basics, uint32_t flowid,
+                  char plot_file_name[])
+{
+    if (f_basics->svg_path != NULL && f_basics->is_svg_per_flow) {
+        const char *ext = strrchr(f_basics->svg_path, '.');
+        int base_len = (ext != NULL && strcmp(ext, ".svg") == 0) ?
+                       (int)(ext - f_basics->svg_path) :
+                       (int)strlen(f_basics->svg_path);
+        snprintf(plot_file_name, NAME_MAX, "%.*s.%08x.svg",
+                 base_len, f_basics->svg_path, flowid);
+    } else if (f_basics->svg_path != NULL) {
+        snprintf(plot_file_name, NAME_MAX, "%s", f_basics->svg_path);
+    } else if (strlen(f_basics->prefix) == 0) {
+        snprintf(plot_file_name, NAME_MAX, "plot_%08x.txt", flowid);
+    } else {
+        snprintf(plot_file_name, NAME_MAX, "%s.%08x.txt",
+                 f_basics->prefix, flowid);
+    }
+}
+
+/* Read the body of the per-flow stats, and skip the head or foot note. */
+int
 read_body_by_flowid(struct file_basic_stats *f_basics, uint32_t flowid)
 {
     int idx;
+    int ret = EXIT_SUCCESS;
 
     printf("input flow id is: %08x\n", flowid);
 
@@ -641,55 +869,37 @@ read_body_by_flowid(struct file_basic_stats *f_basics, uint32_t flowid)
         char plot_file_name[NAME_MAX];
         struct flow_info *f_info = &f_basics->flow_list[idx];
 
-        // Combine the strings into the plot_file buffer
-        if (strlen(f_basics->prefix) == 0) {
-            snprintf(plot_file_name, NAME_MAX, "plot_%08x.txt", flowid);
-        } else {
-            snprintf(plot_file_name, NAME_MAX, "%s.%08x.txt",
-                     f_basics->prefix, flowid);
-        }
+        plot_file_name_of(f_basics, flowid, plot_file_name);
 
-        stats_into_plot_file(f_basics, flowid, plot_file_name);
+        ret = stats_into_plot_file(f_basics, flowid, plot_file_name);
+        if (ret != EXIT_SUCCESS) {
+            /* the body was not read through, nothing to report */
+            return ret;
+        }
 
         if (is_rec_fmt_binary) {
             printf("input file has total records: %" PRIu64 "\n", f_basics->num_records);
         } else {
             printf("input file has total lines: %" PRIu64 "\n", f_basics->num_lines);
         }
-        printf("plot_file_name: %s\n", plot_file_name);
-
-        printf("++++++++++++++++++++++++++++++ summary ++++++++++++++++++++++++++++\n");
-        printf("  %s:%hu->%s:%hu flowid: %08x\n",
-               f_info->laddr, f_info->lport, f_info->faddr, f_info->fport,
-               flowid);
-
-        printf("input flow data_pkt_cnt: %" PRIu64 ", fragment_cnt: %" PRIu64
-               ", fragment_ratio: %.3f\n"
-               "           avg_payload: %.0f, min_payload: %u, max_payload: %u bytes\n"
-               "           avg_srtt: %" PRIu64 ", min_srtt: %u, max_srtt: %u µs\n"
-               "           avg_cwnd: %" PRIu64 ", min_cwnd: %u, max_cwnd: %u bytes\n",
-               f_info->data_pkt_cnt, f_info->fragment_cnt,
-               (double)f_info->fragment_cnt / f_info->data_pkt_cnt,
-               (double)f_info->total_data_sz / f_info->data_pkt_cnt,
-               f_info->min_payload_sz, f_info->max_payload_sz,
-               f_info->srtt_sum / f_info->record_cnt,
-               f_info->srtt_min, f_info->srtt_max,
-               f_info->cwnd_sum / f_info->record_cnt,
-               f_info->cwnd_min, f_info->cwnd_max);
-
+        printf("%s: %s\n", (f_basics->svg_path != NULL) ?
+               "svg_file_name" : "plot_file_name", plot_file_name);
 
-        printf("           has %" PRIu64 " useful records "
-               "(%" PRIu64 " outputs, %" PRIu64 " inputs)\n",
-               f_basics->flow_list[idx].record_cnt,
-               f_basics->flow_list[idx].dir_out,
-               f_basics->flow_list[idx].dir_in);
+        /* the summary block first, then the --analyze results */
+        analysis_finalize(f_basics->analysis, f_basics, f_info);
+        if (f_basics->timing != NULL) {
+            print_flow_timing(f_basics->timing);
+        }
 
-        assert(f_basics->flow_list[idx].record_cnt ==
-               (f_basics->flow_list[idx].dir_in +
-                f_basics->flow_list[idx].dir_out));
+        if (f_basics->rec_filter == NULL) {
+            assert(f_basics->flow_list[idx].record_cnt ==
+                   (f_basics->flow_list[idx].dir_in +
+                    f_basics->flow_list[idx].dir_out));
+        }
     } else {
         printf("but the flow id: %08x not found in file\n", flowid);
     }
+    return ret;
 }
 
 int
@@ -697,15 +907,20 @@ cleanup_file_basic_stats(const struct file_basic_stats *f_basics_ptr)
 {
 
     // Close the file and check for errors
-    if (fclose(f_basics_ptr->file) == EOF) {
+    if (f_basics_ptr->file != NULL && fclose(f_basics_ptr->file) == EOF) {
         PERROR_FUNCTION("Failed to close file");
         return EXIT_FAILURE;
     }
 
     free(f_basics_ptr->first_line_stats);
-    free(f_basics_ptr->last_line_stats->flow_list_str);
+    if (f_basics_ptr->last_line_stats != NULL) {
+        free(f_basics_ptr->last_line_stats->flow_list_str);
+    }
     free(f_basics_ptr->last_line_stats);
     free(f_basics_ptr->flow_list);
+    free(f_basics_ptr->flow_table.keys);
+    free(f_basics_ptr->flow_table.slots);
+    compress_close(f_basics_ptr->compressed);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,301 @@
+/*
+ * sample.h
+ *
+ *  Approximate per-flow stats from a random subset of body chunks.
+ *
+ *  Each sampled chunk is a cluster of records, so the means are ratio
+ *  estimators over the chunks (sum of the values / number of records) and
+ *  their 95% confidence intervals come from the spread between chunks, not
+ *  between records. Record counts come from the foot note and stay exact.
+ */
+
+#ifndef SAMPLE_H_
+#define SAMPLE_H_
+
+#include <math.h>
+#include <stddef.h>
+
+enum {
+    SAMPLE_CHUNK_SIZE = 256 * 1024,
+};
+
+#define SAMPLE_Z95  1.96
+
+/* per chunk sums of the sampled flow */
+struct sample_acc {
+    uint64_t    flow_cnt;       /* records of the flow */
+    uint64_t    rec_cnt;        /* records of the flow passing the predicates */
+    uint64_t    out_cnt;
+    uint64_t    data_pkt_cnt;
+    uint64_t    data_sz_sum;
+    uint64_t    fragment_cnt;
+    uint64_t    srtt_sum;
+    uint64_t    cwnd_sum;
+};
+
+struct sample_ctx {
+    const struct rec_filter *rec_filter;
+    uint32_t    mss;
+    struct sample_acc cur;
+    uint32_t    min_payload_sz;
+    uint32_t    max_payload_sz;
+    uint32_t    srtt_min;
+    uint32_t    srtt_max;
+    uint32_t    cwnd_min;
+    uint32_t    cwnd_max;
+};
+
+static inline uint64_t
+xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return (*state = x);
+}
+
+static void
+sample_record(void *arg, uint32_t flowid, const record_t *rec)
+{
+    struct sample_ctx *ctx = arg;
+    (void)flowid;
+
+    ctx->cur.flow_cnt++;
+    if (ctx->rec_filter != NULL && !rec_filter_match(ctx->rec_filter, rec)) {
+        return;
+    }
+
+    ctx->cur.rec_cnt++;
+    ctx->cur.out_cnt += (rec->direction == 'o');
+    ctx->cur.srtt_sum += rec->srtt;
+    ctx->cur.cwnd_sum += rec->cwnd;
+    if (rec->data_sz > 0) {
+        ctx->cur.data_pkt_cnt++;
+        ctx->cur.data_sz_sum += rec->data_sz;
+        if (ctx->min_payload_sz > rec->data_sz) {
+            ctx->min_payload_sz = rec->data_sz;
+        }
+        if (ctx->max_payload_sz < rec->data_sz) {
+            ctx->max_payload_sz = rec->data_sz;
+        }
+    }
+    if (ctx->mss > 1 && (rec->data_sz % ctx->mss) > 0) {
+        ctx->cur.fragment_cnt++;
+    }
+    if (ctx->srtt_min > rec->srtt) {
+        ctx->srtt_min = rec->srtt;
+    }
+    if (ctx->srtt_max < rec->srtt) {
+        ctx->srtt_max = rec->srtt;
+    }
+    if (ctx->cwnd_min > rec->cwnd) {
+        ctx->cwnd_min = rec->cwnd;
+    }
+    if (ctx->cwnd_max < rec->cwnd) {
+        ctx->cwnd_max = rec->cwnd;
+    }
+}
+
+/* Ratio estimate sum(y) / sum(x) over m of `total` chunks, and the half width
+ * of its 95% confidence interval (NAN when it cannot be estimated).
+ */
+static void
+sample_ratio(const struct sample_acc *accs, uint64_t m, uint64_t total,
+             size_t y_off, size_t x_off, double *ratio, double *half)
+{
+    double sum_y = 0, sum_x = 0, ss = 0;
+
+    for (uint64_t c = 0; c < m; c++) {
+        sum_y += *(const uint64_t *)((const char *)&accs[c] + y_off);
+        sum_x += *(const uint64_t *)((const char *)&accs[c] + x_off);
+    }
+    if (sum_x == 0) {
+        *ratio = NAN;
+        *half = NAN;
+        return;
+    }
+    *ratio = sum_y / sum_x;
+    if (m < 2) {
+        *half = NAN;
+        return;
+    }
+
+    for (uint64_t c = 0; c < m; c++) {
+        double y = *(const uint64_t *)((const char *)&accs[c] + y_off);
+        double x = *(const uint64_t *)((const char *)&accs[c] + x_off);
+        ss += (y - *ratio * x) * (y - *ratio * x);
+    }
+    double x_bar = sum_x / m;
+    double fpc = 1.0 - (double)m / total;   /* finite population correction */
+    *half = SAMPLE_Z95 * sqrt(fpc * ss / (m - 1) / m) / x_bar;
+}
+
+#define SAMPLE_RATIO(accs, m, total, y, x, ratio, half)                     \
+        sample_ratio(accs, m, total, offsetof(struct sample_acc, y),        \
+                     offsetof(struct sample_acc, x), ratio, half)
+
+static int
+sample_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static inline void
+sprint_ci(char *buf, size_t size, const char *fmt, double half)
+{
+    if (isnan(half)) {
+        snprintf(buf, size, "n/a");
+    } else {
+        snprintf(buf, size, fmt, half);
+    }
+}
+
+/* Estimate the read_body_by_flowid() summary from `sample_pct` percent of the
+ * body chunks, picked at random without replacement and read in file order.
+ */
+int
+sample_body_by_flowid(struct file_basic_stats *f_basics, uint32_t flowid,
+                      double sample_pct, uint64_t seed)
+{
+    int idx;
+
+    printf("input flow id is: %08x\n", flowid);
+
+    if (!is_flowid_in_file(f_basics, flowid, &idx)) {
+        printf("but the flow id: %08x not found in file\n", flowid);
+        return EXIT_SUCCESS;
+    }
+
+    struct flow_info *f_info = &f_basics->flow_list[idx];
+    struct body_chunks bc;
+    body_chunks_init(&bc, f_basics, SAMPLE_CHUNK_SIZE);
+    if (bc.count == 0) {
+        printf("the log has no body to sample\n");
+        return EXIT_SUCCESS;
+    }
+
+    uint64_t m = (uint64_t)llround(bc.count * sample_pct / 100.0);
+    if (m < 1) {
+        m = 1;
+    } else if (m > bc.count) {
+        m = bc.count;
+    }
+
+    uint64_t *order = malloc(bc.count * sizeof(*order));
+    struct sample_acc *accs = calloc(m, sizeof(*accs));
+    char *buf = malloc(body_chunks_buf_size(&bc));
+    int ret = EXIT_FAILURE;
+    if (order == NULL || accs == NULL || buf == NULL) {
+        PERROR_FUNCTION("malloc failed for chunk sampling");
+        goto out;
+    }
+
+    /* partial Fisher-Yates shuffle picks m distinct chunks */
+    uint64_t state = (seed != 0) ? seed : 0x9E3779B97F4A7C15ull;
+    for (uint64_t i = 0; i < bc.count; i++) {
+        order[i] = i;
+    }
+    for (uint64_t i = 0; i < m; i++) {
+        uint64_t j = i + xorshift64(&state) % (bc.count - i);
+        uint64_t tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+    }
+    /* visit the picked chunks in file order */
+    qsort(order, m, sizeof(*order), sample_cmp_u64);
+
+    struct sample_ctx ctx = {
+        .rec_filter = f_basics->rec_filter,
+        .mss = f_info->mss,
+        .min_payload_sz = UINT32_MAX,
+        .srtt_min = UINT32_MAX,
+        .cwnd_min = UINT32_MAX,
+    };
+    uint64_t num_records = 0;
+    for (uint64_t i = 0; i < m; i++) {
+        memset(&ctx.cur, 0, sizeof(ctx.cur));
+        int64_t cnt = body_chunk_scan(&bc, order[i], buf, &flowid,
+                                      sample_record, &ctx);
+        if (cnt < 0) {
+            /* the estimates would count the chunks never read */
+            PERROR_FUNCTION("pread");
+            goto out;
+        }
+        num_records += (uint64_t)cnt;
+        accs[i] = ctx.cur;
+    }
+
+    struct sample_acc total = {};
+    for (uint64_t i = 0; i < m; i++) {
+        total.flow_cnt += accs[i].flow_cnt;
+        total.rec_cnt += accs[i].rec_cnt;
+        total.data_pkt_cnt += accs[i].data_pkt_cnt;
+        total.fragment_cnt += accs[i].fragment_cnt;
+    }
+
+    printf("sampled %" PRIu64 " of %" PRIu64 " chunks (%.2f%%), %" PRIu64
+           " records, %" PRIu64 " of flow %08x\n",
+           m, bc.count, 100.0 * m / bc.count, num_records, total.rec_cnt, flowid);
+    if (verbose) {
+        printf("[%s] seed = %" PRIu64 ", chunk size = %zu\n",
+               __FUNCTION__, seed, bc.span);
+    }
+
+    double out_ratio, out_half, pkt_ratio, pkt_half, frag_ratio, frag_half;
+    double payload, payload_half, srtt, srtt_half, cwnd, cwnd_half;
+    SAMPLE_RATIO(accs, m, bc.count, out_cnt, rec_cnt, &out_ratio, &out_half);
+    SAMPLE_RATIO(accs, m, bc.count, data_pkt_cnt, rec_cnt, &pkt_ratio, &pkt_half);
+    SAMPLE_RATIO(accs, m, bc.count, fragment_cnt, data_pkt_cnt, &frag_ratio, &frag_half);
+    SAMPLE_RATIO(accs, m, bc.count, data_sz_sum, data_pkt_cnt, &payload, &payload_half);
+    SAMPLE_RATIO(accs, m, bc.count, srtt_sum, rec_cnt, &srtt, &srtt_half);
+    SAMPLE_RATIO(accs, m, bc.count, cwnd_sum, rec_cnt, &cwnd, &cwnd_half);
+
+    char ci_frag[32], ci_payload[32], ci_srtt[32], ci_cwnd[32];
+    sprint_ci(ci_frag, sizeof(ci_frag), "%.3f", frag_half);
+    sprint_ci(ci_payload, sizeof(ci_payload), "%.0f", payload_half);
+    sprint_ci(ci_srtt, sizeof(ci_srtt), "%.0f", srtt_half);
+    sprint_ci(ci_cwnd, sizeof(ci_cwnd), "%.0f", cwnd_half);
+
+    /* the foot note counts every record of the flow, the predicates keep
+     * about the sampled share of them */
+    double est_records = (double)f_info->record_cnt;
+    if (f_basics->rec_filter != NULL) {
+        est_records = (total.flow_cnt > 0) ?
+            est_records * total.rec_cnt / total.flow_cnt : 0;
+    }
+
+    printf("++++++++++++++++++++++++ sampled summary (95%% CI) +++++++++++++++++++\n");
+    printf("  %s:%hu->%s:%hu flowid: %08x\n",
+           f_info->laddr, f_info->lport, f_info->faddr, f_info->fport, flowid);
+    printf("input flow data_pkt_cnt: ~%.0f, fragment_cnt: ~%.0f, "
+           "fragment_ratio: %.3f ± %s\n"
+           "           avg_payload: %.0f ± %s, min_payload: %u, max_payload: %u bytes\n"
+           "           avg_srtt: %.0f ± %s, min_srtt: %u, max_srtt: %u µs\n"
+           "           avg_cwnd: %.0f ± %s, min_cwnd: %u, max_cwnd: %u bytes\n",
+           pkt_ratio * est_records, pkt_ratio * est_records * frag_ratio,
+           frag_ratio, ci_frag,
+           payload, ci_payload, ctx.min_payload_sz, ctx.max_payload_sz,
+           srtt, ci_srtt, ctx.srtt_min, ctx.srtt_max,
+           cwnd, ci_cwnd, ctx.cwnd_min, ctx.cwnd_max);
+    if (f_basics->rec_filter != NULL) {
+        printf("           has ~%.0f of %" PRIu64 " records matching the "
+               "predicates (~%.0f outputs, ~%.0f inputs)\n",
+               est_records, f_info->record_cnt, out_ratio * est_records,
+               (1.0 - out_ratio) * est_records);
+    } else {
+        printf("           has %" PRIu64 " records (~%.0f outputs, ~%.0f inputs)\n",
+               f_info->record_cnt, out_ratio * est_records,
+               (1.0 - out_ratio) * est_records);
+    }
+    printf("           min/max are over the sampled records only\n");
+    ret = EXIT_SUCCESS;
+
+out:
+    free(order);
+    free(accs);
+    free(buf);
+    return ret;
+}
+
+#endif /* SAMPLE_H_ */
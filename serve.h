@@ -0,0 +1,881 @@
+/*
+ * serve.h
+ *
+ *  --serve: keep one or more logs open and answer queries about them over a
+ *  Unix domain socket, so a viewer or a notebook asking many questions of a
+ *  big log reads it once instead of once per question.
+ *
+ *  At start every log is mapped and its body read in one pass into a flow
+ *  index and a sparse time index: the summary aggregate of each flow, and the
+ *  body offset and time of every SERVE_MARK_GAP-th record of it. Log order is
+ *  time order, so a time window starts at the last mark before it; from there
+ *  the body is scanned forward for the records of the flow until one is past
+ *  the window. A flow whose records go back in time is scanned from its first
+ *  record to its last.
+ *
+ *  A request is one line of words, the command and key=value arguments:
+ *
+ *    logs                              the served logs
+ *    flows [log=N]                     the flow list of log N (default 0)
+ *    summary flow=ID [log=N]           the --summary-only=json row of a flow
+ *    window flow=ID [from=S] [to=S] [max=N] [fmt=json|bin] [log=N]
+ *                                      the records in [from, to) seconds, at
+ *                                      most max of them (default 100000)
+ *    series flow=ID [from=S] [to=S] [points=N] [fmt=json|bin] [log=N]
+ *                                      min and max of cwnd, ssthresh and srtt
+ *                                      in at most N time buckets (default
+ *                                      1200), the empty ones left out
+ *    shutdown                          stop serving
+ *
+ *  The reply is one line of JSON, {"error":"..."} for a bad request. With
+ *  fmt=bin, window and series reply with a "bin <count> <size>" line and
+ *  `count` serve_row or serve_col structs of `size` bytes, in host byte
+ *  order. Connections are answered one at a time, in the order they come;
+ *  one that sends no request or takes no reply for SERVE_IDLE_SECS seconds is
+ *  closed, so a stalled client does not hold the others up.
+ */
+
+#ifndef SERVE_H_
+#define SERVE_H_
+
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+enum {
+    SERVE_BACKLOG       = 16,
+    SERVE_BUF_SIZE      = 1024 * 1024,      /* reply buffer per connection */
+    SERVE_MIN_ROWS      = 64,
+    SERVE_MARK_GAP      = 64,               /* records of a flow per mark */
+    SERVE_IDLE_SECS     = 30,
+    SERVE_DEFAULT_ROWS  = 100000,
+    SERVE_MAX_POINTS    = 1000000,
+};
+
+/* record k * SERVE_MARK_GAP of a flow */
+struct serve_mark {
+    uint64_t    off;                /* in the body */
+    uint32_t    time;               /* rel_time, ms */
+};
+
+/* the records of one flow: marks in log order, and the aggregate */
+struct serve_flow {
+    struct serve_mark *marks;
+    uint64_t    mark_cnt;
+    uint64_t    mark_cap;
+    uint64_t    cnt;                /* records */
+    uint64_t    last_off;           /* of the last record */
+    uint32_t    last_time;
+    bool        is_time_sorted;
+    struct flow_agg agg;
+};
+
+struct serve_log {
+    const char  *file_name;
+    struct file_basic_stats *f_basics;
+    bool        is_own;             /* f_basics is opened and freed here */
+    bool        is_binary;
+    uint32_t    start_time;
+    const char  *map;
+    size_t      map_len;
+    const char  *body_end;
+    struct serve_flow *flows;       /* per flow_list index */
+    uint64_t    num_records;
+};
+
+/* a window record with fmt=bin */
+struct serve_row {
+    uint32_t    rel_time;           /* ms */
+    uint32_t    cwnd;
+    uint32_t    ssthresh;
+    uint32_t    srtt;
+    uint32_t    data_sz;
+    uint32_t    pipe;
+    uint8_t     direction;          /* 'i' or 'o' */
+    uint8_t     pad[3];
+};
+
+/* a series bucket with fmt=bin */
+struct serve_col {
+    uint32_t    time;               /* ms, start of the bucket */
+    uint32_t    cnt;                /* records in the bucket */
+    struct svg_column range;        /* min and max of cwnd, ssthresh, srtt */
+};
+
+_Static_assert(sizeof(struct serve_row) == 28, "serve_row is in the protocol");
+_Static_assert(sizeof(struct serve_col) == 32, "serve_col is in the protocol");
+
+struct serve_req {
+    const char  *cmd;
+    uint32_t    log;
+    bool        has_flowid;
+    uint32_t    flowid;
+    uint64_t    from;               /* ms */
+    uint64_t    to;                 /* ms, exclusive */
+    uint64_t    max;
+    uint32_t    points;
+    bool        is_bin;
+};
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void
+serve_on_signal(int sig)
+{
+    (void)sig;
+    serve_stop = 1;
+}
+
+/* walks the body from a mark to the records of one flow */
+struct serve_cursor {
+    const char  *p;
+    const char  *end;               /* past the start of the flow's last record */
+    uint32_t    flowid;
+};
+
+/* Start at the last mark of `sf` before `from` ms, or at its first record when
+ * the flow is not in time order.
+ */
+static void
+serve_cursor_init(const struct serve_log *sl, const struct serve_flow *sf,
+                  uint32_t flowid, uint64_t from, struct serve_cursor *cur)
+{
+    uint64_t lo = 0, hi = sf->mark_cnt;
+
+    while (sf->is_time_sorted && lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (sf->marks[mid].time < from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    cur->flowid = flowid;
+    if (sf->mark_cnt == 0) {
+        cur->p = cur->end = sl->body_end;
+        return;
+    }
+    cur->p = sl->map + sf->marks[(lo > 0) ? lo - 1 : 0].off;
+    cur->end = sl->map + sf->last_off + 1;
+}
+
+/* the next record of the flow, false after its last */
+static bool
+serve_cursor_next(const struct serve_log *sl, struct serve_cursor *cur,
+                  record_t *rec)
+{
+    while (cur->p < cur->end) {
+        const char *p = cur->p;
+        if (sl->is_binary) {
+            struct pkt_node node;
+            uint32_t flowid;
+            memcpy(&flowid, p, sizeof(flowid));
+            cur->p += sizeof(node);
+            if (flowid == cur->flowid) {
+                memcpy(&node, p, sizeof(node));
+                decode_binary_record(&node, sl->start_time, rec);
+                return true;
+            }
+        } else {
+            const char *eol = memchr(p, '\n', (size_t)(sl->body_end - p));
+            if (eol == NULL) {
+                eol = sl->body_end;
+            }
+            cur->p = eol + 1;
+            /* the lines serve_index() took */
+            if (eol - p > 10 && fast_hex8_to_u32(p) == cur->flowid &&
+                decode_text_record(p, eol, sl->start_time, rec)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static int
+serve_record(struct serve_log *sl, uint32_t flowid, uint64_t off,
+             const record_t *rec)
+{
+    const struct file_basic_stats *f_basics = sl->f_basics;
+    uint32_t idx;
+
+    if (!flow_table_lookup(&f_basics->flow_table, flowid, &idx)) {
+        return EXIT_SUCCESS;
+    }
+
+    struct serve_flow *sf = &sl->flows[idx];
+    if (sf->cnt % SERVE_MARK_GAP == 0) {
+        if (sf->mark_cnt == sf->mark_cap) {
+            uint64_t cap = (sf->mark_cap > 0) ? sf->mark_cap * 2 : 1;
+            struct serve_mark *marks = realloc(sf->marks, cap * sizeof(*marks));
+            if (marks == NULL) {
+                return EXIT_FAILURE;
+            }
+            sf->marks = marks;
+            sf->mark_cap = cap;
+        }
+        sf->marks[sf->mark_cnt++] = (struct serve_mark){off, rec->rel_time};
+    }
+    if (sf->cnt > 0 && rec->rel_time < sf->last_time) {
+        sf->is_time_sorted = false;
+    }
+    sf->last_time = rec->rel_time;
+    sf->last_off = off;
+    sf->cnt++;
+    flow_agg_update(&sf->agg, rec, f_basics->flow_list[idx].mss);
+    sl->num_records++;
+    return EXIT_SUCCESS;
+}
+
+/* Map the log of `sl->f_basics` and index its body. Runs right after
+ * get_file_basics() of the log, while is_rec_fmt_binary is still its format.
+ */
+static int
+serve_index(struct serve_log *sl)
+{
+    const struct file_basic_stats *f_basics = sl->f_basics;
+    const uint32_t n = f_basics->flow_count;
+    int fd = fileno(f_basics->file);
+    struct body_chunks bc;
+    struct stat st;
+    record_t rec;
+
+    body_chunks_init(&bc, f_basics, SUMMARY_CHUNK_SIZE);
+    sl->is_binary = is_rec_fmt_binary;
+    sl->start_time = f_basics->first_flow_start_time;
+
+    if (fstat(fd, &st) != 0 || st.st_size < bc.end) {
+        PERROR_FUNCTION("fstat");
+        return EXIT_FAILURE;
+    }
+    sl->map_len = (size_t)st.st_size;
+    void *map = mmap(NULL, sl->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        PERROR_FUNCTION("mmap");
+        return EXIT_FAILURE;
+    }
+    sl->map = map;
+    sl->body_end = sl->map + bc.end;
+
+    sl->flows = calloc((n > 0) ? n : 1, sizeof(*sl->flows));
+    if (sl->flows == NULL) {
+        PERROR_FUNCTION("calloc failed for the flow index");
+        return EXIT_FAILURE;
+    }
+    /* the foot note counts are a hint, a record needs at least 11 bytes */
+    uint64_t rec_bound = (uint64_t)(bc.end - bc.begin) / PIPE_MIN_LINE_LEN + 1;
+    for (uint32_t i = 0; i < n; i++) {
+        struct serve_flow *sf = &sl->flows[i];
+        uint64_t cnt = f_basics->flow_list[i].record_cnt;
+        sf->is_time_sorted = true;
+        flow_agg_init(&sf->agg);
+        cnt = (cnt < rec_bound) ? cnt : rec_bound;
+        sf->mark_cap = (cnt + SERVE_MARK_GAP - 1) / SERVE_MARK_GAP;
+        sf->marks = (sf->mark_cap > 0) ?
+                    malloc(sf->mark_cap * sizeof(*sf->marks)) : NULL;
+        if (sf->mark_cap > 0 && sf->marks == NULL) {
+            PERROR_FUNCTION("malloc failed for the time index");
+            return EXIT_FAILURE;
+        }
+    }
+
+    posix_madvise(map, sl->map_len, POSIX_MADV_SEQUENTIAL);
+    if (sl->is_binary) {
+        for (long off = bc.begin; off < bc.end; off += sizeof(struct pkt_node)) {
+            struct pkt_node node;
+            memcpy(&node, sl->map + off, sizeof(node));
+            decode_binary_record(&node, sl->start_time, &rec);
+            if (serve_record(sl, node.flowid, (uint64_t)off, &rec) != EXIT_SUCCESS) {
+                PERROR_FUNCTION("realloc failed for the time index");
+                return EXIT_FAILURE;
+            }
+        }
+    } else {
+        const char *p = sl->map + bc.begin;
+        struct text_lines tl = {};
+        while (p < sl->body_end) {
+            const char *next = text_lines_next(&tl, p, sl->body_end, sl->body_end,
+                                               true);
+            for (uint32_t i = 0; i < tl.cnt; i++) {
+                const char *line = tl.base + tl.bol[i];
+                if (!decode_text_record(line, line + tl.len[i], sl->start_time,
+                                        &rec)) {
+                    continue;
+                }
+                if (serve_record(sl, fast_hex8_to_u32(line),
+                                 (uint64_t)(line - sl->map), &rec) != EXIT_SUCCESS) {
+                    PERROR_FUNCTION("realloc failed for the time index");
+                    return EXIT_FAILURE;
+                }
+            }
+            if (next == p) {
+                break;
+            }
+            p = next;
+        }
+    }
+    posix_madvise(map, sl->map_len, POSIX_MADV_RANDOM);
+
+    if (verbose) {
+        uint32_t unsorted = 0;
+        for (uint32_t i = 0; i < n; i++) {
+            unsorted += !sl->flows[i].is_time_sorted;
+        }
+        printf("[%s] %s: %" PRIu64 " records of %u flows, %u not in time order\n",
+               __FUNCTION__, sl->file_name, sl->num_records, n, unsorted);
+    }
+    return EXIT_SUCCESS;
+}
+
+static void
+serve_log_free(struct serve_log *sl)
+{
+    if (sl->flows != NULL) {
+        for (uint32_t i = 0; i < sl->f_basics->flow_count; i++) {
+            free(sl->flows[i].marks);
+        }
+        free(sl->flows);
+    }
+    if (sl->map != NULL) {
+        munmap((void *)sl->map, sl->map_len);
+    }
+    if (sl->is_own && sl->f_basics != NULL) {
+        if (sl->f_basics->file != NULL &&
+            cleanup_file_basic_stats(sl->f_basics) != EXIT_SUCCESS) {
+            PERROR_FUNCTION("cleanup_file_basic_stats() failed");
+        }
+        free(sl->f_basics);
+    }
+}
+
+static void
+serve_json_str(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', out);
+            fputc(*s, out);
+        } else if ((uint8_t)*s < 0x20) {
+            fprintf(out, "\\u%04x", (uint8_t)*s);
+        } else {
+            fputc(*s, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void
+serve_error(FILE *out, const char *fmt, ...)
+{
+    char msg[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    fputs("{\"error\":", out);
+    serve_json_str(out, msg);
+    fputs("}\n", out);
+}
+
+static bool
+serve_parse_u64(const char *val, int base, uint64_t *num)
+{
+    char *end;
+
+    if (*val == '\0' || *val == '-') {
+        return false;
+    }
+    errno = 0;
+    *num = strtoull(val, &end, base);
+    return errno == 0 && *end == '\0';
+}
+
+/* seconds into ms */
+static bool
+serve_parse_time(const char *val, uint64_t *ms)
+{
+    char *end;
+    double secs = strtod(val, &end);
+
+    if (end == val || *end != '\0' || !(secs >= 0) || secs > UINT32_MAX / 1000.0) {
+        return false;
+    }
+    *ms = (uint64_t)llround(secs * 1000.0);
+    return true;
+}
+
+/* Split `line` into `req`, or reply with the error and return false. */
+static bool
+serve_parse(char *line, struct serve_req *req, FILE *out)
+{
+    char *save = NULL;
+    char *tok = strtok_r(line, " \t\r\n", &save);
+
+    *req = (struct serve_req){
+        .cmd = tok,
+        .to = UINT64_MAX,
+        .max = SERVE_DEFAULT_ROWS,
+        .points = SVG_COLUMNS,
+    };
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        char *val = strchr(tok, '=');
+        uint64_t num = 0;
+        bool ok = (val != NULL);
+
+        if (ok) {
+            *val++ = '\0';
+        }
+        if (!ok) {
+            /* no value */
+        } else if (strcmp(tok, "flow") == 0) {
+            ok = serve_parse_u64(val, BASE16, &num) && num <= UINT32_MAX;
+            req->flowid = (uint32_t)num;
+            req->has_flowid = true;
+        } else if (strcmp(tok, "log") == 0) {
+            ok = serve_parse_u64(val, BASE10, &num) && num <= UINT32_MAX;
+            req->log = (uint32_t)num;
+        } else if (strcmp(tok, "from") == 0) {
+            ok = serve_parse_time(val, &req->from);
+        } else if (strcmp(tok, "to") == 0) {
+            ok = serve_parse_time(val, &req->to);
+        } else if (strcmp(tok, "max") == 0) {
+            ok = serve_parse_u64(val, BASE10, &req->max);
+        } else if (strcmp(tok, "points") == 0) {
+            ok = serve_parse_u64(val, BASE10, &num) && num > 0 &&
+                 num <= SERVE_MAX_POINTS;
+            req->points = (uint32_t)num;
+        } else if (strcmp(tok, "fmt") == 0) {
+            ok = (strcmp(val, "json") == 0 || strcmp(val, "bin") == 0);
+            req->is_bin = (strcmp(val, "bin") == 0);
+        } else {
+            serve_error(out, "unknown argument %s", tok);
+            return false;
+        }
+        if (!ok) {
+            serve_error(out, "bad argument %s%s%s", tok, (val != NULL) ? "=" : "",
+                        (val != NULL) ? val : "");
+            return false;
+        }
+    }
+    if (req->from > req->to) {
+        serve_error(out, "from is after to");
+        return false;
+    }
+    return true;
+}
+
+static void
+serve_logs(const struct serve_log *logs, uint32_t log_cnt, FILE *out)
+{
+    fputs("{\"logs\":[", out);
+    for (uint32_t l = 0; l < log_cnt; l++) {
+        const struct serve_log *sl = &logs[l];
+        fprintf(out, "%s{\"log\":%u,\"file\":", (l > 0) ? "," : "", l);
+        serve_json_str(out, sl->file_name);
+        fprintf(out, ",\"format\":\"%s\",\"flows\":%u,\"records\":%" PRIu64 "}",
+                sl->is_binary ? "binary" : "text", sl->f_basics->flow_count,
+                sl->num_records);
+    }
+    fputs("]}\n", out);
+}
+
+static void
+serve_flows(const struct serve_log *sl, uint32_t log, FILE *out)
+{
+    const struct file_basic_stats *f_basics = sl->f_basics;
+
+    fprintf(out, "{\"log\":%u,\"flows\":[", log);
+    for (uint32_t i = 0; i < f_basics->flow_count; i++) {
+        const struct flow_info *f_info = &f_basics->flow_list[i];
+        const struct flow_agg *agg = &sl->flows[i].agg;
+        fprintf(out, "%s{\"flowid\":\"%08x\",\"laddr\":\"%s\",\"lport\":%hu,"
+                "\"faddr\":\"%s\",\"fport\":%hu,\"stack\":\"%s\",\"cc\":\"%s\","
+                "\"mss\":%u,\"records\":%" PRIu64 ",\"first\":%.3f,\"last\":%.3f}",
+                (i > 0) ? "," : "", f_info->flowid, f_info->laddr, f_info->lport,
+                f_info->faddr, f_info->fport, f_info->tcp_stack_name,
+                f_info->tcp_cc_name, f_info->mss, agg->rec_cnt,
+                (agg->rec_cnt > 0) ? agg->time_min / 1000.0 : 0.0,
+                (agg->rec_cnt > 0) ? agg->time_max / 1000.0 : 0.0);
+    }
+    fputs("]}\n", out);
+}
+
+static int
+serve_window(const struct serve_log *sl, const struct serve_flow *sf,
+             const struct serve_req *req, FILE *out)
+{
+    uint64_t cnt = 0, cap = 0;
+    struct serve_row *rows = NULL;
+    struct serve_cursor cur;
+    bool is_truncated = false;
+    record_t rec;
+
+    serve_cursor_init(sl, sf, req->flowid, req->from, &cur);
+    while (serve_cursor_next(sl, &cur, &rec)) {
+        if (sf->is_time_sorted && rec.rel_time >= req->to) {
+            break;
+        }
+        if (rec.rel_time < req->from || rec.rel_time >= req->to) {
+            continue;
+        }
+        if (cnt == req->max) {
+            is_truncated = true;
+            break;
+        }
+        if (cnt == cap) {
+            cap = (cap > 0) ? cap * 2 : SERVE_MIN_ROWS;
+            struct serve_row *grown = realloc(rows, cap * sizeof(*rows));
+            if (grown == NULL) {
+                free(rows);
+                serve_error(out, "out of memory for %" PRIu64 " records", cnt);
+                return EXIT_FAILURE;
+            }
+            rows = grown;
+        }
+        rows[cnt++] = (struct serve_row){
+            .rel_time = rec.rel_time, .cwnd = rec.cwnd, .ssthresh = rec.ssthresh,
+            .srtt = rec.srtt, .data_sz = rec.data_sz, .pipe = rec.pipe,
+            .direction = (uint8_t)rec.direction,
+        };
+    }
+
+    if (req->is_bin) {
+        fprintf(out, "bin %" PRIu64 " %zu\n", cnt, sizeof(*rows));
+        if (cnt > 0) {
+            fwrite(rows, sizeof(*rows), cnt, out);
+        }
+    } else {
+        fprintf(out, "{\"flowid\":\"%08x\",\"rows\":[", req->flowid);
+        for (uint64_t i = 0; i < cnt; i++) {
+            const struct serve_row *r = &rows[i];
+            fprintf(out, "%s[%.3f,\"%c\",%u,%u,%u,%u,%u]", (i > 0) ? "," : "",
+                    r->rel_time / 1000.0, r->direction, r->cwnd, r->ssthresh,
+                    r->srtt, r->data_sz, r->pipe);
+        }
+        fprintf(out, "],\"records\":%" PRIu64 ",\"truncated\":%s}\n", cnt,
+                is_truncated ? "true" : "false");
+    }
+    free(rows);
+    return EXIT_SUCCESS;
+}
+
+static int
+serve_series(const struct serve_log *sl, const struct serve_flow *sf,
+             const struct serve_req *req, FILE *out)
+{
+    uint64_t from = req->from;
+    uint64_t to = req->to;
+    uint64_t num_records = 0;
+    struct serve_cursor cur;
+    record_t rec;
+
+    if (to == UINT64_MAX) {
+        to = (sf->agg.rec_cnt > 0) ? (uint64_t)sf->agg.time_max + 1 : from;
+    }
+    uint64_t width = (to > from) ? (to - from + req->points - 1) / req->points : 1;
+    uint64_t n = (to > from) ? (to - from + width - 1) / width : 0;
+    struct serve_col *cols = malloc(((n > 0) ? n : 1) * sizeof(*cols));
+    if (cols == NULL) {
+        serve_error(out, "out of memory for %" PRIu64 " points", n);
+        return EXIT_FAILURE;
+    }
+    for (uint64_t c = 0; c < n; c++) {
+        cols[c].time = (uint32_t)(from + c * width);
+        cols[c].cnt = 0;
+        svg_column_reset(&cols[c].range);
+    }
+
+    serve_cursor_init(sl, sf, req->flowid, from, &cur);
+    while (serve_cursor_next(sl, &cur, &rec)) {
+        if (sf->is_time_sorted && rec.rel_time >= to) {
+            break;
+        }
+        if (rec.rel_time < from || rec.rel_time >= to) {
+            continue;
+        }
+        struct serve_col *col = &cols[(rec.rel_time - from) / width];
+        col->cnt++;
+        svg_column_update(&col->range, SVG_CWND, rec.cwnd);
+        svg_column_update(&col->range, SVG_SSTHRESH, rec.ssthresh);
+        svg_column_update(&col->range, SVG_SRTT, rec.srtt);
+        num_records++;
+    }
+
+    /* leave the empty buckets out */
+    uint64_t used = 0;
+    for (uint64_t c = 0; c < n; c++) {
+        if (cols[c].cnt > 0) {
+            cols[used++] = cols[c];
+        }
+    }
+
+    if (req->is_bin) {
+        fprintf(out, "bin %" PRIu64 " %zu\n", used, sizeof(*cols));
+        if (used > 0) {
+            fwrite(cols, sizeof(*cols), used, out);
+        }
+    } else {
+        fprintf(out, "{\"flowid\":\"%08x\",\"from\":%.3f,\"to\":%.3f,\"bucket\":%.3f,"
+                "\"cols\":[", req->flowid, from / 1000.0, to / 1000.0,
+                width / 1000.0);
+        for (uint64_t c = 0; c < used; c++) {
+            const struct svg_column *r = &cols[c].range;
+            fprintf(out, "%s[%.3f,%u,%u,%u,%u,%u,%u,%u]", (c > 0) ? "," : "",
+                    cols[c].time / 1000.0, cols[c].cnt, r->min[SVG_CWND],
+                    r->max[SVG_CWND], r->min[SVG_SSTHRESH], r->max[SVG_SSTHRESH],
+                    r->min[SVG_SRTT], r->max[SVG_SRTT]);
+        }
+        fprintf(out, "],\"records\":%" PRIu64 "}\n", num_records);
+    }
+    free(cols);
+    return EXIT_SUCCESS;
+}
+
+/* Answer one request line. Returns false on shutdown. */
+static bool
+serve_request(const struct serve_log *logs, uint32_t log_cnt, char *line,
+              FILE *out)
+{
+    struct serve_req req;
+
+    if (!serve_parse(line, &req, out) || req.cmd == NULL) {
+        return true;
+    }
+    if (strcmp(req.cmd, "shutdown") == 0) {
+        fputs("{\"ok\":true}\n", out);
+        return false;
+    }
+    if (strcmp(req.cmd, "logs") == 0) {
+        serve_logs(logs, log_cnt, out);
+        return true;
+    }
+    if (req.log >= log_cnt) {
+        serve_error(out, "no log %u, %u are served", req.log, log_cnt);
+        return true;
+    }
+
+    const struct serve_log *sl = &logs[req.log];
+    if (strcmp(req.cmd, "flows") == 0) {
+        serve_flows(sl, req.log, out);
+        return true;
+    }
+    if (strcmp(req.cmd, "summary") != 0 && strcmp(req.cmd, "window") != 0 &&
+        strcmp(req.cmd, "series") != 0) {
+        serve_error(out, "unknown command %s", req.cmd);
+        return true;
+    }
+
+    uint32_t idx;
+    if (!req.has_flowid) {
+        serve_error(out, "%s needs flow=ID", req.cmd);
+        return true;
+    }
+    if (!flow_table_lookup(&sl->f_basics->flow_table, req.flowid, &idx)) {
+        serve_error(out, "flow %08x is not in log %u", req.flowid, req.log);
+        return true;
+    }
+
+    const struct serve_flow *sf = &sl->flows[idx];
+    if (strcmp(req.cmd, "summary") == 0) {
+        print_summary_row(out, &sl->f_basics->flow_list[idx], &sf->agg,
+                          SUMMARY_JSON);
+    } else if (strcmp(req.cmd, "window") == 0) {
+        serve_window(sl, sf, &req, out);
+    } else {
+        serve_series(sl, sf, &req, out);
+    }
+    return true;
+}
+
+/* Answer the requests of one connection until it closes. Returns false on
+ * shutdown.
+ */
+static bool
+serve_conn(const struct serve_log *logs, uint32_t log_cnt, int fd)
+{
+    int out_fd = dup(fd);
+    FILE *in = fdopen(fd, "r");
+    FILE *out = (out_fd >= 0) ? fdopen(out_fd, "w") : NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    bool is_serving = true;
+
+    const struct timeval idle = {.tv_sec = SERVE_IDLE_SECS};
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle)) != 0) {
+        PERROR_FUNCTION("setsockopt");
+    }
+    if (in == NULL || out == NULL) {
+        PERROR_FUNCTION("fdopen");
+        if (in != NULL) {
+            fclose(in);
+        } else {
+            close(fd);
+        }
+        if (out != NULL) {
+            fclose(out);
+        } else if (out_fd >= 0) {
+            close(out_fd);
+        }
+        return true;
+    }
+    setvbuf(out, NULL, _IOFBF, SERVE_BUF_SIZE);
+
+    while (is_serving && !serve_stop && getline(&line, &cap, in) > 0) {
+        struct timeval t0, t1;
+        gettimeofday(&t0, NULL);
+        if (line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        is_serving = serve_request(logs, log_cnt, line, out);
+        /* the client went away */
+        if (fflush(out) != 0) {
+            break;
+        }
+        if (verbose) {
+            gettimeofday(&t1, NULL);
+            printf("[%s] %s: %.3f ms\n", __FUNCTION__, line,
+                   (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_usec - t0.tv_usec) / 1000.0);
+        }
+    }
+    free(line);
+    fclose(in);
+    fclose(out);
+    return is_serving;
+}
+
+/* Listen on `path`, replacing a socket no server listens on any more. */
+static int
+serve_listen(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat st;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("socket path is longer than %zu bytes: %s\n",
+               sizeof(addr.sun_path) - 1, path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        PERROR_FUNCTION("socket");
+        return -1;
+    }
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            printf("%s exists and is not a socket\n", path);
+            close(fd);
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            printf("a server already listens on %s\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SERVE_BACKLOG) != 0) {
+        PERROR_FUNCTION("bind/listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Serve the log of `f_basics` and the logs named in `more_files` on the
+ * socket `sock_path` until a shutdown request, SIGINT or SIGTERM.
+ */
+int
+serve_run(struct file_basic_stats *f_basics, const char *file_name,
+          char *const more_files[], int more_cnt, const char *sock_path)
+{
+    const uint32_t log_cnt = 1 + (uint32_t)more_cnt;
+    struct serve_log *logs = calloc(log_cnt, sizeof(*logs));
+    int ret = EXIT_FAILURE;
+    int fd = -1;
+
+    if (logs == NULL) {
+        PERROR_FUNCTION("calloc failed for the served logs");
+        return EXIT_FAILURE;
+    }
+    logs[0].file_name = file_name;
+    logs[0].f_basics = f_basics;
+    if (serve_index(&logs[0]) != EXIT_SUCCESS) {
+        goto out;
+    }
+    for (uint32_t l = 1; l < log_cnt; l++) {
+        struct serve_log *sl = &logs[l];
+        sl->file_name = more_files[l - 1];
+        sl->is_own = true;
+        sl->f_basics = calloc(1, sizeof(*sl->f_basics));
+        printf("input file name: %s\n", sl->file_name);
+        if (sl->f_basics == NULL) {
+            PERROR_FUNCTION("calloc failed for the log");
+            goto out;
+        }
+        if (get_file_basics(sl->f_basics, sl->file_name) != EXIT_SUCCESS) {
+            printf("get_file_basics() failed\n");
+            goto out;
+        }
+        if (serve_index(sl) != EXIT_SUCCESS) {
+            goto out;
+        }
+    }
+
+    fd = serve_listen(sock_path);
+    if (fd < 0) {
+        goto out;
+    }
+
+    struct sigaction sa = {.sa_handler = serve_on_signal};
+    sigemptyset(&sa.sa_mask);
+    /* no SA_RESTART: accept() and reads return on SIGINT and SIGTERM */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("serving %u log%s on %s\n", log_cnt, (log_cnt > 1) ? "s" : "",
+           sock_path);
+    fflush(stdout);
+
+    uint64_t conn_cnt = 0;
+    bool is_serving = true;
+    while (is_serving && !serve_stop) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            PERROR_FUNCTION("accept");
+            goto out;
+        }
+        conn_cnt++;
+        is_serving = serve_conn(logs, log_cnt, conn);
+    }
+    if (verbose) {
+        printf("[%s] %" PRIu64 " connections\n", __FUNCTION__, conn_cnt);
+    }
+    ret = EXIT_SUCCESS;
+
+out:
+    if (fd >= 0) {
+        close(fd);
+        unlink(sock_path);
+    }
+    for (uint32_t l = 0; l < log_cnt; l++) {
+        serve_log_free(&logs[l]);
+    }
+    free(logs);
+    return ret;
+}
+
+#endif /* SERVE_H_ */
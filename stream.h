@@ -0,0 +1,474 @@
+/*
+ * stream.h
+ *
+ *  Review of a log that is read once, front to back, without seeking: `-f -`
+ *  for stdin, a named pipe or a process substitution, e.g.
+ *  `-f <(ssh dut cat siftr2.log)`.
+ *
+ *  The head note comes first, so the record format and the start time are
+ *  known before the body. The flow list only comes with the foot note at the
+ *  end, so the flows are taken from the body records as they arrive, each
+ *  with its own aggregate, and matched with the foot note afterwards. The
+ *  fragment count needs the mss of the foot note; until then each flow keeps
+ *  count of its payload sizes, which are few distinct values.
+ */
+
+#ifndef STREAM_H_
+#define STREAM_H_
+
+#include <sys/stat.h>
+
+enum {
+    STREAM_BUF_SIZE     = 4 * 1024 * 1024,
+    STREAM_MIN_FLOWS    = 64,
+    STREAM_MIN_SIZES    = 64,
+};
+
+/* payload size -> packets, open addressing; 0 marks an empty bucket */
+struct size_counts {
+    uint32_t    *sizes;
+    uint64_t    *cnts;
+    uint32_t    mask;
+    uint32_t    used;
+};
+
+struct stream_flow {
+    uint32_t    flowid;
+    struct flow_agg agg;            /* fragment_cnt is set at the foot note */
+    struct size_counts sizes;
+};
+
+struct stream_ctx {
+    FILE        *in;
+    char        *buf;
+    size_t      cap;
+    size_t      len;                /* bytes in buf */
+    size_t      pos;                /* bytes of buf consumed */
+    bool        is_eof;
+    struct stream_flow *flows;
+    uint32_t    flow_cnt;
+    uint32_t    flow_cap;
+    struct flow_table table;        /* flowid -> flows index */
+    uint64_t    line_cnt;           /* body lines */
+    uint64_t    num_records;
+};
+
+/* stdin and anything that is not a regular file can't be seeked */
+static bool
+stream_is_needed(const char *file_name)
+{
+    struct stat st;
+
+    if (strcmp(file_name, "-") == 0) {
+        return true;
+    }
+    return stat(file_name, &st) == 0 && !S_ISREG(st.st_mode);
+}
+
+static int
+size_counts_add(struct size_counts *sc, uint32_t size)
+{
+    if (2 * (sc->used + 1) > sc->mask + 1) {
+        uint32_t cap = (sc->mask == 0) ? STREAM_MIN_SIZES : 2 * (sc->mask + 1);
+        struct size_counts grown = {
+            .sizes = calloc(cap, sizeof(*grown.sizes)),
+            .cnts = calloc(cap, sizeof(*grown.cnts)),
+            .mask = cap - 1,
+        };
+        if (grown.sizes == NULL || grown.cnts == NULL) {
+            free(grown.sizes);
+            free(grown.cnts);
+            return EXIT_FAILURE;
+        }
+        for (uint32_t b = 0; sc->mask != 0 && b <= sc->mask; b++) {
+            if (sc->sizes[b] != 0) {
+                uint32_t g = flow_table_hash(sc->sizes[b]) & grown.mask;
+                while (grown.sizes[g] != 0) {
+                    g = (g + 1) & grown.mask;
+                }
+                grown.sizes[g] = sc->sizes[b];
+                grown.cnts[g] = sc->cnts[b];
+            }
+        }
+        grown.used = sc->used;
+        free(sc->sizes);
+        free(sc->cnts);
+        *sc = grown;
+    }
+
+    uint32_t b = flow_table_hash(size) & sc->mask;
+    while (sc->sizes[b] != 0 && sc->sizes[b] != size) {
+        b = (b + 1) & sc->mask;
+    }
+    if (sc->sizes[b] == 0) {
+        sc->sizes[b] = size;
+        sc->used++;
+    }
+    sc->cnts[b]++;
+    return EXIT_SUCCESS;
+}
+
+/* packets whose payload is not a multiple of `mss`, as flow_agg counts them */
+static uint64_t
+size_counts_fragments(const struct size_counts *sc, uint32_t mss)
+{
+    uint64_t fragment_cnt = 0;
+
+    for (uint32_t b = 0; mss > 1 && sc->mask != 0 && b <= sc->mask; b++) {
+        if (sc->sizes[b] % mss > 0) {
+            fragment_cnt += sc->cnts[b];
+        }
+    }
+    return fragment_cnt;
+}
+
+/* the flow of `flowid`, added when it is seen the first time */
+static struct stream_flow *
+stream_flow_of(struct stream_ctx *ctx, uint32_t flowid)
+{
+    uint32_t idx;
+
+    if (flow_table_lookup(&ctx->table, flowid, &idx)) {
+        return &ctx->flows[idx];
+    }
+    if (ctx->flow_cnt == ctx->flow_cap) {
+        uint32_t cap = (ctx->flow_cap == 0) ? STREAM_MIN_FLOWS : 2 * ctx->flow_cap;
+        struct stream_flow *flows = realloc(ctx->flows, cap * sizeof(*flows));
+        struct flow_table table;
+        if (flows == NULL) {
+            return NULL;
+        }
+        ctx->flows = flows;
+        ctx->flow_cap = cap;
+        if (flow_table_init(&table, cap) != EXIT_SUCCESS) {
+            return NULL;
+        }
+        for (uint32_t i = 0; i < ctx->flow_cnt; i++) {
+            flow_table_insert(&table, flows[i].flowid, i);
+        }
+        flow_table_free(&ctx->table);
+        ctx->table = table;
+    }
+
+    struct stream_flow *f = &ctx->flows[ctx->flow_cnt];
+    memset(f, 0, sizeof(*f));
+    f->flowid = flowid;
+    flow_agg_init(&f->agg);
+    flow_table_insert(&ctx->table, flowid, ctx->flow_cnt++);
+    return f;
+}
+
+/* Have at least `want` unread bytes in the buffer, or all that are left.
+ * The buffer grows for a line longer than it, like a big foot note.
+ */
+static size_t
+stream_fill(struct stream_ctx *ctx, size_t want)
+{
+    if (ctx->len - ctx->pos >= want || ctx->is_eof) {
+        return ctx->len - ctx->pos;
+    }
+    memmove(ctx->buf, ctx->buf + ctx->pos, ctx->len - ctx->pos);
+    ctx->len -= ctx->pos;
+    ctx->pos = 0;
+    if (want + 1 > ctx->cap) {
+        size_t cap = ctx->cap;
+        while (want + 1 > cap) {
+            cap *= 2;
+        }
+        char *buf = realloc(ctx->buf, cap);
+        if (buf == NULL) {
+            PERROR_FUNCTION("realloc failed for the stream buffer");
+            ctx->is_eof = true;
+            return ctx->len;
+        }
+        ctx->buf = buf;
+        ctx->cap = cap;
+    }
+    /* one byte is kept for the '\0' of a last line without '\n' */
+    while (ctx->len < want && !ctx->is_eof) {
+        size_t n = fread(ctx->buf + ctx->len, 1, ctx->cap - 1 - ctx->len, ctx->in);
+        ctx->len += n;
+        if (n == 0) {
+            if (ferror(ctx->in)) {
+                PERROR_FUNCTION("fread");
+            }
+            ctx->is_eof = true;
+        }
+    }
+    return ctx->len - ctx->pos;
+}
+
+/* The next line, without its '\n', in `*line` up to `*eol`. The line stays
+ * in the buffer until the next call. Returns false at the end of the input.
+ */
+static bool
+stream_next_line(struct stream_ctx *ctx, char **line, char **eol)
+{
+    size_t scanned = 0;
+
+    while (true) {
+        char *p = ctx->buf + ctx->pos;
+        size_t avail = ctx->len - ctx->pos;
+        char *nl = memchr(p + scanned, '\n', avail - scanned);
+        if (nl != NULL) {
+            *line = p;
+            *eol = nl;
+            ctx->pos += (size_t)(nl - p) + 1;
+            return true;
+        }
+        if (ctx->is_eof) {
+            if (avail == 0) {
+                return false;
+            }
+            *line = p;
+            *eol = p + avail;
+            ctx->pos = ctx->len;
+            return true;
+        }
+        scanned = avail;
+        /* at least twice the bytes at hand, so a long line grows the buffer */
+        stream_fill(ctx, AGG_MAX(2 * avail, (size_t)STREAM_BUF_SIZE / 2));
+    }
+}
+
+static void
+stream_free(struct stream_ctx *ctx)
+{
+    for (uint32_t i = 0; i < ctx->flow_cnt; i++) {
+        free(ctx->flows[i].sizes.sizes);
+        free(ctx->flows[i].sizes.cnts);
+    }
+    free(ctx->flows);
+    flow_table_free(&ctx->table);
+    free(ctx->buf);
+}
+
+/* Open the stream and read its head note and first record. */
+static int
+stream_open(struct stream_ctx *ctx, struct file_basic_stats *f_basics,
+            const char *file_name)
+{
+    char *line, *eol;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->in = (strcmp(file_name, "-") == 0) ? stdin : fopen(file_name, "r");
+    if (ctx->in == NULL) {
+        PERROR_FUNCTION("Failed to open file");
+        return EXIT_FAILURE;
+    }
+    f_basics->file = ctx->in;
+    ctx->cap = STREAM_BUF_SIZE;
+    ctx->buf = malloc(ctx->cap);
+    if (ctx->buf == NULL ||
+        flow_table_init(&ctx->table, STREAM_MIN_FLOWS) != EXIT_SUCCESS) {
+        PERROR_FUNCTION("malloc failed for the stream buffer");
+        return EXIT_FAILURE;
+    }
+
+    if (!stream_next_line(ctx, &line, &eol)) {
+        PERROR_FUNCTION("Failed to read the first line.");
+        return EXIT_FAILURE;
+    }
+    *eol = '\0';
+    f_basics->first_line_stats = parse_first_line(line);
+    if (f_basics->first_line_stats == NULL) {
+        PERROR_FUNCTION("head note not exist");
+        return EXIT_FAILURE;
+    }
+    f_basics->body_offset = (long)ctx->pos;
+
+    /* the start time of the first record, which is left unread */
+    if (is_rec_fmt_binary) {
+        struct pkt_node node;
+        if (stream_fill(ctx, sizeof(node)) >= sizeof(node)) {
+            memcpy(&node, ctx->buf + ctx->pos, sizeof(node));
+            f_basics->first_flow_start_time = node.tval;
+        }
+    } else {
+        size_t avail = stream_fill(ctx, PATH_MAX);
+        char *p = ctx->buf + ctx->pos;
+        char *nl = memchr(p, '\n', avail);
+        char first[PATH_MAX];
+        char *fields[TOTAL_FIELDS];
+        size_t len = (nl != NULL) ? (size_t)(nl - p) : avail;
+        if (len == 0 || len >= sizeof(first)) {
+            PERROR_FUNCTION("Failed to read the second line");
+            return EXIT_FAILURE;
+        }
+        memcpy(first, p, len);
+        first[len] = '\0';
+        fill_fields_from_line(fields, first, BODY);
+        f_basics->first_flow_start_time = fast_hex_to_u32(fields[RELATIVE_TIME]);
+    }
+    return EXIT_SUCCESS;
+}
+
+static void
+stream_record(struct stream_ctx *ctx, const struct file_basic_stats *f_basics,
+              uint32_t flowid, const record_t *rec, const uint32_t *only_flowid,
+              chunk_record_fn fn, void *arg)
+{
+    if (f_basics->rec_filter != NULL &&
+        !rec_filter_match(f_basics->rec_filter, rec)) {
+        return;
+    }
+    struct stream_flow *f = stream_flow_of(ctx, flowid);
+    if (f == NULL) {
+        return;
+    }
+    /* any mss: the fragments are counted from the sizes at the foot note */
+    flow_agg_update(&f->agg, rec, UINT32_MAX);
+    if (rec->data_sz > 0 && size_counts_add(&f->sizes, rec->data_sz) != EXIT_SUCCESS) {
+        PERROR_FUNCTION("calloc failed for payload sizes");
+    }
+    if (only_flowid != NULL && flowid == *only_flowid) {
+        fn(arg, flowid, rec);
+    }
+}
+
+/* The foot note of the flows of the body, in the order they started, for a
+ * stream that ended before its own (recover.h).
+ */
+static int
+stream_recover_foot_note(const struct stream_ctx *ctx,
+                         struct file_basic_stats *f_basics)
+{
+    struct recover_flow *flows;
+    uint32_t max_tval = 0;
+
+    if (ctx->flow_cnt == 0) {
+        printf("no record in the body to rebuild the flow list from\n");
+        return EXIT_FAILURE;
+    }
+    flows = calloc(ctx->flow_cnt, sizeof(*flows));
+    if (flows == NULL) {
+        PERROR_FUNCTION("calloc failed for the flow list");
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < ctx->flow_cnt; i++) {
+        const struct stream_flow *f = &ctx->flows[i];
+        flows[i].flowid = f->flowid;
+        flows[i].first_pos = i;
+        flows[i].record_cnt = f->agg.rec_cnt;
+        max_tval = AGG_MAX(max_tval, f_basics->first_flow_start_time + f->agg.time_max);
+    }
+
+    char *foot = recover_make_foot_note(f_basics, flows, ctx->flow_cnt, max_tval,
+                                        is_rec_fmt_binary ? sizeof(struct pkt_node) :
+                                        RECOVER_TEXT_LINE_MAX);
+    int ret = (foot != NULL) ? recover_set_foot_note(f_basics, foot) : EXIT_FAILURE;
+    if (ret == EXIT_SUCCESS) {
+        printf("rebuilt the foot note from the %u flows in the stream, their "
+               "addresses, ports, stack, cc, mss, SACK and window scales are "
+               "unknown\n", ctx->flow_cnt);
+    }
+    free(foot);
+    free(flows);
+    return ret;
+}
+
+/* Read the body up to the foot note. Every record goes into the aggregate of
+ * its flow, those of `*only_flowid` also to `fn`. The foot note is parsed
+ * into f_basics, which is left without one if the stream ended before it.
+ */
+static int
+stream_body(struct stream_ctx *ctx, struct file_basic_stats *f_basics,
+            const uint32_t *only_flowid, chunk_record_fn fn, void *arg)
+{
+    const uint32_t start_time = f_basics->first_flow_start_time;
+    const size_t key_len = sizeof(FOOT_NOTE_KEY) - 1;
+    char *line, *eol;
+    record_t rec;
+
+    while (true) {
+        if (is_rec_fmt_binary) {
+            struct pkt_node node;
+            size_t avail = stream_fill(ctx, sizeof(node));
+            char *p = ctx->buf + ctx->pos;
+            /* the last pkt_node ends with the '\n' of the body */
+            size_t nl = (avail > 0 && p[0] == '\n') ? 1 : 0;
+            if (avail >= nl + key_len && memcmp(p + nl, FOOT_NOTE_KEY, key_len) == 0) {
+                ctx->pos += nl;
+                break;
+            }
+            if (avail < sizeof(node)) {
+                break;
+            }
+            memcpy(&node, p, sizeof(node));
+            ctx->pos += sizeof(node);
+            ctx->num_records++;
+            decode_binary_record(&node, start_time, &rec);
+            stream_record(ctx, f_basics, node.flowid, &rec, only_flowid, fn, arg);
+        } else {
+            size_t avail = stream_fill(ctx, key_len);
+            if (avail >= key_len &&
+                memcmp(ctx->buf + ctx->pos, FOOT_NOTE_KEY, key_len) == 0) {
+                break;
+            }
+            if (!stream_next_line(ctx, &line, &eol)) {
+                break;
+            }
+            ctx->line_cnt++;
+            if (decode_text_record(line, eol, start_time, &rec)) {
+                stream_record(ctx, f_basics, fast_hex8_to_u32(line), &rec,
+                              only_flowid, fn, arg);
+            }
+        }
+    }
+
+    f_basics->last_line_offset = (long)ctx->pos;
+    if (stream_next_line(ctx, &line, &eol) &&
+        strncmp(line, FOOT_NOTE_KEY, key_len) == 0) {
+        *eol = '\0';
+        f_basics->last_line_stats = parse_last_line(line);
+    }
+    if (f_basics->last_line_stats == NULL && is_recover_mode &&
+        stream_recover_foot_note(ctx, f_basics) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (f_basics->last_line_stats == NULL) {
+        return EXIT_FAILURE;    /* the caller says the stream ended early */
+    }
+    get_flow_count_and_info(f_basics);
+    f_basics->num_lines = 1 + ctx->line_cnt + 1;
+    f_basics->num_records = ctx->num_records;
+    return EXIT_SUCCESS;
+}
+
+/* Match the flows of the body with the flow list of the foot note: the
+ * aggregate of each, with its fragments at the mss of the foot note, goes to
+ * aggs[flow_list index] and into the flow_info.
+ */
+static void
+stream_reconcile(struct stream_ctx *ctx, struct file_basic_stats *f_basics,
+                 struct flow_agg *aggs)
+{
+    for (uint32_t i = 0; i < f_basics->flow_count; i++) {
+        flow_agg_init(&aggs[i]);
+    }
+    for (uint32_t i = 0; i < ctx->flow_cnt; i++) {
+        struct stream_flow *f = &ctx->flows[i];
+        uint32_t idx;
+
+        if (!flow_table_lookup(&f_basics->flow_table, f->flowid, &idx)) {
+            printf("flow id %08x has %" PRIu64 " records in the body but is "
+                   "not in the foot note\n", f->flowid, f->agg.rec_cnt);
+            continue;
+        }
+        struct flow_info *f_info = &f_basics->flow_list[idx];
+        f->agg.fragment_cnt = size_counts_fragments(&f->sizes, f_info->mss);
+        aggs[idx] = f->agg;
+        flow_agg_to_flow_info(&aggs[idx], f_info);
+        if (f_basics->rec_filter == NULL && f->agg.rec_cnt != f_info->record_cnt) {
+            printf("flow id %08x has %" PRIu64 " records in the body, the foot "
+                   "note counts %" PRIu64 "\n", f->flowid, f->agg.rec_cnt,
+                   f_info->record_cnt);
+        }
+    }
+    if (verbose) {
+        printf("[%s] %u flows in the body, %u in the foot note\n", __FUNCTION__,
+               ctx->flow_cnt, f_basics->flow_count);
+    }
+}
+
+#endif /* STREAM_H_ */
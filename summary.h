@@ -0,0 +1,183 @@
+/*
+ * summary.h
+ *
+ *  Summary-only review: the read_body_by_flowid() summary of one, some or
+ *  all flows from a single pass over the body, without formatting a record
+ *  or writing a plot file.
+ *
+ *  Besides the summary block, each flow can be printed as one JSON object or
+ *  one TSV row per line for loading into a database.
+ */
+
+#ifndef SUMMARY_H_
+#define SUMMARY_H_
+
+enum {
+    SUMMARY_CHUNK_SIZE = 1024 * 1024,
+};
+
+enum summary_format {
+    SUMMARY_TEXT,
+    SUMMARY_JSON,
+    SUMMARY_TSV,
+};
+
+struct summary_ctx {
+    const struct file_basic_stats *f_basics;
+    const bool  *is_selected;       /* per flow_list index */
+    struct flow_agg *aggs;          /* per flow_list index */
+};
+
+static void
+summary_record(void *arg, uint32_t flowid, const record_t *rec)
+{
+    struct summary_ctx *ctx = arg;
+    uint32_t idx;
+
+    if (!flow_table_lookup(&ctx->f_basics->flow_table, flowid, &idx) ||
+        !ctx->is_selected[idx]) {
+        return;
+    }
+    if (ctx->f_basics->rec_filter != NULL &&
+        !rec_filter_match(ctx->f_basics->rec_filter, rec)) {
+        return;
+    }
+    flow_agg_update(&ctx->aggs[idx], rec, ctx->f_basics->flow_list[idx].mss);
+}
+
+static inline double
+safe_ratio(double num, double den)
+{
+    return (den > 0) ? num / den : 0.0;
+}
+
+static void
+print_summary_row(FILE *out, const struct flow_info *f_info,
+                  const struct flow_agg *agg, enum summary_format format)
+{
+    double avg_payload = safe_ratio(agg->total_data_sz, agg->data_pkt_cnt);
+    double fragment_ratio = safe_ratio(agg->fragment_cnt, agg->data_pkt_cnt);
+    double avg_srtt = safe_ratio(agg->srtt_sum, agg->rec_cnt);
+    double avg_cwnd = safe_ratio(agg->cwnd_sum, agg->rec_cnt);
+    uint32_t min_payload = (agg->data_pkt_cnt > 0) ? agg->min_payload_sz : 0;
+    uint32_t srtt_min = (agg->rec_cnt > 0) ? agg->srtt_min : 0;
+    uint32_t cwnd_min = (agg->rec_cnt > 0) ? agg->cwnd_min : 0;
+
+    if (format == SUMMARY_JSON) {
+        fprintf(out, "{\"flowid\":\"%08x\",\"laddr\":\"%s\",\"lport\":%hu,"
+                "\"faddr\":\"%s\",\"fport\":%hu,\"stack\":\"%s\",\"cc\":\"%s\","
+                "\"mss\":%u,\"record_cnt\":%" PRIu64 ",\"records\":%" PRIu64 ","
+                "\"outputs\":%" PRIu64 ",\"inputs\":%" PRIu64 ","
+                "\"data_pkt_cnt\":%" PRIu64 ",\"total_data_sz\":%" PRIu64 ","
+                "\"fragment_cnt\":%" PRIu64 ",\"fragment_ratio\":%.4f,"
+                "\"avg_payload\":%.1f,\"min_payload\":%u,\"max_payload\":%u,"
+                "\"avg_srtt\":%.1f,\"min_srtt\":%u,\"max_srtt\":%u,"
+                "\"srtt_p50\":%u,\"srtt_p90\":%u,\"srtt_p99\":%u,"
+                "\"avg_cwnd\":%.1f,\"min_cwnd\":%u,\"max_cwnd\":%u}\n",
+                f_info->flowid, f_info->laddr, f_info->lport, f_info->faddr,
+                f_info->fport, f_info->tcp_stack_name, f_info->tcp_cc_name,
+                f_info->mss, f_info->record_cnt, agg->rec_cnt, agg->dir_out,
+                agg->dir_in, agg->data_pkt_cnt, agg->total_data_sz,
+                agg->fragment_cnt, fragment_ratio, avg_payload, min_payload,
+                agg->max_payload_sz, avg_srtt, srtt_min, agg->srtt_max,
+                flow_agg_srtt_percentile(agg, 50), flow_agg_srtt_percentile(agg, 90),
+                flow_agg_srtt_percentile(agg, 99), avg_cwnd, cwnd_min,
+                agg->cwnd_max);
+    } else {
+        fprintf(out, "%08x" TAB "%s" TAB "%hu" TAB "%s" TAB "%hu" TAB "%s" TAB "%s" TAB
+                "%u" TAB "%" PRIu64 TAB "%" PRIu64 TAB "%" PRIu64 TAB "%" PRIu64 TAB
+                "%" PRIu64 TAB "%" PRIu64 TAB "%" PRIu64 TAB "%.4f" TAB
+                "%.1f" TAB "%u" TAB "%u" TAB "%.1f" TAB "%u" TAB "%u" TAB
+                "%u" TAB "%u" TAB "%u" TAB "%.1f" TAB "%u" TAB "%u\n",
+                f_info->flowid, f_info->laddr, f_info->lport, f_info->faddr,
+                f_info->fport, f_info->tcp_stack_name, f_info->tcp_cc_name,
+                f_info->mss, f_info->record_cnt, agg->rec_cnt, agg->dir_out,
+                agg->dir_in, agg->data_pkt_cnt, agg->total_data_sz,
+                agg->fragment_cnt, fragment_ratio, avg_payload, min_payload,
+                agg->max_payload_sz, avg_srtt, srtt_min, agg->srtt_max,
+                flow_agg_srtt_percentile(agg, 50), flow_agg_srtt_percentile(agg, 90),
+                flow_agg_srtt_percentile(agg, 99), avg_cwnd, cwnd_min,
+                agg->cwnd_max);
+    }
+}
+
+/* Print the flows with is_selected[idx] set from their aggregates. */
+static void
+summary_print(const struct file_basic_stats *f_basics, const bool *is_selected,
+              const struct flow_agg *aggs, enum summary_format format)
+{
+    if (format == SUMMARY_TSV) {
+        printf("#flowid" TAB "laddr" TAB "lport" TAB "faddr" TAB "fport" TAB
+               "stack" TAB "cc" TAB "mss" TAB "record_cnt" TAB "records" TAB
+               "outputs" TAB "inputs" TAB "data_pkt_cnt" TAB "total_data_sz" TAB
+               "fragment_cnt" TAB "fragment_ratio" TAB "avg_payload" TAB
+               "min_payload" TAB "max_payload" TAB "avg_srtt" TAB "min_srtt" TAB
+               "max_srtt" TAB "srtt_p50" TAB "srtt_p90" TAB "srtt_p99" TAB
+               "avg_cwnd" TAB "min_cwnd" TAB "max_cwnd\n");
+    }
+    for (uint32_t i = 0; i < f_basics->flow_count; i++) {
+        if (!is_selected[i]) {
+            continue;
+        }
+        if (format == SUMMARY_TEXT) {
+            /* the same block read_body_by_flowid() prints */
+            struct flow_info f_info = f_basics->flow_list[i];
+            flow_agg_to_flow_info(&aggs[i], &f_info);
+            printf("input flow id is: %08x\n", f_info.flowid);
+            print_flow_summary(f_basics, &f_info);
+        } else {
+            print_summary_row(stdout, &f_basics->flow_list[i], &aggs[i], format);
+        }
+    }
+}
+
+/* The summary of every flow with is_selected[idx] set, from one pass over
+ * the body. `only_flowid` narrows the scan to one flow when not NULL.
+ */
+int
+summary_report(const struct file_basic_stats *f_basics, const bool *is_selected,
+               const uint32_t *only_flowid, enum summary_format format)
+{
+    const uint32_t n = f_basics->flow_count;
+    struct summary_ctx ctx = {
+        .f_basics = f_basics,
+        .is_selected = is_selected,
+        .aggs = malloc(n * sizeof(*ctx.aggs)),
+    };
+    struct body_chunks bc;
+    body_chunks_init(&bc, f_basics, SUMMARY_CHUNK_SIZE);
+    char *buf = malloc(body_chunks_buf_size(&bc));
+    int ret = EXIT_FAILURE;
+
+    if (ctx.aggs == NULL || buf == NULL) {
+        PERROR_FUNCTION("malloc failed for summary");
+        goto out;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        flow_agg_init(&ctx.aggs[i]);
+    }
+
+    uint64_t num_records = 0;
+    for (uint64_t k = 0; k < bc.count; k++) {
+        int64_t cnt = body_chunk_scan(&bc, k, buf, only_flowid, summary_record, &ctx);
+        if (cnt < 0) {
+            PERROR_FUNCTION("pread");
+            goto out;
+        }
+        num_records += (uint64_t)cnt;
+    }
+    if (verbose) {
+        printf("[%s] %" PRIu64 " records in %" PRIu64 " chunks\n",
+               __FUNCTION__, num_records, bc.count);
+    }
+
+    summary_print(f_basics, is_selected, ctx.aggs, format);
+    ret = EXIT_SUCCESS;
+
+out:
+    free(ctx.aggs);
+    free(buf);
+    return ret;
+}
+
+#endif /* SUMMARY_H_ */
@@ -0,0 +1,272 @@
+/*
+ * svg.h
+ *
+ *  Render cwnd, ssthresh and srtt of a flow over rel_time into an SVG file,
+ *  straight from the record stream.
+ *
+ *  Records are reduced at pixel resolution while they arrive: every pixel
+ *  column keeps only the min and max of each series, so memory and output
+ *  size depend on the image width and not on the number of records. The time
+ *  range starts as the log duration; a later record doubles it by folding
+ *  pairs of columns, which keeps the min/max exact.
+ */
+
+#ifndef SVG_H_
+#define SVG_H_
+
+#include <math.h>
+
+enum {
+    SVG_COLUMNS         = 1200,     /* plot area width in pixels */
+    SVG_PANEL_HEIGHT    = 300,
+    SVG_MARGIN_LEFT     = 80,
+    SVG_MARGIN_RIGHT    = 30,
+    SVG_MARGIN_TOP      = 50,
+    SVG_PANEL_GAP       = 60,
+    SVG_MARGIN_BOTTOM   = 50,
+    SVG_WIDTH           = SVG_MARGIN_LEFT + SVG_COLUMNS + SVG_MARGIN_RIGHT,
+    SVG_HEIGHT          = SVG_MARGIN_TOP + 2 * SVG_PANEL_HEIGHT +
+                          SVG_PANEL_GAP + SVG_MARGIN_BOTTOM,
+};
+
+enum {
+    SVG_CWND,
+    SVG_SSTHRESH,
+    SVG_SRTT,
+    TOTAL_SVG_SERIES,
+};
+
+struct svg_column {
+    uint32_t    min[TOTAL_SVG_SERIES];
+    uint32_t    max[TOTAL_SVG_SERIES];
+};
+
+struct svg_plot {
+    uint32_t    t_span;             /* rel_time mapped onto the columns */
+    uint64_t    rec_cnt;
+    struct svg_column cols[SVG_COLUMNS];
+};
+
+static inline void
+svg_column_reset(struct svg_column *col)
+{
+    for (int s = 0; s < TOTAL_SVG_SERIES; s++) {
+        col->min[s] = UINT32_MAX;
+        col->max[s] = 0;
+    }
+}
+
+static inline void
+svg_plot_init(struct svg_plot *plot, uint32_t t_span)
+{
+    plot->t_span = (t_span > 0) ? t_span : 1;
+    plot->rec_cnt = 0;
+    for (int c = 0; c < SVG_COLUMNS; c++) {
+        svg_column_reset(&plot->cols[c]);
+    }
+}
+
+static inline void
+svg_column_update(struct svg_column *col, int series, uint32_t val)
+{
+    if (col->min[series] > val) {
+        col->min[series] = val;
+    }
+    if (col->max[series] < val) {
+        col->max[series] = val;
+    }
+}
+
+/* Double the time range: column c takes over columns 2c and 2c + 1. */
+static void
+svg_plot_fold(struct svg_plot *plot)
+{
+    for (int c = 0; c < SVG_COLUMNS / 2; c++) {
+        const struct svg_column *a = &plot->cols[2 * c];
+        const struct svg_column *b = &plot->cols[2 * c + 1];
+        struct svg_column merged;
+        for (int s = 0; s < TOTAL_SVG_SERIES; s++) {
+            merged.min[s] = (a->min[s] < b->min[s]) ? a->min[s] : b->min[s];
+            merged.max[s] = (a->max[s] > b->max[s]) ? a->max[s] : b->max[s];
+        }
+        plot->cols[c] = merged;
+    }
+    for (int c = SVG_COLUMNS / 2; c < SVG_COLUMNS; c++) {
+        svg_column_reset(&plot->cols[c]);
+    }
+    plot->t_span = (plot->t_span > UINT32_MAX / 2) ? UINT32_MAX : plot->t_span * 2;
+}
+
+static inline void
+svg_plot_add(struct svg_plot *plot, const record_t *rec)
+{
+    while (rec->rel_time >= plot->t_span && plot->t_span < UINT32_MAX) {
+        svg_plot_fold(plot);
+    }
+
+    uint64_t c = (uint64_t)rec->rel_time * SVG_COLUMNS / plot->t_span;
+    struct svg_column *col = &plot->cols[(c < SVG_COLUMNS) ? c : SVG_COLUMNS - 1];
+
+    svg_column_update(col, SVG_CWND, rec->cwnd);
+    svg_column_update(col, SVG_SSTHRESH, rec->ssthresh);
+    svg_column_update(col, SVG_SRTT, rec->srtt);
+    plot->rec_cnt++;
+}
+
+/* a 1, 2 or 5 times power of ten step giving about `ticks` ticks */
+static inline double
+svg_nice_step(double range, int ticks)
+{
+    double raw = range / ticks;
+    double mag = pow(10, floor(log10(raw)));
+    double norm = raw / mag;
+
+    if (norm < 1.5) {
+        return mag;
+    } else if (norm < 3.5) {
+        return 2 * mag;
+    } else if (norm < 7.5) {
+        return 5 * mag;
+    }
+    return 10 * mag;
+}
+
+static inline void
+svg_format_value(char *buf, size_t size, double val, double unit, const char *suffix)
+{
+    double scaled = val / unit;
+    if (val == 0) {
+        snprintf(buf, size, "0");
+    } else if (scaled == floor(scaled)) {
+        snprintf(buf, size, "%.0f%s", scaled, suffix);
+    } else {
+        snprintf(buf, size, "%.1f%s", scaled, suffix);
+    }
+}
+
+/* Axes, ticks and labels of one panel with top edge `y0` and range [0, y_max]. */
+static void
+svg_write_axes(FILE *out, int y0, double y_max, double unit,
+               const char *suffix, double t_secs, const char *y_label)
+{
+    const int x0 = SVG_MARGIN_LEFT;
+    const int y1 = y0 + SVG_PANEL_HEIGHT;
+    char label[32];
+
+    fprintf(out, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" "
+            "fill=\"none\" stroke=\"#444\"/>\n",
+            x0, y0, SVG_COLUMNS, SVG_PANEL_HEIGHT);
+
+    double y_step = svg_nice_step(y_max, 5);
+    for (double v = 0; v <= y_max * 1.0001; v += y_step) {
+        double y = y1 - v / y_max * SVG_PANEL_HEIGHT;
+        svg_format_value(label, sizeof(label), v, unit, suffix);
+        fprintf(out, "<line x1=\"%d\" y1=\"%.1f\" x2=\"%d\" y2=\"%.1f\" "
+                "stroke=\"#ddd\"/>\n", x0, y, x0 + SVG_COLUMNS, y);
+        fprintf(out, "<text x=\"%d\" y=\"%.1f\" text-anchor=\"end\">%s</text>\n",
+                x0 - 6, y + 4, label);
+    }
+
+    double t_step = svg_nice_step(t_secs, 10);
+    for (double t = 0; t <= t_secs * 1.0001; t += t_step) {
+        double x = x0 + t / t_secs * SVG_COLUMNS;
+        fprintf(out, "<line x1=\"%.1f\" y1=\"%d\" x2=\"%.1f\" y2=\"%d\" "
+                "stroke=\"#444\"/>\n", x, y1, x, y1 + 5);
+        fprintf(out, "<text x=\"%.1f\" y=\"%d\" text-anchor=\"middle\">%g</text>\n",
+                x, y1 + 18, t);
+    }
+
+    fprintf(out, "<text x=\"16\" y=\"%d\" text-anchor=\"middle\" "
+            "transform=\"rotate(-90 16 %d)\">%s</text>\n",
+            y0 + SVG_PANEL_HEIGHT / 2, y0 + SVG_PANEL_HEIGHT / 2, y_label);
+}
+
+/* Min/max envelope of one series: a vertical stroke per pixel column, joined
+ * to the next column. Values above y_max are clipped to the top edge.
+ */
+static void
+svg_write_series(FILE *out, const struct svg_plot *plot, int series, int y0,
+                 double y_max, const char *color)
+{
+    const int y1 = y0 + SVG_PANEL_HEIGHT;
+    bool pen_down = false;
+
+    fprintf(out, "<path fill=\"none\" stroke=\"%s\" stroke-width=\"1\" d=\"", color);
+    for (int c = 0; c < SVG_COLUMNS; c++) {
+        const struct svg_column *col = &plot->cols[c];
+        if (col->min[series] > col->max[series]) {
+            continue;   /* no record in this column */
+        }
+        double lo = (col->min[series] < y_max) ? col->min[series] : y_max;
+        double hi = (col->max[series] < y_max) ? col->max[series] : y_max;
+        int x = SVG_MARGIN_LEFT + c;
+
+        fprintf(out, "%c%d %.1f", pen_down ? 'L' : 'M', x,
+                y1 - lo / y_max * SVG_PANEL_HEIGHT);
+        if (hi != lo) {
+            fprintf(out, "V%.1f", y1 - hi / y_max * SVG_PANEL_HEIGHT);
+        }
+        pen_down = true;
+    }
+    fprintf(out, "\"/>\n");
+}
+
+int
+svg_plot_write(const struct svg_plot *plot, const char *path, const char *title)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        PERROR_FUNCTION("open svg file");
+        return EXIT_FAILURE;
+    }
+
+    uint32_t cwnd_max = 0, srtt_max = 0;
+    for (int c = 0; c < SVG_COLUMNS; c++) {
+        if (plot->cols[c].max[SVG_CWND] > cwnd_max) {
+            cwnd_max = plot->cols[c].max[SVG_CWND];
+        }
+        if (plot->cols[c].max[SVG_SRTT] > srtt_max) {
+            srtt_max = plot->cols[c].max[SVG_SRTT];
+        }
+    }
+    /* the initial ssthresh is "infinite", so the window panel follows cwnd
+     * and clips ssthresh */
+    double win_max = (cwnd_max > 0) ? cwnd_max * 1.25 : 1;
+    double rtt_max = (srtt_max > 0) ? srtt_max * 1.1 : 1;
+    double t_secs = plot->t_span / 1000.0;
+    const int top = SVG_MARGIN_TOP;
+    const int bottom = SVG_MARGIN_TOP + SVG_PANEL_HEIGHT + SVG_PANEL_GAP;
+
+    fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+            "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" "
+            "viewBox=\"0 0 %d %d\" font-family=\"sans-serif\" font-size=\"12\">\n"
+            "<rect width=\"100%%\" height=\"100%%\" fill=\"white\"/>\n",
+            SVG_WIDTH, SVG_HEIGHT, SVG_WIDTH, SVG_HEIGHT);
+    fprintf(out, "<text x=\"%d\" y=\"24\" font-size=\"15\">%s (%" PRIu64
+            " records)</text>\n", SVG_MARGIN_LEFT, title, plot->rec_cnt);
+    fprintf(out, "<text x=\"%d\" y=\"24\" text-anchor=\"end\">"
+            "<tspan fill=\"#1f77b4\">cwnd</tspan> "
+            "<tspan fill=\"#d62728\">ssthresh (clipped)</tspan> "
+            "<tspan fill=\"#2ca02c\">srtt</tspan></text>\n",
+            SVG_MARGIN_LEFT + SVG_COLUMNS);
+
+    svg_write_axes(out, top, win_max, (win_max >= 1e6) ? 1e6 : 1e3,
+                   (win_max >= 1e6) ? "M" : "K", t_secs, "window (bytes)");
+    svg_write_series(out, plot, SVG_SSTHRESH, top, win_max, "#d62728");
+    svg_write_series(out, plot, SVG_CWND, top, win_max, "#1f77b4");
+
+    svg_write_axes(out, bottom, rtt_max, 1e3, "", t_secs, "srtt (ms)");
+    svg_write_series(out, plot, SVG_SRTT, bottom, rtt_max, "#2ca02c");
+
+    fprintf(out, "<text x=\"%d\" y=\"%d\" text-anchor=\"middle\">"
+            "relative time (seconds)</text>\n</svg>\n",
+            SVG_MARGIN_LEFT + SVG_COLUMNS / 2, SVG_HEIGHT - 10);
+
+    if (fclose(out) != 0) {
+        PERROR_FUNCTION("close svg file");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+#endif /* SVG_H_ */
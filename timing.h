@@ -0,0 +1,190 @@
+/*
+ * timing.h
+ *
+ *  Inter-packet timing and burstiness of a flow, one record at a time.
+ *
+ *  Outputs carrying data give the inter-send gaps and the send bursts,
+ *  inputs give the inter-ACK gaps and the receive bursts. A burst is a run of
+ *  records in one direction less than TIMING_BURST_GAP_MS apart, which is
+ *  how TSO and LRO aggregates show up in the log. The update is a few
+ *  compares and a bit scan per record, so it runs inside the writer thread
+ *  without slowing the pass down.
+ */
+
+#ifndef TIMING_H_
+#define TIMING_H_
+
+enum {
+    TIMING_HIST_BUCKETS = 24,   /* log2 buckets */
+    TIMING_BURST_GAP_MS = 1,    /* records closer than this form a burst */
+    TIMING_ACK_CLOCK_MS = 1,    /* a send this close after an input is ACK clocked */
+};
+
+enum {
+    TIMING_IN,
+    TIMING_OUT,
+    TOTAL_TIMING_DIRS,
+};
+
+struct dir_timing {
+    bool        has_last;
+    uint32_t    last_time;          /* rel_time of the previous record */
+    uint64_t    gap_cnt;
+    uint64_t    gap_sum;
+    uint64_t    gap_hist[TIMING_HIST_BUCKETS];
+
+    uint32_t    burst_recs;         /* the burst being built */
+    uint64_t    burst_bytes;
+    uint64_t    burst_cnt;
+    uint64_t    burst_rec_hist[TIMING_HIST_BUCKETS];    /* bursts by records */
+    uint64_t    burst_byte_hist[TIMING_HIST_BUCKETS];   /* bytes by burst size */
+};
+
+struct flow_timing {
+    struct dir_timing dir[TOTAL_TIMING_DIRS];
+    bool        has_input;
+    uint32_t    last_input_time;
+    uint64_t    send_cnt;
+    uint64_t    clocked_send_cnt;
+};
+
+/* bucket b holds values in [2^(b-1), 2^b), bucket 0 holds 0 */
+static inline uint32_t
+timing_bucket(uint64_t val)
+{
+    uint32_t b = (val == 0) ? 0 : 64 - (uint32_t)__builtin_clzll(val);
+    return (b < TIMING_HIST_BUCKETS) ? b : TIMING_HIST_BUCKETS - 1;
+}
+
+static inline void
+flow_timing_init(struct flow_timing *timing)
+{
+    memset(timing, 0, sizeof(*timing));
+}
+
+static inline void
+dir_timing_close_burst(struct dir_timing *dt)
+{
+    if (dt->burst_recs > 0) {
+        dt->burst_cnt++;
+        dt->burst_rec_hist[timing_bucket(dt->burst_recs)]++;
+        dt->burst_byte_hist[timing_bucket(dt->burst_bytes)] += dt->burst_bytes;
+    }
+    dt->burst_recs = 0;
+    dt->burst_bytes = 0;
+}
+
+static inline void
+dir_timing_update(struct dir_timing *dt, uint32_t time, uint32_t data_sz)
+{
+    if (dt->has_last) {
+        uint32_t gap = time - dt->last_time;
+        dt->gap_cnt++;
+        dt->gap_sum += gap;
+        dt->gap_hist[timing_bucket(gap)]++;
+        if (gap >= TIMING_BURST_GAP_MS) {
+            dir_timing_close_burst(dt);
+        }
+    }
+    dt->has_last = true;
+    dt->last_time = time;
+    dt->burst_recs++;
+    dt->burst_bytes += data_sz;
+}
+
+static inline void
+flow_timing_update(struct flow_timing *timing, const record_t *rec)
+{
+    if (rec->direction == 'o') {
+        /* outputs without data are window updates or pure ACKs, not sends */
+        if (rec->data_sz == 0) {
+            return;
+        }
+        dir_timing_update(&timing->dir[TIMING_OUT], rec->rel_time, rec->data_sz);
+        timing->send_cnt++;
+        if (timing->has_input &&
+            rec->rel_time - timing->last_input_time <= TIMING_ACK_CLOCK_MS) {
+            timing->clocked_send_cnt++;
+        }
+    } else {
+        dir_timing_update(&timing->dir[TIMING_IN], rec->rel_time, rec->data_sz);
+        timing->has_input = true;
+        timing->last_input_time = rec->rel_time;
+    }
+}
+
+/* Flush the open bursts, call once after the last record. */
+static inline void
+flow_timing_finish(struct flow_timing *timing)
+{
+    for (int d = 0; d < TOTAL_TIMING_DIRS; d++) {
+        dir_timing_close_burst(&timing->dir[d]);
+    }
+}
+
+static void
+print_timing_hist(const char *name, const char *unit, const uint64_t hist[],
+                  uint64_t total)
+{
+    if (total == 0) {
+        return;
+    }
+    printf("  %s\n", name);
+    for (int b = 0; b < TIMING_HIST_BUCKETS; b++) {
+        if (hist[b] == 0) {
+            continue;
+        }
+        uint64_t lo = (b == 0) ? 0 : 1ull << (b - 1);
+        uint64_t hi = (b == 0) ? 0 : (1ull << b) - 1;
+        char range[48];
+        if (b == TIMING_HIST_BUCKETS - 1) {
+            snprintf(range, sizeof(range), ">= %" PRIu64, lo);
+        } else if (lo == hi) {
+            snprintf(range, sizeof(range), "%" PRIu64, lo);
+        } else {
+            snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64, lo, hi);
+        }
+        printf("    %-22s %-5s %12" PRIu64 " %6.2f%%\n", range, unit, hist[b],
+               100.0 * hist[b] / total);
+    }
+}
+
+void
+print_flow_timing(const struct flow_timing *timing)
+{
+    static const char *const dir_names[TOTAL_TIMING_DIRS] = {
+        [TIMING_IN] = "input (inter-ACK)",
+        [TIMING_OUT] = "output (inter-send)",
+    };
+
+    printf("++++++++++++++++++++++++ timing and bursts +++++++++++++++++++++++\n");
+    for (int d = 0; d < TOTAL_TIMING_DIRS; d++) {
+        const struct dir_timing *dt = &timing->dir[d];
+        uint64_t burst_bytes = 0, burst_recs = 0;
+
+        for (int b = 0; b < TIMING_HIST_BUCKETS; b++) {
+            burst_bytes += dt->burst_byte_hist[b];
+        }
+        burst_recs = dt->gap_cnt + (dt->has_last ? 1 : 0);
+
+        printf("%s: %" PRIu64 " gaps, avg_gap: %.3f ms, %" PRIu64
+               " bursts, avg_burst: %.2f records, %.0f bytes\n",
+               dir_names[d], dt->gap_cnt,
+               (dt->gap_cnt > 0) ? (double)dt->gap_sum / dt->gap_cnt : 0.0,
+               dt->burst_cnt,
+               (dt->burst_cnt > 0) ? (double)burst_recs / dt->burst_cnt : 0.0,
+               (dt->burst_cnt > 0) ? (double)burst_bytes / dt->burst_cnt : 0.0);
+        print_timing_hist("gap histogram", "ms", dt->gap_hist, dt->gap_cnt);
+        print_timing_hist("burst size histogram", "recs", dt->burst_rec_hist,
+                          dt->burst_cnt);
+        print_timing_hist("bytes by burst size", "bytes", dt->burst_byte_hist,
+                          burst_bytes);
+    }
+    printf("ACK clocking: %" PRIu64 " of %" PRIu64 " sends (%.2f%%) within %d ms "
+           "after an input\n", timing->clocked_send_cnt, timing->send_cnt,
+           (timing->send_cnt > 0) ?
+           100.0 * timing->clocked_send_cnt / timing->send_cnt : 0.0,
+           TIMING_ACK_CLOCK_MS);
+}
+
+#endif /* TIMING_H_ */
@@ -0,0 +1,447 @@
+/*
+ * verify.h
+ *
+ *  Integrity check of a log with `--verify`, before spending a long run on
+ *  it.
+ *
+ *  The body is cut into as many ranges of whole chunks as there are workers,
+ *  and each worker checks its range in file order: every text line has
+ *  TOTAL_FIELDS fields of hex digits and an 'i' or 'o' direction, every
+ *  record belongs to a flow of the flow list, and the tval of each flow
+ *  never goes back. The per-flow counts of the ranges are added up in range
+ *  order, checking tval across the range edges, and compared with the
+ *  FL_NUMRECORD and FL_NTRANS counts of the foot note. Violations are
+ *  reported with the byte offset of the line or pkt_node, the first
+ *  VERIFY_MAX_REPORTS of them in file order.
+ */
+
+#ifndef VERIFY_H_
+#define VERIFY_H_
+
+#include <ctype.h>
+
+enum {
+    VERIFY_CHUNK_SIZE   = 4 * 1024 * 1024,
+    VERIFY_MAX_REPORTS  = 32,
+};
+
+enum verify_kind {
+    VERIFY_FIELD_CNT,       /* a text line without TOTAL_FIELDS fields */
+    VERIFY_HEX,             /* a field that is not hex */
+    VERIFY_DIRECTION,
+    VERIFY_UNKNOWN_FLOW,    /* a flowid that is not in the flow list */
+    VERIFY_TVAL,            /* the tval of a flow goes back */
+    VERIFY_BODY_SIZE,       /* a binary body of no whole pkt_nodes */
+    TOTAL_VERIFY_KINDS,
+};
+
+struct verify_report {
+    long        offset;
+    uint8_t     kind;
+    uint32_t    flowid;
+    uint32_t    val;        /* field count, field, direction or tval */
+    uint32_t    prev;       /* the tval it went back from */
+};
+
+struct verify_flow {
+    uint64_t    rec_cnt;
+    uint64_t    dir_in;
+    uint64_t    dir_out;
+    uint32_t    first_tval;
+    uint32_t    last_tval;
+    long        first_offset;
+};
+
+/* the range of chunks one worker checks */
+struct verify_part {
+    uint64_t    chunk_lo;
+    uint64_t    chunk_hi;
+    struct verify_flow *flows;      /* per flow_list index */
+    uint64_t    num_records;
+    uint64_t    kind_cnt[TOTAL_VERIFY_KINDS];
+    uint32_t    report_cnt;
+    struct verify_report reports[VERIFY_MAX_REPORTS];
+    bool        has_failed;
+};
+
+struct verify_ctx {
+    struct body_chunks bc;
+    const struct file_basic_stats *f_basics;
+    atomic_uint next_worker;
+    uint32_t    workers;
+    struct verify_part parts[PSCAN_MAX_WORKERS];
+};
+
+static void
+verify_report(struct verify_part *part, long offset, enum verify_kind kind,
+              uint32_t flowid, uint32_t val, uint32_t prev)
+{
+    part->kind_cnt[kind]++;
+    if (part->report_cnt < VERIFY_MAX_REPORTS) {
+        part->reports[part->report_cnt++] = (struct verify_report){
+            offset, kind, flowid, val, prev,
+        };
+    }
+}
+
+/* Count the record of `flowid` at file offset `offset` into its flow. */
+static void
+verify_record(struct verify_ctx *ctx, struct verify_part *part, long offset,
+              uint32_t flowid, bool is_dir_in, uint32_t tval)
+{
+    uint32_t idx;
+
+    part->num_records++;
+    if (!flow_table_lookup(&ctx->f_basics->flow_table, flowid, &idx)) {
+        verify_report(part, offset, VERIFY_UNKNOWN_FLOW, flowid, 0, 0);
+        return;
+    }
+    struct verify_flow *vf = &part->flows[idx];
+    if (vf->rec_cnt == 0) {
+        vf->first_tval = tval;
+        vf->first_offset = offset;
+    } else if (tval < vf->last_tval) {
+        verify_report(part, offset, VERIFY_TVAL, flowid, tval, vf->last_tval);
+    }
+    vf->last_tval = tval;
+    vf->rec_cnt++;
+    vf->dir_in += is_dir_in;
+    vf->dir_out += !is_dir_in;
+}
+
+/* Check the text line [p, eol) at file offset `offset`. */
+static void
+verify_text_line(struct verify_ctx *ctx, struct verify_part *part,
+                 const char *p, const char *eol, long offset)
+{
+    uint32_t field = 0, digits = 0;
+    bool is_hex = true;
+    uint32_t bad_field = 0;
+
+    for (const char *c = p; c <= eol; c++) {
+        if (c == eol || *c == ',') {
+            /* the flowid has 8 digits, the direction is one letter */
+            bool is_ok = (field == FLOW_ID) ? (digits == 8) :
+                         (field == DIRECTION) ? (digits == 1) :
+                         (digits > 0 && digits <= 8);
+            if (is_hex && !is_ok) {
+                is_hex = false;
+                bad_field = field;
+            }
+            field++;
+            digits = 0;
+        } else {
+            if (is_hex && field != DIRECTION && !isxdigit((unsigned char)*c)) {
+                is_hex = false;
+                bad_field = field;
+            }
+            digits++;
+        }
+    }
+
+    if (field != TOTAL_FIELDS) {
+        verify_report(part, offset, VERIFY_FIELD_CNT, 0, field, 0);
+        return;
+    }
+    uint32_t flowid = (is_hex || bad_field > FLOW_ID) ? fast_hex8_to_u32(p) : 0;
+    if (!is_hex && bad_field != DIRECTION) {
+        verify_report(part, offset, VERIFY_HEX, flowid, bad_field, 0);
+        return;
+    }
+    if (!is_hex || (p[9] != 'i' && p[9] != 'o')) {
+        verify_report(part, offset, VERIFY_DIRECTION, flowid, (uint8_t)p[9], 0);
+        return;
+    }
+
+    record_t rec;
+    /* start_time 0 leaves the tval in rel_time */
+    if (!decode_text_record(p, eol, 0, &rec)) {
+        return;
+    }
+    verify_record(ctx, part, offset, flowid, rec.direction == 'i', rec.rel_time);
+}
+
+static int
+verify_text_chunk(struct verify_ctx *ctx, struct verify_part *part, uint64_t k,
+                  char *buf)
+{
+    const struct body_chunks *bc = &ctx->bc;
+    long lo = bc->begin + (long)(k * bc->span);
+    long hi = (lo + (long)bc->span < bc->end) ? lo + (long)bc->span : bc->end;
+    const char *p, *stop, *lim;
+
+    if (body_chunk_read_text(bc, k, buf, &p, &stop, &lim) != EXIT_SUCCESS) {
+        PERROR_FUNCTION("pread");
+        return EXIT_FAILURE;
+    }
+    while (p < stop) {
+        const char *nl = memchr(p, '\n', (size_t)(lim - p));
+        const char *eol = (nl != NULL) ? nl : lim;
+
+        /* `stop` is at file offset `hi` */
+        verify_text_line(ctx, part, p, eol, hi - (long)(stop - p));
+        p = eol + 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int
+verify_binary_chunk(struct verify_ctx *ctx, struct verify_part *part,
+                    uint64_t k, char *buf)
+{
+    const size_t rec_size = sizeof(struct pkt_node);
+    const struct body_chunks *bc = &ctx->bc;
+    long lo = bc->begin + (long)(k * bc->span);
+    long hi = (lo + (long)bc->span < bc->end) ? lo + (long)bc->span : bc->end;
+    struct pkt_node node;
+
+    ssize_t got = pread_full(bc->fd, buf, (size_t)(hi - lo), lo);
+    if (got < 0) {
+        PERROR_FUNCTION("pread");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < (size_t)got / rec_size; i++) {
+        long offset = lo + (long)(i * rec_size);
+
+        memcpy(&node, buf + i * rec_size, rec_size);
+        if (node.direction != DIR_IN && node.direction != DIR_OUT) {
+            verify_report(part, offset, VERIFY_DIRECTION, node.flowid,
+                          (uint32_t)node.direction, 0);
+            continue;
+        }
+        verify_record(ctx, part, offset, node.flowid, node.direction == DIR_IN,
+                      node.tval);
+    }
+    return EXIT_SUCCESS;
+}
+
+int verify_worker(void *arg)
+{
+    struct verify_ctx *ctx = arg;
+    struct verify_part *part = &ctx->parts[atomic_fetch_add(&ctx->next_worker, 1)];
+    char *buf = malloc(body_chunks_buf_size(&ctx->bc));
+
+    part->has_failed = (buf == NULL);
+    for (uint64_t k = part->chunk_lo; k < part->chunk_hi && !part->has_failed; k++) {
+        part->has_failed = (is_rec_fmt_binary ?
+                            verify_binary_chunk(ctx, part, k, buf) :
+                            verify_text_chunk(ctx, part, k, buf)) != EXIT_SUCCESS;
+    }
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
+static int
+verify_report_cmp(const void *a, const void *b)
+{
+    const struct verify_report *ra = a;
+    const struct verify_report *rb = b;
+
+    return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
+
+static void
+print_verify_report(const struct verify_report *r)
+{
+    printf("at byte %ld: ", r->offset);
+    switch (r->kind) {
+    case VERIFY_FIELD_CNT:
+        printf("%u fields, not %d\n", r->val, TOTAL_FIELDS);
+        break;
+    case VERIFY_HEX:
+        printf("field %u is not hex\n", r->val);
+        break;
+    case VERIFY_DIRECTION:
+        if (is_rec_fmt_binary) {
+            printf("direction %u is not 0 or 1\n", r->val);
+        } else {
+            printf("direction '%c' is not i or o\n", (char)r->val);
+        }
+        break;
+    case VERIFY_UNKNOWN_FLOW:
+        printf("flow id %08x is not in the flow list\n", r->flowid);
+        break;
+    case VERIFY_TVAL:
+        printf("tval %u of flow id %08x goes back from %u\n", r->val,
+               r->flowid, r->prev);
+        break;
+    case VERIFY_BODY_SIZE:
+        printf("%u bytes after the last whole pkt_node\n", r->val);
+        break;
+    }
+}
+
+/* Check the body of `f_basics` against itself and the foot note on parallel
+ * workers. Returns EXIT_FAILURE when the log has violations or can't be read.
+ */
+int
+verify_log(const struct file_basic_stats *f_basics)
+{
+    const uint32_t flow_cnt = f_basics->flow_count;
+    struct verify_ctx *ctx = calloc(1, sizeof(*ctx));
+    struct verify_report *reports = NULL;
+    uint64_t *expect = NULL;
+    uint64_t report_cnt = 0, violation_cnt = 0, flow_violation_cnt = 0;
+    int ret = EXIT_FAILURE;
+
+    if (ctx == NULL) {
+        PERROR_FUNCTION("calloc failed for verify");
+        return EXIT_FAILURE;
+    }
+    ctx->f_basics = f_basics;
+    body_chunks_init(&ctx->bc, f_basics, VERIFY_CHUNK_SIZE);
+    atomic_init(&ctx->next_worker, 0);
+    ctx->workers = pscan_worker_count(ctx->bc.count);
+    for (uint32_t w = 0; w < ctx->workers; w++) {
+        struct verify_part *part = &ctx->parts[w];
+        part->chunk_lo = ctx->bc.count * w / ctx->workers;
+        part->chunk_hi = ctx->bc.count * (w + 1) / ctx->workers;
+        part->flows = calloc(AGG_MAX(flow_cnt, 1u), sizeof(*part->flows));
+        if (part->flows == NULL) {
+            PERROR_FUNCTION("calloc failed for verify flows");
+            goto out;
+        }
+    }
+
+    /* siftr2 writes a '\n' between the last pkt_node and the foot note */
+    struct verify_part *all = &ctx->parts[0];
+    if (is_rec_fmt_binary) {
+        long len = f_basics->last_line_offset - 1 - f_basics->body_offset;
+        long rest = (len > 0) ? len % (long)sizeof(struct pkt_node) : 0;
+        if (rest != 0) {
+            verify_report(all, f_basics->last_line_offset - 1 - rest,
+                          VERIFY_BODY_SIZE, 0, (uint32_t)rest, 0);
+        }
+    }
+
+    /* each worker takes the next range, so one not started leaves it out */
+    thrd_t threads[PSCAN_MAX_WORKERS];
+    uint32_t started = 0;
+    while (started < ctx->workers &&
+           thrd_create(&threads[started], verify_worker, ctx) == thrd_success) {
+        started++;
+    }
+    for (uint32_t w = 0; w < started; w++) {
+        thrd_join(threads[w], NULL);
+    }
+    if (started < ctx->workers) {
+        printf("started %u of %u verify workers\n", started, ctx->workers);
+        goto out;
+    }
+
+    /* the reports of all ranges and of the tval across their edges */
+    size_t report_cap = (size_t)ctx->workers * (VERIFY_MAX_REPORTS + flow_cnt);
+    reports = malloc(report_cap * sizeof(*reports));
+    if (reports == NULL) {
+        PERROR_FUNCTION("malloc failed for verify reports");
+        goto out;
+    }
+    for (uint32_t w = 0; w < ctx->workers; w++) {
+        struct verify_part *part = &ctx->parts[w];
+        if (part->has_failed) {
+            goto out;
+        }
+        memcpy(reports + report_cnt, part->reports,
+               part->report_cnt * sizeof(*reports));
+        report_cnt += part->report_cnt;
+        if (w == 0) {
+            continue;
+        }
+        for (uint32_t i = 0; i < flow_cnt; i++) {
+            struct verify_flow *d = &all->flows[i];
+            const struct verify_flow *s = &part->flows[i];
+            if (s->rec_cnt == 0) {
+                continue;
+            }
+            if (d->rec_cnt == 0) {
+                *d = *s;
+                continue;
+            }
+            if (s->first_tval < d->last_tval) {
+                all->kind_cnt[VERIFY_TVAL]++;
+                reports[report_cnt++] = (struct verify_report){
+                    s->first_offset, VERIFY_TVAL, f_basics->flow_list[i].flowid,
+                    s->first_tval, d->last_tval,
+                };
+            }
+            d->rec_cnt += s->rec_cnt;
+            d->dir_in += s->dir_in;
+            d->dir_out += s->dir_out;
+            d->last_tval = s->last_tval;
+        }
+        all->num_records += part->num_records;
+        for (int kind = 0; kind < TOTAL_VERIFY_KINDS; kind++) {
+            all->kind_cnt[kind] += part->kind_cnt[kind];
+        }
+    }
+    qsort(reports, report_cnt, sizeof(*reports), verify_report_cmp);
+
+    printf("++++++++++++++++++++++++++++++ verify +++++++++++++++++++++++++++++\n");
+    for (int kind = 0; kind < TOTAL_VERIFY_KINDS; kind++) {
+        violation_cnt += all->kind_cnt[kind];
+    }
+    for (uint64_t r = 0; r < report_cnt && r < VERIFY_MAX_REPORTS; r++) {
+        print_verify_report(&reports[r]);
+    }
+    if (violation_cnt > VERIFY_MAX_REPORTS) {
+        printf("... and %" PRIu64 " more\n", violation_cnt - VERIFY_MAX_REPORTS);
+    }
+
+    /* the records of a flowid listed twice all go to its first entry, which
+     * then expects the counts of both */
+    expect = calloc(2 * (size_t)AGG_MAX(flow_cnt, 1u), sizeof(*expect));
+    if (expect == NULL) {
+        PERROR_FUNCTION("calloc failed for verify counts");
+        goto out;
+    }
+    for (uint32_t i = 0; i < flow_cnt; i++) {
+        const struct flow_info *f_info = &f_basics->flow_list[i];
+        uint32_t idx = i;
+        flow_table_lookup(&f_basics->flow_table, f_info->flowid, &idx);
+        if (idx != i) {
+            printf("flow id %08x is listed twice in the flow list\n",
+                   f_info->flowid);
+            flow_violation_cnt++;
+        }
+        expect[2 * idx] += f_info->record_cnt;
+        expect[2 * idx + 1] += f_info->trans_cnt;
+    }
+    for (uint32_t i = 0; i < flow_cnt; i++) {
+        const struct flow_info *f_info = &f_basics->flow_list[i];
+        const struct verify_flow *vf = &all->flows[i];
+        uint64_t record_cnt = expect[2 * i], trans_cnt = expect[2 * i + 1];
+        uint32_t idx = i;
+
+        flow_table_lookup(&f_basics->flow_table, f_info->flowid, &idx);
+        if (idx != i) {
+            continue;
+        }
+        if (vf->rec_cnt != record_cnt || vf->dir_in + vf->dir_out != trans_cnt) {
+            printf("flow id %08x has %" PRIu64 " records (%" PRIu64 " in, %"
+                   PRIu64 " out) from byte %ld, the foot note counts %" PRIu64
+                   " records and %" PRIu64 " transfers\n", f_info->flowid,
+                   vf->rec_cnt, vf->dir_in, vf->dir_out,
+                   (vf->rec_cnt > 0) ? vf->first_offset : f_basics->body_offset,
+                   record_cnt, trans_cnt);
+            flow_violation_cnt++;
+        }
+    }
+
+    printf("ring_drops: %u records siftr2 could not log\n",
+           f_basics->last_line_stats->ring_drops);
+    printf("verified %" PRIu64 " records of %u flows on %u workers: %" PRIu64
+           " violations\n", all->num_records, flow_cnt, ctx->workers,
+           violation_cnt + flow_violation_cnt);
+    ret = (violation_cnt + flow_violation_cnt == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+out:
+    for (uint32_t w = 0; w < ctx->workers; w++) {
+        free(ctx->parts[w].flows);
+    }
+    free(ctx);
+    free(reports);
+    free(expect);
+    return ret;
+}
+
+#endif /* VERIFY_H_ */